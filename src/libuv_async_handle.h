@@ -5,7 +5,9 @@
 
 #include "libuv_handle.h"
 #include "libuv_mutex.h"
+#include "libuv_histogram.h"
 
+#include <atomic>
 #include <list>
 
 namespace io_simplify {
@@ -18,29 +20,141 @@ namespace io_simplify {
             using CallbackAsync = std::function<void()>;
             using CallbackAsyncList = std::list<CallbackAsync>;
 
+            // all durations in nanoseconds
+            struct Statistics
+            {
+                uint64_t posted = 0;
+                uint64_t executed = 0;
+                uint64_t drains = 0;
+
+                size_t pending = 0; // queued and not yet drained when the snapshot was taken
+                size_t max_backlog = 0; // largest number of callbacks run by a single drain
+
+                Histogram queue_delay; // Async to start of execution
+                Histogram execute_duration; // time spent inside the callback
+                Histogram backlog; // callbacks run per drain
+            };
+
+        private:
+            struct AsyncTask
+            {
+                CallbackAsync callback_async;
+                uint64_t posted;
+            };
+
+            using AsyncTaskList = std::list<AsyncTask>;
+
         private:
-            Mutex _mutex;
-            CallbackAsyncList _callback_async_list;
+            Mutex _mutex; // producers: the task list and the posted counter
+            AsyncTaskList _async_task_list;
+            uint64_t _posted;
+
+            /*
+                Drain statistics never touch the producer mutex. The loop records a drain into _drain_statistics, merges it
+                into the published buffer nobody reads, flips _front under _published_mutex and merges the drain into the
+                other buffer too, so both stay equal between drains and Snapshot copies the front one without holding up
+                the loop or any producer beyond the flip.
+            */
+            Mutex _published_mutex;
+            Statistics _published[2];
+            int _front; // written by the loop thread under _published_mutex
+
+            Statistics _drain_statistics; // loop thread only
+            std::atomic<bool> _reset_requested;
 
         private:
-            void getCallbackAsyncList(CallbackAsyncList& callback_async_list)
+            void getAsyncTaskList(AsyncTaskList& async_task_list)
             {
                 _mutex.Lock();
-                callback_async_list.swap(_callback_async_list);
+                async_task_list.swap(_async_task_list);
                 _mutex.Unlock();
             }
 
+            static void mergeStatistics(Statistics& statistics, const Statistics& drain_statistics)
+            {
+                statistics.executed += drain_statistics.executed;
+                statistics.drains += drain_statistics.drains;
+
+                if (drain_statistics.max_backlog > statistics.max_backlog)
+                {
+                    statistics.max_backlog = drain_statistics.max_backlog;
+                }
+
+                statistics.queue_delay.Merge(drain_statistics.queue_delay);
+                statistics.execute_duration.Merge(drain_statistics.execute_duration);
+                statistics.backlog.Merge(drain_statistics.backlog);
+            }
+
+            // cheaper than assigning Statistics(), Histogram::Reset clears the touched buckets only
+            static void clearStatistics(Statistics& statistics)
+            {
+                statistics.executed = 0;
+                statistics.drains = 0;
+                statistics.max_backlog = 0;
+
+                statistics.queue_delay.Reset();
+                statistics.execute_duration.Reset();
+                statistics.backlog.Reset();
+            }
+
+            void publishStatistics()
+            {
+                bool reset = _reset_requested.exchange(false, std::memory_order_acq_rel);
+
+                // no reader copies the back buffer: Snapshot holds _published_mutex while it copies the front one
+                Statistics& back = _published[1 - _front];
+                if (reset)
+                {
+                    clearStatistics(back);
+                }
+                mergeStatistics(back, _drain_statistics);
+
+                _published_mutex.Lock();
+                _front = 1 - _front;
+                _published_mutex.Unlock();
+
+                // the former front one, readers of it are done
+                Statistics& former = _published[1 - _front];
+                if (reset)
+                {
+                    clearStatistics(former);
+                }
+                mergeStatistics(former, _drain_statistics);
+
+                clearStatistics(_drain_statistics);
+            }
+
             static void callback_uv_async(uv_async_t* handle)
             {
                 AsyncHandle* server_handle = (AsyncHandle*)(handle->data);
 
-                CallbackAsyncList callback_async_list;
-                server_handle->getCallbackAsyncList(callback_async_list);
+                LIBUV_WATCHDOG_CALLBACK(server_handle, TRACE_CALLBACK_ASYNC);
+
+                AsyncTaskList async_task_list;
+                server_handle->getAsyncTaskList(async_task_list);
 
-                for (CallbackAsync& callback_async : callback_async_list)
+                Statistics& drain_statistics = server_handle->_drain_statistics;
+
+                drain_statistics.drains = 1;
+                drain_statistics.max_backlog = async_task_list.size();
+                drain_statistics.backlog.Record(async_task_list.size());
+
+                uint64_t begin = uv_hrtime();
+                for (AsyncTask& async_task : async_task_list)
                 {
-                    callback_async();
+                    drain_statistics.queue_delay.Record(begin > async_task.posted ? begin - async_task.posted : 0);
+
+                    async_task.callback_async();
+
+                    uint64_t end = uv_hrtime();
+
+                    drain_statistics.execute_duration.Record(end - begin);
+                    ++drain_statistics.executed;
+
+                    begin = end;
                 }
+
+                server_handle->publishStatistics();
             }
 
         public:
@@ -48,20 +162,54 @@ namespace io_simplify {
                 : Handle<uv_async_t>(loop)
 
                 , _mutex()
-                , _callback_async_list()
+                , _async_task_list()
+                , _posted(0)
+
+                , _published_mutex()
+                , _published()
+                , _front(0)
+
+                , _drain_statistics()
+                , _reset_requested(false)
             {
                 Handle<uv_async_t>::status = uv_async_init(loop->uv, Handle<uv_async_t>::uv, callback_uv_async);
             }
 
             int Async(const CallbackAsync& callback_async)
             {
+                uint64_t posted = uv_hrtime();
+
                 _mutex.Lock();
-                _callback_async_list.push_back(callback_async);
+                _async_task_list.push_back(AsyncTask{callback_async, posted});
+                ++_posted;
                 _mutex.Unlock();
 
                 return uv_async_send(Handle<uv_async_t>::uv);
             }
 
+            // safe from any thread
+            void Snapshot(Statistics& statistics)
+            {
+                _published_mutex.Lock();
+                statistics = _published[_front];
+                _published_mutex.Unlock();
+
+                _mutex.Lock();
+                statistics.posted = _posted;
+                statistics.pending = _async_task_list.size();
+                _mutex.Unlock();
+            }
+
+            // safe from any thread, the drain statistics start over with the next drain
+            void ResetStatistics()
+            {
+                _mutex.Lock();
+                _posted = 0;
+                _mutex.Unlock();
+
+                _reset_requested.store(true, std::memory_order_release);
+            }
+
             ~AsyncHandle()
             {
             }
@@ -0,0 +1,392 @@
+#ifndef IO_SIMPLIFY_LIBUV_CAPTURE_H
+#define IO_SIMPLIFY_LIBUV_CAPTURE_H
+
+#include "libuv_base.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+namespace io_simplify {
+
+    namespace libuv {
+
+        /*
+            Records received payloads into a binary log for replay.
+
+            The loop thread appends a record to a lock-free single-producer ring and returns; a background thread moves
+            whole runs of records from the ring into the file. The loop never blocks on the file: when the ring is full
+            the record is dropped and counted. One Capture serves the handles of one loop. After the first failed write
+            the file ends there, so it never holds a torn record in the middle; the ring keeps being drained and what it
+            held is counted as unwritten.
+
+            The file is a FileHeader followed by records, each a RecordHeader plus payload padded to 8 bytes,
+            so a mmap of the file can be walked in place.
+        */
+        class Capture
+        {
+        public:
+            enum RecordType : uint16_t
+            {
+                RECORD_PAD = 0, // ring only, never in the file
+                RECORD_OPEN = 1, // tcp connection starts being captured
+                RECORD_DATA = 2, // tcp payload
+                RECORD_CLOSE = 3, // tcp connection ended (eof or error)
+                RECORD_DATAGRAM = 4, // one udp datagram
+            };
+
+            static constexpr char MAGIC[8] = {'U', 'V', 'C', 'A', 'P', 'T', '0', '1'};
+
+            struct FileHeader
+            {
+                char magic[8];
+                uint64_t wall_clock_ns; // capture start, nanoseconds since the epoch
+            };
+
+            struct RecordHeader
+            {
+                uint64_t time_ns; // since the capture started
+                uint64_t connection; // tcp: id given to StartCapture; udp: handle id mixed with the peer address
+                uint32_t length; // payload bytes, padding excluded
+                uint16_t type;
+                uint16_t reserved;
+            };
+
+            struct Statistics
+            {
+                uint64_t records = 0;
+                uint64_t bytes = 0; // payload bytes captured
+                uint64_t dropped_records = 0; // ring full
+                uint64_t dropped_bytes = 0;
+                uint64_t written_bytes = 0; // file bytes, headers and padding included
+                uint64_t unwritten_bytes = 0; // ring bytes drained without writing, from the first failed write on
+            };
+
+            static size_t RecordSize(size_t length)
+            {
+                return (sizeof(RecordHeader) + length + 7) & ~size_t(7);
+            }
+
+        private:
+            char* _ring;
+            size_t _capacity; // power of two
+
+            // running byte counts, the ring offset is the count modulo the capacity
+            std::atomic<uint64_t> _head; // written by the loop thread
+            std::atomic<uint64_t> _tail; // written by the writer thread
+
+            uint64_t _start;
+
+            FILE* _file;
+            std::thread _writer;
+            std::atomic<bool> _stopping;
+
+            std::atomic<uint64_t> _records;
+            std::atomic<uint64_t> _bytes;
+            std::atomic<uint64_t> _dropped_records;
+            std::atomic<uint64_t> _dropped_bytes;
+            std::atomic<uint64_t> _written_bytes;
+            std::atomic<uint64_t> _unwritten_bytes;
+
+            bool _write_failed; // writer thread only, once set the file is left alone
+
+        private:
+            // moves everything published so far to the file, returns false if there was nothing
+            bool flush()
+            {
+                uint64_t head = _head.load(std::memory_order_acquire);
+                uint64_t tail = _tail.load(std::memory_order_relaxed);
+
+                if (tail == head)
+                {
+                    return false;
+                }
+
+                while (tail < head)
+                {
+                    size_t offset = (size_t)(tail & (_capacity - 1));
+                    size_t contiguous = _capacity - offset;
+
+                    // the producer skips a tail too short for a header, or marks it with a pad record
+                    if (contiguous < sizeof(RecordHeader) || RECORD_PAD == ((RecordHeader*)(_ring + offset))->type)
+                    {
+                        tail += contiguous;
+                        continue;
+                    }
+
+                    // one fwrite for the run of records up to the end of the ring or the last published one
+                    size_t run = 0;
+                    while (tail + run < head && run < contiguous)
+                    {
+                        if (contiguous - run < sizeof(RecordHeader))
+                        {
+                            break;
+                        }
+
+                        RecordHeader* header = (RecordHeader*)(_ring + offset + run);
+                        if (RECORD_PAD == header->type)
+                        {
+                            break;
+                        }
+
+                        run += RecordSize(header->length);
+                    }
+
+                    // a failed run may be partly in the file, records appended after it would be misread; keep draining
+                    // so the loop is not starved of ring space
+                    if (_write_failed || 1 != fwrite(_ring + offset, run, 1, _file))
+                    {
+                        _write_failed = true;
+                        _unwritten_bytes.fetch_add(run, std::memory_order_relaxed);
+                    }
+                    else
+                    {
+                        _written_bytes.fetch_add(run, std::memory_order_relaxed);
+                    }
+
+                    tail += run;
+
+                    _tail.store(tail, std::memory_order_release);
+                }
+
+                _tail.store(tail, std::memory_order_release);
+
+                return true;
+            }
+
+            void run()
+            {
+                while (!_stopping.load(std::memory_order_acquire))
+                {
+                    if (!flush())
+                    {
+                        flushFile();
+
+                        // polling keeps the loop thread free of wakeup system calls
+                        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    }
+                }
+
+                flush();
+                flushFile();
+            }
+
+            // buffered writes fail here as well
+            void flushFile()
+            {
+                if (!_write_failed && 0 != fflush(_file))
+                {
+                    _write_failed = true;
+                }
+            }
+
+        public:
+            // ring_capacity is rounded up to a power of two
+            explicit Capture(size_t ring_capacity = 8 * 1024 * 1024)
+                : _ring(nullptr)
+                , _capacity(4096)
+
+                , _head(0)
+                , _tail(0)
+
+                , _start(0)
+
+                , _file(nullptr)
+                , _writer()
+                , _stopping(false)
+
+                , _records(0)
+                , _bytes(0)
+                , _dropped_records(0)
+                , _dropped_bytes(0)
+                , _written_bytes(0)
+                , _unwritten_bytes(0)
+
+                , _write_failed(false)
+            {
+                while (_capacity < ring_capacity)
+                {
+                    _capacity <<= 1;
+                }
+            }
+
+            ~Capture()
+            {
+                Close();
+            }
+
+            int Open(const char* path)
+            {
+                if (nullptr != _file)
+                {
+                    return UV_EALREADY;
+                }
+
+                _ring = (char*)malloc(_capacity);
+                if (nullptr == _ring)
+                {
+                    return UV_ENOMEM;
+                }
+
+                _file = fopen(path, "wb");
+                if (nullptr == _file)
+                {
+                    free(_ring);
+                    _ring = nullptr;
+
+                    return UV_EIO;
+                }
+
+                FileHeader file_header;
+                memcpy(file_header.magic, MAGIC, sizeof(MAGIC));
+                file_header.wall_clock_ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::system_clock::now().time_since_epoch()).count();
+
+                if (1 != fwrite(&file_header, sizeof(file_header), 1, _file) || 0 != fflush(_file))
+                {
+                    fclose(_file);
+                    _file = nullptr;
+
+                    free(_ring);
+                    _ring = nullptr;
+
+                    return UV_EIO;
+                }
+
+                _start = uv_hrtime();
+
+                _head.store(0, std::memory_order_relaxed);
+                _tail.store(0, std::memory_order_relaxed);
+                _stopping.store(false, std::memory_order_relaxed);
+                _write_failed = false;
+
+                _writer = std::thread(&Capture::run, this);
+
+                return 0;
+            }
+
+            // writes what is still in the ring, then closes the file; the handles must not record any more
+            void Close()
+            {
+                if (nullptr == _file)
+                {
+                    return;
+                }
+
+                _stopping.store(true, std::memory_order_release);
+                _writer.join();
+
+                fclose(_file);
+                _file = nullptr;
+
+                free(_ring);
+                _ring = nullptr;
+            }
+
+            // loop thread only; never blocks, drops the record when the ring is full
+            void Record(RecordType type, uint64_t connection, const void* data, size_t length)
+            {
+                if (nullptr == _file)
+                {
+                    return;
+                }
+
+                size_t record_size = RecordSize(length);
+
+                uint64_t head = _head.load(std::memory_order_relaxed);
+                uint64_t tail = _tail.load(std::memory_order_acquire);
+
+                size_t offset = (size_t)(head & (_capacity - 1));
+                size_t contiguous = _capacity - offset;
+                size_t skip = contiguous < record_size ? contiguous : 0;
+
+                if (record_size > _capacity / 2 || head + skip + record_size - tail > _capacity)
+                {
+                    _dropped_records.fetch_add(1, std::memory_order_relaxed);
+                    _dropped_bytes.fetch_add(length, std::memory_order_relaxed);
+                    return;
+                }
+
+                if (skip > 0)
+                {
+                    if (skip >= sizeof(RecordHeader))
+                    {
+                        ((RecordHeader*)(_ring + offset))->type = RECORD_PAD;
+                    }
+
+                    head += skip;
+                    offset = 0;
+                }
+
+                RecordHeader* header = (RecordHeader*)(_ring + offset);
+                header->time_ns = uv_hrtime() - _start;
+                header->connection = connection;
+                header->length = (uint32_t)length;
+                header->type = type;
+                header->reserved = 0;
+
+                char* payload = (char*)(header + 1);
+                memcpy(payload, data, length);
+                memset(payload + length, 0, record_size - sizeof(RecordHeader) - length);
+
+                _records.fetch_add(1, std::memory_order_relaxed);
+                _bytes.fetch_add(length, std::memory_order_relaxed);
+
+                _head.store(head + record_size, std::memory_order_release);
+            }
+
+            // udp records are keyed by handle id and peer, so replay can give every peer its own socket
+            static uint64_t PeerConnection(uint64_t handle_id, const struct sockaddr* addr)
+            {
+                uint64_t key = 14695981039346656037ull;
+
+                if (nullptr != addr && AF_INET == addr->sa_family)
+                {
+                    const struct sockaddr_in* addr_in = (const struct sockaddr_in*)addr;
+
+                    return (handle_id << 48) ^ ((uint64_t)(addr_in->sin_addr.s_addr) << 16) ^ addr_in->sin_port;
+                }
+
+                if (nullptr != addr && AF_INET6 == addr->sa_family)
+                {
+                    const struct sockaddr_in6* addr_in6 = (const struct sockaddr_in6*)addr;
+
+                    const unsigned char* bytes = (const unsigned char*)&(addr_in6->sin6_addr);
+
+                    for (size_t i = 0; i < sizeof(addr_in6->sin6_addr); ++i)
+                    {
+                        key = (key ^ bytes[i]) * 1099511628211ull;
+                    }
+
+                    key ^= addr_in6->sin6_port;
+                }
+
+                return (handle_id << 48) ^ (key & 0xffffffffffffull);
+            }
+
+            // safe from any thread
+            void Snapshot(Statistics& statistics) const
+            {
+                statistics.records = _records.load(std::memory_order_relaxed);
+                statistics.bytes = _bytes.load(std::memory_order_relaxed);
+                statistics.dropped_records = _dropped_records.load(std::memory_order_relaxed);
+                statistics.dropped_bytes = _dropped_bytes.load(std::memory_order_relaxed);
+                statistics.written_bytes = _written_bytes.load(std::memory_order_relaxed);
+                statistics.unwritten_bytes = _unwritten_bytes.load(std::memory_order_relaxed);
+            }
+
+        private:
+            Capture(const Capture&) = delete;
+            Capture& operator=(const Capture&) = delete;
+
+            Capture(Capture&&) = delete;
+            Capture& operator=(Capture&&) = delete;
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef IO_SIMPLIFY_LIBUV_CHECK_HANDLE_H
+#define IO_SIMPLIFY_LIBUV_CHECK_HANDLE_H
+
+#include "libuv_loop.h"
+
+#include "libuv_handle.h"
+
+namespace io_simplify {
+
+    namespace libuv {
+
+        /*
+            Check handles will run the given callback once per loop iteration, right after polling for i/o.
+        */
+        class CheckHandle : public Handle<uv_check_t>
+        {
+        public:
+            using CallbackCheck = std::function<void()>;
+
+        private:
+            CallbackCheck _callback_check;
+
+        private:
+            static void callback_uv_check(uv_check_t* handle)
+            {
+                CheckHandle* check_handle = (CheckHandle*)(handle->data);
+
+                LIBUV_WATCHDOG_CALLBACK(check_handle, TRACE_CALLBACK_CHECK);
+
+                check_handle->_callback_check();
+            }
+
+        public:
+            explicit CheckHandle(Loop* loop)
+                : Handle<uv_check_t>(loop)
+
+                , _callback_check()
+            {
+                Handle<uv_check_t>::status = uv_check_init(loop->uv, Handle<uv_check_t>::uv);
+            }
+
+            ~CheckHandle()
+            {
+            }
+
+            int Start(const CallbackCheck& callback_check)
+            {
+                _callback_check = callback_check;
+
+                return uv_check_start(Handle<uv_check_t>::uv, callback_uv_check);
+            }
+
+            void Stop()
+            {
+                uv_check_stop(Handle<uv_check_t>::uv);
+            }
+
+            bool IsActive() const
+            {
+                return 0 != uv_is_active((const uv_handle_t*)(Handle<uv_check_t>::uv));
+            }
+
+        private:
+            CheckHandle() = delete;
+
+            CheckHandle(const CheckHandle&) = delete;
+            CheckHandle& operator=(const CheckHandle&) = delete;
+
+            CheckHandle(CheckHandle&&) = delete;
+            CheckHandle& operator=(CheckHandle&&) = delete;
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,822 @@
+#ifndef IO_SIMPLIFY_LIBUV_COMPRESSION_H
+#define IO_SIMPLIFY_LIBUV_COMPRESSION_H
+
+#include "libuv_loop.h"
+
+#include "libuv_deferred_queue.h"
+#include "libuv_tcp_handle.h"
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <string.h>
+
+#include <zlib.h>
+
+namespace io_simplify {
+
+    namespace libuv {
+
+        /*
+            Per-loop state shared by the CompressedStreams of one loop: deflate and inflate contexts recycled
+            between connections (a context costs a few hundred KiB to set up), read buffers for inflated data,
+            the queue that batches writes per loop iteration, and the statistics.
+
+            Uses zlib (raw deflate). Build with LIBUV_SIMPLIFY_ZLIB=ON, or link zlib yourself.
+        */
+        class CompressionPool
+        {
+            friend class CompressedStream;
+
+        public:
+            using CallbackPoolClosed = std::function<void()>;
+
+            struct Statistics
+            {
+                uint64_t raw_bytes = 0; // written by the application
+                uint64_t wire_bytes = 0; // handed to the sockets, frame headers included
+
+                uint64_t compressed_blocks = 0;
+                uint64_t plain_blocks = 0; // below the threshold
+                uint64_t offloaded_blocks = 0; // compressed on the thread pool
+
+                uint64_t inflated_bytes = 0;
+
+                uint64_t compress_ns = 0; // time spent in deflate, thread pool included
+                uint64_t decompress_ns = 0;
+
+                // raw over wire bytes, > 1 means the stage saves bandwidth
+                double Ratio() const
+                {
+                    return 0 == wire_bytes ? 1.0 : (double)raw_bytes / (double)wire_bytes;
+                }
+            };
+
+        private:
+            Loop* _loop;
+            DeferredQueue _deferred;
+
+            int _level;
+            size_t _threshold;
+            size_t _offload_threshold;
+            size_t _read_buffer_size;
+            size_t _max_pooled;
+
+            std::vector<z_stream*> _deflaters;
+            std::vector<z_stream*> _inflaters;
+            std::vector<char*> _read_buffers;
+
+            Statistics _statistics;
+
+        private:
+            z_stream* takeDeflater()
+            {
+                if (!_deflaters.empty())
+                {
+                    z_stream* stream = _deflaters.back();
+                    _deflaters.pop_back();
+                    return stream;
+                }
+
+                z_stream* stream = new z_stream();
+                if (Z_OK != deflateInit2(stream, _level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY))
+                {
+                    delete stream;
+                    return nullptr;
+                }
+
+                return stream;
+            }
+
+            void returnDeflater(z_stream* stream)
+            {
+                if (_deflaters.size() < _max_pooled && Z_OK == deflateReset(stream))
+                {
+                    _deflaters.push_back(stream);
+                    return;
+                }
+
+                deflateEnd(stream);
+                delete stream;
+            }
+
+            z_stream* takeInflater()
+            {
+                if (!_inflaters.empty())
+                {
+                    z_stream* stream = _inflaters.back();
+                    _inflaters.pop_back();
+                    return stream;
+                }
+
+                z_stream* stream = new z_stream();
+                if (Z_OK != inflateInit2(stream, -15))
+                {
+                    delete stream;
+                    return nullptr;
+                }
+
+                return stream;
+            }
+
+            void returnInflater(z_stream* stream)
+            {
+                if (_inflaters.size() < _max_pooled && Z_OK == inflateReset(stream))
+                {
+                    _inflaters.push_back(stream);
+                    return;
+                }
+
+                inflateEnd(stream);
+                delete stream;
+            }
+
+            char* takeReadBuffer()
+            {
+                if (!_read_buffers.empty())
+                {
+                    char* buffer = _read_buffers.back();
+                    _read_buffers.pop_back();
+                    return buffer;
+                }
+
+                return (char*)malloc(_read_buffer_size);
+            }
+
+            void returnReadBuffer(char* buffer)
+            {
+                if (_read_buffers.size() < _max_pooled)
+                {
+                    _read_buffers.push_back(buffer);
+                    return;
+                }
+
+                free(buffer);
+            }
+
+        public:
+            /*
+                level: zlib level, 1 favours speed.
+                threshold: batches smaller than this go out uncompressed.
+                offload_threshold: batches at least this large are deflated on the libuv thread pool.
+                read_buffer_size: size of the pooled buffers inflated data is delivered in.
+                max_pooled: contexts and read buffers kept for reuse, each.
+            */
+            CompressionPool(Loop* loop, int level = 1, size_t threshold = 256, size_t offload_threshold = 64 * 1024,
+                size_t read_buffer_size = 64 * 1024, size_t max_pooled = 64)
+                : _loop(loop)
+                , _deferred(loop)
+
+                , _level(level)
+                , _threshold(threshold)
+                , _offload_threshold(offload_threshold)
+                , _read_buffer_size(read_buffer_size)
+                , _max_pooled(max_pooled)
+
+                , _deflaters()
+                , _inflaters()
+                , _read_buffers()
+
+                , _statistics()
+            {
+            }
+
+            ~CompressionPool()
+            {
+                for (z_stream* stream : _deflaters)
+                {
+                    deflateEnd(stream);
+                    delete stream;
+                }
+
+                for (z_stream* stream : _inflaters)
+                {
+                    inflateEnd(stream);
+                    delete stream;
+                }
+
+                for (char* buffer : _read_buffers)
+                {
+                    free(buffer);
+                }
+            }
+
+            const Statistics& GetStatistics() const
+            {
+                return _statistics;
+            }
+
+            // after every stream of the pool is closed
+            void Close(const CallbackPoolClosed& callback_pool_closed = nullptr)
+            {
+                _deferred.Close(callback_pool_closed);
+            }
+
+        private:
+            CompressionPool() = delete;
+
+            CompressionPool(const CompressionPool&) = delete;
+            CompressionPool& operator=(const CompressionPool&) = delete;
+
+            CompressionPool(CompressionPool&&) = delete;
+            CompressionPool& operator=(CompressionPool&&) = delete;
+        };
+
+        /*
+            Compression stage over a connected TcpHandle; both ends must use one.
+
+            Everything written during one loop iteration is gathered and leaves as one block, cut every MAX_BATCH_SIZE
+            bytes so no block exceeds what the peer accepts: uncompressed below the pool's threshold, otherwise deflated
+            with the connection's streaming context (Z_SYNC_FLUSH per block, so the dictionary carries over between
+            blocks) inline or, for large batches, on the thread pool while later writes queue up behind it. Blocks are
+            framed with an 8-byte header: type, 3 reserved bytes, little-endian payload length.
+
+            Received blocks are delivered to CallbackRead in pooled buffers of the pool's read_buffer_size, valid
+            during the callback only; uncompressed blocks point into the input buffer. A corrupt stream reports UV_EPROTO.
+
+            Close the stream, then the TcpHandle, and delete the stream once the handle is closed.
+        */
+        class CompressedStream
+        {
+        public:
+            using CallbackStreamClosed = std::function<void()>;
+
+            static constexpr uint8_t BLOCK_PLAIN = 0;
+            static constexpr uint8_t BLOCK_DEFLATE = 1;
+
+            static constexpr size_t HEADER_SIZE = 8;
+            static constexpr size_t MAX_BLOCK_SIZE = 64 * 1024 * 1024;
+
+            // largest batch per block, leaving room for what deflate adds to incompressible data
+            static constexpr size_t MAX_BATCH_SIZE = MAX_BLOCK_SIZE - MAX_BLOCK_SIZE / 256;
+
+        private:
+            struct Block
+            {
+                TcpHandle::WriteRequest request;
+                uv_work_t work;
+
+                CompressedStream* stream;
+
+                char header[HEADER_SIZE];
+                std::string input;
+                std::string output;
+
+                uint64_t compress_ns;
+                int result;
+            };
+
+        private:
+            CompressionPool* _pool;
+            TcpHandle* _tcp;
+
+            z_stream* _deflater;
+            z_stream* _inflater;
+
+            std::string _pending; // written during this loop iteration
+            std::vector<Block*> _free_blocks;
+            Block* _offloaded; // on the thread pool, blocks after it wait in _pending
+            size_t _writing; // blocks handed to the socket
+
+            std::vector<char> _input;
+            size_t _input_begin;
+            size_t _input_end;
+
+            CallbackRead _callback_read;
+
+            bool _flush_deferred;
+            int _error; // the failure, reported once; nothing is sent any more
+            bool _closing;
+            bool _closed;
+            CallbackStreamClosed _callback_stream_closed;
+
+        private:
+            static void callback_block_written(TcpHandle::WriteRequest* write_request, int status)
+            {
+                Block* block = (Block*)(write_request);
+                CompressedStream* stream = block->stream;
+
+                --stream->_writing;
+                stream->_free_blocks.push_back(block);
+
+                if (status < 0)
+                {
+                    stream->fail(status);
+                }
+            }
+
+            static void callback_work(uv_work_t* work)
+            {
+                Block* block = (Block*)(work->data);
+
+                block->result = block->stream->deflateBlock(block);
+            }
+
+            static void callback_after_work(uv_work_t* work, int status)
+            {
+                Block* block = (Block*)(work->data);
+                CompressedStream* stream = block->stream;
+
+                stream->_offloaded = nullptr;
+
+                if (stream->_closing)
+                {
+                    stream->_free_blocks.push_back(block);
+                    stream->settle();
+                    return;
+                }
+
+                stream->_pool->_statistics.compress_ns += block->compress_ns;
+
+                if (status < 0 || Z_OK != block->result)
+                {
+                    stream->_free_blocks.push_back(block);
+                    stream->fail(status < 0 ? status : UV_EPROTO);
+                    return;
+                }
+
+                if (stream->send(block, BLOCK_DEFLATE, block->output))
+                {
+                    // writes that queued up behind the offloaded block
+                    stream->flush();
+                }
+            }
+
+            static void setHeader(char* header, uint8_t type, size_t size)
+            {
+                header[0] = (char)type;
+                header[1] = header[2] = header[3] = 0;
+
+                for (int i = 0; i < 4; ++i)
+                {
+                    header[4 + i] = (char)((size >> (8 * i)) & 0xff);
+                }
+            }
+
+            // runs on the loop or a pool thread, never both at once for one stream
+            int deflateBlock(Block* block)
+            {
+                uint64_t begin = uv_hrtime();
+
+                block->output.resize(deflateBound(_deflater, (uLong)block->input.size()) + 16);
+
+                _deflater->next_in = (Bytef*)block->input.data();
+                _deflater->avail_in = (uInt)block->input.size();
+                _deflater->next_out = (Bytef*)block->output.data();
+                _deflater->avail_out = (uInt)block->output.size();
+
+                int result = deflate(_deflater, Z_SYNC_FLUSH);
+
+                // the bound leaves room for the flush marker, growing is only a safety net
+                while (Z_OK == result && 0 == _deflater->avail_out)
+                {
+                    size_t produced = block->output.size();
+
+                    block->output.resize(produced + 64 * 1024);
+
+                    _deflater->next_out = (Bytef*)block->output.data() + produced;
+                    _deflater->avail_out = 64 * 1024;
+
+                    result = deflate(_deflater, Z_SYNC_FLUSH);
+                }
+
+                block->output.resize(block->output.size() - _deflater->avail_out);
+                block->compress_ns = uv_hrtime() - begin;
+
+                return result;
+            }
+
+            Block* takeBlock()
+            {
+                if (!_free_blocks.empty())
+                {
+                    Block* block = _free_blocks.back();
+                    _free_blocks.pop_back();
+                    return block;
+                }
+
+                Block* block = new Block();
+                block->request.callback_written = callback_block_written;
+                block->work.data = block;
+                block->stream = this;
+
+                return block;
+            }
+
+            bool send(Block* block, uint8_t type, const std::string& payload)
+            {
+                setHeader(block->header, type, payload.size());
+
+                uv_buf_t bufs[2] = {
+                    uv_buf_init(block->header, HEADER_SIZE),
+                    uv_buf_init((char*)payload.data(), (unsigned int)payload.size()),
+                };
+
+                CompressionPool::Statistics& statistics = _pool->_statistics;
+                statistics.wire_bytes += HEADER_SIZE + payload.size();
+
+                int res = _tcp->Write(&(block->request), bufs, 2);
+                if (res < 0)
+                {
+                    _free_blocks.push_back(block);
+                    fail(res);
+                    return false;
+                }
+
+                ++_writing;
+
+                return true;
+            }
+
+            void flush()
+            {
+                while (!_closing && 0 == _error && nullptr == _offloaded && !_pending.empty())
+                {
+                    if (!flushBatch())
+                    {
+                        return;
+                    }
+                }
+            }
+
+            // one block of at most MAX_BATCH_SIZE bytes off the front of _pending, false once the stream failed
+            bool flushBatch()
+            {
+                CompressionPool::Statistics& statistics = _pool->_statistics;
+
+                Block* block = takeBlock();
+                if (_pending.size() <= MAX_BATCH_SIZE)
+                {
+                    block->input.swap(_pending);
+                    _pending.clear();
+                }
+                else
+                {
+                    block->input.assign(_pending, 0, MAX_BATCH_SIZE);
+                    _pending.erase(0, MAX_BATCH_SIZE);
+                }
+
+                statistics.raw_bytes += block->input.size();
+
+                if (block->input.size() < _pool->_threshold)
+                {
+                    ++statistics.plain_blocks;
+
+                    return send(block, BLOCK_PLAIN, block->input);
+                }
+
+                ++statistics.compressed_blocks;
+
+                if (block->input.size() >= _pool->_offload_threshold)
+                {
+                    ++statistics.offloaded_blocks;
+
+                    int res = uv_queue_work(_pool->_loop->uv, &(block->work), callback_work, callback_after_work);
+                    if (res < 0)
+                    {
+                        _free_blocks.push_back(block);
+                        fail(res);
+                        return false;
+                    }
+
+                    _offloaded = block;
+                    return true;
+                }
+
+                int result = deflateBlock(block);
+
+                statistics.compress_ns += block->compress_ns;
+
+                if (Z_OK != result)
+                {
+                    _free_blocks.push_back(block);
+                    fail(UV_EPROTO);
+                    return false;
+                }
+
+                return send(block, BLOCK_DEFLATE, block->output);
+            }
+
+            void deferFlush()
+            {
+                if (_flush_deferred)
+                {
+                    return;
+                }
+
+                _flush_deferred = true;
+
+                _pool->_deferred.Defer([this] () {
+                    _flush_deferred = false;
+
+                    if (_closing)
+                    {
+                        settle();
+                        return;
+                    }
+
+                    flush();
+                });
+            }
+
+            void fail(int status)
+            {
+                if (_closing || 0 != _error)
+                {
+                    return;
+                }
+
+                _error = status;
+
+                // never sent now, Write refuses more
+                _pending.clear();
+
+                _tcp->StopRead();
+
+                if (_callback_read)
+                {
+                    _callback_read(status, nullptr);
+                }
+            }
+
+            // hands the inflated block to the reader, one pooled buffer at a time
+            bool inflateBlock(const char* data, size_t size)
+            {
+                CompressionPool::Statistics& statistics = _pool->_statistics;
+
+                _inflater->next_in = (Bytef*)data;
+                _inflater->avail_in = (uInt)size;
+
+                char* buffer = _pool->takeReadBuffer();
+                if (nullptr == buffer)
+                {
+                    return false;
+                }
+
+                bool ok = true;
+                do
+                {
+                    _inflater->next_out = (Bytef*)buffer;
+                    _inflater->avail_out = (uInt)_pool->_read_buffer_size;
+
+                    uint64_t begin = uv_hrtime();
+                    int result = inflate(_inflater, Z_SYNC_FLUSH);
+                    statistics.decompress_ns += uv_hrtime() - begin;
+
+                    size_t produced = _pool->_read_buffer_size - _inflater->avail_out;
+
+                    if (Z_OK != result && Z_BUF_ERROR != result)
+                    {
+                        ok = false;
+                        break;
+                    }
+
+                    if (0 == produced)
+                    {
+                        break;
+                    }
+
+                    statistics.inflated_bytes += produced;
+
+                    uv_buf_t buf = uv_buf_init(buffer, (unsigned int)produced);
+                    _callback_read((ssize_t)produced, &buf);
+                } while (!_closing && (0 != _inflater->avail_in || 0 == _inflater->avail_out));
+
+                _pool->returnReadBuffer(buffer);
+
+                return ok && (_closing || 0 == _inflater->avail_in);
+            }
+
+            void read(ssize_t nread)
+            {
+                if (nread < 0)
+                {
+                    _callback_read(nread, nullptr);
+                    return;
+                }
+
+                _input_end += (size_t)nread;
+
+                while (!_closing && _input_end - _input_begin >= HEADER_SIZE)
+                {
+                    const unsigned char* header = (const unsigned char*)(_input.data() + _input_begin);
+
+                    size_t size = 0;
+                    for (int i = 3; i >= 0; --i)
+                    {
+                        size = (size << 8) | header[4 + i];
+                    }
+
+                    if (size > MAX_BLOCK_SIZE || (BLOCK_PLAIN != header[0] && BLOCK_DEFLATE != header[0]))
+                    {
+                        fail(UV_EPROTO);
+                        return;
+                    }
+
+                    if (_input_end - _input_begin < HEADER_SIZE + size)
+                    {
+                        // make room for the rest of the block
+                        if (_input.size() - _input_begin < HEADER_SIZE + size)
+                        {
+                            memmove(_input.data(), _input.data() + _input_begin, _input_end - _input_begin);
+                            _input_end -= _input_begin;
+                            _input_begin = 0;
+
+                            if (_input.size() < HEADER_SIZE + size)
+                            {
+                                _input.resize(HEADER_SIZE + size);
+                            }
+                        }
+                        break;
+                    }
+
+                    char* payload = _input.data() + _input_begin + HEADER_SIZE;
+                    _input_begin += HEADER_SIZE + size;
+
+                    if (0 == size)
+                    {
+                        continue;
+                    }
+
+                    if (BLOCK_PLAIN == header[0])
+                    {
+                        uv_buf_t buf = uv_buf_init(payload, (unsigned int)size);
+                        _callback_read((ssize_t)size, &buf);
+                    }
+                    else if (!inflateBlock(payload, size))
+                    {
+                        fail(UV_EPROTO);
+                        return;
+                    }
+                }
+
+                if (_input_begin == _input_end)
+                {
+                    _input_begin = _input_end = 0;
+                }
+                else if (_input_begin > 0 && _input.size() - _input_end < _input.size() / 4)
+                {
+                    memmove(_input.data(), _input.data() + _input_begin, _input_end - _input_begin);
+                    _input_end -= _input_begin;
+                    _input_begin = 0;
+                }
+            }
+
+            // the stream is closed once nothing on the thread pool or the deferred queue refers to it
+            void settle()
+            {
+                if (!_closing || _closed || nullptr != _offloaded || _flush_deferred)
+                {
+                    return;
+                }
+
+                _closed = true;
+
+                if (nullptr != _deflater)
+                {
+                    _pool->returnDeflater(_deflater);
+                    _deflater = nullptr;
+                }
+
+                if (nullptr != _inflater)
+                {
+                    _pool->returnInflater(_inflater);
+                    _inflater = nullptr;
+                }
+
+                if (_callback_stream_closed)
+                {
+                    _callback_stream_closed();
+                }
+            }
+
+        public:
+            CompressedStream(CompressionPool* pool, TcpHandle* tcp)
+                : _pool(pool)
+                , _tcp(tcp)
+
+                , _deflater(pool->takeDeflater())
+                , _inflater(pool->takeInflater())
+
+                , _pending()
+                , _free_blocks()
+                , _offloaded(nullptr)
+                , _writing(0)
+
+                , _input(64 * 1024)
+                , _input_begin(0)
+                , _input_end(0)
+
+                , _callback_read()
+
+                , _flush_deferred(false)
+                , _error(0)
+                , _closing(false)
+                , _closed(false)
+                , _callback_stream_closed()
+            {
+            }
+
+            // the TcpHandle must be closed, its write callbacks refer to the stream's blocks
+            ~CompressedStream()
+            {
+                for (Block* block : _free_blocks)
+                {
+                    delete block;
+                }
+
+                if (nullptr != _deflater)
+                {
+                    _pool->returnDeflater(_deflater);
+                }
+
+                if (nullptr != _inflater)
+                {
+                    _pool->returnInflater(_inflater);
+                }
+            }
+
+            int StartRead(const CallbackRead& callback_read)
+            {
+                if (nullptr == _deflater || nullptr == _inflater)
+                {
+                    return UV_ENOMEM;
+                }
+
+                _callback_read = callback_read;
+
+                return _tcp->StartRead(
+                    [this] (ssize_t nread, const uv_buf_t*) {
+                        read(nread);
+                    },
+                    [this] (size_t, uv_buf_t* buf) {
+                        if (_input.size() - _input_end < 4096)
+                        {
+                            _input.resize(_input.size() * 2);
+                        }
+
+                        buf->base = _input.data() + _input_end;
+                        buf->len = _input.size() - _input_end;
+                    });
+            }
+
+            // copies bufs; everything written in this loop iteration leaves together at the end of it
+            int Write(const uv_buf_t* bufs, unsigned int nbufs)
+            {
+                if (_closing || 0 != _error)
+                {
+                    return _closing ? UV_EPIPE : _error;
+                }
+
+                if (nullptr == _deflater)
+                {
+                    return UV_ENOMEM;
+                }
+
+                for (unsigned int i = 0; i < nbufs; ++i)
+                {
+                    _pending.append(bufs[i].base, bufs[i].len);
+                }
+
+                deferFlush();
+
+                return 0;
+            }
+
+            // bytes written but not handed to the socket yet, the batch being compressed on the thread pool included
+            size_t Pending() const
+            {
+                return _pending.size() + (nullptr != _offloaded ? _offloaded->input.size() : 0);
+            }
+
+            // stops reading and drops writes not flushed yet; the TcpHandle itself stays open
+            void Close(const CallbackStreamClosed& callback_stream_closed = nullptr)
+            {
+                if (_closing)
+                {
+                    return;
+                }
+
+                _closing = true;
+                _callback_stream_closed = callback_stream_closed;
+
+                _tcp->StopRead();
+                _pending.clear();
+
+                settle();
+            }
+
+        private:
+            CompressedStream() = delete;
+
+            CompressedStream(const CompressedStream&) = delete;
+            CompressedStream& operator=(const CompressedStream&) = delete;
+
+            CompressedStream(CompressedStream&&) = delete;
+            CompressedStream& operator=(CompressedStream&&) = delete;
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,715 @@
+#ifndef IO_SIMPLIFY_LIBUV_COROUTINE_H
+#define IO_SIMPLIFY_LIBUV_COROUTINE_H
+
+#if !defined(__cpp_impl_coroutine)
+#error "libuv_coroutine.h requires C++20 coroutines, configure with -DLIBUV_SIMPLIFY_COROUTINE=ON"
+#endif
+
+#include "libuv_tcp_handle.h"
+#include "libuv_udp_handle.h"
+
+#include <coroutine>
+#include <exception>
+
+namespace io_simplify {
+
+    namespace libuv {
+
+        /*
+            Size-class free lists for coroutine frames. A loop is driven by a single thread, so the thread local pool
+            is the loop's pool; frames finished on another thread simply move to that thread's lists.
+        */
+        class FramePool
+        {
+            static constexpr size_t GRANULE = 64;
+            static constexpr size_t CLASSES = 32; // frames up to 2 KiB are pooled
+
+            struct FreeFrame
+            {
+                FreeFrame* next;
+            };
+
+        private:
+            FreeFrame* _free_frames[CLASSES];
+
+        public:
+            FramePool()
+                : _free_frames()
+            {
+            }
+
+            ~FramePool()
+            {
+                for (size_t index = 0; index < CLASSES; ++index)
+                {
+                    while (_free_frames[index])
+                    {
+                        FreeFrame* frame = _free_frames[index];
+                        _free_frames[index] = frame->next;
+
+                        free(frame);
+                    }
+                }
+            }
+
+            static FramePool& Local()
+            {
+                static thread_local FramePool pool;
+                return pool;
+            }
+
+            void* Allocate(size_t size)
+            {
+                size_t index = (size + GRANULE - 1) / GRANULE;
+                if (index >= CLASSES)
+                {
+                    return malloc(size);
+                }
+
+                FreeFrame* frame = _free_frames[index];
+                if (frame)
+                {
+                    _free_frames[index] = frame->next;
+                    return frame;
+                }
+
+                return malloc(index * GRANULE);
+            }
+
+            void Deallocate(void* memory, size_t size)
+            {
+                size_t index = (size + GRANULE - 1) / GRANULE;
+                if (index >= CLASSES)
+                {
+                    free(memory);
+                    return;
+                }
+
+                FreeFrame* frame = (FreeFrame*)(memory);
+                frame->next = _free_frames[index];
+                _free_frames[index] = frame;
+            }
+
+        private:
+            FramePool(const FramePool&) = delete;
+            FramePool& operator=(const FramePool&) = delete;
+
+            FramePool(FramePool&&) = delete;
+            FramePool& operator=(FramePool&&) = delete;
+        };
+
+        /*
+            Fire and forget coroutine: starts running at the call, frees its frame when it returns.
+            Every co_await below resumes inline from the loop callback that completed it.
+        */
+        class Task
+        {
+        public:
+            struct promise_type
+            {
+                Task get_return_object() noexcept
+                {
+                    return Task();
+                }
+
+                std::suspend_never initial_suspend() noexcept
+                {
+                    return {};
+                }
+
+                std::suspend_never final_suspend() noexcept
+                {
+                    return {};
+                }
+
+                void return_void() noexcept
+                {
+                }
+
+                void unhandled_exception() noexcept
+                {
+                    std::terminate();
+                }
+
+                static void* operator new(size_t size)
+                {
+                    return FramePool::Local().Allocate(size);
+                }
+
+                static void operator delete(void* memory, size_t size)
+                {
+                    FramePool::Local().Deallocate(memory, size);
+                }
+            };
+        };
+
+        // coroutine view of a connected (or connecting) TcpHandle, one pending Read and any number of Writes at a time
+        class TcpStream
+        {
+        public:
+            class ReadAwaiter
+            {
+                friend class TcpStream;
+
+                TcpStream* _stream;
+                uv_buf_t _buf;
+
+                std::coroutine_handle<> _coroutine;
+                ssize_t _nread;
+
+            public:
+                ReadAwaiter(TcpStream* stream, uv_buf_t buf)
+                    : _stream(stream)
+                    , _buf(buf)
+                    , _coroutine()
+                    , _nread(0)
+                {
+                }
+
+                bool await_ready() const noexcept
+                {
+                    return false;
+                }
+
+                bool await_suspend(std::coroutine_handle<> coroutine)
+                {
+                    _coroutine = coroutine;
+
+                    _stream->_reader = this;
+
+                    if (!_stream->_reading)
+                    {
+                        int res = _stream->_handle->StartRead(
+                            [stream = _stream] (ssize_t nread, const uv_buf_t* buf) { stream->onRead(nread); },
+                            [stream = _stream] (size_t suggested_size, uv_buf_t* buf) { stream->onAlloc(buf); });
+                        if (res < 0)
+                        {
+                            _stream->_reader = nullptr;
+                            _nread = res;
+                            return false;
+                        }
+
+                        _stream->_reading = true;
+                    }
+
+                    return true;
+                }
+
+                // bytes read, UV_EOF or UV_E*
+                ssize_t await_resume() const noexcept
+                {
+                    return _nread;
+                }
+            };
+
+            class WriteAwaiter : private TcpHandle::WriteRequest
+            {
+                TcpHandle* _handle;
+                const uv_buf_t* _bufs;
+                unsigned int _nbufs;
+
+                std::coroutine_handle<> _coroutine;
+                int _status;
+
+            private:
+                static void callback_written(TcpHandle::WriteRequest* write_request, int status)
+                {
+                    WriteAwaiter* awaiter = static_cast<WriteAwaiter*>(write_request);
+
+                    awaiter->_status = status;
+                    awaiter->_coroutine.resume();
+                }
+
+            public:
+                WriteAwaiter(TcpHandle* handle, const uv_buf_t* bufs, unsigned int nbufs)
+                    : TcpHandle::WriteRequest()
+                    , _handle(handle)
+                    , _bufs(bufs)
+                    , _nbufs(nbufs)
+                    , _coroutine()
+                    , _status(0)
+                {
+                    TcpHandle::WriteRequest::callback_written = callback_written;
+                }
+
+                bool await_ready() const noexcept
+                {
+                    return false;
+                }
+
+                bool await_suspend(std::coroutine_handle<> coroutine)
+                {
+                    _coroutine = coroutine;
+
+                    _status = _handle->Write(this, _bufs, _nbufs);
+
+                    return 0 == _status;
+                }
+
+                int await_resume() const noexcept
+                {
+                    return _status;
+                }
+            };
+
+            class ConnectAwaiter
+            {
+                TcpHandle* _handle;
+                struct sockaddr_storage _addr;
+
+                uv_connect_t _req;
+                std::coroutine_handle<> _coroutine;
+                int _status;
+
+            public:
+                ConnectAwaiter(TcpHandle* handle, const Endpoint& endpoint)
+                    : _handle(handle)
+                    , _addr()
+                    , _req()
+                    , _coroutine()
+                    , _status(0)
+                {
+                    _status = uv_ip4_addr(endpoint.address.c_str(), endpoint.port, (struct sockaddr_in*)&_addr);
+                }
+
+                ConnectAwaiter(TcpHandle* handle, const struct sockaddr* addr)
+                    : _handle(handle)
+                    , _addr()
+                    , _req()
+                    , _coroutine()
+                    , _status(0)
+                {
+                    memcpy(&_addr, addr, AF_INET6 == addr->sa_family ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+                }
+
+                bool await_ready() const noexcept
+                {
+                    return _status < 0;
+                }
+
+                bool await_suspend(std::coroutine_handle<> coroutine)
+                {
+                    _coroutine = coroutine;
+                    _req.data = this;
+
+                    _status = _handle->Connect(&_req, (const struct sockaddr*)&_addr, [] (uv_connect_t* req, int status) {
+                        ConnectAwaiter* awaiter = (ConnectAwaiter*)(req->data);
+
+                        awaiter->_status = status;
+                        awaiter->_coroutine.resume();
+                    });
+
+                    return 0 == _status;
+                }
+
+                int await_resume() const noexcept
+                {
+                    return _status;
+                }
+            };
+
+        private:
+            TcpHandle* _handle;
+
+            ReadAwaiter* _reader;
+            bool _reading;
+
+        private:
+            void onAlloc(uv_buf_t* buf)
+            {
+                if (_reader)
+                {
+                    *buf = _reader->_buf;
+                }
+                else
+                {
+                    // nobody is reading, libuv reports UV_ENOBUFS and reading pauses until the next Read
+                    *buf = uv_buf_init(nullptr, 0);
+                }
+            }
+
+            void onRead(ssize_t nread)
+            {
+                if (0 == nread)
+                {
+                    return;
+                }
+
+                ReadAwaiter* reader = _reader;
+                if (nullptr == reader || nread < 0)
+                {
+                    _handle->StopRead();
+                    _reading = false;
+                }
+
+                if (reader)
+                {
+                    _reader = nullptr;
+
+                    reader->_nread = nread;
+                    reader->_coroutine.resume();
+                }
+            }
+
+        public:
+            explicit TcpStream(TcpHandle* handle)
+                : _handle(handle)
+                , _reader(nullptr)
+                , _reading(false)
+            {
+            }
+
+            ~TcpStream()
+            {
+                if (_reading)
+                {
+                    _handle->StopRead();
+                }
+            }
+
+            TcpHandle* Handle() const
+            {
+                return _handle;
+            }
+
+            // co_await yields bytes read into buf, UV_EOF or UV_E*; the socket stays armed between consecutive Reads
+            ReadAwaiter Read(uv_buf_t buf)
+            {
+                return ReadAwaiter(this, buf);
+            }
+
+            // co_await yields the write status; bufs must stay valid until then
+            WriteAwaiter Write(const uv_buf_t* bufs, unsigned int nbufs)
+            {
+                return WriteAwaiter(_handle, bufs, nbufs);
+            }
+
+            ConnectAwaiter Connect(const Endpoint& endpoint)
+            {
+                return ConnectAwaiter(_handle, endpoint);
+            }
+
+            ConnectAwaiter Connect(const struct sockaddr* addr)
+            {
+                return ConnectAwaiter(_handle, addr);
+            }
+
+        private:
+            TcpStream(const TcpStream&) = delete;
+            TcpStream& operator=(const TcpStream&) = delete;
+
+            TcpStream(TcpStream&&) = delete;
+            TcpStream& operator=(TcpStream&&) = delete;
+        };
+
+        // coroutine view of a bound TcpHandle; connections arriving while nobody awaits are accepted later
+        class TcpListener
+        {
+        public:
+            class AcceptAwaiter
+            {
+                friend class TcpListener;
+
+                TcpListener* _listener;
+                TcpHandle* _client;
+
+                std::coroutine_handle<> _coroutine;
+                int _status;
+
+            public:
+                AcceptAwaiter(TcpListener* listener, TcpHandle* client)
+                    : _listener(listener)
+                    , _client(client)
+                    , _coroutine()
+                    , _status(0)
+                {
+                }
+
+                bool await_ready()
+                {
+                    if (_listener->_status < 0)
+                    {
+                        _status = _listener->_status;
+                        return true;
+                    }
+
+                    if (_listener->_pending > 0)
+                    {
+                        --_listener->_pending;
+
+                        _status = _listener->_handle->Accept(_client);
+                        return true;
+                    }
+
+                    return false;
+                }
+
+                void await_suspend(std::coroutine_handle<> coroutine)
+                {
+                    _coroutine = coroutine;
+
+                    _listener->_acceptor = this;
+                }
+
+                int await_resume() const noexcept
+                {
+                    return _status;
+                }
+            };
+
+        private:
+            TcpHandle* _handle;
+
+            AcceptAwaiter* _acceptor;
+            size_t _pending;
+            int _status;
+
+        private:
+            void onConnection(int status)
+            {
+                if (status < 0)
+                {
+                    _status = status;
+                }
+                else
+                {
+                    ++_pending;
+                }
+
+                AcceptAwaiter* acceptor = _acceptor;
+                if (acceptor && acceptor->await_ready())
+                {
+                    _acceptor = nullptr;
+
+                    acceptor->_coroutine.resume();
+                }
+            }
+
+        public:
+            explicit TcpListener(TcpHandle* handle)
+                : _handle(handle)
+                , _acceptor(nullptr)
+                , _pending(0)
+                , _status(0)
+            {
+            }
+
+            int Listen(int backlog = 128)
+            {
+                return _handle->Listen([this] (int status) { onConnection(status); }, backlog);
+            }
+
+            // client must be initialised on the listener's loop, co_await yields the accept status
+            AcceptAwaiter Accept(TcpHandle* client)
+            {
+                return AcceptAwaiter(this, client);
+            }
+
+        private:
+            TcpListener(const TcpListener&) = delete;
+            TcpListener& operator=(const TcpListener&) = delete;
+
+            TcpListener(TcpListener&&) = delete;
+            TcpListener& operator=(TcpListener&&) = delete;
+        };
+
+        // coroutine view of a bound UdpHandle, one pending Receive and any number of Sends at a time
+        class UdpSocket
+        {
+        public:
+            struct Received
+            {
+                ssize_t nread; // bytes in the datagram or UV_E*
+                unsigned int flags;
+                struct sockaddr_storage addr;
+            };
+
+            class ReceiveAwaiter
+            {
+                friend class UdpSocket;
+
+                UdpSocket* _socket;
+                uv_buf_t _buf;
+
+                std::coroutine_handle<> _coroutine;
+                Received _received;
+
+            public:
+                ReceiveAwaiter(UdpSocket* socket, uv_buf_t buf)
+                    : _socket(socket)
+                    , _buf(buf)
+                    , _coroutine()
+                    , _received()
+                {
+                }
+
+                bool await_ready() const noexcept
+                {
+                    return false;
+                }
+
+                bool await_suspend(std::coroutine_handle<> coroutine)
+                {
+                    _coroutine = coroutine;
+
+                    _socket->_receiver = this;
+
+                    if (!_socket->_receiving)
+                    {
+                        int res = _socket->_handle->StartReceive(
+                            [socket = _socket] (ssize_t nread, const uv_buf_t* buf, const struct sockaddr* addr, unsigned flags) { socket->onReceived(nread, addr, flags); },
+                            [socket = _socket] (size_t suggested_size, uv_buf_t* buf) { socket->onAlloc(buf); });
+                        if (res < 0)
+                        {
+                            _socket->_receiver = nullptr;
+                            _received.nread = res;
+                            return false;
+                        }
+
+                        _socket->_receiving = true;
+                    }
+
+                    return true;
+                }
+
+                const Received& await_resume() const noexcept
+                {
+                    return _received;
+                }
+            };
+
+            class SendAwaiter : private UdpHandle::SendRequest
+            {
+                UdpHandle* _handle;
+                const uv_buf_t* _bufs;
+                unsigned int _nbufs;
+                const struct sockaddr* _addr;
+
+                std::coroutine_handle<> _coroutine;
+                int _status;
+
+            private:
+                static void callback_sent(UdpHandle::SendRequest* send_request, int status)
+                {
+                    SendAwaiter* awaiter = static_cast<SendAwaiter*>(send_request);
+
+                    awaiter->_status = status;
+                    awaiter->_coroutine.resume();
+                }
+
+            public:
+                SendAwaiter(UdpHandle* handle, const uv_buf_t* bufs, unsigned int nbufs, const struct sockaddr* addr)
+                    : UdpHandle::SendRequest()
+                    , _handle(handle)
+                    , _bufs(bufs)
+                    , _nbufs(nbufs)
+                    , _addr(addr)
+                    , _coroutine()
+                    , _status(0)
+                {
+                    UdpHandle::SendRequest::callback_sent = callback_sent;
+                }
+
+                bool await_ready() const noexcept
+                {
+                    return false;
+                }
+
+                bool await_suspend(std::coroutine_handle<> coroutine)
+                {
+                    _coroutine = coroutine;
+
+                    _status = _handle->Send(this, _bufs, _nbufs, _addr);
+
+                    return 0 == _status;
+                }
+
+                int await_resume() const noexcept
+                {
+                    return _status;
+                }
+            };
+
+        private:
+            UdpHandle* _handle;
+
+            ReceiveAwaiter* _receiver;
+            bool _receiving;
+
+        private:
+            void onAlloc(uv_buf_t* buf)
+            {
+                *buf = _receiver ? _receiver->_buf : uv_buf_init(nullptr, 0);
+            }
+
+            void onReceived(ssize_t nread, const struct sockaddr* addr, unsigned flags)
+            {
+                // nothing left to read
+                if (0 == nread && nullptr == addr)
+                {
+                    return;
+                }
+
+                ReceiveAwaiter* receiver = _receiver;
+                if (nullptr == receiver)
+                {
+                    _handle->StopReceive();
+                    _receiving = false;
+                    return;
+                }
+
+                _receiver = nullptr;
+
+                receiver->_received.nread = nread;
+                receiver->_received.flags = flags;
+                if (addr)
+                {
+                    memcpy(&(receiver->_received.addr), addr, AF_INET6 == addr->sa_family ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+                }
+
+                receiver->_coroutine.resume();
+            }
+
+        public:
+            explicit UdpSocket(UdpHandle* handle)
+                : _handle(handle)
+                , _receiver(nullptr)
+                , _receiving(false)
+            {
+            }
+
+            ~UdpSocket()
+            {
+                if (_receiving)
+                {
+                    _handle->StopReceive();
+                }
+            }
+
+            UdpHandle* Handle() const
+            {
+                return _handle;
+            }
+
+            ReceiveAwaiter Receive(uv_buf_t buf)
+            {
+                return ReceiveAwaiter(this, buf);
+            }
+
+            // addr may be nullptr on a connected handle; bufs must stay valid until the co_await returns
+            SendAwaiter Send(const uv_buf_t* bufs, unsigned int nbufs, const struct sockaddr* addr = nullptr)
+            {
+                return SendAwaiter(_handle, bufs, nbufs, addr);
+            }
+
+        private:
+            UdpSocket(const UdpSocket&) = delete;
+            UdpSocket& operator=(const UdpSocket&) = delete;
+
+            UdpSocket(UdpSocket&&) = delete;
+            UdpSocket& operator=(UdpSocket&&) = delete;
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,145 @@
+#ifndef IO_SIMPLIFY_LIBUV_DEFERRED_QUEUE_H
+#define IO_SIMPLIFY_LIBUV_DEFERRED_QUEUE_H
+
+#include "libuv_loop.h"
+
+#include "libuv_check_handle.h"
+#include "libuv_idle_handle.h"
+
+#include <vector>
+
+namespace io_simplify {
+
+    namespace libuv {
+
+        /*
+            Loop-local deferred work, the same-thread counterpart of AsyncHandle::Async: no lock, no wakeup system call.
+
+            Callbacks deferred during an iteration run in its check phase, i.e. after all the i/o callbacks of the batch
+            (flush batched responses, end-of-tick bookkeeping). Callbacks deferred from inside a deferred callback run on
+            the next iteration. While work is pending an idle handle keeps the loop from blocking in poll.
+            Must only be used from the loop thread.
+        */
+        class DeferredQueue
+        {
+        public:
+            using CallbackDeferred = std::function<void()>;
+            using CallbackQueueClosed = std::function<void()>;
+
+        private:
+            CheckHandle _check;
+            IdleHandle _idle;
+
+            // swapped each iteration, both keep their capacity
+            std::vector<CallbackDeferred> _pending;
+            std::vector<CallbackDeferred> _running;
+
+            bool _armed;
+
+            int _closing;
+            CallbackQueueClosed _callback_queue_closed;
+
+        private:
+            void run()
+            {
+                _running.swap(_pending);
+
+                for (CallbackDeferred& callback_deferred : _running)
+                {
+                    callback_deferred();
+                }
+
+                _running.clear();
+
+                if (_pending.empty() && _armed)
+                {
+                    _check.Stop();
+                    _idle.Stop();
+
+                    _armed = false;
+                }
+            }
+
+            void arm()
+            {
+                if (!_armed)
+                {
+                    _check.Start([this] () { run(); });
+                    _idle.Start([] () {});
+
+                    _armed = true;
+                }
+            }
+
+        public:
+            explicit DeferredQueue(Loop* loop)
+                : _check(loop)
+                , _idle(loop)
+
+                , _pending()
+                , _running()
+
+                , _armed(false)
+
+                , _closing(0)
+                , _callback_queue_closed()
+            {
+            }
+
+            ~DeferredQueue()
+            {
+            }
+
+            void Defer(const CallbackDeferred& callback_deferred)
+            {
+                _pending.push_back(callback_deferred);
+
+                arm();
+            }
+
+            void Defer(CallbackDeferred&& callback_deferred)
+            {
+                _pending.push_back(std::move(callback_deferred));
+
+                arm();
+            }
+
+            size_t Pending() const
+            {
+                return _pending.size();
+            }
+
+            // callbacks still pending are dropped without running
+            void Close(const CallbackQueueClosed& callback_queue_closed = nullptr)
+            {
+                _callback_queue_closed = callback_queue_closed;
+
+                _pending.clear();
+                _armed = false;
+
+                _closing = 2;
+
+                CallbackHandleClosed callback_handle_closed = [this] () {
+                    if (0 == --_closing && _callback_queue_closed)
+                    {
+                        _callback_queue_closed();
+                    }
+                };
+
+                _check.Close(callback_handle_closed);
+                _idle.Close(callback_handle_closed);
+            }
+
+        private:
+            DeferredQueue() = delete;
+
+            DeferredQueue(const DeferredQueue&) = delete;
+            DeferredQueue& operator=(const DeferredQueue&) = delete;
+
+            DeferredQueue(DeferredQueue&&) = delete;
+            DeferredQueue& operator=(DeferredQueue&&) = delete;
+        };
+    }
+}
+
+#endif
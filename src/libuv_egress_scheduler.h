@@ -0,0 +1,674 @@
+#ifndef IO_SIMPLIFY_LIBUV_EGRESS_SCHEDULER_H
+#define IO_SIMPLIFY_LIBUV_EGRESS_SCHEDULER_H
+
+#include "libuv_loop.h"
+
+#include "libuv_idle_handle.h"
+#include "libuv_timer_handle.h"
+#include "libuv_tcp_handle.h"
+#include "libuv_udp_handle.h"
+
+#include <deque>
+#include <vector>
+
+#include <string.h>
+
+namespace io_simplify {
+
+    namespace libuv {
+
+        /*
+            Optional per-loop egress scheduler.
+
+            Writes go through a Flow (one per handle) instead of the handle itself. While nothing is backlogged a write
+            is handed to the handle immediately; once flows have queued data they are served by deficit round-robin,
+            at most budget_per_iteration bytes per loop iteration, each flow limited by its token bucket
+            (own one or shared by a group of flows). A flow whose handle already has more than max_handle_queue bytes
+            waiting in the kernel write queue is skipped until the queue drained below it, so a slow peer keeps its
+            backlog in the flow instead of in libuv.
+        */
+        class EgressScheduler
+        {
+        public:
+            using CallbackSchedulerClosed = std::function<void()>;
+
+            static constexpr uint64_t HANDLE_QUEUE_RETRY = 1000000; // nanoseconds
+
+            class TokenBucket
+            {
+                uint64_t _rate; // bytes per second, 0 for unlimited
+                int64_t _burst;
+                int64_t _tokens; // may go negative, a write larger than the burst is paid back before the next one
+                uint64_t _refilled; // uv_hrtime()
+
+            public:
+                explicit TokenBucket(uint64_t rate = 0, uint64_t burst = 64 * 1024)
+                    : _rate(rate)
+                    , _burst((int64_t)burst)
+                    , _tokens((int64_t)burst)
+                    , _refilled(uv_hrtime())
+                {
+                }
+
+                void SetRate(uint64_t rate, uint64_t burst)
+                {
+                    _rate = rate;
+                    _burst = (int64_t)burst;
+
+                    if (_tokens > _burst)
+                    {
+                        _tokens = _burst;
+                    }
+                }
+
+                void Refill(uint64_t now)
+                {
+                    if (0 == _rate || now <= _refilled)
+                    {
+                        return;
+                    }
+
+                    // past the time the bucket takes to fill it is simply full; elapsed * _rate would wrap after an idle gap
+                    uint64_t elapsed = now - _refilled;
+                    if (elapsed >= (uint64_t)(_burst - _tokens) * 1000000000 / _rate)
+                    {
+                        _tokens = _burst;
+                        _refilled = now;
+                        return;
+                    }
+
+                    int64_t tokens = (int64_t)(elapsed * _rate / 1000000000);
+                    if (tokens > 0)
+                    {
+                        _tokens = _tokens + tokens < _burst ? _tokens + tokens : _burst;
+
+                        // keep the remainder of a partial token
+                        _refilled += (uint64_t)tokens * 1000000000 / _rate;
+                    }
+                }
+
+                bool Available() const
+                {
+                    return 0 == _rate || _tokens > 0;
+                }
+
+                void Consume(size_t bytes)
+                {
+                    if (_rate > 0)
+                    {
+                        _tokens -= (int64_t)bytes;
+                    }
+                }
+
+                // nanoseconds until Available()
+                uint64_t WaitTime() const
+                {
+                    if (Available())
+                    {
+                        return 0;
+                    }
+
+                    return (uint64_t)(1 - _tokens) * 1000000000 / _rate + 1;
+                }
+            };
+
+            class Flow
+            {
+                friend class EgressScheduler;
+
+            protected:
+                // queued buffers, small vectors stay inline
+                struct Pending
+                {
+                    void* request;
+
+                    uv_buf_t bufs_inline[4];
+                    std::vector<uv_buf_t> bufs_heap;
+                    unsigned int nbufs;
+
+                    size_t bytes;
+
+                    struct sockaddr_storage addr;
+                    bool has_addr;
+
+                    Pending(void* pending_request, const uv_buf_t* bufs, unsigned int buf_count, const struct sockaddr* sock_addr)
+                        : request(pending_request)
+                        , bufs_heap()
+                        , nbufs(buf_count)
+                        , bytes(0)
+                        , has_addr(nullptr != sock_addr)
+                    {
+                        if (nbufs <= 4)
+                        {
+                            memcpy(bufs_inline, bufs, nbufs * sizeof(uv_buf_t));
+                        }
+                        else
+                        {
+                            bufs_heap.assign(bufs, bufs + nbufs);
+                        }
+
+                        for (unsigned int i = 0; i < nbufs; ++i)
+                        {
+                            bytes += bufs[i].len;
+                        }
+
+                        if (has_addr)
+                        {
+                            memcpy(&addr, sock_addr, sock_addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+                        }
+                    }
+
+                    const uv_buf_t* Bufs() const
+                    {
+                        return nbufs <= 4 ? bufs_inline : bufs_heap.data();
+                    }
+
+                    const struct sockaddr* Addr() const
+                    {
+                        return has_addr ? (const struct sockaddr*)&addr : nullptr;
+                    }
+                };
+
+            private:
+                EgressScheduler* _scheduler;
+
+                TokenBucket _own_bucket;
+                TokenBucket* _bucket;
+
+                std::deque<Pending> _pending;
+                size_t _queued_bytes;
+
+                size_t _deficit;
+                bool _quantum_granted;
+
+                Flow* _prev;
+                Flow* _next;
+                bool _active;
+
+            protected:
+                virtual int dispatch(Pending& pending) = 0;
+                virtual void cancel(Pending& pending, int status) = 0;
+
+                // bytes handed to the handle and not yet written by it
+                virtual size_t handleQueue() const = 0;
+
+                bool blocked() const
+                {
+                    return _scheduler->_max_handle_queue > 0 && handleQueue() > _scheduler->_max_handle_queue;
+                }
+
+                int enqueue(void* request, const uv_buf_t* bufs, unsigned int nbufs, const struct sockaddr* addr)
+                {
+                    _pending.emplace_back(request, bufs, nbufs, addr);
+                    _queued_bytes += _pending.back().bytes;
+
+                    _scheduler->activate(this);
+
+                    return 0;
+                }
+
+                // fast path: nothing backlogged on the loop, tokens left and room in the handle's queue
+                bool bypass() const
+                {
+                    return _pending.empty() && 0 == _scheduler->_active_count && _bucket->Available() && !blocked();
+                }
+
+                void consume(size_t bytes)
+                {
+                    _bucket->Consume(bytes);
+                }
+
+                void cancelAll(int status)
+                {
+                    _scheduler->deactivate(this);
+
+                    std::deque<Pending> pending;
+                    pending.swap(_pending);
+                    _queued_bytes = 0;
+
+                    for (Pending& entry : pending)
+                    {
+                        cancel(entry, status);
+                    }
+                }
+
+            public:
+                Flow(EgressScheduler* scheduler, TokenBucket* bucket)
+                    : _scheduler(scheduler)
+
+                    , _own_bucket()
+                    , _bucket(bucket ? bucket : &_own_bucket)
+
+                    , _pending()
+                    , _queued_bytes(0)
+
+                    , _deficit(0)
+                    , _quantum_granted(false)
+
+                    , _prev(nullptr)
+                    , _next(nullptr)
+                    , _active(false)
+                {
+                }
+
+                virtual ~Flow()
+                {
+                    _scheduler->deactivate(this);
+                }
+
+                // limits this flow alone, ignored when the flow was created with a group bucket
+                void SetRate(uint64_t rate, uint64_t burst)
+                {
+                    _own_bucket.SetRate(rate, burst);
+                }
+
+                size_t QueuedBytes() const
+                {
+                    return _queued_bytes;
+                }
+
+                size_t QueuedRequests() const
+                {
+                    return _pending.size();
+                }
+
+            private:
+                Flow(const Flow&) = delete;
+                Flow& operator=(const Flow&) = delete;
+
+                Flow(Flow&&) = delete;
+                Flow& operator=(Flow&&) = delete;
+            };
+
+            /*
+                Requests still queued when the flow is destroyed (or Cancel is called) complete with UV_ECANCELED.
+                Destroy the flow before closing its handle.
+            */
+            class TcpFlow : public Flow
+            {
+                TcpHandle* _handle;
+
+            protected:
+                int dispatch(Pending& pending) override
+                {
+                    return _handle->Write((TcpHandle::WriteRequest*)(pending.request), pending.Bufs(), pending.nbufs);
+                }
+
+                void cancel(Pending& pending, int status) override
+                {
+                    TcpHandle::WriteRequest* write_request = (TcpHandle::WriteRequest*)(pending.request);
+
+                    write_request->callback_written(write_request, status);
+                }
+
+                size_t handleQueue() const override
+                {
+                    return uv_stream_get_write_queue_size((const uv_stream_t*)(_handle->uv));
+                }
+
+            public:
+                TcpFlow(EgressScheduler* scheduler, TcpHandle* handle, TokenBucket* bucket = nullptr)
+                    : Flow(scheduler, bucket)
+                    , _handle(handle)
+                {
+                }
+
+                ~TcpFlow()
+                {
+                    Cancel();
+                }
+
+                // the bufs array is copied, the memory it points to must stay valid until write_request completes
+                int Write(TcpHandle::WriteRequest* write_request, const uv_buf_t* bufs, unsigned int nbufs)
+                {
+                    if (bypass())
+                    {
+                        int res = _handle->Write(write_request, bufs, nbufs);
+                        if (0 == res)
+                        {
+                            size_t bytes = 0;
+                            for (unsigned int i = 0; i < nbufs; ++i)
+                            {
+                                bytes += bufs[i].len;
+                            }
+
+                            consume(bytes);
+                        }
+
+                        return res;
+                    }
+
+                    return enqueue(write_request, bufs, nbufs, nullptr);
+                }
+
+                void Cancel(int status = UV_ECANCELED)
+                {
+                    cancelAll(status);
+                }
+            };
+
+            class UdpFlow : public Flow
+            {
+                UdpHandle* _handle;
+
+            protected:
+                int dispatch(Pending& pending) override
+                {
+                    return _handle->Send((UdpHandle::SendRequest*)(pending.request), pending.Bufs(), pending.nbufs, pending.Addr());
+                }
+
+                void cancel(Pending& pending, int status) override
+                {
+                    UdpHandle::SendRequest* send_request = (UdpHandle::SendRequest*)(pending.request);
+
+                    send_request->callback_sent(send_request, status);
+                }
+
+                size_t handleQueue() const override
+                {
+                    return uv_udp_get_send_queue_size(_handle->uv);
+                }
+
+            public:
+                UdpFlow(EgressScheduler* scheduler, UdpHandle* handle, TokenBucket* bucket = nullptr)
+                    : Flow(scheduler, bucket)
+                    , _handle(handle)
+                {
+                }
+
+                ~UdpFlow()
+                {
+                    Cancel();
+                }
+
+                // addr may be nullptr on a connected handle, it is copied
+                int Send(UdpHandle::SendRequest* send_request, const uv_buf_t* bufs, unsigned int nbufs, const struct sockaddr* addr = nullptr)
+                {
+                    if (bypass())
+                    {
+                        int res = _handle->Send(send_request, bufs, nbufs, addr);
+                        if (0 == res)
+                        {
+                            size_t bytes = 0;
+                            for (unsigned int i = 0; i < nbufs; ++i)
+                            {
+                                bytes += bufs[i].len;
+                            }
+
+                            consume(bytes);
+                        }
+
+                        return res;
+                    }
+
+                    return enqueue(send_request, bufs, nbufs, addr);
+                }
+
+                void Cancel(int status = UV_ECANCELED)
+                {
+                    cancelAll(status);
+                }
+            };
+
+        private:
+            IdleHandle _idle;
+            TimerHandle _timer;
+
+            size_t _budget_per_iteration;
+            size_t _quantum;
+            size_t _max_handle_queue;
+
+            Flow* _cursor; // circular list of flows with queued data
+            size_t _active_count;
+
+            Flow* _serving; // the flow run() dispatches for, cleared when it is deactivated meanwhile
+
+            int _closing;
+            CallbackSchedulerClosed _callback_scheduler_closed;
+
+        private:
+            void activate(Flow* flow)
+            {
+                if (flow->_active)
+                {
+                    return;
+                }
+
+                flow->_active = true;
+                flow->_deficit = 0;
+                flow->_quantum_granted = false;
+
+                if (_cursor)
+                {
+                    // join at the tail, right behind the flow being served
+                    flow->_next = _cursor;
+                    flow->_prev = _cursor->_prev;
+                    _cursor->_prev->_next = flow;
+                    _cursor->_prev = flow;
+                }
+                else
+                {
+                    flow->_next = flow;
+                    flow->_prev = flow;
+                    _cursor = flow;
+                }
+
+                ++_active_count;
+
+                _idle.Start([this] () { run(); });
+            }
+
+            void deactivate(Flow* flow)
+            {
+                if (!flow->_active)
+                {
+                    return;
+                }
+
+                flow->_active = false;
+                flow->_deficit = 0;
+                flow->_quantum_granted = false;
+
+                if (flow->_next == flow)
+                {
+                    _cursor = nullptr;
+                }
+                else
+                {
+                    flow->_prev->_next = flow->_next;
+                    flow->_next->_prev = flow->_prev;
+
+                    if (_cursor == flow)
+                    {
+                        _cursor = flow->_next;
+                    }
+                }
+
+                flow->_prev = nullptr;
+                flow->_next = nullptr;
+
+                if (_serving == flow)
+                {
+                    _serving = nullptr;
+                }
+
+                if (0 == --_active_count)
+                {
+                    _idle.Stop();
+                    _timer.Stop();
+                }
+            }
+
+            void run()
+            {
+                uint64_t now = uv_hrtime();
+
+                size_t budget = _budget_per_iteration;
+
+                size_t throttled = 0;
+                uint64_t wait = UINT64_MAX;
+
+                while (_cursor && budget > 0 && throttled < _active_count)
+                {
+                    Flow* flow = _cursor;
+
+                    flow->_bucket->Refill(now);
+
+                    bool blocked = flow->blocked();
+                    if (blocked || !flow->_bucket->Available())
+                    {
+                        // a full handle queue gives no hint when it drains, look again shortly
+                        uint64_t flow_wait = blocked ? HANDLE_QUEUE_RETRY : flow->_bucket->WaitTime();
+                        if (flow_wait < wait)
+                        {
+                            wait = flow_wait;
+                        }
+
+                        ++throttled;
+                        flow->_quantum_granted = false;
+                        _cursor = flow->_next;
+                        continue;
+                    }
+
+                    throttled = 0;
+
+                    if (!flow->_quantum_granted)
+                    {
+                        flow->_deficit += _quantum;
+                        flow->_quantum_granted = true;
+                    }
+
+                    _serving = flow;
+
+                    while (!flow->_pending.empty() && budget > 0 && flow->_bucket->Available() && !flow->blocked())
+                    {
+                        if (flow->_pending.front().bytes > flow->_deficit)
+                        {
+                            break;
+                        }
+
+                        // off the queue before any callback runs, it may cancel or destroy the flow
+                        Flow::Pending pending(std::move(flow->_pending.front()));
+                        flow->_pending.pop_front();
+
+                        size_t bytes = pending.bytes;
+
+                        flow->_queued_bytes -= bytes;
+                        flow->_deficit -= bytes;
+                        flow->_bucket->Consume(bytes);
+
+                        budget = budget > bytes ? budget - bytes : 0;
+
+                        int res = flow->dispatch(pending);
+                        if (res < 0)
+                        {
+                            flow->cancel(pending, res);
+
+                            if (_serving != flow)
+                            {
+                                // cancelled or destroyed by the callback, deactivate already moved the cursor on
+                                break;
+                            }
+                        }
+                    }
+
+                    if (_serving != flow)
+                    {
+                        continue;
+                    }
+
+                    _serving = nullptr;
+
+                    if (flow->_pending.empty())
+                    {
+                        deactivate(flow);
+                    }
+                    else if (flow->_pending.front().bytes > flow->_deficit)
+                    {
+                        // turn is over, the deficit carries to the next round
+                        flow->_quantum_granted = false;
+                        _cursor = flow->_next;
+                    }
+                    // otherwise budget, tokens or the handle's queue ran out mid-turn, the flow resumes its turn later
+                }
+
+                if (0 == _active_count)
+                {
+                    return;
+                }
+
+                if (_cursor && throttled >= _active_count)
+                {
+                    // every backlogged flow waits for tokens, sleep until the earliest refill
+                    _idle.Stop();
+                    _timer.Start([this] () {
+                        _idle.Start([this] () { run(); });
+                    }, (wait + 999999) / 1000000);
+                }
+            }
+
+        public:
+            /*
+                budget_per_iteration: bytes handed to the kernel per loop iteration while flows are backlogged.
+                quantum: bytes credited to a backlogged flow per round-robin round.
+                max_handle_queue: bytes a handle may have waiting in its write queue before its flow is held back,
+                0 for no bound.
+            */
+            EgressScheduler(Loop* loop, size_t budget_per_iteration = 256 * 1024, size_t quantum = 16 * 1024, size_t max_handle_queue = 256 * 1024)
+                : _idle(loop)
+                , _timer(loop)
+
+                , _budget_per_iteration(budget_per_iteration)
+                , _quantum(quantum)
+                , _max_handle_queue(max_handle_queue)
+
+                , _cursor(nullptr)
+                , _active_count(0)
+
+                , _serving(nullptr)
+
+                , _closing(0)
+                , _callback_scheduler_closed()
+            {
+            }
+
+            ~EgressScheduler()
+            {
+            }
+
+            size_t BackloggedFlows() const
+            {
+                return _active_count;
+            }
+
+            // flows must be destroyed (or cancelled) before the scheduler is closed
+            void Close(const CallbackSchedulerClosed& callback_scheduler_closed = nullptr)
+            {
+                _callback_scheduler_closed = callback_scheduler_closed;
+
+                _closing = 2;
+
+                CallbackHandleClosed callback_handle_closed = [this] () {
+                    if (0 == --_closing && _callback_scheduler_closed)
+                    {
+                        _callback_scheduler_closed();
+                    }
+                };
+
+                _idle.Close(callback_handle_closed);
+                _timer.Close(callback_handle_closed);
+            }
+
+        private:
+            EgressScheduler() = delete;
+
+            EgressScheduler(const EgressScheduler&) = delete;
+            EgressScheduler& operator=(const EgressScheduler&) = delete;
+
+            EgressScheduler(EgressScheduler&&) = delete;
+            EgressScheduler& operator=(EgressScheduler&&) = delete;
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,646 @@
+#ifndef IO_SIMPLIFY_LIBUV_FEED_HANDLER_H
+#define IO_SIMPLIFY_LIBUV_FEED_HANDLER_H
+
+#include "libuv_loop.h"
+
+#include "libuv_histogram.h"
+#include "libuv_timer_handle.h"
+#include "libuv_udp_handle.h"
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+#include <stdint.h>
+#include <string.h>
+
+namespace io_simplify {
+
+    namespace libuv {
+
+        /*
+            Handler of a sequenced feed published twice, on an A and a B line (usually two multicast groups), merged back
+            into one in-order stream on one loop.
+
+            Every packet carries its sequence number at a fixed offset. The first copy of a sequence number is delivered,
+            later copies from either line are duplicates. The next expected number is delivered straight out of the
+            receive buffer, without a copy; a packet arriving ahead of it is copied into a ring of window slots allocated
+            at construction, marked in a bitmap of the same window, and delivered once the hole before it is filled.
+            A hole is given up (CallbackGap) when a packet arrives window or more numbers past it, or when it is still
+            open gap_timeout milliseconds after it was noticed; the packets buffered behind it are delivered then.
+
+            Each line receives with recvmmsg into one buffer of its own, so a loop wakeup takes up to receive_batch
+            datagrams per line without allocating. The feed starts at the first sequence number it sees.
+
+            4-byte sequence numbers are compared modulo 2^32, so the feed runs through their wrap; the numbers reported
+            keep counting past it, the wire value is their low 32 bits. A packet reset_distance or more away from the
+            next expected number, ahead or behind, means the numbering restarted (publisher restart, or a corrupt
+            packet): the packets still buffered are delivered, their holes given up, CallbackReset reports the jump and
+            the feed continues from that packet. A line trailing the other by that much looks the same, so keep
+            reset_distance above the line skew.
+
+            Statistics also measure latency: how long packets waited in the ring for a hole to fill, and how far the
+            slower line trails the faster one (the delay between the two copies of a sequence number).
+            Loop thread only.
+        */
+        class FeedHandler
+        {
+        public:
+            static constexpr int LINE_A = 0;
+            static constexpr int LINE_B = 1;
+
+            // data is only valid during the call
+            using CallbackMessage = std::function<void(uint64_t sequence, const char* data, size_t size)>;
+            // sequence numbers [first, first + count) were never received on either line
+            using CallbackGap = std::function<void(uint64_t first, uint64_t count)>;
+            // the feed restarted at sequence, expected was the number it would have delivered next
+            using CallbackReset = std::function<void(uint64_t expected, uint64_t sequence)>;
+            using CallbackFeedClosed = std::function<void()>;
+
+            struct Options
+            {
+                size_t sequence_offset = 0; // where the sequence number starts in a packet
+                unsigned int sequence_bytes = 8; // 4 or 8
+                bool big_endian = true;
+
+                size_t window = 4096; // out-of-order packets held, rounded up to a power of two
+                size_t max_packet = 1500; // ring slot size, larger out-of-order packets count as malformed
+                uint64_t gap_timeout = 50; // milliseconds, 0 gives holes up only when the window overflows
+                uint64_t reset_distance = 0; // distance from the next expected number taken as a reset, 0 for RESET_WINDOWS windows
+                size_t receive_batch = 16; // datagrams per recvmmsg and line
+            };
+
+            struct Statistics
+            {
+                uint64_t received[2] = {0, 0}; // per line
+                uint64_t first[2] = {0, 0}; // per line, sequence numbers this line delivered first
+
+                uint64_t delivered = 0;
+                uint64_t duplicates = 0;
+                uint64_t out_of_order = 0; // packets that went through the ring
+                uint64_t gaps = 0; // holes given up
+                uint64_t missing = 0; // sequence numbers in those holes
+                uint64_t resets = 0; // numbering restarts
+                uint64_t malformed = 0; // too short, truncated, or too large for the ring
+                uint64_t errors = 0; // receive errors
+
+                Histogram hold_ns; // time out-of-order packets waited in the ring
+                Histogram line_skew_ns; // delay of the second copy of a sequence number
+            };
+
+        private:
+            static constexpr size_t DATAGRAM_MAX = 64 * 1024; // libuv hands recvmmsg chunks of this size
+            static constexpr uint64_t RESET_WINDOWS = 16; // default reset_distance, in windows
+
+        private:
+            Options _options;
+            size_t _mask;
+            uint64_t _reset_distance;
+
+            UdpHandle _line_a;
+            UdpHandle _line_b;
+            TimerHandle _timer;
+
+            std::vector<char> _receive[2];
+
+            // indexed by sequence & _mask
+            std::vector<uint64_t> _present; // bitmap of packets buffered ahead of _next
+            std::vector<char> _ring;
+            std::vector<uint32_t> _ring_size;
+            std::vector<uint64_t> _arrival; // uv_hrtime() of the first copy
+            std::vector<uint64_t> _arrival_sequence; // which sequence number _arrival belongs to
+
+            bool _started;
+            uint64_t _next; // first sequence number not delivered yet
+            uint64_t _highest; // highest buffered, valid while _buffered > 0
+            size_t _buffered;
+            uint64_t _hole_since; // uv_now() the hole at _next was noticed, valid while _buffered > 0
+
+            CallbackMessage _callback_message;
+            CallbackGap _callback_gap;
+            CallbackReset _callback_reset;
+
+            Statistics _statistics;
+
+            int _closing;
+            CallbackFeedClosed _callback_feed_closed;
+
+        private:
+            uint64_t sequenceOf(const char* data) const
+            {
+                const char* p = data + _options.sequence_offset;
+
+                uint64_t sequence;
+                if (8 == _options.sequence_bytes)
+                {
+                    memcpy(&sequence, p, 8);
+                }
+                else
+                {
+                    uint32_t sequence32;
+                    memcpy(&sequence32, p, 4);
+                    sequence = sequence32;
+                }
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+                bool swap = !_options.big_endian;
+#else
+                bool swap = _options.big_endian;
+#endif
+                if (swap)
+                {
+                    sequence = 8 == _options.sequence_bytes ? __builtin_bswap64(sequence) : __builtin_bswap32((uint32_t)sequence);
+                }
+
+                return sequence;
+            }
+
+            // signed distance from _next, serial number arithmetic for 4-byte numbers
+            int64_t distanceOf(uint64_t sequence) const
+            {
+                if (8 == _options.sequence_bytes)
+                {
+                    return (int64_t)(sequence - _next);
+                }
+
+                return (int32_t)((uint32_t)sequence - (uint32_t)_next);
+            }
+
+            bool isPresent(uint64_t sequence) const
+            {
+                size_t slot = sequence & _mask;
+                return 0 != (_present[slot >> 6] & (uint64_t(1) << (slot & 63)));
+            }
+
+            void setPresent(uint64_t sequence, bool present)
+            {
+                size_t slot = sequence & _mask;
+                if (present)
+                {
+                    _present[slot >> 6] |= uint64_t(1) << (slot & 63);
+                }
+                else
+                {
+                    _present[slot >> 6] &= ~(uint64_t(1) << (slot & 63));
+                }
+            }
+
+            void deliver(uint64_t sequence, const char* data, size_t size, uint64_t now)
+            {
+                size_t slot = sequence & _mask;
+
+                _arrival[slot] = now;
+                _arrival_sequence[slot] = sequence;
+
+                ++_next;
+                ++_statistics.delivered;
+
+                _callback_message(sequence, data, size);
+            }
+
+            // delivers the buffered packets that follow _next without a hole
+            void drain(uint64_t now)
+            {
+                while (_buffered > 0 && isPresent(_next))
+                {
+                    size_t slot = _next & _mask;
+
+                    setPresent(_next, false);
+                    --_buffered;
+
+                    _statistics.hold_ns.Record(now - _arrival[slot]);
+
+                    // deliver overwrites _arrival[slot] with the delivery time, the line skew is measured from arrival
+                    uint64_t arrival = _arrival[slot];
+
+                    deliver(_next, _ring.data() + slot * _options.max_packet, _ring_size[slot], now);
+
+                    _arrival[slot] = arrival;
+                }
+
+                if (_buffered > 0)
+                {
+                    // a new hole opened behind the packets still buffered
+                    _hole_since = uv_now(_timer.loop->uv);
+                }
+            }
+
+            // gives up everything before sequence, delivering what was buffered in between
+            void skipTo(uint64_t sequence, uint64_t now)
+            {
+                while (_next < sequence)
+                {
+                    if (_buffered > 0 && isPresent(_next))
+                    {
+                        drain(now);
+                        continue;
+                    }
+
+                    // the hole runs up to the next buffered packet, or to sequence
+                    uint64_t end = sequence;
+                    for (uint64_t next = _next + 1; _buffered > 0 && next < sequence && next <= _highest; ++next)
+                    {
+                        if (isPresent(next))
+                        {
+                            end = next;
+                            break;
+                        }
+                    }
+
+                    uint64_t first = _next;
+                    uint64_t count = end - first;
+
+                    _next = end;
+
+                    ++_statistics.gaps;
+                    _statistics.missing += count;
+
+                    if (_callback_gap)
+                    {
+                        _callback_gap(first, count);
+                    }
+                }
+
+                drain(now);
+            }
+
+            // the old numbering ends: what it buffered is delivered, the holes in between given up
+            void reset(uint64_t sequence, uint64_t now)
+            {
+                if (_buffered > 0)
+                {
+                    skipTo(_highest + 1, now);
+                }
+
+                uint64_t expected = _next;
+
+                ++_statistics.resets;
+
+                _next = sequence;
+
+                // skew is only measured between copies of the same numbering
+                std::fill(_arrival_sequence.begin(), _arrival_sequence.end(), ~uint64_t(0));
+
+                if (_callback_reset)
+                {
+                    _callback_reset(expected, sequence);
+                }
+            }
+
+            void packet(int line, const char* data, size_t size, uint64_t now)
+            {
+                ++_statistics.received[line];
+
+                if (size < _options.sequence_offset + _options.sequence_bytes)
+                {
+                    ++_statistics.malformed;
+                    return;
+                }
+
+                uint64_t sequence = sequenceOf(data);
+
+                if (!_started)
+                {
+                    _started = true;
+                    _next = sequence;
+                }
+
+                int64_t distance = distanceOf(sequence);
+                if (distance >= (int64_t)_reset_distance || distance <= -(int64_t)_reset_distance)
+                {
+                    reset(sequence, now);
+                    distance = 0;
+                }
+
+                // a 4-byte number from before the one the feed started at
+                if (distance < 0 && (uint64_t)(-distance) > _next)
+                {
+                    ++_statistics.duplicates;
+                    return;
+                }
+
+                sequence = _next + (uint64_t)distance;
+
+                if (sequence < _next || (_buffered > 0 && sequence <= _highest && isPresent(sequence)))
+                {
+                    ++_statistics.duplicates;
+
+                    size_t slot = sequence & _mask;
+                    if (_arrival_sequence[slot] == sequence)
+                    {
+                        _statistics.line_skew_ns.Record(now - _arrival[slot]);
+
+                        // only the first duplicate measures the skew
+                        _arrival_sequence[slot] = ~sequence;
+                    }
+                    return;
+                }
+
+                if (sequence == _next)
+                {
+                    ++_statistics.first[line];
+
+                    deliver(sequence, data, size, now);
+                    drain(now);
+                    return;
+                }
+
+                if (size > _options.max_packet)
+                {
+                    ++_statistics.malformed;
+                    return;
+                }
+
+                if (sequence - _next > _mask)
+                {
+                    // no room in the window: the oldest holes go
+                    skipTo(sequence - _mask, now);
+
+                    if (sequence == _next)
+                    {
+                        ++_statistics.first[line];
+
+                        deliver(sequence, data, size, now);
+                        drain(now);
+                        return;
+                    }
+                }
+
+                ++_statistics.first[line];
+                ++_statistics.out_of_order;
+
+                size_t slot = sequence & _mask;
+
+                memcpy(_ring.data() + slot * _options.max_packet, data, size);
+                _ring_size[slot] = (uint32_t)size;
+                _arrival[slot] = now;
+                _arrival_sequence[slot] = sequence;
+
+                setPresent(sequence, true);
+
+                if (0 == _buffered++)
+                {
+                    _highest = sequence;
+                    _hole_since = uv_now(_timer.loop->uv);
+                }
+                else if (sequence > _highest)
+                {
+                    _highest = sequence;
+                }
+            }
+
+            void received(int line, ssize_t nread, const uv_buf_t* buf, unsigned flags)
+            {
+                if (nread < 0)
+                {
+                    ++_statistics.errors;
+                    return;
+                }
+
+                // 0 bytes: nothing to read, or the end of a recvmmsg batch (UV_UDP_MMSG_FREE)
+                if (0 == nread)
+                {
+                    return;
+                }
+
+                if (flags & UV_UDP_PARTIAL)
+                {
+                    ++_statistics.received[line];
+                    ++_statistics.malformed;
+                    return;
+                }
+
+                packet(line, buf->base, (size_t)nread, uv_hrtime());
+            }
+
+            void expire()
+            {
+                if (0 == _buffered)
+                {
+                    return;
+                }
+
+                if (uv_now(_timer.loop->uv) - _hole_since >= _options.gap_timeout)
+                {
+                    uint64_t now = uv_hrtime();
+
+                    // up to the first buffered packet, drain takes it from there
+                    uint64_t first_buffered = _next;
+                    while (!isPresent(first_buffered))
+                    {
+                        ++first_buffered;
+                    }
+
+                    skipTo(first_buffered, now);
+                }
+            }
+
+            UdpHandle& lineHandle(int line)
+            {
+                return LINE_A == line ? _line_a : _line_b;
+            }
+
+            static size_t roundUp(size_t window)
+            {
+                size_t size = 64;
+                while (size < window)
+                {
+                    size <<= 1;
+                }
+                return size;
+            }
+
+        public:
+            explicit FeedHandler(Loop* loop)
+                : FeedHandler(loop, Options())
+            {
+            }
+
+            FeedHandler(Loop* loop, const Options& options)
+                : _options(options)
+                , _mask(roundUp(options.window) - 1)
+                , _reset_distance(0)
+
+                , _line_a(loop, UV_UDP_RECVMMSG)
+                , _line_b(loop, UV_UDP_RECVMMSG)
+                , _timer(loop)
+
+                , _receive()
+
+                , _present((_mask + 1) / 64, 0)
+                , _ring((_mask + 1) * options.max_packet)
+                , _ring_size(_mask + 1, 0)
+                , _arrival(_mask + 1, 0)
+                , _arrival_sequence(_mask + 1, ~uint64_t(0))
+
+                , _started(false)
+                , _next(0)
+                , _highest(0)
+                , _buffered(0)
+                , _hole_since(0)
+
+                , _callback_message()
+                , _callback_gap()
+                , _callback_reset()
+
+                , _statistics()
+
+                , _closing(0)
+                , _callback_feed_closed()
+            {
+                if (4 != _options.sequence_bytes)
+                {
+                    _options.sequence_bytes = 8;
+                }
+
+                // just past the window is an overflow, the oldest holes go; a reset is never inside the window, and 4-byte
+                // distances only tell direction below 2^31
+                _reset_distance = options.reset_distance > 0 ? options.reset_distance : RESET_WINDOWS * (_mask + 1);
+                if (_reset_distance < _mask + 1)
+                {
+                    _reset_distance = _mask + 1;
+                }
+                if (4 == _options.sequence_bytes && _reset_distance > 0x7fffffff)
+                {
+                    _reset_distance = 0x7fffffff;
+                }
+
+                size_t batch = options.receive_batch > 0 ? options.receive_batch : 1;
+
+                _receive[LINE_A].resize(batch * DATAGRAM_MAX);
+                _receive[LINE_B].resize(batch * DATAGRAM_MAX);
+            }
+
+            ~FeedHandler()
+            {
+            }
+
+            /*
+                Binds line (LINE_A or LINE_B) to endpoint and, for a multicast address, joins the group on interface_addr
+                (nullptr for the default interface), only for source_addr's traffic when given. Call before Start.
+            */
+            int Subscribe(int line, const Endpoint& endpoint, const char* interface_addr = nullptr, const char* source_addr = nullptr)
+            {
+                struct sockaddr_in addr;
+                int res = uv_ip4_addr(endpoint.address.c_str(), endpoint.port, &addr);
+                if (res < 0)
+                {
+                    return res;
+                }
+
+                UdpHandle& udp_handle = lineHandle(line);
+
+                // 224.0.0.0/4 is multicast, anything else is a plain unicast line
+                res = udp_handle.Bind((const struct sockaddr*)&addr);
+                if (res < 0 || 0xe0000000 != (ntohl(addr.sin_addr.s_addr) & 0xf0000000))
+                {
+                    return res;
+                }
+
+                if (nullptr != source_addr)
+                {
+                    return udp_handle.JoinMulticastSourceGroup(endpoint.address.c_str(), interface_addr, source_addr);
+                }
+
+                return udp_handle.JoinMulticastGroup(endpoint.address.c_str(), interface_addr);
+            }
+
+            // also for a single line, the other one then just never receives
+            int Start(const CallbackMessage& callback_message, const CallbackGap& callback_gap = nullptr, const CallbackReset& callback_reset = nullptr)
+            {
+                _callback_message = callback_message;
+                _callback_gap = callback_gap;
+                _callback_reset = callback_reset;
+
+                if (_options.gap_timeout > 0)
+                {
+                    uint64_t interval = _options.gap_timeout / 4 > 0 ? _options.gap_timeout / 4 : 1;
+
+                    int res = _timer.Start([this] () { expire(); }, interval, interval);
+                    if (res < 0)
+                    {
+                        return res;
+                    }
+                }
+
+                for (int line = LINE_A; line <= LINE_B; ++line)
+                {
+                    int res = lineHandle(line).StartReceive(
+                        [this, line] (ssize_t nread, const uv_buf_t* buf, const struct sockaddr*, unsigned flags) {
+                            received(line, nread, buf, flags);
+                        },
+                        [this, line] (size_t, uv_buf_t* buf) {
+                            *buf = uv_buf_init(_receive[line].data(), (unsigned int)_receive[line].size());
+                        });
+
+                    if (res < 0)
+                    {
+                        return res;
+                    }
+                }
+
+                return 0;
+            }
+
+            // feeds a packet from elsewhere as if line had received it, e.g. from a capture replay or a recovery channel
+            void Inject(int line, const char* data, size_t size)
+            {
+                packet(line, data, size, uv_hrtime());
+            }
+
+            uint64_t NextSequence() const
+            {
+                return _next;
+            }
+
+            size_t Buffered() const
+            {
+                return _buffered;
+            }
+
+            const Statistics& GetStatistics() const
+            {
+                return _statistics;
+            }
+
+            UdpHandle* Line(int line)
+            {
+                return &lineHandle(line);
+            }
+
+            void Close(const CallbackFeedClosed& callback_feed_closed = nullptr)
+            {
+                if (0 != _closing)
+                {
+                    return;
+                }
+
+                _callback_feed_closed = callback_feed_closed;
+
+                _closing = 3;
+
+                CallbackHandleClosed callback_handle_closed = [this] () {
+                    if (0 == --_closing && _callback_feed_closed)
+                    {
+                        _callback_feed_closed();
+                    }
+                };
+
+                _line_a.Close(callback_handle_closed);
+                _line_b.Close(callback_handle_closed);
+                _timer.Close(callback_handle_closed);
+            }
+
+        private:
+            FeedHandler() = delete;
+
+            FeedHandler(const FeedHandler&) = delete;
+            FeedHandler& operator=(const FeedHandler&) = delete;
+
+            FeedHandler(FeedHandler&&) = delete;
+            FeedHandler& operator=(FeedHandler&&) = delete;
+        };
+    }
+}
+
+#endif
@@ -2,6 +2,7 @@
 #define IO_SIMPLIFY_LIBUV_HANDLE_H
 
 #include "libuv_loop.h"
+#include "libuv_trace.h"
 
 #include <string>
 #include <functional>
@@ -46,14 +47,24 @@ namespace io_simplify {
             {
                 Handle* handle_type = (Handle*)(handle->data);
 
+                LIBUV_WATCHDOG_CALLBACK(handle_type, TRACE_CALLBACK_CLOSE);
+
                 handle_type->_callback_handle_closed();
             }
 
+        protected:
+            // runs first thing in Close, also when closed through a Handle pointer; releases what the subclass owns besides uv
+            virtual void closing()
+            {
+            }
+
         public:
             Loop* loop;
 
             uv_handle_t* uv_handle;
 
+            LIBUV_TRACE_COUNTERS
+
         public:
             explicit Handle(Loop* loop_ref)
                 : Base<uv_object_type>()
@@ -79,6 +90,8 @@ namespace io_simplify {
             */
             void Close(const CallbackHandleClosed& callback_handle_closed = nullptr)
             {
+                closing();
+
                 if (0 == Base<uv_object_type>::status)
                 {
                     _callback_handle_closed = callback_handle_closed;
@@ -0,0 +1,234 @@
+#ifndef IO_SIMPLIFY_LIBUV_HISTOGRAM_H
+#define IO_SIMPLIFY_LIBUV_HISTOGRAM_H
+
+#include <string.h>
+#include <stdint.h>
+
+namespace io_simplify {
+
+    namespace libuv {
+
+        /*
+            Log-linear histogram in the spirit of HdrHistogram: every power of two is split into 16 linear sub-buckets,
+            so any recorded value is reproduced within 1/16 of itself. Fixed size, never allocates, values are unit-less
+            (the library records nanoseconds or counts).
+        */
+        class Histogram
+        {
+        public:
+            static constexpr unsigned int SUB_BUCKET_BITS = 4;
+            static constexpr unsigned int SUB_BUCKETS = 1u << SUB_BUCKET_BITS;
+            static constexpr unsigned int BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+        private:
+            uint64_t _buckets[BUCKETS];
+
+            uint64_t _count;
+            uint64_t _sum;
+            uint64_t _min;
+            uint64_t _max;
+
+            // range of touched buckets, keeps Merge and Reset cheap for sparse histograms
+            unsigned int _low;
+            unsigned int _high;
+
+        private:
+            static unsigned int bucketOf(uint64_t value)
+            {
+                if (value < SUB_BUCKETS)
+                {
+                    return (unsigned int)value;
+                }
+
+                unsigned int exponent = 63 - __builtin_clzll(value);
+
+                return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + (unsigned int)((value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1));
+            }
+
+            // largest value falling into the bucket
+            static uint64_t valueOf(unsigned int bucket)
+            {
+                if (bucket < SUB_BUCKETS)
+                {
+                    return bucket;
+                }
+
+                unsigned int exponent = bucket / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+                uint64_t sub_bucket = bucket % SUB_BUCKETS;
+
+                uint64_t lowest = (uint64_t(1) << exponent) | (sub_bucket << (exponent - SUB_BUCKET_BITS));
+
+                return lowest + ((uint64_t(1) << (exponent - SUB_BUCKET_BITS)) - 1);
+            }
+
+        public:
+            Histogram()
+            {
+                memset(_buckets, 0, sizeof(_buckets));
+
+                _count = 0;
+                _sum = 0;
+                _min = UINT64_MAX;
+                _max = 0;
+
+                _low = BUCKETS;
+                _high = 0;
+            }
+
+            void Record(uint64_t value, uint64_t count = 1)
+            {
+                unsigned int bucket = bucketOf(value);
+
+                _buckets[bucket] += count;
+
+                _count += count;
+                _sum += value * count;
+
+                if (value < _min)
+                {
+                    _min = value;
+                }
+
+                if (value > _max)
+                {
+                    _max = value;
+                }
+
+                if (bucket < _low)
+                {
+                    _low = bucket;
+                }
+
+                if (bucket > _high)
+                {
+                    _high = bucket;
+                }
+            }
+
+            void Merge(const Histogram& other)
+            {
+                if (0 == other._count)
+                {
+                    return;
+                }
+
+                for (unsigned int bucket = other._low; bucket <= other._high; ++bucket)
+                {
+                    _buckets[bucket] += other._buckets[bucket];
+                }
+
+                _count += other._count;
+                _sum += other._sum;
+
+                if (other._min < _min)
+                {
+                    _min = other._min;
+                }
+
+                if (other._max > _max)
+                {
+                    _max = other._max;
+                }
+
+                if (other._low < _low)
+                {
+                    _low = other._low;
+                }
+
+                if (other._high > _high)
+                {
+                    _high = other._high;
+                }
+            }
+
+            void Reset()
+            {
+                if (_count > 0)
+                {
+                    memset(_buckets + _low, 0, (_high - _low + 1) * sizeof(uint64_t));
+                }
+
+                _count = 0;
+                _sum = 0;
+                _min = UINT64_MAX;
+                _max = 0;
+
+                _low = BUCKETS;
+                _high = 0;
+            }
+
+            uint64_t Count() const
+            {
+                return _count;
+            }
+
+            uint64_t Sum() const
+            {
+                return _sum;
+            }
+
+            uint64_t Min() const
+            {
+                return _count > 0 ? _min : 0;
+            }
+
+            uint64_t Max() const
+            {
+                return _max;
+            }
+
+            double Mean() const
+            {
+                return _count > 0 ? (double)_sum / (double)_count : 0.0;
+            }
+
+            // percentile – 0.0 through 100.0, returns the upper bound of the bucket holding it
+            uint64_t Percentile(double percentile) const
+            {
+                if (0 == _count)
+                {
+                    return 0;
+                }
+
+                uint64_t rank = (uint64_t)(percentile / 100.0 * (double)_count + 0.5);
+                if (rank < 1)
+                {
+                    rank = 1;
+                }
+
+                uint64_t seen = 0;
+                for (unsigned int bucket = _low; bucket <= _high; ++bucket)
+                {
+                    seen += _buckets[bucket];
+                    if (seen >= rank)
+                    {
+                        uint64_t value = valueOf(bucket);
+                        return value < _max ? value : _max;
+                    }
+                }
+
+                return _max;
+            }
+
+            // visits non-empty buckets in ascending order as (upper bound, count), used by exporters
+            template<typename visitor_type>
+            void ForEach(visitor_type&& visitor) const
+            {
+                if (0 == _count)
+                {
+                    return;
+                }
+
+                for (unsigned int bucket = _low; bucket <= _high; ++bucket)
+                {
+                    if (_buckets[bucket] > 0)
+                    {
+                        visitor(valueOf(bucket), _buckets[bucket]);
+                    }
+                }
+            }
+        };
+    }
+}
+
+#endif
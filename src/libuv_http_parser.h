@@ -0,0 +1,735 @@
+#ifndef IO_SIMPLIFY_LIBUV_HTTP_PARSER_H
+#define IO_SIMPLIFY_LIBUV_HTTP_PARSER_H
+
+#include <string_view>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// define IO_SIMPLIFY_LIBUV_HTTP_SCALAR to force the portable scanner
+#if !defined(IO_SIMPLIFY_LIBUV_HTTP_SCALAR)
+#if defined(__AVX2__)
+#define IO_SIMPLIFY_LIBUV_HTTP_AVX2
+#endif
+#if defined(__SSE2__)
+#define IO_SIMPLIFY_LIBUV_HTTP_SSE2
+#endif
+#endif
+
+#if defined(IO_SIMPLIFY_LIBUV_HTTP_AVX2) || defined(IO_SIMPLIFY_LIBUV_HTTP_SSE2)
+#include <immintrin.h>
+#endif
+
+namespace io_simplify {
+
+    namespace libuv {
+
+        struct HttpHeader
+        {
+            std::string_view name;
+            std::string_view value;
+        };
+
+        /*
+            A parsed request. Every view points into the buffer handed to HttpParser::Parse and is only valid as long as that buffer is.
+        */
+        struct HttpRequest
+        {
+            static constexpr size_t MAX_HEADERS = 64;
+
+            std::string_view method;
+            std::string_view target;
+            int minor_version;
+
+            HttpHeader headers[MAX_HEADERS];
+            size_t num_headers;
+
+            // de-chunked in place for chunked requests
+            std::string_view body;
+
+            bool keep_alive;
+
+            // case-insensitive lookup of the first header with that name, empty if missing
+            std::string_view Header(std::string_view name) const
+            {
+                for (size_t i = 0; i < num_headers; ++i)
+                {
+                    if (headers[i].name.size() == name.size() && equalsIgnoreCase(headers[i].name.data(), name.data(), name.size()))
+                    {
+                        return headers[i].value;
+                    }
+                }
+
+                return std::string_view();
+            }
+
+            static bool equalsIgnoreCase(const char* left, const char* right, size_t size)
+            {
+                for (size_t i = 0; i < size; ++i)
+                {
+                    unsigned char l = (unsigned char)left[i];
+                    unsigned char r = (unsigned char)right[i];
+
+                    if (l - 'A' < 26u)
+                    {
+                        l |= 0x20;
+                    }
+                    if (r - 'A' < 26u)
+                    {
+                        r |= 0x20;
+                    }
+
+                    if (l != r)
+                    {
+                        return false;
+                    }
+                }
+
+                return true;
+            }
+        };
+
+        /*
+            Incremental HTTP/1.1 request parser.
+
+            Parse is given everything received so far for the current request and either completes the request, asks for more bytes,
+            or rejects it. A request split across reads has its headers parsed again once more bytes arrived, the header limit bounds
+            that work; a chunked body resumes where the caller's ChunkedProgress says the previous call stopped. Delimiters are found
+            32 (AVX2) or 16 (SSE2) bytes at a time, and the same pass rejects control characters, so request bytes are touched once.
+
+            Bodies are delimited by Content-Length or chunked transfer coding (extensions and trailers are skipped).
+        */
+        class HttpParser
+        {
+        public:
+            // Parse results below zero are the negated HTTP status to answer with before closing
+            static constexpr ptrdiff_t INCOMPLETE = 0;
+            static constexpr ptrdiff_t BAD_REQUEST = -400;
+            static constexpr ptrdiff_t PAYLOAD_TOO_LARGE = -413;
+            static constexpr ptrdiff_t HEADERS_TOO_LARGE = -431;
+            static constexpr ptrdiff_t NOT_IMPLEMENTED = -501;
+            static constexpr ptrdiff_t VERSION_NOT_SUPPORTED = -505;
+
+            /*
+                How far an incomplete chunked body was walked, relative to the start of its body. Kept by the caller per
+                connection, so a body arriving over many reads is walked once; clear it once Parse returned anything other
+                than INCOMPLETE.
+            */
+            struct ChunkedProgress
+            {
+                size_t cursor = 0; // next chunk-size line
+                size_t body_size = 0; // chunk data decoded so far, at the start of the body
+
+                void Clear()
+                {
+                    cursor = 0;
+                    body_size = 0;
+                }
+            };
+
+        private:
+            size_t _max_header_bytes;
+            size_t _max_body_bytes;
+
+        private:
+            /*
+                First byte that is a control character (other than HTAB), DEL, or one of the two extra delimiters; nullptr if none.
+                Line ends are control characters, so every scan also stops at the end of the line.
+            */
+            static const char* findSpecial(const char* p, const char* end, char extra1, char extra2)
+            {
+#if defined(IO_SIMPLIFY_LIBUV_HTTP_AVX2)
+                {
+                    const __m256i ctl = _mm256_set1_epi8(0x1f);
+                    const __m256i del = _mm256_set1_epi8(0x7f);
+                    const __m256i tab = _mm256_set1_epi8('\t');
+                    const __m256i first = _mm256_set1_epi8(extra1);
+                    const __m256i second = _mm256_set1_epi8(extra2);
+
+                    while (end - p >= 32)
+                    {
+                        __m256i bytes = _mm256_loadu_si256((const __m256i*)p);
+
+                        __m256i hits = _mm256_cmpeq_epi8(_mm256_max_epu8(bytes, ctl), ctl);
+                        hits = _mm256_andnot_si256(_mm256_cmpeq_epi8(bytes, tab), hits);
+                        hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(bytes, del));
+                        hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(bytes, first));
+                        hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(bytes, second));
+
+                        unsigned int mask = (unsigned int)_mm256_movemask_epi8(hits);
+                        if (0 != mask)
+                        {
+                            return p + __builtin_ctz(mask);
+                        }
+
+                        p += 32;
+                    }
+                }
+#endif
+#if defined(IO_SIMPLIFY_LIBUV_HTTP_SSE2)
+                {
+                    const __m128i ctl = _mm_set1_epi8(0x1f);
+                    const __m128i del = _mm_set1_epi8(0x7f);
+                    const __m128i tab = _mm_set1_epi8('\t');
+                    const __m128i first = _mm_set1_epi8(extra1);
+                    const __m128i second = _mm_set1_epi8(extra2);
+
+                    while (end - p >= 16)
+                    {
+                        __m128i bytes = _mm_loadu_si128((const __m128i*)p);
+
+                        __m128i hits = _mm_cmpeq_epi8(_mm_max_epu8(bytes, ctl), ctl);
+                        hits = _mm_andnot_si128(_mm_cmpeq_epi8(bytes, tab), hits);
+                        hits = _mm_or_si128(hits, _mm_cmpeq_epi8(bytes, del));
+                        hits = _mm_or_si128(hits, _mm_cmpeq_epi8(bytes, first));
+                        hits = _mm_or_si128(hits, _mm_cmpeq_epi8(bytes, second));
+
+                        unsigned int mask = (unsigned int)_mm_movemask_epi8(hits);
+                        if (0 != mask)
+                        {
+                            return p + __builtin_ctz(mask);
+                        }
+
+                        p += 16;
+                    }
+                }
+#endif
+                for (; p < end; ++p)
+                {
+                    unsigned char c = (unsigned char)(*p);
+
+                    if ((c <= 0x1f && c != '\t') || c == 0x7f || c == (unsigned char)extra1 || c == (unsigned char)extra2)
+                    {
+                        return p;
+                    }
+                }
+
+                return nullptr;
+            }
+
+            /*
+                Expects p at a line end found by findSpecial. Returns the start of the next line,
+                nullptr if the line end is not complete yet, or end + 1 if the control character is not a line end.
+            */
+            static const char* skipLineEnd(const char* p, const char* end)
+            {
+                if ('\n' == *p)
+                {
+                    return p + 1;
+                }
+
+                if ('\r' == *p)
+                {
+                    if (p + 1 == end)
+                    {
+                        return nullptr;
+                    }
+
+                    if ('\n' == p[1])
+                    {
+                        return p + 2;
+                    }
+                }
+
+                return end + 1;
+            }
+
+            static bool isOws(char c)
+            {
+                return ' ' == c || '\t' == c;
+            }
+
+            static bool hasToken(std::string_view value, const char* lower_token, size_t size)
+            {
+                while (!value.empty())
+                {
+                    size_t comma = value.find(',');
+                    std::string_view item = value.substr(0, comma);
+
+                    while (!item.empty() && isOws(item.front()))
+                    {
+                        item.remove_prefix(1);
+                    }
+                    while (!item.empty() && isOws(item.back()))
+                    {
+                        item.remove_suffix(1);
+                    }
+
+                    if (item.size() == size && HttpRequest::equalsIgnoreCase(item.data(), lower_token, size))
+                    {
+                        return true;
+                    }
+
+                    if (std::string_view::npos == comma)
+                    {
+                        break;
+                    }
+
+                    value.remove_prefix(comma + 1);
+                }
+
+                return false;
+            }
+
+            /*
+                Walks a chunked body starting at p from where progress stopped, moving the data of every complete chunk down
+                to form one contiguous body at p as it goes. On INCOMPLETE, progress keeps the chunks walked so far and
+                required_offset is set to the body offset the next chunk needs, 0 when unknown.
+            */
+            ptrdiff_t parseChunked(char* p, const char* end, ChunkedProgress& progress, size_t& required_offset) const
+            {
+                char* cursor = p + progress.cursor;
+                char* output = p + progress.body_size;
+
+                required_offset = 0;
+
+                while (true)
+                {
+                    // chunk-size [ ; extensions ] CRLF
+                    uint64_t chunk_size = 0;
+                    const char* digit = cursor;
+
+                    for (; digit < end; ++digit)
+                    {
+                        unsigned char c = (unsigned char)(*digit);
+                        unsigned int value;
+
+                        if (c - '0' < 10u)
+                        {
+                            value = c - '0';
+                        }
+                        else if ((c | 0x20) - 'a' < 6u)
+                        {
+                            value = (c | 0x20) - 'a' + 10;
+                        }
+                        else
+                        {
+                            break;
+                        }
+
+                        chunk_size = chunk_size * 16 + value;
+                        if (chunk_size > _max_body_bytes)
+                        {
+                            return PAYLOAD_TOO_LARGE;
+                        }
+                    }
+
+                    if (digit == end)
+                    {
+                        return INCOMPLETE;
+                    }
+
+                    if (digit == cursor || (';' != *digit && '\r' != *digit && '\n' != *digit && !isOws(*digit)))
+                    {
+                        return BAD_REQUEST;
+                    }
+
+                    const char* line_end = findSpecial(digit, end, '\n', '\n');
+                    if (nullptr == line_end)
+                    {
+                        return INCOMPLETE;
+                    }
+
+                    const char* next = skipLineEnd(line_end, end);
+                    if (nullptr == next)
+                    {
+                        return INCOMPLETE;
+                    }
+                    if (next > end)
+                    {
+                        return BAD_REQUEST;
+                    }
+
+                    if (0 == chunk_size)
+                    {
+                        cursor = (char*)next;
+                        break;
+                    }
+
+                    if (progress.body_size + chunk_size > _max_body_bytes)
+                    {
+                        return PAYLOAD_TOO_LARGE;
+                    }
+
+                    // chunk-data CRLF
+                    const char* data = next;
+                    if ((uint64_t)(end - data) < chunk_size + 1)
+                    {
+                        required_offset = (size_t)(data - p) + (size_t)chunk_size + 1;
+                        return INCOMPLETE;
+                    }
+
+                    const char* data_end = data + chunk_size;
+
+                    next = skipLineEnd(data_end, end);
+                    if (nullptr == next)
+                    {
+                        return INCOMPLETE;
+                    }
+                    if (next > end)
+                    {
+                        return BAD_REQUEST;
+                    }
+
+                    memmove(output, data, chunk_size);
+                    output += chunk_size;
+
+                    // the chunk is done with, a later call resumes behind it
+                    progress.body_size += chunk_size;
+                    progress.cursor = (size_t)(next - p);
+
+                    cursor = (char*)next;
+                }
+
+                // trailer fields up to the empty line, skipped
+                while (true)
+                {
+                    if (cursor == end)
+                    {
+                        return INCOMPLETE;
+                    }
+
+                    const char* line_end = findSpecial(cursor, end, '\n', '\n');
+                    if (nullptr == line_end)
+                    {
+                        return INCOMPLETE;
+                    }
+
+                    const char* next = skipLineEnd(line_end, end);
+                    if (nullptr == next)
+                    {
+                        return INCOMPLETE;
+                    }
+                    if (next > end)
+                    {
+                        return BAD_REQUEST;
+                    }
+
+                    bool empty = (line_end == cursor);
+
+                    cursor = (char*)next;
+
+                    if (empty)
+                    {
+                        break;
+                    }
+                }
+
+                return cursor - p;
+            }
+
+        public:
+            explicit HttpParser(size_t max_header_bytes = 8192, size_t max_body_bytes = 1024 * 1024)
+                : _max_header_bytes(max_header_bytes)
+                , _max_body_bytes(max_body_bytes)
+            {
+            }
+
+            ~HttpParser()
+            {
+            }
+
+            /*
+                Returns the number of bytes the request occupied (> 0), INCOMPLETE, or one of the negative error statuses.
+
+                On INCOMPLETE, required is set to the total number of bytes the request needs when that is already known
+                (headers complete, Content-Length body or the rest of a chunk), 0 otherwise; callers can skip parsing until
+                that much arrived.
+                data is only written to when de-chunking a chunked body, which happens chunk by chunk as they complete, so
+                a retry after INCOMPLETE must pass the same progress: it resumes after the chunks already moved in place.
+            */
+            ptrdiff_t Parse(char* data, size_t size, HttpRequest& request, size_t& required, ChunkedProgress& progress) const
+            {
+                const char* begin = data;
+                const char* end = data + size;
+                const char* p = begin;
+
+                required = 0;
+
+                // tolerate empty lines ahead of a request (RFC 7230 3.5)
+                while (p < end && ('\r' == *p || '\n' == *p))
+                {
+                    ++p;
+                }
+
+                ptrdiff_t header_limit = (ptrdiff_t)_max_header_bytes + (p - begin);
+
+                ptrdiff_t result = INCOMPLETE;
+                bool headers_complete = false;
+                do
+                {
+                    // method SP request-target SP HTTP-version CRLF
+                    const char* delimiter = findSpecial(p, end, ' ', ' ');
+                    if (nullptr == delimiter)
+                    {
+                        break;
+                    }
+                    if (' ' != *delimiter || delimiter == p)
+                    {
+                        result = BAD_REQUEST;
+                        break;
+                    }
+
+                    request.method = std::string_view(p, delimiter - p);
+                    p = delimiter + 1;
+
+                    delimiter = findSpecial(p, end, ' ', ' ');
+                    if (nullptr == delimiter)
+                    {
+                        break;
+                    }
+                    if (' ' != *delimiter || delimiter == p)
+                    {
+                        result = BAD_REQUEST;
+                        break;
+                    }
+
+                    request.target = std::string_view(p, delimiter - p);
+                    p = delimiter + 1;
+
+                    if (end - p < 9)
+                    {
+                        if (0 != memcmp(p, "HTTP/1.", (size_t)(end - p) < 7 ? (size_t)(end - p) : 7))
+                        {
+                            result = (end - p >= 6 && 0 == memcmp(p, "HTTP/", 5)) ? VERSION_NOT_SUPPORTED : BAD_REQUEST;
+                        }
+                        break;
+                    }
+
+                    if (0 != memcmp(p, "HTTP/", 5))
+                    {
+                        result = BAD_REQUEST;
+                        break;
+                    }
+                    if ('1' != p[5] || '.' != p[6] || (unsigned char)(p[7] - '0') > 9)
+                    {
+                        result = VERSION_NOT_SUPPORTED;
+                        break;
+                    }
+
+                    request.minor_version = p[7] - '0';
+
+                    p = skipLineEnd(p + 8, end);
+                    if (nullptr == p)
+                    {
+                        break;
+                    }
+                    if (p > end)
+                    {
+                        result = BAD_REQUEST;
+                        break;
+                    }
+
+                    // header fields up to the empty line
+                    bool chunked = false;
+                    bool has_length = false;
+                    bool connection_close = false;
+                    bool connection_keep_alive = false;
+                    uint64_t content_length = 0;
+
+                    request.num_headers = 0;
+
+                    const char* headers_end = nullptr;
+                    while (true)
+                    {
+                        if (p == end)
+                        {
+                            break;
+                        }
+
+                        if ('\r' == *p || '\n' == *p)
+                        {
+                            headers_end = skipLineEnd(p, end);
+                            if (headers_end > end)
+                            {
+                                result = BAD_REQUEST;
+                            }
+                            break;
+                        }
+
+                        // no obs-fold, no whitespace before the colon
+                        if (isOws(*p))
+                        {
+                            result = BAD_REQUEST;
+                            break;
+                        }
+
+                        if (request.num_headers == HttpRequest::MAX_HEADERS)
+                        {
+                            result = HEADERS_TOO_LARGE;
+                            break;
+                        }
+
+                        const char* colon = findSpecial(p, end, ':', ' ');
+                        if (nullptr == colon)
+                        {
+                            break;
+                        }
+                        if (':' != *colon || colon == p)
+                        {
+                            result = BAD_REQUEST;
+                            break;
+                        }
+
+                        std::string_view name(p, colon - p);
+
+                        const char* value = colon + 1;
+                        while (value < end && isOws(*value))
+                        {
+                            ++value;
+                        }
+
+                        const char* line_end = findSpecial(value, end, '\n', '\n');
+                        if (nullptr == line_end)
+                        {
+                            break;
+                        }
+
+                        const char* next = skipLineEnd(line_end, end);
+                        if (nullptr == next)
+                        {
+                            break;
+                        }
+                        if (next > end)
+                        {
+                            result = BAD_REQUEST;
+                            break;
+                        }
+
+                        const char* value_end = line_end;
+                        while (value_end > value && isOws(value_end[-1]))
+                        {
+                            --value_end;
+                        }
+
+                        HttpHeader& header = request.headers[request.num_headers++];
+                        header.name = name;
+                        header.value = std::string_view(value, value_end - value);
+
+                        // headers framing the message, matched by length first
+                        if (14 == name.size() && HttpRequest::equalsIgnoreCase(name.data(), "content-length", 14))
+                        {
+                            uint64_t length = 0;
+                            if (header.value.empty())
+                            {
+                                result = BAD_REQUEST;
+                                break;
+                            }
+                            for (char c : header.value)
+                            {
+                                if ((unsigned char)(c - '0') > 9 || length > _max_body_bytes)
+                                {
+                                    result = (unsigned char)(c - '0') > 9 ? BAD_REQUEST : PAYLOAD_TOO_LARGE;
+                                    break;
+                                }
+                                length = length * 10 + (c - '0');
+                            }
+                            if (result < 0)
+                            {
+                                break;
+                            }
+                            if (has_length && length != content_length)
+                            {
+                                result = BAD_REQUEST;
+                                break;
+                            }
+
+                            has_length = true;
+                            content_length = length;
+                        }
+                        else if (17 == name.size() && HttpRequest::equalsIgnoreCase(name.data(), "transfer-encoding", 17))
+                        {
+                            // only "chunked" alone is understood
+                            if (7 != header.value.size() || !HttpRequest::equalsIgnoreCase(header.value.data(), "chunked", 7))
+                            {
+                                result = NOT_IMPLEMENTED;
+                                break;
+                            }
+
+                            chunked = true;
+                        }
+                        else if (10 == name.size() && HttpRequest::equalsIgnoreCase(name.data(), "connection", 10))
+                        {
+                            connection_close = connection_close || hasToken(header.value, "close", 5);
+                            connection_keep_alive = connection_keep_alive || hasToken(header.value, "keep-alive", 10);
+                        }
+
+                        p = next;
+                    }
+
+                    if (result < 0 || nullptr == headers_end)
+                    {
+                        break;
+                    }
+
+                    // the same limit whether the headers arrived in one read or over several
+                    if (headers_end - begin > header_limit)
+                    {
+                        result = HEADERS_TOO_LARGE;
+                        break;
+                    }
+
+                    headers_complete = true;
+
+                    if (chunked && has_length)
+                    {
+                        result = BAD_REQUEST;
+                        break;
+                    }
+                    if (content_length > _max_body_bytes)
+                    {
+                        result = PAYLOAD_TOO_LARGE;
+                        break;
+                    }
+
+                    request.keep_alive = (1 == request.minor_version) ? !connection_close : (connection_keep_alive && !connection_close);
+
+                    char* body = data + (headers_end - begin);
+
+                    if (chunked)
+                    {
+                        size_t required_offset = 0;
+
+                        result = parseChunked(body, end, progress, required_offset);
+                        if (result > 0)
+                        {
+                            request.body = std::string_view(body, progress.body_size);
+                            result += body - data;
+                        }
+                        else if (INCOMPLETE == result && required_offset > 0)
+                        {
+                            required = (size_t)(body - data) + required_offset;
+                        }
+                        break;
+                    }
+
+                    if ((uint64_t)(end - body) < content_length)
+                    {
+                        required = (size_t)(body - data) + (size_t)content_length;
+                        break;
+                    }
+
+                    request.body = std::string_view(body, (size_t)content_length);
+                    result = (body - data) + (ptrdiff_t)content_length;
+                } while (false);
+
+                if (INCOMPLETE == result && !headers_complete && (ptrdiff_t)size > header_limit)
+                {
+                    result = HEADERS_TOO_LARGE;
+                }
+
+                return result;
+            }
+
+        private:
+            HttpParser(const HttpParser&) = delete;
+            HttpParser& operator=(const HttpParser&) = delete;
+
+            HttpParser(HttpParser&&) = delete;
+            HttpParser& operator=(HttpParser&&) = delete;
+        };
+    }
+}
+
+#endif
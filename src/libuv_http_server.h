@@ -0,0 +1,721 @@
+#ifndef IO_SIMPLIFY_LIBUV_HTTP_SERVER_H
+#define IO_SIMPLIFY_LIBUV_HTTP_SERVER_H
+
+#include "libuv_loop.h"
+
+#include "libuv_tcp_handle.h"
+#include "libuv_deferred_queue.h"
+#include "libuv_http_parser.h"
+
+#include <charconv>
+#include <deque>
+#include <string>
+
+#include <string.h>
+
+namespace io_simplify {
+
+    namespace libuv {
+
+        /*
+            HTTP/1.1 server stage on top of TcpHandle.
+
+            Each connection reads straight into its own input buffer, and every complete request found in a read is handed to
+            CallbackRequest with views into that buffer (valid during the callback only, copy what has to outlive it).
+            Responses are appended to the connection's output in request order and everything answered while handling one read,
+            pipelined requests included, leaves in a single write. Responses given outside CallbackRequest are flushed at the
+            end of the loop iteration, again as one write per connection.
+
+            Every request must be answered exactly once, in order. While a connection has more than max_pending_output bytes of
+            responses unwritten it stops reading and parsing until the peer catches up.
+        */
+        class HttpServer
+        {
+        public:
+            class Connection;
+
+            using CallbackRequest = std::function<void(Connection* connection, const HttpRequest& request)>;
+
+            // the connection is freed after this returns
+            using CallbackConnectionClosed = std::function<void(Connection* connection)>;
+
+            using CallbackServerClosed = std::function<void()>;
+
+            static std::string_view Reason(int status_code)
+            {
+                switch (status_code)
+                {
+                case 100: return "Continue";
+                case 101: return "Switching Protocols";
+                case 200: return "OK";
+                case 201: return "Created";
+                case 202: return "Accepted";
+                case 204: return "No Content";
+                case 206: return "Partial Content";
+                case 301: return "Moved Permanently";
+                case 302: return "Found";
+                case 304: return "Not Modified";
+                case 307: return "Temporary Redirect";
+                case 308: return "Permanent Redirect";
+                case 400: return "Bad Request";
+                case 401: return "Unauthorized";
+                case 403: return "Forbidden";
+                case 404: return "Not Found";
+                case 405: return "Method Not Allowed";
+                case 408: return "Request Timeout";
+                case 409: return "Conflict";
+                case 411: return "Length Required";
+                case 413: return "Payload Too Large";
+                case 414: return "URI Too Long";
+                case 415: return "Unsupported Media Type";
+                case 429: return "Too Many Requests";
+                case 431: return "Request Header Fields Too Large";
+                case 500: return "Internal Server Error";
+                case 501: return "Not Implemented";
+                case 502: return "Bad Gateway";
+                case 503: return "Service Unavailable";
+                case 504: return "Gateway Timeout";
+                case 505: return "HTTP Version Not Supported";
+                default: return "Unknown";
+                }
+            }
+
+            class Connection
+            {
+                friend class HttpServer;
+
+            private:
+                static constexpr size_t INPUT_INITIAL = 16 * 1024;
+                static constexpr size_t INPUT_MIN_READ = 4 * 1024;
+
+                struct OutputRequest : public TcpHandle::WriteRequest
+                {
+                    Connection* connection;
+                };
+
+            private:
+                HttpServer* _server;
+                Connection* _prev;
+                Connection* _next;
+
+                TcpHandle _tcp;
+
+                // unparsed input is [_input_begin, _input_end)
+                char* _input;
+                size_t _input_capacity;
+                size_t _input_begin;
+                size_t _input_end;
+                size_t _input_required;
+                HttpParser::ChunkedProgress _input_chunked; // of the request at _input_begin
+
+                HttpRequest _request;
+
+                // responses are appended to _output, _writing is in flight; swapped so both keep their capacity
+                std::string _output;
+                std::string _writing;
+                OutputRequest _output_request;
+
+                uint64_t _dispatched;
+                uint64_t _responded;
+                uint64_t _close_after; // request number answered last, 0 while keep-alive
+                std::deque<uint64_t> _head_requests; // numbers of the HEAD requests not answered yet
+                int _error_status;
+
+                bool _reading;
+                bool _dispatching;
+                bool _flush_deferred;
+                bool _eof;
+                bool _shutdown;
+                bool _closing;
+                bool _closed;
+
+            public:
+                // free for the user
+                void* data;
+
+            private:
+                static void callback_output_written(TcpHandle::WriteRequest* write_request, int status)
+                {
+                    ((OutputRequest*)(write_request))->connection->written(status);
+                }
+
+                size_t pendingOutput() const
+                {
+                    return _output.size() + _writing.size();
+                }
+
+                bool acceptsRequests() const
+                {
+                    return !_closing && !_shutdown && !_eof && 0 == _error_status && 0 == _close_after;
+                }
+
+                void alloc(uv_buf_t* buf)
+                {
+                    size_t unparsed = _input_end - _input_begin;
+
+                    if (_input_begin > 0 && _input_capacity - _input_end < INPUT_MIN_READ)
+                    {
+                        memmove(_input, _input + _input_begin, unparsed);
+
+                        _input_begin = 0;
+                        _input_end = unparsed;
+                    }
+
+                    size_t wanted = _input_end + INPUT_MIN_READ;
+                    if (_input_required > unparsed)
+                    {
+                        wanted = _input_end + (_input_required - unparsed);
+                    }
+
+                    if (wanted > _input_capacity)
+                    {
+                        size_t capacity = _input_capacity > 0 ? _input_capacity * 2 : INPUT_INITIAL;
+                        if (capacity < wanted)
+                        {
+                            capacity = wanted;
+                        }
+
+                        char* input = (char*)realloc(_input, capacity);
+                        if (nullptr == input)
+                        {
+                            // libuv reports UV_ENOBUFS to the read callback
+                            buf->base = nullptr;
+                            buf->len = 0;
+                            return;
+                        }
+
+                        _input = input;
+                        _input_capacity = capacity;
+                    }
+
+                    buf->base = _input + _input_end;
+                    buf->len = _input_capacity - _input_end;
+                }
+
+                void read(ssize_t nread)
+                {
+                    if (nread > 0)
+                    {
+                        _input_end += nread;
+
+                        process();
+                        settle();
+                    }
+                    else if (UV_EOF == nread)
+                    {
+                        // whatever is left is an incomplete request nobody will finish
+                        _eof = true;
+
+                        stopRead();
+                        settle();
+                    }
+                    else if (nread < 0)
+                    {
+                        Close();
+                    }
+                }
+
+                void process()
+                {
+                    _dispatching = true;
+
+                    while (acceptsRequests() && pendingOutput() < _server->_max_pending_output)
+                    {
+                        size_t unparsed = _input_end - _input_begin;
+                        if (0 == unparsed || unparsed < _input_required)
+                        {
+                            break;
+                        }
+
+                        ptrdiff_t result = _server->_parser.Parse(_input + _input_begin, unparsed, _request, _input_required, _input_chunked);
+                        if (HttpParser::INCOMPLETE == result)
+                        {
+                            break;
+                        }
+
+                        _input_chunked.Clear();
+
+                        if (result < 0)
+                        {
+                            _error_status = (int)(-result);
+                            break;
+                        }
+
+                        _input_begin += (size_t)result;
+                        _input_required = 0;
+
+                        ++_dispatched;
+
+                        if (4 == _request.method.size() && 0 == memcmp(_request.method.data(), "HEAD", 4))
+                        {
+                            _head_requests.push_back(_dispatched);
+                        }
+
+                        if (!_request.keep_alive)
+                        {
+                            _close_after = _dispatched;
+                        }
+
+                        _server->_callback_request(this, _request);
+                    }
+
+                    if (_input_begin == _input_end)
+                    {
+                        _input_begin = 0;
+                        _input_end = 0;
+                    }
+
+                    _dispatching = false;
+                }
+
+                // decides whether to keep reading, whether the connection is done, and writes what was answered
+                void settle()
+                {
+                    if (_closing)
+                    {
+                        return;
+                    }
+
+                    if (!_shutdown && !acceptsRequests() && _responded == _dispatched)
+                    {
+                        if (0 != _error_status && 0 == _close_after)
+                        {
+                            appendResponse(_error_status, std::string_view(), nullptr, 0, true, true);
+                        }
+
+                        _shutdown = true;
+                    }
+
+                    if (!acceptsRequests() || pendingOutput() >= _server->_max_pending_output)
+                    {
+                        stopRead();
+                    }
+                    else if (!_reading)
+                    {
+                        _reading = (0 == _tcp.StartRead(
+                            [this] (ssize_t nread, const uv_buf_t*) { read(nread); },
+                            [this] (size_t, uv_buf_t* buf) { alloc(buf); }));
+                    }
+
+                    flush();
+
+                    if (_shutdown && 0 == pendingOutput())
+                    {
+                        Close();
+                    }
+                }
+
+                void stopRead()
+                {
+                    if (_reading)
+                    {
+                        _tcp.StopRead();
+                        _reading = false;
+                    }
+                }
+
+                void flush()
+                {
+                    if (_closing || !_writing.empty() || _output.empty())
+                    {
+                        return;
+                    }
+
+                    _writing.swap(_output);
+
+                    uv_buf_t buf = uv_buf_init(_writing.data(), (unsigned int)_writing.size());
+
+                    int res = _tcp.Write(&_output_request, &buf, 1);
+                    if (res < 0)
+                    {
+                        _writing.clear();
+
+                        Close();
+                    }
+                }
+
+                void written(int status)
+                {
+                    _writing.clear();
+
+                    if (_closing)
+                    {
+                        return;
+                    }
+
+                    if (status < 0)
+                    {
+                        Close();
+                        return;
+                    }
+
+                    // requests held back while the output was over the limit
+                    process();
+                    settle();
+                }
+
+                void deferFlush()
+                {
+                    if (_flush_deferred)
+                    {
+                        return;
+                    }
+
+                    _flush_deferred = true;
+
+                    _server->_deferred.Defer([this] () {
+                        _flush_deferred = false;
+
+                        if (_closed)
+                        {
+                            release();
+                            return;
+                        }
+
+                        settle();
+                    });
+                }
+
+                // with_body false answers a HEAD request: the length of body, none of its bytes
+                void appendResponse(int status_code, std::string_view body, const HttpHeader* headers, size_t num_headers, bool last, bool with_body)
+                {
+                    char number[24];
+
+                    _output.append("HTTP/1.1 ", 9);
+                    _output.append(number, std::to_chars(number, number + sizeof(number), status_code).ptr - number);
+                    _output.push_back(' ');
+                    _output.append(Reason(status_code));
+                    _output.append("\r\n", 2);
+
+                    for (size_t i = 0; i < num_headers; ++i)
+                    {
+                        _output.append(headers[i].name);
+                        _output.append(": ", 2);
+                        _output.append(headers[i].value);
+                        _output.append("\r\n", 2);
+                    }
+
+                    _output.append("Content-Length: ", 16);
+                    _output.append(number, std::to_chars(number, number + sizeof(number), body.size()).ptr - number);
+                    _output.append("\r\n", 2);
+
+                    if (last)
+                    {
+                        _output.append("Connection: close\r\n", 19);
+                    }
+
+                    _output.append("\r\n", 2);
+
+                    if (with_body)
+                    {
+                        _output.append(body);
+                    }
+                }
+
+                void release()
+                {
+                    _server->connectionReleased(this);
+                }
+
+            public:
+                Connection(HttpServer* server)
+                    : _server(server)
+                    , _prev(nullptr)
+                    , _next(nullptr)
+
+                    , _tcp(server->_loop)
+
+                    , _input(nullptr)
+                    , _input_capacity(0)
+                    , _input_begin(0)
+                    , _input_end(0)
+                    , _input_required(0)
+                    , _input_chunked()
+
+                    , _request()
+
+                    , _output()
+                    , _writing()
+                    , _output_request()
+
+                    , _dispatched(0)
+                    , _responded(0)
+                    , _close_after(0)
+                    , _head_requests()
+                    , _error_status(0)
+
+                    , _reading(false)
+                    , _dispatching(false)
+                    , _flush_deferred(false)
+                    , _eof(false)
+                    , _shutdown(false)
+                    , _closing(false)
+                    , _closed(false)
+
+                    , data(nullptr)
+                {
+                    _output_request.callback_written = callback_output_written;
+                    _output_request.connection = this;
+                }
+
+                ~Connection()
+                {
+                    free(_input);
+                }
+
+                TcpHandle* Handle()
+                {
+                    return &_tcp;
+                }
+
+                /*
+                    Answers the oldest unanswered request. Content-Length is added, and "Connection: close" when the
+                    connection ends after this response; the body is left out when answering HEAD. Ignored once the
+                    connection is closing.
+                */
+                void Respond(int status_code, std::string_view body, const HttpHeader* headers = nullptr, size_t num_headers = 0)
+                {
+                    if (_closing || _shutdown || _responded == _dispatched)
+                    {
+                        return;
+                    }
+
+                    ++_responded;
+
+                    bool head = !_head_requests.empty() && _head_requests.front() == _responded;
+                    if (head)
+                    {
+                        _head_requests.pop_front();
+                    }
+
+                    appendResponse(status_code, body, headers, num_headers, _responded == _close_after, !head);
+
+                    if (!_dispatching)
+                    {
+                        deferFlush();
+                    }
+                }
+
+                // responses not written yet are dropped
+                void Close()
+                {
+                    if (_closing)
+                    {
+                        return;
+                    }
+
+                    _closing = true;
+
+                    stopRead();
+
+                    _tcp.Close([this] () {
+                        _closed = true;
+
+                        // a deferred flush still refers to the connection, it releases it instead
+                        if (!_flush_deferred)
+                        {
+                            release();
+                        }
+                    });
+                }
+
+            private:
+                Connection() = delete;
+
+                Connection(const Connection&) = delete;
+                Connection& operator=(const Connection&) = delete;
+
+                Connection(Connection&&) = delete;
+                Connection& operator=(Connection&&) = delete;
+            };
+
+        private:
+            Loop* _loop;
+
+            TcpHandle _listener;
+            DeferredQueue _deferred;
+
+            HttpParser _parser;
+            size_t _max_pending_output;
+
+            CallbackRequest _callback_request;
+            CallbackConnectionClosed _callback_connection_closed;
+
+            Connection* _connections;
+            size_t _connection_count;
+
+            bool _closing;
+            int _closing_handles;
+            CallbackServerClosed _callback_server_closed;
+
+        private:
+            void accept(int status)
+            {
+                if (status < 0 || _closing)
+                {
+                    return;
+                }
+
+                Connection* connection = new Connection(this);
+
+                connection->_next = _connections;
+                if (nullptr != _connections)
+                {
+                    _connections->_prev = connection;
+                }
+                _connections = connection;
+
+                ++_connection_count;
+
+                if (connection->_tcp.status < 0)
+                {
+                    connectionReleased(connection);
+                    return;
+                }
+
+                if (_listener.Accept(&(connection->_tcp)) < 0)
+                {
+                    connection->Close();
+                    return;
+                }
+
+                connection->_tcp.NoDelay(1);
+                connection->settle();
+            }
+
+            void connectionReleased(Connection* connection)
+            {
+                if (nullptr != connection->_prev)
+                {
+                    connection->_prev->_next = connection->_next;
+                }
+                else
+                {
+                    _connections = connection->_next;
+                }
+
+                if (nullptr != connection->_next)
+                {
+                    connection->_next->_prev = connection->_prev;
+                }
+
+                --_connection_count;
+
+                if (_callback_connection_closed)
+                {
+                    _callback_connection_closed(connection);
+                }
+
+                delete connection;
+
+                if (_closing && 0 == _connection_count)
+                {
+                    closeHandles();
+                }
+            }
+
+            void closeHandles()
+            {
+                _closing_handles = 2;
+
+                CallbackHandleClosed callback_handle_closed = [this] () {
+                    if (0 == --_closing_handles && _callback_server_closed)
+                    {
+                        _callback_server_closed();
+                    }
+                };
+
+                _listener.Close(callback_handle_closed);
+                _deferred.Close(callback_handle_closed);
+            }
+
+        public:
+            HttpServer(Loop* loop, size_t max_header_bytes = 8192, size_t max_body_bytes = 1024 * 1024, size_t max_pending_output = 1024 * 1024)
+                : _loop(loop)
+
+                , _listener(loop)
+                , _deferred(loop)
+
+                , _parser(max_header_bytes, max_body_bytes)
+                , _max_pending_output(max_pending_output)
+
+                , _callback_request()
+                , _callback_connection_closed()
+
+                , _connections(nullptr)
+                , _connection_count(0)
+
+                , _closing(false)
+                , _closing_handles(0)
+                , _callback_server_closed()
+            {
+            }
+
+            ~HttpServer()
+            {
+            }
+
+            int Listen(const Endpoint& endpoint, const CallbackRequest& callback_request, int backlog = 128)
+            {
+                int res = _listener.Bind(endpoint);
+                do
+                {
+                    if (res < 0)
+                    {
+                        break;
+                    }
+
+                    _callback_request = callback_request;
+
+                    res = _listener.Listen([this] (int status) { accept(status); }, backlog);
+                } while (false);
+
+                return res;
+            }
+
+            void SetConnectionClosed(const CallbackConnectionClosed& callback_connection_closed)
+            {
+                _callback_connection_closed = callback_connection_closed;
+            }
+
+            size_t Connections() const
+            {
+                return _connection_count;
+            }
+
+            // closes every connection, then the listener
+            void Close(const CallbackServerClosed& callback_server_closed = nullptr)
+            {
+                if (_closing)
+                {
+                    return;
+                }
+
+                _closing = true;
+                _callback_server_closed = callback_server_closed;
+
+                if (0 == _connection_count)
+                {
+                    closeHandles();
+                    return;
+                }
+
+                for (Connection* connection = _connections; nullptr != connection; connection = connection->_next)
+                {
+                    connection->Close();
+                }
+            }
+
+        private:
+            HttpServer() = delete;
+
+            HttpServer(const HttpServer&) = delete;
+            HttpServer& operator=(const HttpServer&) = delete;
+
+            HttpServer(HttpServer&&) = delete;
+            HttpServer& operator=(HttpServer&&) = delete;
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef IO_SIMPLIFY_LIBUV_IDLE_HANDLE_H
+#define IO_SIMPLIFY_LIBUV_IDLE_HANDLE_H
+
+#include "libuv_loop.h"
+
+#include "libuv_handle.h"
+
+namespace io_simplify {
+
+    namespace libuv {
+
+        /*
+            Idle handles will run the given callback once per loop iteration, right before the uv_prepare_t handles.
+            While an idle handle is active the loop performs a zero timeout poll instead of blocking for i/o.
+        */
+        class IdleHandle : public Handle<uv_idle_t>
+        {
+        public:
+            using CallbackIdle = std::function<void()>;
+
+        private:
+            CallbackIdle _callback_idle;
+
+        private:
+            static void callback_uv_idle(uv_idle_t* handle)
+            {
+                IdleHandle* idle_handle = (IdleHandle*)(handle->data);
+
+                LIBUV_WATCHDOG_CALLBACK(idle_handle, TRACE_CALLBACK_IDLE);
+
+                idle_handle->_callback_idle();
+            }
+
+        public:
+            explicit IdleHandle(Loop* loop)
+                : Handle<uv_idle_t>(loop)
+
+                , _callback_idle()
+            {
+                Handle<uv_idle_t>::status = uv_idle_init(loop->uv, Handle<uv_idle_t>::uv);
+            }
+
+            ~IdleHandle()
+            {
+            }
+
+            int Start(const CallbackIdle& callback_idle)
+            {
+                _callback_idle = callback_idle;
+
+                return uv_idle_start(Handle<uv_idle_t>::uv, callback_uv_idle);
+            }
+
+            void Stop()
+            {
+                uv_idle_stop(Handle<uv_idle_t>::uv);
+            }
+
+            bool IsActive() const
+            {
+                return 0 != uv_is_active((const uv_handle_t*)(Handle<uv_idle_t>::uv));
+            }
+
+        private:
+            IdleHandle() = delete;
+
+            IdleHandle(const IdleHandle&) = delete;
+            IdleHandle& operator=(const IdleHandle&) = delete;
+
+            IdleHandle(IdleHandle&&) = delete;
+            IdleHandle& operator=(IdleHandle&&) = delete;
+        };
+    }
+}
+
+#endif
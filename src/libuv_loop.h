@@ -2,6 +2,8 @@
 #define IO_SIMPLIFY_LIBUV_LOOP_H
 
 #include "libuv_base.h"
+#include "libuv_loop_arena.h"
+#include "libuv_read_buffer_pool.h"
 
 namespace io_simplify {
 
@@ -9,9 +11,19 @@ namespace io_simplify {
 
         class Loop : public Base<uv_loop_t>
         {
+        public:
+            // request-scoped allocations of this loop's handles, loop thread only
+            LoopArena arena;
+
+            // read buffers lent to this loop's adaptive reads, loop thread only
+            ReadBufferPool read_buffers;
+
         public:
             Loop()
                 : Base<uv_loop_t>()
+
+                , arena()
+                , read_buffers()
             {
                 Base<uv_loop_t>::status = uv_loop_init(Base<uv_loop_t>::uv);
             }
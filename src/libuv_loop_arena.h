@@ -0,0 +1,306 @@
+#ifndef IO_SIMPLIFY_LIBUV_LOOP_ARENA_H
+#define IO_SIMPLIFY_LIBUV_LOOP_ARENA_H
+
+#include <new>
+#include <utility>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+namespace io_simplify {
+
+    namespace libuv {
+
+        /*
+            Monotonic arena for short-lived, loop-thread objects: write and send requests, small response buffers, callback state.
+
+            Allocation bumps a pointer in the current chunk. Every chunk is one generation that only counts its live objects;
+            Free does nothing but decrement that count. A chunk whose objects have all been freed is rewound in place when it
+            is still the current one, or goes back to a small free list to become a later generation. Objects larger than a
+            quarter of a chunk fall through to malloc.
+
+            Blocks are 8-byte aligned and carry an 8-byte header. Not thread-safe: allocate and free on the loop thread only.
+        */
+        class LoopArena
+        {
+        public:
+            static constexpr size_t ALIGNMENT = 8;
+
+            struct Statistics
+            {
+                uint64_t allocations = 0;
+                uint64_t large_allocations = 0; // fell through to malloc
+                uint64_t chunks_created = 0; // chunk mallocs, a warm arena stops creating them
+                uint64_t generations = 0; // chunks reclaimed, rewound or recycled
+
+                size_t chunks = 0; // chunks held, current and free ones included
+                size_t live = 0; // objects not freed yet
+            };
+
+        private:
+            struct Chunk
+            {
+                size_t live;
+                size_t offset; // bump pointer, from the chunk start
+
+                // free list, or the list of full chunks waiting for their last objects
+                Chunk* prev;
+                Chunk* next;
+            };
+
+            static constexpr size_t HEADER = sizeof(uint64_t);
+            static constexpr size_t CHUNK_START = (sizeof(Chunk) + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+
+            // header of a malloc'd block, chunk blocks store their offset from the chunk instead
+            static constexpr uint64_t LARGE = 0;
+
+        private:
+            size_t _chunk_size;
+            size_t _max_free_chunks;
+
+            Chunk* _current;
+            Chunk* _full;
+            Chunk* _free;
+            size_t _free_count;
+
+            Statistics _statistics;
+
+        private:
+            static size_t blockSize(size_t size)
+            {
+                return HEADER + ((size + ALIGNMENT - 1) & ~(ALIGNMENT - 1));
+            }
+
+            Chunk* takeChunk()
+            {
+                Chunk* chunk = _free;
+                if (nullptr != chunk)
+                {
+                    _free = chunk->next;
+                    --_free_count;
+                }
+                else
+                {
+                    chunk = (Chunk*)malloc(_chunk_size);
+                    if (nullptr == chunk)
+                    {
+                        return nullptr;
+                    }
+
+                    ++_statistics.chunks_created;
+                    ++_statistics.chunks;
+                }
+
+                chunk->live = 0;
+                chunk->offset = CHUNK_START;
+                chunk->prev = nullptr;
+                chunk->next = nullptr;
+
+                return chunk;
+            }
+
+            void recycle(Chunk* chunk)
+            {
+                ++_statistics.generations;
+
+                if (_free_count < _max_free_chunks)
+                {
+                    chunk->next = _free;
+                    _free = chunk;
+                    ++_free_count;
+                }
+                else
+                {
+                    free(chunk);
+                    --_statistics.chunks;
+                }
+            }
+
+        public:
+            explicit LoopArena(size_t chunk_size = 64 * 1024, size_t max_free_chunks = 4)
+                : _chunk_size(chunk_size)
+                , _max_free_chunks(max_free_chunks)
+
+                , _current(nullptr)
+                , _full(nullptr)
+                , _free(nullptr)
+                , _free_count(0)
+
+                , _statistics()
+            {
+            }
+
+            // blocks still live are released with their chunks
+            ~LoopArena()
+            {
+                free(_current);
+
+                Chunk* lists[] = {_full, _free};
+                for (Chunk* chunk : lists)
+                {
+                    while (nullptr != chunk)
+                    {
+                        Chunk* next = chunk->next;
+
+                        free(chunk);
+
+                        chunk = next;
+                    }
+                }
+            }
+
+            void* Allocate(size_t size)
+            {
+                size_t block_size = blockSize(size);
+
+                uint64_t* header = nullptr;
+
+                if (block_size > (_chunk_size - CHUNK_START) / 4)
+                {
+                    header = (uint64_t*)malloc(block_size);
+                    if (nullptr == header)
+                    {
+                        return nullptr;
+                    }
+
+                    *header = LARGE;
+
+                    ++_statistics.large_allocations;
+                }
+                else
+                {
+                    if (nullptr == _current || _current->offset + block_size > _chunk_size)
+                    {
+                        // a full chunk lives on until its last object is freed
+                        Chunk* full = _current;
+
+                        _current = takeChunk();
+
+                        if (nullptr != full)
+                        {
+                            if (0 == full->live)
+                            {
+                                recycle(full);
+                            }
+                            else
+                            {
+                                full->prev = nullptr;
+                                full->next = _full;
+                                if (nullptr != _full)
+                                {
+                                    _full->prev = full;
+                                }
+                                _full = full;
+                            }
+                        }
+
+                        if (nullptr == _current)
+                        {
+                            return nullptr;
+                        }
+                    }
+
+                    header = (uint64_t*)((char*)_current + _current->offset);
+                    *header = _current->offset;
+
+                    _current->offset += block_size;
+                    ++_current->live;
+                }
+
+                ++_statistics.allocations;
+                ++_statistics.live;
+
+                return header + 1;
+            }
+
+            void Free(void* block)
+            {
+                if (nullptr == block)
+                {
+                    return;
+                }
+
+                uint64_t* header = (uint64_t*)block - 1;
+
+                --_statistics.live;
+
+                if (LARGE == *header)
+                {
+                    free(header);
+                    return;
+                }
+
+                Chunk* chunk = (Chunk*)((char*)header - *header);
+                if (0 != --chunk->live)
+                {
+                    return;
+                }
+
+                if (chunk == _current)
+                {
+                    // everything of this generation completed, start over in the same (cache-warm) memory
+                    chunk->offset = CHUNK_START;
+                    ++_statistics.generations;
+                }
+                else
+                {
+                    if (nullptr != chunk->prev)
+                    {
+                        chunk->prev->next = chunk->next;
+                    }
+                    else
+                    {
+                        _full = chunk->next;
+                    }
+
+                    if (nullptr != chunk->next)
+                    {
+                        chunk->next->prev = chunk->prev;
+                    }
+
+                    recycle(chunk);
+                }
+            }
+
+            template<typename object_type, typename... argument_types>
+            object_type* New(argument_types&&... arguments)
+            {
+                static_assert(alignof(object_type) <= ALIGNMENT, "arena blocks are 8-byte aligned");
+
+                void* block = Allocate(sizeof(object_type));
+                if (nullptr == block)
+                {
+                    return nullptr;
+                }
+
+                return new (block) object_type(std::forward<argument_types>(arguments)...);
+            }
+
+            template<typename object_type>
+            void Delete(object_type* object)
+            {
+                if (nullptr != object)
+                {
+                    object->~object_type();
+
+                    Free(object);
+                }
+            }
+
+            const Statistics& GetStatistics() const
+            {
+                return _statistics;
+            }
+
+        private:
+            LoopArena(const LoopArena&) = delete;
+            LoopArena& operator=(const LoopArena&) = delete;
+
+            LoopArena(LoopArena&&) = delete;
+            LoopArena& operator=(LoopArena&&) = delete;
+        };
+    }
+}
+
+#endif
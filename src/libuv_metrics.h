@@ -0,0 +1,842 @@
+#ifndef IO_SIMPLIFY_LIBUV_METRICS_H
+#define IO_SIMPLIFY_LIBUV_METRICS_H
+
+#include "libuv_loop.h"
+
+#include "libuv_mutex.h"
+#include "libuv_timer_handle.h"
+#include "libuv_tcp_handle.h"
+#include "libuv_async_handle.h"
+
+#include <atomic>
+#include <charconv>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef IO_SIMPLIFY_LIBUV_METRICS_MAX_SERIES
+#define IO_SIMPLIFY_LIBUV_METRICS_MAX_SERIES 256 // counters, gauges and histograms of one registry
+#endif
+
+#ifndef IO_SIMPLIFY_LIBUV_METRICS_MAX_HISTOGRAMS
+#define IO_SIMPLIFY_LIBUV_METRICS_MAX_HISTOGRAMS 32
+#endif
+
+#ifndef IO_SIMPLIFY_LIBUV_METRICS_MAX_BUCKETS
+#define IO_SIMPLIFY_LIBUV_METRICS_MAX_BUCKETS 16 // upper bounds per histogram, +Inf not counted
+#endif
+
+namespace io_simplify {
+
+    namespace libuv {
+
+        /*
+            Metrics registry rendered in the Prometheus text format.
+
+            Counters and histograms are sharded per thread: every thread updating them gets its own block of slots on
+            first use and is the only writer of it, so an update is a plain load and store without a locked instruction.
+            Render sums the shards of all threads, the ones that exited included, so counters never go back.
+            Gauges are single atomics; sampled gauges call a function at render time, on the rendering thread.
+
+            Register series at startup: registration takes a lock and a full registry hands out series that do nothing.
+            labels is the inside of the braces, e.g. "loop=\"io\",handle=\"tcp\"", and may be empty. Series sharing
+            a name form one family and should be registered with the same help and type; Render writes a family's
+            series together, whenever they were registered.
+        */
+        class MetricsRegistry
+        {
+        private:
+            enum SeriesType
+            {
+                SERIES_COUNTER,
+                SERIES_GAUGE,
+                SERIES_SAMPLED,
+                SERIES_HISTOGRAM,
+            };
+
+            struct Series
+            {
+                SeriesType type;
+
+                std::string name;
+                std::string help;
+                std::string labels;
+                bool first_of_family;
+                std::atomic<unsigned int> next_of_family; // index of the family's next series, 0 for none
+
+                unsigned int slot; // counter or histogram slot in the shards
+
+                std::atomic<int64_t> gauge;
+                std::function<double()> sampler;
+
+                uint64_t bounds[IO_SIMPLIFY_LIBUV_METRICS_MAX_BUCKETS];
+                unsigned int bound_count;
+            };
+
+            struct Shard
+            {
+                std::atomic<uint64_t> counters[IO_SIMPLIFY_LIBUV_METRICS_MAX_SERIES];
+
+                struct
+                {
+                    std::atomic<uint64_t> buckets[IO_SIMPLIFY_LIBUV_METRICS_MAX_BUCKETS + 1]; // not cumulative, last one is +Inf
+                    std::atomic<uint64_t> sum;
+                } histograms[IO_SIMPLIFY_LIBUV_METRICS_MAX_HISTOGRAMS];
+
+                Shard* next;
+
+                Shard()
+                    : next(nullptr)
+                {
+                    for (std::atomic<uint64_t>& counter : counters)
+                    {
+                        counter.store(0, std::memory_order_relaxed);
+                    }
+
+                    for (auto& histogram : histograms)
+                    {
+                        for (std::atomic<uint64_t>& bucket : histogram.buckets)
+                        {
+                            bucket.store(0, std::memory_order_relaxed);
+                        }
+
+                        histogram.sum.store(0, std::memory_order_relaxed);
+                    }
+                }
+            };
+
+            // single writer, so no read-modify-write is needed
+            static void bump(std::atomic<uint64_t>& value, uint64_t delta)
+            {
+                value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+            }
+
+        public:
+            class Counter
+            {
+                friend class MetricsRegistry;
+
+            private:
+                MetricsRegistry* _registry;
+                unsigned int _slot;
+
+            public:
+                Counter()
+                    : _registry(nullptr)
+                    , _slot(0)
+                {
+                }
+
+                void Add(uint64_t value = 1) const
+                {
+                    if (nullptr != _registry)
+                    {
+                        bump(_registry->shard()->counters[_slot], value);
+                    }
+                }
+            };
+
+            class Gauge
+            {
+                friend class MetricsRegistry;
+
+            private:
+                std::atomic<int64_t>* _value;
+
+            public:
+                Gauge()
+                    : _value(nullptr)
+                {
+                }
+
+                void Set(int64_t value) const
+                {
+                    if (nullptr != _value)
+                    {
+                        _value->store(value, std::memory_order_relaxed);
+                    }
+                }
+
+                void Add(int64_t value) const
+                {
+                    if (nullptr != _value)
+                    {
+                        _value->fetch_add(value, std::memory_order_relaxed);
+                    }
+                }
+            };
+
+            class Histogram
+            {
+                friend class MetricsRegistry;
+
+            private:
+                MetricsRegistry* _registry;
+                const Series* _series;
+
+            public:
+                Histogram()
+                    : _registry(nullptr)
+                    , _series(nullptr)
+                {
+                }
+
+                void Observe(uint64_t value) const
+                {
+                    if (nullptr == _registry)
+                    {
+                        return;
+                    }
+
+                    unsigned int bucket = 0;
+                    while (bucket < _series->bound_count && value > _series->bounds[bucket])
+                    {
+                        ++bucket;
+                    }
+
+                    auto& histogram = _registry->shard()->histograms[_series->slot];
+
+                    bump(histogram.buckets[bucket], 1);
+                    bump(histogram.sum, value);
+                }
+            };
+
+        private:
+            uint64_t _id; // tells registries apart in the per-thread shard cache, addresses get reused
+
+            Mutex _mutex;
+
+            Series _series[IO_SIMPLIFY_LIBUV_METRICS_MAX_SERIES];
+            std::atomic<unsigned int> _series_count; // published after the series is complete
+            unsigned int _counter_count;
+            unsigned int _histogram_count;
+
+            std::atomic<Shard*> _shards;
+
+        private:
+            static uint64_t nextId()
+            {
+                static std::atomic<uint64_t> id(0);
+                return ++id;
+            }
+
+            Shard* shard()
+            {
+                static thread_local uint64_t cached_id = 0;
+                static thread_local Shard* cached_shard = nullptr;
+
+                if (cached_id == _id)
+                {
+                    return cached_shard;
+                }
+
+                // a thread updating several registries keeps one shard per registry
+                static thread_local std::vector<std::pair<uint64_t, Shard*>> thread_shards;
+
+                Shard* found = nullptr;
+                for (const std::pair<uint64_t, Shard*>& thread_shard : thread_shards)
+                {
+                    if (thread_shard.first == _id)
+                    {
+                        found = thread_shard.second;
+                        break;
+                    }
+                }
+
+                if (nullptr == found)
+                {
+                    found = new Shard();
+
+                    found->next = _shards.load(std::memory_order_relaxed);
+                    while (!_shards.compare_exchange_weak(found->next, found, std::memory_order_release, std::memory_order_relaxed))
+                    {
+                    }
+
+                    thread_shards.emplace_back(_id, found);
+                }
+
+                cached_id = _id;
+                cached_shard = found;
+
+                return found;
+            }
+
+            Series* add(SeriesType type, const char* name, const char* help, const char* labels)
+            {
+                unsigned int count = _series_count.load(std::memory_order_relaxed);
+                if (count == IO_SIMPLIFY_LIBUV_METRICS_MAX_SERIES)
+                {
+                    return nullptr;
+                }
+
+                Series* series = &(_series[count]);
+
+                series->type = type;
+                series->name = name;
+                series->help = help;
+                series->labels = nullptr != labels ? labels : "";
+                series->first_of_family = true;
+                series->next_of_family.store(0, std::memory_order_relaxed);
+
+                for (unsigned int i = 0; i < count; ++i)
+                {
+                    if (_series[i].name == series->name)
+                    {
+                        series->first_of_family = false;
+                        break;
+                    }
+                }
+
+                series->slot = 0;
+                series->gauge.store(0, std::memory_order_relaxed);
+                series->bound_count = 0;
+
+                return series;
+            }
+
+            void publish()
+            {
+                unsigned int count = _series_count.load(std::memory_order_relaxed);
+                Series& series = _series[count];
+
+                // append to the family, a renderer following the link sees the series complete
+                if (!series.first_of_family)
+                {
+                    unsigned int last = 0;
+                    while (_series[last].name != series.name)
+                    {
+                        ++last;
+                    }
+                    while (0 != _series[last].next_of_family.load(std::memory_order_relaxed))
+                    {
+                        last = _series[last].next_of_family.load(std::memory_order_relaxed);
+                    }
+
+                    _series[last].next_of_family.store(count, std::memory_order_release);
+                }
+
+                _series_count.store(count + 1, std::memory_order_release);
+            }
+
+            static void appendNumber(std::string& out, uint64_t value)
+            {
+                char number[24];
+                out.append(number, std::to_chars(number, number + sizeof(number), value).ptr - number);
+            }
+
+            static void appendNumber(std::string& out, int64_t value)
+            {
+                char number[24];
+                out.append(number, std::to_chars(number, number + sizeof(number), value).ptr - number);
+            }
+
+            static void appendNumber(std::string& out, double value)
+            {
+                char number[32];
+                int size = snprintf(number, sizeof(number), "%.17g", value);
+                out.append(number, size > 0 ? (size_t)size : 0);
+            }
+
+            // name{labels} or name{labels,extra}
+            static void appendName(std::string& out, const Series& series, const char* suffix, const char* extra = nullptr)
+            {
+                out.append(series.name);
+                out.append(suffix);
+
+                if (!series.labels.empty() || nullptr != extra)
+                {
+                    out.push_back('{');
+                    out.append(series.labels);
+
+                    if (nullptr != extra)
+                    {
+                        if (!series.labels.empty())
+                        {
+                            out.push_back(',');
+                        }
+                        out.append(extra);
+                    }
+
+                    out.push_back('}');
+                }
+
+                out.push_back(' ');
+            }
+
+        public:
+            MetricsRegistry()
+                : _id(nextId())
+
+                , _mutex()
+
+                , _series()
+                , _series_count(0)
+                , _counter_count(0)
+                , _histogram_count(0)
+
+                , _shards(nullptr)
+            {
+            }
+
+            // no thread may update the registry's series any more
+            ~MetricsRegistry()
+            {
+                Shard* shard = _shards.load(std::memory_order_acquire);
+                while (nullptr != shard)
+                {
+                    Shard* next = shard->next;
+
+                    delete shard;
+
+                    shard = next;
+                }
+            }
+
+            Counter AddCounter(const char* name, const char* help, const char* labels = nullptr)
+            {
+                Counter counter;
+
+                _mutex.Lock();
+
+                Series* series = add(SERIES_COUNTER, name, help, labels);
+                if (nullptr != series)
+                {
+                    series->slot = _counter_count++;
+
+                    counter._registry = this;
+                    counter._slot = series->slot;
+
+                    publish();
+                }
+
+                _mutex.Unlock();
+
+                return counter;
+            }
+
+            Gauge AddGauge(const char* name, const char* help, const char* labels = nullptr)
+            {
+                Gauge gauge;
+
+                _mutex.Lock();
+
+                Series* series = add(SERIES_GAUGE, name, help, labels);
+                if (nullptr != series)
+                {
+                    gauge._value = &(series->gauge);
+
+                    publish();
+                }
+
+                _mutex.Unlock();
+
+                return gauge;
+            }
+
+            // sampler runs on the thread rendering the registry, it must be safe to call from there
+            bool AddSampledGauge(const char* name, const char* help, const char* labels, const std::function<double()>& sampler)
+            {
+                _mutex.Lock();
+
+                Series* series = add(SERIES_SAMPLED, name, help, labels);
+                if (nullptr != series)
+                {
+                    series->sampler = sampler;
+
+                    publish();
+                }
+
+                _mutex.Unlock();
+
+                return nullptr != series;
+            }
+
+            // bounds are inclusive upper bounds in increasing order, at most IO_SIMPLIFY_LIBUV_METRICS_MAX_BUCKETS of them
+            Histogram AddHistogram(const char* name, const char* help, const char* labels, const uint64_t* bounds, size_t bound_count)
+            {
+                Histogram histogram;
+
+                if (bound_count > IO_SIMPLIFY_LIBUV_METRICS_MAX_BUCKETS)
+                {
+                    return histogram;
+                }
+
+                _mutex.Lock();
+
+                Series* series = _histogram_count < IO_SIMPLIFY_LIBUV_METRICS_MAX_HISTOGRAMS ? add(SERIES_HISTOGRAM, name, help, labels) : nullptr;
+                if (nullptr != series)
+                {
+                    series->slot = _histogram_count++;
+
+                    for (size_t i = 0; i < bound_count; ++i)
+                    {
+                        series->bounds[i] = bounds[i];
+                    }
+                    series->bound_count = (unsigned int)bound_count;
+
+                    histogram._registry = this;
+                    histogram._series = series;
+
+                    publish();
+                }
+
+                _mutex.Unlock();
+
+                return histogram;
+            }
+
+            /*
+                Writes every series to out, replacing its content. out keeps its capacity from one render to the next,
+                so a reused string stops allocating once it has grown to the size of the exposition.
+            */
+            void Render(std::string& out)
+            {
+                out.clear();
+
+                unsigned int count = _series_count.load(std::memory_order_acquire);
+
+                for (unsigned int i = 0; i < count; ++i)
+                {
+                    if (!_series[i].first_of_family)
+                    {
+                        continue;
+                    }
+
+                    static const char* TYPE_NAMES[] = {"counter", "gauge", "gauge", "histogram"};
+
+                    out.append("# HELP ");
+                    out.append(_series[i].name);
+                    out.push_back(' ');
+                    out.append(_series[i].help);
+                    out.append("\n# TYPE ");
+                    out.append(_series[i].name);
+                    out.push_back(' ');
+                    out.append(TYPE_NAMES[_series[i].type]);
+                    out.push_back('\n');
+
+                    for (unsigned int member = i; ; member = _series[member].next_of_family.load(std::memory_order_acquire))
+                    {
+                        Series& series = _series[member];
+
+                        switch (series.type)
+                        {
+                        case SERIES_COUNTER:
+                            {
+                                uint64_t value = 0;
+                                for (Shard* shard = _shards.load(std::memory_order_acquire); shard; shard = shard->next)
+                                {
+                                    value += shard->counters[series.slot].load(std::memory_order_relaxed);
+                                }
+
+                                appendName(out, series, "");
+                                appendNumber(out, value);
+                            }
+                            break;
+                        case SERIES_GAUGE:
+                            appendName(out, series, "");
+                            appendNumber(out, (int64_t)series.gauge.load(std::memory_order_relaxed));
+                            break;
+                        case SERIES_SAMPLED:
+                            appendName(out, series, "");
+                            appendNumber(out, series.sampler());
+                            break;
+                        case SERIES_HISTOGRAM:
+                            {
+                                uint64_t cumulative = 0;
+                                uint64_t sum = 0;
+
+                                for (Shard* shard = _shards.load(std::memory_order_acquire); shard; shard = shard->next)
+                                {
+                                    sum += shard->histograms[series.slot].sum.load(std::memory_order_relaxed);
+                                }
+
+                                for (unsigned int bucket = 0; bucket <= series.bound_count; ++bucket)
+                                {
+                                    for (Shard* shard = _shards.load(std::memory_order_acquire); shard; shard = shard->next)
+                                    {
+                                        cumulative += shard->histograms[series.slot].buckets[bucket].load(std::memory_order_relaxed);
+                                    }
+
+                                    char le[40] = "le=\"+Inf\"";
+                                    if (bucket < series.bound_count)
+                                    {
+                                        char* end = std::to_chars(le + 4, le + sizeof(le) - 2, series.bounds[bucket]).ptr;
+                                        end[0] = '"';
+                                        end[1] = '\0';
+                                    }
+
+                                    appendName(out, series, "_bucket", le);
+                                    appendNumber(out, cumulative);
+                                    out.push_back('\n');
+                                }
+
+                                appendName(out, series, "_sum");
+                                appendNumber(out, sum);
+                                out.push_back('\n');
+
+                                appendName(out, series, "_count");
+                                appendNumber(out, cumulative);
+                            }
+                            break;
+                        }
+
+                        out.push_back('\n');
+
+                        if (0 == series.next_of_family.load(std::memory_order_acquire))
+                        {
+                            break;
+                        }
+                    }
+                }
+            }
+
+        private:
+            MetricsRegistry(const MetricsRegistry&) = delete;
+            MetricsRegistry& operator=(const MetricsRegistry&) = delete;
+
+            MetricsRegistry(MetricsRegistry&&) = delete;
+            MetricsRegistry& operator=(MetricsRegistry&&) = delete;
+        };
+
+        /*
+            Samples one loop into a registry from that loop's own thread, every interval milliseconds: handles,
+            active handles and requests, bytes waiting in the write queues of its streams, arena blocks and chunks,
+            and how late the sampling timer fires (a histogram of loop lag in microseconds). Several loops can share
+            a registry with different labels.
+
+            Watch adds the series of one handle, sampled along: a TcpHandle's write queue (and the bytes it moved
+            when the trace counters are compiled in), an AsyncHandle's pending, posted and executed callbacks.
+            Every Watch registers series for good, so watch long-lived handles, not every connection, and Unwatch
+            a handle before closing it.
+        */
+        class LoopMetrics
+        {
+        public:
+            using CallbackLoopMetricsClosed = std::function<void()>;
+
+        private:
+            Loop* _loop;
+            TimerHandle _timer;
+
+            uint64_t _interval;
+            uint64_t _expected; // uv_hrtime() the next sample is due
+
+            MetricsRegistry::Gauge _handles;
+            MetricsRegistry::Gauge _active_handles;
+            MetricsRegistry::Gauge _active_requests;
+            MetricsRegistry::Gauge _arena_live;
+            MetricsRegistry::Gauge _arena_chunks;
+            MetricsRegistry::Gauge _write_queue;
+            MetricsRegistry::Histogram _lag;
+
+            MetricsRegistry* _registry;
+
+            struct WatchedTcp
+            {
+                const TcpHandle* handle;
+
+                MetricsRegistry::Gauge write_queue;
+
+#if defined(IO_SIMPLIFY_LIBUV_TRACE)
+                MetricsRegistry::Counter bytes_in;
+                MetricsRegistry::Counter bytes_out;
+                uint64_t sampled_in;
+                uint64_t sampled_out;
+#endif
+            };
+
+            struct WatchedAsync
+            {
+                AsyncHandle* handle;
+
+                MetricsRegistry::Gauge pending;
+                MetricsRegistry::Counter posted;
+                MetricsRegistry::Counter executed;
+                uint64_t sampled_posted;
+                uint64_t sampled_executed;
+            };
+
+            std::vector<WatchedTcp> _tcp_handles;
+            std::vector<WatchedAsync> _async_handles;
+
+            AsyncHandle::Statistics _async_statistics; // kept to reuse its histograms' storage
+
+        private:
+            struct Walked
+            {
+                int64_t handles = 0;
+                int64_t write_queue = 0;
+            };
+
+            // counters only go up, a value below the last sample means its source was reset
+            static void addSampled(const MetricsRegistry::Counter& counter, uint64_t value, uint64_t& sampled)
+            {
+                counter.Add(value >= sampled ? value - sampled : value);
+                sampled = value;
+            }
+
+            void sample()
+            {
+                uint64_t now = uv_hrtime();
+
+                _lag.Observe(now > _expected ? (now - _expected) / 1000 : 0);
+                _expected = now + _interval * 1000000;
+
+                Walked walked;
+
+                uv_walk(_loop->uv, [] (uv_handle_t* handle, void* arg) {
+                    Walked* walked = (Walked*)arg;
+
+                    ++walked->handles;
+
+                    uv_handle_type type = uv_handle_get_type(handle);
+                    if (UV_TCP == type || UV_NAMED_PIPE == type || UV_TTY == type)
+                    {
+                        walked->write_queue += (int64_t)uv_stream_get_write_queue_size((const uv_stream_t*)handle);
+                    }
+                }, &walked);
+
+                _handles.Set(walked.handles);
+                _write_queue.Set(walked.write_queue);
+                _active_handles.Set((int64_t)_loop->uv->active_handles);
+                _active_requests.Set((int64_t)_loop->uv->active_reqs.count);
+
+                const LoopArena::Statistics& arena = _loop->arena.GetStatistics();
+                _arena_live.Set((int64_t)arena.live);
+                _arena_chunks.Set((int64_t)arena.chunks);
+
+                for (WatchedTcp& watched : _tcp_handles)
+                {
+                    watched.write_queue.Set((int64_t)uv_stream_get_write_queue_size((const uv_stream_t*)(watched.handle->uv)));
+
+#if defined(IO_SIMPLIFY_LIBUV_TRACE)
+                    addSampled(watched.bytes_in, watched.handle->trace.bytes_in, watched.sampled_in);
+                    addSampled(watched.bytes_out, watched.handle->trace.bytes_out, watched.sampled_out);
+#endif
+                }
+
+                for (WatchedAsync& watched : _async_handles)
+                {
+                    watched.handle->Snapshot(_async_statistics);
+
+                    watched.pending.Set((int64_t)_async_statistics.pending);
+                    addSampled(watched.posted, _async_statistics.posted, watched.sampled_posted);
+                    addSampled(watched.executed, _async_statistics.executed, watched.sampled_executed);
+                }
+            }
+
+        public:
+            LoopMetrics(Loop* loop, MetricsRegistry* registry, const char* labels = nullptr, uint64_t interval = 1000)
+                : _loop(loop)
+                , _timer(loop)
+
+                , _interval(interval)
+                , _expected(0)
+
+                , _handles(registry->AddGauge("uv_loop_handles", "Handles on the loop, closing ones included.", labels))
+                , _active_handles(registry->AddGauge("uv_loop_active_handles", "Active handles on the loop.", labels))
+                , _active_requests(registry->AddGauge("uv_loop_active_requests", "Requests in flight on the loop.", labels))
+                , _arena_live(registry->AddGauge("uv_loop_arena_live_blocks", "Loop arena blocks not freed yet.", labels))
+                , _arena_chunks(registry->AddGauge("uv_loop_arena_chunks", "Chunks held by the loop arena.", labels))
+                , _write_queue(registry->AddGauge("uv_loop_write_queue_bytes", "Bytes waiting in the write queues of the loop's streams.", labels))
+                , _lag()
+
+                , _registry(registry)
+
+                , _tcp_handles()
+                , _async_handles()
+
+                , _async_statistics()
+            {
+                static const uint64_t LAG_BOUNDS[] = {100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000};
+
+                _lag = registry->AddHistogram("uv_loop_lag_microseconds", "How late the loop ran its sampling timer.", labels,
+                    LAG_BOUNDS, sizeof(LAG_BOUNDS) / sizeof(LAG_BOUNDS[0]));
+            }
+
+            ~LoopMetrics()
+            {
+            }
+
+            int Start()
+            {
+                _expected = uv_hrtime() + _interval * 1000000;
+
+                return _timer.Start([this] () { sample(); }, _interval, _interval);
+            }
+
+            // loop thread only, labels tell the handle apart from the others of the loop
+            void Watch(const TcpHandle* handle, const char* labels)
+            {
+                WatchedTcp watched;
+                watched.handle = handle;
+
+                watched.write_queue = _registry->AddGauge("uv_tcp_write_queue_bytes", "Bytes waiting in the handle's write queue.", labels);
+
+#if defined(IO_SIMPLIFY_LIBUV_TRACE)
+                watched.bytes_in = _registry->AddCounter("uv_tcp_received_bytes_total", "Bytes read by the handle.", labels);
+                watched.bytes_out = _registry->AddCounter("uv_tcp_sent_bytes_total", "Bytes written by the handle.", labels);
+                watched.sampled_in = 0;
+                watched.sampled_out = 0;
+#endif
+
+                _tcp_handles.push_back(watched);
+            }
+
+            void Watch(AsyncHandle* handle, const char* labels)
+            {
+                WatchedAsync watched;
+                watched.handle = handle;
+
+                watched.pending = _registry->AddGauge("uv_async_pending", "Callbacks queued on the handle and not yet drained.", labels);
+                watched.posted = _registry->AddCounter("uv_async_posted_total", "Callbacks posted to the handle.", labels);
+                watched.executed = _registry->AddCounter("uv_async_executed_total", "Callbacks the handle ran.", labels);
+                watched.sampled_posted = 0;
+                watched.sampled_executed = 0;
+
+                _async_handles.push_back(watched);
+            }
+
+            // the handle's series keep their last values
+            void Unwatch(const void* handle)
+            {
+                for (size_t i = 0; i < _tcp_handles.size(); ++i)
+                {
+                    if (_tcp_handles[i].handle == handle)
+                    {
+                        _tcp_handles.erase(_tcp_handles.begin() + i);
+                        return;
+                    }
+                }
+
+                for (size_t i = 0; i < _async_handles.size(); ++i)
+                {
+                    if (_async_handles[i].handle == handle)
+                    {
+                        _async_handles.erase(_async_handles.begin() + i);
+                        return;
+                    }
+                }
+            }
+
+            void Close(const CallbackLoopMetricsClosed& callback_loop_metrics_closed = nullptr)
+            {
+                _timer.Close(callback_loop_metrics_closed);
+            }
+
+        private:
+            LoopMetrics() = delete;
+
+            LoopMetrics(const LoopMetrics&) = delete;
+            LoopMetrics& operator=(const LoopMetrics&) = delete;
+
+            LoopMetrics(LoopMetrics&&) = delete;
+            LoopMetrics& operator=(LoopMetrics&&) = delete;
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef IO_SIMPLIFY_LIBUV_METRICS_SERVER_H
+#define IO_SIMPLIFY_LIBUV_METRICS_SERVER_H
+
+#include "libuv_loop.h"
+
+#include "libuv_http_server.h"
+#include "libuv_metrics.h"
+
+#include <string>
+
+namespace io_simplify {
+
+    namespace libuv {
+
+        /*
+            Serves a MetricsRegistry over HTTP for Prometheus to scrape, on any loop: the one it measures, or a dedicated
+            one so a busy loop cannot delay its own scrapes.
+
+            A scrape renders into one string kept by the server and copied into the connection's output, both of which
+            keep their capacity, so once warm a scrape allocates nothing. Rendering only reads relaxed atomics (and calls
+            the sampled gauges), it never waits for the threads updating the registry.
+        */
+        class MetricsServer
+        {
+        public:
+            using CallbackServerClosed = HttpServer::CallbackServerClosed;
+
+        private:
+            HttpServer _server;
+            MetricsRegistry* _registry;
+
+            std::string _path;
+            std::string _exposition;
+
+            uint64_t _scrapes;
+
+        private:
+            void request(HttpServer::Connection* connection, const HttpRequest& request)
+            {
+                std::string_view target = request.target;
+
+                size_t query = target.find('?');
+                if (std::string_view::npos != query)
+                {
+                    target = target.substr(0, query);
+                }
+
+                if (target != _path)
+                {
+                    connection->Respond(404, "not found\n");
+                    return;
+                }
+
+                bool head = request.method == "HEAD";
+                if (request.method != "GET" && !head)
+                {
+                    static const HttpHeader ALLOW[] = {
+                        {"Allow", "GET, HEAD"},
+                    };
+
+                    connection->Respond(405, "method not allowed\n", ALLOW, 1);
+                    return;
+                }
+
+                // HEAD renders too, for the Content-Length, but is not a scrape
+                if (!head)
+                {
+                    ++_scrapes;
+                }
+
+                _registry->Render(_exposition);
+
+                static const HttpHeader HEADERS[] = {
+                    {"Content-Type", "text/plain; version=0.0.4; charset=utf-8"},
+                };
+
+                connection->Respond(200, _exposition, HEADERS, 1);
+            }
+
+        public:
+            MetricsServer(Loop* loop, MetricsRegistry* registry, const char* path = "/metrics")
+                : _server(loop, 8192, 0, 4 * 1024 * 1024)
+                , _registry(registry)
+
+                , _path(path)
+                , _exposition()
+
+                , _scrapes(0)
+            {
+            }
+
+            ~MetricsServer()
+            {
+            }
+
+            int Listen(const Endpoint& endpoint, int backlog = 16)
+            {
+                return _server.Listen(endpoint, [this] (HttpServer::Connection* connection, const HttpRequest& http_request) {
+                    request(connection, http_request);
+                }, backlog);
+            }
+
+            uint64_t Scrapes() const
+            {
+                return _scrapes;
+            }
+
+            void Close(const CallbackServerClosed& callback_server_closed = nullptr)
+            {
+                _server.Close(callback_server_closed);
+            }
+
+        private:
+            MetricsServer() = delete;
+
+            MetricsServer(const MetricsServer&) = delete;
+            MetricsServer& operator=(const MetricsServer&) = delete;
+
+            MetricsServer(MetricsServer&&) = delete;
+            MetricsServer& operator=(MetricsServer&&) = delete;
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef IO_SIMPLIFY_LIBUV_POLL_HANDLE_H
+#define IO_SIMPLIFY_LIBUV_POLL_HANDLE_H
+
+#include "libuv_loop.h"
+
+#include "libuv_handle.h"
+
+namespace io_simplify {
+
+    namespace libuv {
+
+        /*
+            Poll handles are used to watch file descriptors for readability, writability and disconnection similar to the purpose of poll(2).
+
+            The user should not close a file descriptor while it is being polled by an active poll handle.
+            Do not poll a descriptor that another handle of the same loop already watches (e.g. the socket of a TcpHandle):
+            poll a dup() of it instead, which gets its own epoll registration.
+        */
+        class PollHandle : public Handle<uv_poll_t>
+        {
+        public:
+            // events is a bitmask of UV_READABLE, UV_WRITABLE, UV_DISCONNECT, UV_PRIORITIZED
+            using CallbackPoll = std::function<void(int status, int events)>;
+
+        private:
+            CallbackPoll _callback_poll;
+
+        private:
+            static void callback_uv_poll(uv_poll_t* handle, int status, int events)
+            {
+                PollHandle* poll_handle = (PollHandle*)(handle->data);
+
+                LIBUV_WATCHDOG_CALLBACK(poll_handle, TRACE_CALLBACK_POLL);
+
+                poll_handle->_callback_poll(status, events);
+            }
+
+        public:
+            PollHandle(Loop* loop, int fd)
+                : Handle<uv_poll_t>(loop)
+
+                , _callback_poll()
+            {
+                Handle<uv_poll_t>::status = uv_poll_init(loop->uv, Handle<uv_poll_t>::uv, fd);
+            }
+
+            ~PollHandle()
+            {
+            }
+
+            // calling Start again on an active handle only updates the events mask and callback
+            int Start(int events, const CallbackPoll& callback_poll)
+            {
+                _callback_poll = callback_poll;
+
+                return uv_poll_start(Handle<uv_poll_t>::uv, events, callback_uv_poll);
+            }
+
+            int Stop()
+            {
+                return uv_poll_stop(Handle<uv_poll_t>::uv);
+            }
+
+        private:
+            PollHandle() = delete;
+
+            PollHandle(const PollHandle&) = delete;
+            PollHandle& operator=(const PollHandle&) = delete;
+
+            PollHandle(PollHandle&&) = delete;
+            PollHandle& operator=(PollHandle&&) = delete;
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef IO_SIMPLIFY_LIBUV_PREPARE_HANDLE_H
+#define IO_SIMPLIFY_LIBUV_PREPARE_HANDLE_H
+
+#include "libuv_loop.h"
+
+#include "libuv_handle.h"
+
+namespace io_simplify {
+
+    namespace libuv {
+
+        /*
+            Prepare handles will run the given callback once per loop iteration, right before polling for i/o.
+        */
+        class PrepareHandle : public Handle<uv_prepare_t>
+        {
+        public:
+            using CallbackPrepare = std::function<void()>;
+
+        private:
+            CallbackPrepare _callback_prepare;
+
+        private:
+            static void callback_uv_prepare(uv_prepare_t* handle)
+            {
+                PrepareHandle* prepare_handle = (PrepareHandle*)(handle->data);
+
+                LIBUV_WATCHDOG_CALLBACK(prepare_handle, TRACE_CALLBACK_PREPARE);
+
+                prepare_handle->_callback_prepare();
+            }
+
+        public:
+            explicit PrepareHandle(Loop* loop)
+                : Handle<uv_prepare_t>(loop)
+
+                , _callback_prepare()
+            {
+                Handle<uv_prepare_t>::status = uv_prepare_init(loop->uv, Handle<uv_prepare_t>::uv);
+            }
+
+            ~PrepareHandle()
+            {
+            }
+
+            int Start(const CallbackPrepare& callback_prepare)
+            {
+                _callback_prepare = callback_prepare;
+
+                return uv_prepare_start(Handle<uv_prepare_t>::uv, callback_uv_prepare);
+            }
+
+            void Stop()
+            {
+                uv_prepare_stop(Handle<uv_prepare_t>::uv);
+            }
+
+            bool IsActive() const
+            {
+                return 0 != uv_is_active((const uv_handle_t*)(Handle<uv_prepare_t>::uv));
+            }
+
+        private:
+            PrepareHandle() = delete;
+
+            PrepareHandle(const PrepareHandle&) = delete;
+            PrepareHandle& operator=(const PrepareHandle&) = delete;
+
+            PrepareHandle(PrepareHandle&&) = delete;
+            PrepareHandle& operator=(PrepareHandle&&) = delete;
+        };
+    }
+}
+
+#endif
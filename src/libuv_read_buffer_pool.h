@@ -0,0 +1,243 @@
+#ifndef IO_SIMPLIFY_LIBUV_READ_BUFFER_POOL_H
+#define IO_SIMPLIFY_LIBUV_READ_BUFFER_POOL_H
+
+#include "libuv_base.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+namespace io_simplify {
+
+    namespace libuv {
+
+        /*
+            What a connection remembers of its reads between them: an average of its recent nread and the size class it
+            gets its next buffer from. The only read state an idle connection keeps.
+        */
+        struct ReadBufferSizing
+        {
+            uint32_t average = 0; // nread, exponentially weighted over the last reads
+            uint8_t size_class = 0xff; // unset: the pool's initial class
+        };
+
+        /*
+            Read buffers of one loop's connections (see TcpHandle::StartAdaptiveRead), lent for a single read: allocated in
+            the alloc callback, taken back right after the read callback returned. Between reads a connection holds no
+            buffer at all, so a million idle connections cost their handles and nothing more.
+
+            Buffers come in power-of-two size classes from MIN_SIZE to MAX_SIZE. Each connection moves between them on its
+            own reads: a read that fills its buffer moves it one class up at once, since more is likely waiting, while it
+            moves down one class at a time, once the average of its reads would fill no more than half of the smaller
+            class, so neither one short read nor a stream hovering at a class boundary makes it shrink back and forth.
+
+            Returned buffers are kept per class for the next reads, at most max_free of each; Trim releases them all, e.g.
+            from a timer when the loop has gone quiet. Not thread-safe: loop thread only.
+        */
+        class ReadBufferPool
+        {
+        public:
+            static constexpr unsigned MIN_SHIFT = 9;
+            static constexpr unsigned CLASSES = 8;
+
+            static constexpr size_t MIN_SIZE = size_t(1) << MIN_SHIFT; // 512 bytes
+            static constexpr size_t MAX_SIZE = MIN_SIZE << (CLASSES - 1); // 64 KiB, libuv's suggested size
+
+            struct Statistics
+            {
+                uint64_t allocations = 0;
+                uint64_t reuses = 0; // allocations served from a kept buffer
+                uint64_t grows = 0;
+                uint64_t shrinks = 0;
+
+                size_t lent = 0; // buffers inside a read right now
+                size_t kept = 0; // buffers waiting for the next reads
+                size_t kept_bytes = 0;
+            };
+
+        private:
+            struct FreeBuffer
+            {
+                FreeBuffer* next;
+            };
+
+        private:
+            size_t _max_free;
+            uint8_t _initial_class;
+
+            FreeBuffer* _free[CLASSES];
+            size_t _free_count[CLASSES];
+
+            Statistics _statistics;
+
+        private:
+            static size_t classSize(unsigned size_class)
+            {
+                return MIN_SIZE << size_class;
+            }
+
+            // smallest class holding size bytes
+            static uint8_t classOf(size_t size)
+            {
+                uint8_t size_class = 0;
+                while (size_class + 1 < CLASSES && classSize(size_class) < size)
+                {
+                    ++size_class;
+                }
+                return size_class;
+            }
+
+        public:
+            /*
+                initial_size: buffer size for a connection's first read, rounded up to a class.
+                max_free: returned buffers kept per class.
+            */
+            explicit ReadBufferPool(size_t initial_size = 2048, size_t max_free = 64)
+                : _max_free(max_free)
+                , _initial_class(classOf(initial_size))
+
+                , _free()
+                , _free_count()
+
+                , _statistics()
+            {
+            }
+
+            ~ReadBufferPool()
+            {
+                Trim();
+            }
+
+            void Allocate(ReadBufferSizing& sizing, uv_buf_t* buf)
+            {
+                if (sizing.size_class >= CLASSES)
+                {
+                    sizing.size_class = _initial_class;
+                    sizing.average = (uint32_t)classSize(_initial_class) / 2;
+                }
+
+                unsigned size_class = sizing.size_class;
+
+                ++_statistics.allocations;
+
+                FreeBuffer* buffer = _free[size_class];
+                if (nullptr != buffer)
+                {
+                    _free[size_class] = buffer->next;
+                    --_free_count[size_class];
+
+                    ++_statistics.reuses;
+                    --_statistics.kept;
+                    _statistics.kept_bytes -= classSize(size_class);
+                }
+                else
+                {
+                    buffer = (FreeBuffer*)malloc(classSize(size_class));
+                }
+
+                if (nullptr == buffer)
+                {
+                    // libuv reports UV_ENOBUFS to the read callback
+                    *buf = uv_buf_init(nullptr, 0);
+                    return;
+                }
+
+                ++_statistics.lent;
+
+                *buf = uv_buf_init((char*)buffer, (unsigned int)classSize(size_class));
+            }
+
+            // after the read callback, which must have consumed or copied the data
+            void Release(ReadBufferSizing& sizing, ssize_t nread, const uv_buf_t* buf)
+            {
+                if (nullptr == buf->base)
+                {
+                    return;
+                }
+
+                --_statistics.lent;
+
+                unsigned size_class = classOf(buf->len);
+
+                if (_free_count[size_class] < _max_free)
+                {
+                    FreeBuffer* buffer = (FreeBuffer*)(buf->base);
+
+                    buffer->next = _free[size_class];
+                    _free[size_class] = buffer;
+                    ++_free_count[size_class];
+
+                    ++_statistics.kept;
+                    _statistics.kept_bytes += classSize(size_class);
+                }
+                else
+                {
+                    free(buf->base);
+                }
+
+                if (nread <= 0)
+                {
+                    // EAGAIN, EOF and errors say nothing about the stream's read sizes
+                    return;
+                }
+
+                // weight 1/4 on the latest read
+                sizing.average = (uint32_t)(((uint64_t)sizing.average * 3 + (uint64_t)nread) / 4);
+
+                if ((size_t)nread >= buf->len)
+                {
+                    if (sizing.size_class + 1u < CLASSES)
+                    {
+                        ++sizing.size_class;
+                        ++_statistics.grows;
+                    }
+
+                    // the stream reads at least this much, as far as it can tell
+                    if (sizing.average < (uint32_t)buf->len)
+                    {
+                        sizing.average = (uint32_t)buf->len;
+                    }
+                }
+                else if (sizing.size_class > 0 && sizing.average <= classSize(sizing.size_class - 1) / 2)
+                {
+                    --sizing.size_class;
+                    ++_statistics.shrinks;
+                }
+            }
+
+            // releases every kept buffer, lent ones come back as usual
+            void Trim()
+            {
+                for (unsigned size_class = 0; size_class < CLASSES; ++size_class)
+                {
+                    while (nullptr != _free[size_class])
+                    {
+                        FreeBuffer* next = _free[size_class]->next;
+
+                        free(_free[size_class]);
+
+                        _free[size_class] = next;
+                    }
+                    _free_count[size_class] = 0;
+                }
+
+                _statistics.kept = 0;
+                _statistics.kept_bytes = 0;
+            }
+
+            const Statistics& GetStatistics() const
+            {
+                return _statistics;
+            }
+
+        private:
+            ReadBufferPool(const ReadBufferPool&) = delete;
+            ReadBufferPool& operator=(const ReadBufferPool&) = delete;
+
+            ReadBufferPool(ReadBufferPool&&) = delete;
+            ReadBufferPool& operator=(ReadBufferPool&&) = delete;
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,745 @@
+#ifndef IO_SIMPLIFY_LIBUV_RPC_CLIENT_H
+#define IO_SIMPLIFY_LIBUV_RPC_CLIENT_H
+
+#include "libuv_loop.h"
+
+#include "libuv_deferred_queue.h"
+#include "libuv_tcp_handle.h"
+#include "libuv_timer_handle.h"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace io_simplify {
+
+    namespace libuv {
+
+        /*
+            Pipelined request/response client: any number of requests in flight on one TcpHandle, answered in any order.
+
+            Every message is a frame of an 8-byte header, the body length and the request id (both 32-bit big endian),
+            followed by the body; the server answers a request with a frame carrying the same id. The id is the request's
+            slot in a table sized at construction (low 16 bits) and the slot's generation (high 16 bits), so a response
+            finds its request with one index, and a response arriving after its request timed out is recognized and
+            dropped. Slots and their callbacks are reused, deadlines sit in a heap indexed from the slots; a call
+            allocates nothing once the client is warm.
+
+            Requests are appended to one output buffer and written once per loop iteration, after its i/o callbacks
+            (DeferredQueue), so a burst of calls leaves in one write; while a write is in flight the next batch builds up.
+
+            CallbackResponse gets 0 and the response body, which is only valid during the call, or a negative status:
+            UV_ETIMEDOUT past the deadline, UV_ECANCELED on Close, the connection's error when it failed (reported once
+            to CallbackDisconnected as well). A failed client stays failed: Close it and make a new one.
+            Loop thread only.
+        */
+        class RpcClient
+        {
+        public:
+            using CallbackResponse = std::function<void(int status, const char* data, size_t size)>;
+            using CallbackConnected = std::function<void(int status)>;
+            using CallbackDisconnected = std::function<void(int status)>;
+            using CallbackClientClosed = std::function<void()>;
+
+            static constexpr size_t HEADER_SIZE = 8;
+            static constexpr size_t MAX_IN_FLIGHT = 65536;
+
+            struct Statistics
+            {
+                uint64_t calls = 0;
+                uint64_t responses = 0;
+                uint64_t timeouts = 0;
+                uint64_t late = 0; // responses to requests that had timed out
+                uint64_t failed = 0; // requests failed by the connection or Close
+                uint64_t writes = 0; // batches written
+                uint64_t written_bytes = 0;
+
+                size_t in_flight = 0;
+            };
+
+        private:
+            static constexpr size_t INPUT_INITIAL = 16 * 1024;
+            static constexpr size_t INPUT_MIN_READ = 4 * 1024;
+
+            static constexpr uint32_t NO_SLOT = 0xffffffff;
+
+            struct Slot
+            {
+                CallbackResponse callback_response;
+                uint64_t deadline; // loop time in milliseconds
+                uint32_t heap_index;
+                uint16_t generation;
+                bool busy;
+            };
+
+            struct OutputRequest : public TcpHandle::WriteRequest
+            {
+                RpcClient* client;
+            };
+
+        private:
+            Loop* _loop;
+
+            TcpHandle _tcp;
+            TimerHandle _timer;
+            DeferredQueue _deferred;
+
+            uv_connect_t _connect;
+
+            uint64_t _default_timeout;
+            size_t _max_pending_output;
+            size_t _max_response;
+
+            std::vector<Slot> _slots;
+            std::vector<uint32_t> _free_slots;
+            std::vector<uint32_t> _deadlines; // min-heap of slot indices by deadline
+
+            // requests are appended to _output, _writing is in flight; swapped so both keep their capacity
+            std::string _output;
+            std::string _writing;
+            OutputRequest _output_request;
+
+            // unparsed input is [_input_begin, _input_end)
+            char* _input;
+            size_t _input_capacity;
+            size_t _input_begin;
+            size_t _input_end;
+            size_t _input_required;
+
+            CallbackConnected _callback_connected;
+            CallbackDisconnected _callback_disconnected;
+
+            Statistics _statistics;
+
+            int _error;
+            bool _connected;
+            bool _reading;
+            bool _flush_deferred;
+            bool _timer_armed;
+
+            bool _closing;
+            int _closing_handles;
+            CallbackClientClosed _callback_client_closed;
+
+        private:
+            static void callback_output_written(TcpHandle::WriteRequest* write_request, int status)
+            {
+                ((OutputRequest*)(write_request))->client->written(status);
+            }
+
+            static void putUint32(char* p, uint32_t value)
+            {
+                p[0] = (char)(value >> 24);
+                p[1] = (char)(value >> 16);
+                p[2] = (char)(value >> 8);
+                p[3] = (char)(value);
+            }
+
+            static uint32_t getUint32(const char* p)
+            {
+                const unsigned char* u = (const unsigned char*)p;
+
+                return ((uint32_t)u[0] << 24) | ((uint32_t)u[1] << 16) | ((uint32_t)u[2] << 8) | (uint32_t)u[3];
+            }
+
+            bool deadlineBefore(uint32_t a, uint32_t b) const
+            {
+                return _slots[a].deadline < _slots[b].deadline;
+            }
+
+            void heapSet(size_t position, uint32_t slot)
+            {
+                _deadlines[position] = slot;
+                _slots[slot].heap_index = (uint32_t)position;
+            }
+
+            void heapUp(size_t position)
+            {
+                uint32_t slot = _deadlines[position];
+                while (position > 0)
+                {
+                    size_t parent = (position - 1) / 2;
+                    if (!deadlineBefore(slot, _deadlines[parent]))
+                    {
+                        break;
+                    }
+
+                    heapSet(position, _deadlines[parent]);
+                    position = parent;
+                }
+                heapSet(position, slot);
+            }
+
+            void heapDown(size_t position)
+            {
+                uint32_t slot = _deadlines[position];
+                size_t size = _deadlines.size();
+                while (true)
+                {
+                    size_t child = position * 2 + 1;
+                    if (child >= size)
+                    {
+                        break;
+                    }
+
+                    if (child + 1 < size && deadlineBefore(_deadlines[child + 1], _deadlines[child]))
+                    {
+                        ++child;
+                    }
+
+                    if (!deadlineBefore(_deadlines[child], slot))
+                    {
+                        break;
+                    }
+
+                    heapSet(position, _deadlines[child]);
+                    position = child;
+                }
+                heapSet(position, slot);
+            }
+
+            void heapRemove(uint32_t slot)
+            {
+                size_t position = _slots[slot].heap_index;
+                uint32_t last = _deadlines.back();
+
+                _deadlines.pop_back();
+
+                if (position < _deadlines.size())
+                {
+                    heapSet(position, last);
+                    heapUp(position);
+                    heapDown(_slots[last].heap_index);
+                }
+            }
+
+            // frees the slot first, so the callback may call again
+            void complete(uint32_t index, int status, const char* data, size_t size)
+            {
+                Slot& slot = _slots[index];
+
+                CallbackResponse callback_response = std::move(slot.callback_response);
+                slot.callback_response = nullptr;
+                slot.busy = false;
+                ++slot.generation;
+
+                heapRemove(index);
+                _free_slots.push_back(index);
+
+                --_statistics.in_flight;
+
+                callback_response(status, data, size);
+            }
+
+            void failAll(int status)
+            {
+                for (uint32_t index = 0; index < _slots.size(); ++index)
+                {
+                    if (_slots[index].busy)
+                    {
+                        ++_statistics.failed;
+
+                        complete(index, status, nullptr, 0);
+                    }
+                }
+            }
+
+            void fail(int status)
+            {
+                if (0 != _error)
+                {
+                    return;
+                }
+
+                _error = status;
+
+                stopRead();
+                _output.clear();
+
+                failAll(status);
+
+                if (_callback_disconnected && !_closing)
+                {
+                    _callback_disconnected(status);
+                }
+            }
+
+            void armTimer()
+            {
+                if (_closing)
+                {
+                    return;
+                }
+
+                if (_deadlines.empty())
+                {
+                    if (_timer_armed)
+                    {
+                        _timer.Stop();
+                        _timer_armed = false;
+                    }
+                    return;
+                }
+
+                uint64_t now = uv_now(_loop->uv);
+                uint64_t deadline = _slots[_deadlines[0]].deadline;
+
+                _timer.Start([this] () { expire(); }, deadline > now ? deadline - now : 0);
+                _timer_armed = true;
+            }
+
+            void expire()
+            {
+                _timer_armed = false;
+
+                uint64_t now = uv_now(_loop->uv);
+
+                while (!_deadlines.empty() && !_closing && _slots[_deadlines[0]].deadline <= now)
+                {
+                    ++_statistics.timeouts;
+
+                    complete(_deadlines[0], UV_ETIMEDOUT, nullptr, 0);
+                }
+
+                armTimer();
+            }
+
+            void connected(int status)
+            {
+                if (_closing)
+                {
+                    return;
+                }
+
+                if (status < 0)
+                {
+                    fail(status);
+                }
+                else
+                {
+                    _connected = true;
+
+                    _reading = (0 == _tcp.StartRead(
+                        [this] (ssize_t nread, const uv_buf_t*) { read(nread); },
+                        [this] (size_t, uv_buf_t* buf) { alloc(buf); }));
+
+                    flush();
+                }
+
+                if (_callback_connected)
+                {
+                    _callback_connected(status);
+                }
+            }
+
+            void alloc(uv_buf_t* buf)
+            {
+                size_t unparsed = _input_end - _input_begin;
+
+                if (_input_begin > 0 && _input_capacity - _input_end < INPUT_MIN_READ)
+                {
+                    memmove(_input, _input + _input_begin, unparsed);
+
+                    _input_begin = 0;
+                    _input_end = unparsed;
+                }
+
+                size_t wanted = _input_end + INPUT_MIN_READ;
+                if (_input_required > unparsed)
+                {
+                    wanted = _input_end + (_input_required - unparsed);
+                }
+
+                if (wanted > _input_capacity)
+                {
+                    size_t capacity = _input_capacity > 0 ? _input_capacity * 2 : INPUT_INITIAL;
+                    if (capacity < wanted)
+                    {
+                        capacity = wanted;
+                    }
+
+                    char* input = (char*)realloc(_input, capacity);
+                    if (nullptr == input)
+                    {
+                        // libuv reports UV_ENOBUFS to the read callback
+                        buf->base = nullptr;
+                        buf->len = 0;
+                        return;
+                    }
+
+                    _input = input;
+                    _input_capacity = capacity;
+                }
+
+                buf->base = _input + _input_end;
+                buf->len = _input_capacity - _input_end;
+            }
+
+            void read(ssize_t nread)
+            {
+                if (nread > 0)
+                {
+                    _input_end += nread;
+
+                    process();
+                }
+                else if (nread < 0)
+                {
+                    fail(UV_EOF == nread ? UV_ECONNRESET : (int)nread);
+                }
+            }
+
+            void process()
+            {
+                while (!_closing && 0 == _error)
+                {
+                    size_t unparsed = _input_end - _input_begin;
+                    if (unparsed < HEADER_SIZE)
+                    {
+                        _input_required = HEADER_SIZE;
+                        break;
+                    }
+
+                    const char* frame = _input + _input_begin;
+
+                    size_t size = getUint32(frame);
+                    if (size > _max_response)
+                    {
+                        fail(UV_EPROTO);
+                        return;
+                    }
+
+                    if (unparsed < HEADER_SIZE + size)
+                    {
+                        _input_required = HEADER_SIZE + size;
+                        break;
+                    }
+
+                    _input_begin += HEADER_SIZE + size;
+                    _input_required = 0;
+
+                    uint32_t id = getUint32(frame + 4);
+                    uint32_t index = id & 0xffff;
+
+                    if (index < _slots.size() && _slots[index].busy && _slots[index].generation == (uint16_t)(id >> 16))
+                    {
+                        ++_statistics.responses;
+
+                        complete(index, 0, frame + HEADER_SIZE, size);
+                    }
+                    else
+                    {
+                        ++_statistics.late;
+                    }
+                }
+
+                if (_input_begin == _input_end)
+                {
+                    _input_begin = 0;
+                    _input_end = 0;
+                }
+
+                // responses usually leave the earliest deadline behind
+                armTimer();
+            }
+
+            void stopRead()
+            {
+                if (_reading)
+                {
+                    _tcp.StopRead();
+                    _reading = false;
+                }
+            }
+
+            void flush()
+            {
+                if (_closing || 0 != _error || !_connected || !_writing.empty() || _output.empty())
+                {
+                    return;
+                }
+
+                _writing.swap(_output);
+
+                uv_buf_t buf = uv_buf_init(_writing.data(), (unsigned int)_writing.size());
+
+                int res = _tcp.Write(&_output_request, &buf, 1);
+                if (res < 0)
+                {
+                    _writing.clear();
+
+                    fail(res);
+                    return;
+                }
+
+                ++_statistics.writes;
+                _statistics.written_bytes += buf.len;
+            }
+
+            void written(int status)
+            {
+                _writing.clear();
+
+                if (_closing)
+                {
+                    return;
+                }
+
+                if (status < 0)
+                {
+                    fail(status);
+                    return;
+                }
+
+                // the batch built up during the write
+                flush();
+            }
+
+            void deferFlush()
+            {
+                if (_flush_deferred)
+                {
+                    return;
+                }
+
+                _flush_deferred = true;
+
+                _deferred.Defer([this] () {
+                    _flush_deferred = false;
+
+                    flush();
+                });
+            }
+
+        public:
+            /*
+                max_in_flight: slots in the request table, at most MAX_IN_FLIGHT.
+                default_timeout: deadline in milliseconds of calls that give none.
+                max_pending_output: Call fails with UV_EAGAIN while more than this is waiting to be written.
+                max_response: larger response bodies are a protocol error (UV_EPROTO).
+            */
+            RpcClient(Loop* loop, size_t max_in_flight = 4096, uint64_t default_timeout = 5000,
+                size_t max_pending_output = 4 * 1024 * 1024, size_t max_response = 16 * 1024 * 1024)
+                : _loop(loop)
+
+                , _tcp(loop)
+                , _timer(loop)
+                , _deferred(loop)
+
+                , _connect()
+
+                , _default_timeout(default_timeout)
+                , _max_pending_output(max_pending_output)
+                , _max_response(max_response)
+
+                , _slots(max_in_flight < MAX_IN_FLIGHT ? max_in_flight : MAX_IN_FLIGHT)
+                , _free_slots()
+                , _deadlines()
+
+                , _output()
+                , _writing()
+                , _output_request()
+
+                , _input(nullptr)
+                , _input_capacity(0)
+                , _input_begin(0)
+                , _input_end(0)
+                , _input_required(0)
+
+                , _callback_connected()
+                , _callback_disconnected()
+
+                , _statistics()
+
+                , _error(0)
+                , _connected(false)
+                , _reading(false)
+                , _flush_deferred(false)
+                , _timer_armed(false)
+
+                , _closing(false)
+                , _closing_handles(0)
+                , _callback_client_closed()
+            {
+                _free_slots.reserve(_slots.size());
+                _deadlines.reserve(_slots.size());
+
+                // lowest slots first, they stay warm in cache
+                for (size_t index = _slots.size(); index > 0; --index)
+                {
+                    Slot& slot = _slots[index - 1];
+
+                    slot.deadline = 0;
+                    slot.heap_index = NO_SLOT;
+                    slot.generation = 0;
+                    slot.busy = false;
+
+                    _free_slots.push_back((uint32_t)(index - 1));
+                }
+
+                _output_request.callback_written = callback_output_written;
+                _output_request.client = this;
+            }
+
+            ~RpcClient()
+            {
+                free(_input);
+            }
+
+            int Connect(const Endpoint& endpoint, const CallbackConnected& callback_connected = nullptr)
+            {
+                _callback_connected = callback_connected;
+
+                return _tcp.Connect(&_connect, endpoint, [this] (uv_connect_t*, int status) {
+                    connected(status);
+                });
+            }
+
+            void SetDisconnected(const CallbackDisconnected& callback_disconnected)
+            {
+                _callback_disconnected = callback_disconnected;
+            }
+
+            /*
+                Queues one request, sent with the others queued during this loop iteration; may be called before the
+                connection is up. timeout is in milliseconds, 0 for the client's default.
+                Returns UV_ENOBUFS when max_in_flight requests are waiting, UV_EAGAIN when too much output is waiting, the
+                connection's error once it failed; callback_response is not called then.
+            */
+            int Call(const uv_buf_t* bufs, unsigned int nbufs, const CallbackResponse& callback_response, uint64_t timeout = 0)
+            {
+                if (_closing)
+                {
+                    return UV_ECANCELED;
+                }
+
+                if (0 != _error)
+                {
+                    return _error;
+                }
+
+                if (_free_slots.empty())
+                {
+                    return UV_ENOBUFS;
+                }
+
+                if (_output.size() + _writing.size() > _max_pending_output)
+                {
+                    return UV_EAGAIN;
+                }
+
+                size_t size = 0;
+                for (unsigned int i = 0; i < nbufs; ++i)
+                {
+                    size += bufs[i].len;
+                }
+
+                if (size > 0xffffffff)
+                {
+                    return UV_E2BIG;
+                }
+
+                uint32_t index = _free_slots.back();
+                _free_slots.pop_back();
+
+                Slot& slot = _slots[index];
+
+                slot.callback_response = callback_response;
+                slot.deadline = uv_now(_loop->uv) + (timeout > 0 ? timeout : _default_timeout);
+                slot.busy = true;
+
+                _deadlines.push_back(index);
+                heapUp(_deadlines.size() - 1);
+
+                char header[HEADER_SIZE];
+                putUint32(header, (uint32_t)size);
+                putUint32(header + 4, ((uint32_t)slot.generation << 16) | index);
+
+                _output.append(header, HEADER_SIZE);
+                for (unsigned int i = 0; i < nbufs; ++i)
+                {
+                    _output.append(bufs[i].base, bufs[i].len);
+                }
+
+                ++_statistics.calls;
+                ++_statistics.in_flight;
+
+                // a new earliest deadline moves the timer
+                if (0 == slot.heap_index)
+                {
+                    armTimer();
+                }
+
+                deferFlush();
+
+                return 0;
+            }
+
+            int Call(const void* data, size_t size, const CallbackResponse& callback_response, uint64_t timeout = 0)
+            {
+                uv_buf_t buf = uv_buf_init((char*)data, (unsigned int)size);
+
+                return Call(&buf, 1, callback_response, timeout);
+            }
+
+            size_t InFlight() const
+            {
+                return _statistics.in_flight;
+            }
+
+            const Statistics& GetStatistics() const
+            {
+                return _statistics;
+            }
+
+            TcpHandle* Native()
+            {
+                return &_tcp;
+            }
+
+            // requests still in flight fail with UV_ECANCELED
+            void Close(const CallbackClientClosed& callback_client_closed = nullptr)
+            {
+                if (_closing)
+                {
+                    return;
+                }
+
+                _closing = true;
+                _callback_client_closed = callback_client_closed;
+
+                failAll(UV_ECANCELED);
+
+                stopRead();
+
+                _closing_handles = 3;
+
+                CallbackHandleClosed callback_handle_closed = [this] () {
+                    if (0 == --_closing_handles && _callback_client_closed)
+                    {
+                        _callback_client_closed();
+                    }
+                };
+
+                _tcp.Close(callback_handle_closed);
+                _timer.Close(callback_handle_closed);
+                _deferred.Close(callback_handle_closed);
+            }
+
+        private:
+            RpcClient() = delete;
+
+            RpcClient(const RpcClient&) = delete;
+            RpcClient& operator=(const RpcClient&) = delete;
+
+            RpcClient(RpcClient&&) = delete;
+            RpcClient& operator=(RpcClient&&) = delete;
+        };
+    }
+}
+
+#endif
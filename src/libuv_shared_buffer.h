@@ -0,0 +1,310 @@
+#ifndef IO_SIMPLIFY_LIBUV_SHARED_BUFFER_H
+#define IO_SIMPLIFY_LIBUV_SHARED_BUFFER_H
+
+#include "libuv_tcp_handle.h"
+#include "libuv_udp_handle.h"
+
+#include <atomic>
+#include <new>
+
+#include <string.h>
+
+namespace io_simplify {
+
+    namespace libuv {
+
+        /*
+            Immutable, reference counted payload living in a single allocation.
+
+            One buffer can be written to any number of handles (on any loops) at once: the payload is referenced,
+            not copied, and freed when the last reference goes. A broadcast costs one payload plus one write request
+            per destination, allocated together in one block.
+        */
+        class SharedBuffer
+        {
+        public:
+            // called once, after the last write of the broadcast completed, on the thread that completed it
+            using CallbackBroadcast = std::function<void(size_t succeeded, size_t failed)>;
+
+        private:
+            std::atomic<size_t> _references;
+            size_t _size;
+
+        private:
+            template<typename handle_type, typename request_type>
+            struct BroadcastBlock;
+
+            struct TcpRequest : public TcpHandle::WriteRequest
+            {
+                BroadcastBlock<TcpHandle, TcpRequest>* broadcast;
+            };
+
+            struct UdpRequest : public UdpHandle::SendRequest
+            {
+                BroadcastBlock<UdpHandle, UdpRequest>* broadcast;
+            };
+
+            template<typename handle_type, typename request_type>
+            struct BroadcastBlock
+            {
+                SharedBuffer* buffer;
+
+                std::atomic<size_t> pending;
+                std::atomic<size_t> failed;
+                size_t count;
+
+                CallbackBroadcast callback_broadcast;
+
+                request_type* Requests()
+                {
+                    return (request_type*)(this + 1);
+                }
+
+                static BroadcastBlock* Create(SharedBuffer* shared_buffer, size_t request_count, const CallbackBroadcast& callback)
+                {
+                    static_assert(sizeof(BroadcastBlock) % alignof(request_type) == 0, "requests must follow the header aligned");
+
+                    void* memory = malloc(sizeof(BroadcastBlock) + request_count * sizeof(request_type));
+                    if (nullptr == memory)
+                    {
+                        return nullptr;
+                    }
+
+                    BroadcastBlock* broadcast = new (memory) BroadcastBlock();
+
+                    broadcast->buffer = shared_buffer;
+                    broadcast->pending.store(request_count + 1, std::memory_order_relaxed); // +1 held while issuing
+                    broadcast->failed.store(0, std::memory_order_relaxed);
+                    broadcast->count = request_count;
+                    broadcast->callback_broadcast = callback;
+
+                    shared_buffer->Retain();
+
+                    return broadcast;
+                }
+
+                void Complete(int status)
+                {
+                    if (status < 0)
+                    {
+                        failed.fetch_add(1, std::memory_order_relaxed);
+                    }
+
+                    if (1 == pending.fetch_sub(1, std::memory_order_acq_rel))
+                    {
+                        if (callback_broadcast)
+                        {
+                            size_t failures = failed.load(std::memory_order_relaxed);
+
+                            callback_broadcast(count - failures, failures);
+                        }
+
+                        buffer->Release();
+
+                        this->~BroadcastBlock();
+                        free(this);
+                    }
+                }
+            };
+
+            static void callback_tcp_written(TcpHandle::WriteRequest* write_request, int status)
+            {
+                ((TcpRequest*)(write_request))->broadcast->Complete(status);
+            }
+
+            static void callback_udp_sent(UdpHandle::SendRequest* send_request, int status)
+            {
+                ((UdpRequest*)(send_request))->broadcast->Complete(status);
+            }
+
+        private:
+            explicit SharedBuffer(size_t size)
+                : _references(1)
+                , _size(size)
+            {
+            }
+
+            ~SharedBuffer()
+            {
+            }
+
+        public:
+            // returned buffer holds one reference owned by the caller
+            static SharedBuffer* Create(const void* data, size_t size)
+            {
+                void* memory = malloc(sizeof(SharedBuffer) + size);
+                if (nullptr == memory)
+                {
+                    return nullptr;
+                }
+
+                SharedBuffer* shared_buffer = new (memory) SharedBuffer(size);
+
+                memcpy(shared_buffer->data(), data, size);
+
+                return shared_buffer;
+            }
+
+            // gathers bufs into one payload
+            static SharedBuffer* Create(const uv_buf_t* bufs, unsigned int nbufs)
+            {
+                size_t size = 0;
+                for (unsigned int i = 0; i < nbufs; ++i)
+                {
+                    size += bufs[i].len;
+                }
+
+                void* memory = malloc(sizeof(SharedBuffer) + size);
+                if (nullptr == memory)
+                {
+                    return nullptr;
+                }
+
+                SharedBuffer* shared_buffer = new (memory) SharedBuffer(size);
+
+                char* data = shared_buffer->data();
+                for (unsigned int i = 0; i < nbufs; ++i)
+                {
+                    memcpy(data, bufs[i].base, bufs[i].len);
+                    data += bufs[i].len;
+                }
+
+                return shared_buffer;
+            }
+
+            void Retain()
+            {
+                _references.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            void Release()
+            {
+                if (1 == _references.fetch_sub(1, std::memory_order_acq_rel))
+                {
+                    this->~SharedBuffer();
+                    free(this);
+                }
+            }
+
+            const char* Data() const
+            {
+                return (const char*)(this + 1);
+            }
+
+            size_t Size() const
+            {
+                return _size;
+            }
+
+            uv_buf_t Buf() const
+            {
+                return uv_buf_init((char*)Data(), (unsigned int)_size);
+            }
+
+            /*
+                Writes the payload to every handle. Each handle is written from the caller's thread, so all handles
+                must belong to the calling loop, or use one call per loop. Returns number of writes started or UV_ENOMEM.
+                The caller keeps its own reference and may Release it right away.
+            */
+            int Broadcast(TcpHandle* const* handles, size_t count, const CallbackBroadcast& callback_broadcast = nullptr)
+            {
+                using TcpBroadcast = SharedBuffer::BroadcastBlock<TcpHandle, TcpRequest>;
+
+                TcpBroadcast* broadcast = TcpBroadcast::Create(this, count, callback_broadcast);
+                if (nullptr == broadcast)
+                {
+                    return UV_ENOMEM;
+                }
+
+                uv_buf_t buf = Buf();
+
+                int started = 0;
+                for (size_t i = 0; i < count; ++i)
+                {
+                    TcpRequest* request = broadcast->Requests() + i;
+
+                    request->callback_written = callback_tcp_written;
+                    request->broadcast = broadcast;
+
+                    int res = handles[i]->Write(request, &buf, 1);
+                    if (res < 0)
+                    {
+                        broadcast->Complete(res);
+                    }
+                    else
+                    {
+                        ++started;
+                    }
+                }
+
+                broadcast->Complete(0);
+
+                return started;
+            }
+
+            // sends the payload from one socket to every peer in addrs
+            int Broadcast(UdpHandle* handle, const struct sockaddr* const* addrs, size_t count, const CallbackBroadcast& callback_broadcast = nullptr)
+            {
+                using UdpBroadcast = SharedBuffer::BroadcastBlock<UdpHandle, UdpRequest>;
+
+                UdpBroadcast* broadcast = UdpBroadcast::Create(this, count, callback_broadcast);
+                if (nullptr == broadcast)
+                {
+                    return UV_ENOMEM;
+                }
+
+                uv_buf_t buf = Buf();
+
+                int started = 0;
+                for (size_t i = 0; i < count; ++i)
+                {
+                    UdpRequest* request = broadcast->Requests() + i;
+
+                    request->callback_sent = callback_udp_sent;
+                    request->broadcast = broadcast;
+
+                    int res = handle->Send(request, &buf, 1, addrs[i]);
+                    if (res < 0)
+                    {
+                        broadcast->Complete(res);
+                    }
+                    else
+                    {
+                        ++started;
+                    }
+                }
+
+                broadcast->Complete(0);
+
+                return started;
+            }
+
+            int Write(TcpHandle* handle, const CallbackBroadcast& callback_broadcast = nullptr)
+            {
+                return Broadcast(&handle, 1, callback_broadcast);
+            }
+
+            int Send(UdpHandle* handle, const struct sockaddr* addr, const CallbackBroadcast& callback_broadcast = nullptr)
+            {
+                return Broadcast(handle, &addr, 1, callback_broadcast);
+            }
+
+        private:
+            char* data()
+            {
+                return (char*)(this + 1);
+            }
+
+        private:
+            SharedBuffer() = delete;
+
+            SharedBuffer(const SharedBuffer&) = delete;
+            SharedBuffer& operator=(const SharedBuffer&) = delete;
+
+            SharedBuffer(SharedBuffer&&) = delete;
+            SharedBuffer& operator=(SharedBuffer&&) = delete;
+        };
+    }
+}
+
+#endif
@@ -0,0 +1,628 @@
+#ifndef IO_SIMPLIFY_LIBUV_SHM_CHANNEL_H
+#define IO_SIMPLIFY_LIBUV_SHM_CHANNEL_H
+
+#if !defined(__linux__)
+#error "libuv_shm_channel.h requires Linux (memfd_create, eventfd)"
+#endif
+
+#include "libuv_loop.h"
+
+#include "libuv_handle.h"
+#include "libuv_poll_handle.h"
+
+#include <atomic>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace io_simplify {
+
+    namespace libuv {
+
+        /*
+            Message channel between two processes (or threads) over shared memory.
+
+            One memfd holds a single-producer/single-consumer ring per direction; side 0 writes ring 0 and reads ring 1,
+            side 1 the other way round. Messages are copied once into the ring by Write and handed to the reader in place.
+            Each side sleeps on its own eventfd, which the peer only writes while that side is parked with nothing to read
+            (or waits for space), so a busy consumer costs the producer no system call at all.
+        */
+        class ShmChannel
+        {
+        public:
+            // the three descriptors a peer needs, move them across processes with fork or SendDescriptor
+            struct Descriptor
+            {
+                int memfd = -1;
+                int eventfd[2] = {-1, -1};
+            };
+
+            using CallbackWritable = std::function<void()>;
+            using CallbackChannelClosed = std::function<void()>;
+
+        private:
+            static constexpr uint64_t MAGIC = 0x696f5f73686d7631ull; // "io_shmv1"
+
+            static constexpr uint32_t WRAP = 0xFFFFFFFFu; // rest of the lap is unused, continue at offset 0
+            static constexpr uint64_t RECORD_HEADER = 8;
+
+            static constexpr size_t MAX_MESSAGES_PER_WAKEUP = 1024;
+
+            struct RingHeader
+            {
+                alignas(64) std::atomic<uint64_t> head; // written by the producer
+                alignas(64) std::atomic<uint64_t> tail; // written by the consumer
+                alignas(64) std::atomic<uint32_t> consumer_waiting; // consumer parked, producer must signal
+                std::atomic<uint32_t> producer_waiting; // producer hit a full ring, consumer must signal
+            };
+
+            struct Layout
+            {
+                uint64_t magic;
+                uint64_t capacity;
+
+                RingHeader rings[2];
+            };
+
+            static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared memory atomics must be lock free");
+
+        private:
+            PollHandle _poll;
+
+            int _side;
+            Descriptor _descriptor;
+
+            Layout* _layout;
+            size_t _layout_size;
+
+            RingHeader* _tx;
+            RingHeader* _rx;
+            char* _tx_data;
+            char* _rx_data;
+
+            uint64_t _capacity;
+
+            CallbackRead _callback_read;
+            bool _reading;
+
+            CallbackWritable _callback_writable;
+            bool _blocked;
+
+            CallbackChannelClosed _callback_channel_closed;
+
+        public:
+            int status;
+
+        private:
+            static uint64_t layoutSize(uint64_t capacity)
+            {
+                return ((sizeof(Layout) + 63) & ~uint64_t(63)) + 2 * capacity;
+            }
+
+            static uint64_t recordSize(size_t len)
+            {
+                return (RECORD_HEADER + len + 7) & ~uint64_t(7);
+            }
+
+            static void signal(int fd)
+            {
+                uint64_t one = 1;
+                ssize_t res;
+                do
+                {
+                    res = write(fd, &one, sizeof(one));
+                } while (res < 0 && EINTR == errno);
+            }
+
+            int peerEventFd() const
+            {
+                return _descriptor.eventfd[1 - _side];
+            }
+
+            void onWakeup()
+            {
+                uint64_t value;
+                while (read(_descriptor.eventfd[_side], &value, sizeof(value)) < 0 && EINTR == errno)
+                {
+                }
+
+                if (_reading)
+                {
+                    drain();
+                }
+
+                if (_blocked && _callback_writable && nullptr != _layout && writableBytes() > 0)
+                {
+                    _blocked = false;
+
+                    _callback_writable();
+                }
+            }
+
+            // the ring can no longer be trusted: reading stops for good and the reader gets the error
+            void fail(int error)
+            {
+                status = error;
+                _reading = false;
+
+                uv_buf_t buf = uv_buf_init(nullptr, 0);
+                _callback_read((ssize_t)error, &buf);
+            }
+
+            void drain()
+            {
+                uint64_t tail = _rx->tail.load(std::memory_order_relaxed);
+                uint64_t mask = _capacity - 1;
+
+                for (size_t count = 0; count < MAX_MESSAGES_PER_WAKEUP; )
+                {
+                    uint64_t head = _rx->head.load(std::memory_order_acquire);
+                    if (head == tail)
+                    {
+                        // park, then look again in case the producer published without seeing us parked
+                        _rx->consumer_waiting.store(1, std::memory_order_relaxed);
+                        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+                        if (_rx->head.load(std::memory_order_acquire) == tail)
+                        {
+                            return;
+                        }
+
+                        _rx->consumer_waiting.store(0, std::memory_order_relaxed);
+                        continue;
+                    }
+
+                    uint64_t offset = tail & mask;
+
+                    uint32_t len;
+                    memcpy(&len, _rx_data + offset, sizeof(len));
+
+                    if (WRAP == len)
+                    {
+                        tail += _capacity - offset;
+                        _rx->tail.store(tail, std::memory_order_release);
+                        continue;
+                    }
+
+                    // the length comes from the peer's memory: it must stay inside the lap and inside what was published
+                    if (len > _capacity - offset - RECORD_HEADER || recordSize(len) > head - tail)
+                    {
+                        fail(UV_EPROTO);
+                        return;
+                    }
+
+                    uv_buf_t buf = uv_buf_init(_rx_data + offset + RECORD_HEADER, len);
+
+                    _callback_read((ssize_t)len, &buf);
+
+                    tail += recordSize(len);
+                    _rx->tail.store(tail, std::memory_order_release);
+
+                    ++count;
+
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                    if (_rx->producer_waiting.load(std::memory_order_relaxed) && _rx->producer_waiting.exchange(0))
+                    {
+                        signal(peerEventFd());
+                    }
+
+                    if (!_reading || nullptr == _layout)
+                    {
+                        return;
+                    }
+                }
+
+                // budget spent with messages left, come back on the next iteration
+                signal(_descriptor.eventfd[_side]);
+            }
+
+            uint64_t writableBytes() const
+            {
+                uint64_t head = _tx->head.load(std::memory_order_relaxed);
+                uint64_t tail = _tx->tail.load(std::memory_order_acquire);
+
+                return _capacity - (head - tail);
+            }
+
+        public:
+            /*
+                Creates the shared region and both eventfds, capacity is per direction and rounded up to a power of two.
+                The caller owns the descriptors until they are passed to a ShmChannel.
+            */
+            static int Create(size_t capacity, Descriptor& descriptor)
+            {
+                uint64_t ring_capacity = 4096;
+                while (ring_capacity < capacity)
+                {
+                    ring_capacity <<= 1;
+                }
+
+                int res = 0;
+                do
+                {
+                    descriptor.memfd = memfd_create("io_simplify_shm_channel", MFD_CLOEXEC);
+                    if (descriptor.memfd < 0)
+                    {
+                        res = uv_translate_sys_error(errno);
+                        break;
+                    }
+
+                    if (ftruncate(descriptor.memfd, (off_t)layoutSize(ring_capacity)) < 0)
+                    {
+                        res = uv_translate_sys_error(errno);
+                        break;
+                    }
+
+                    void* memory = mmap(nullptr, sizeof(Layout), PROT_READ | PROT_WRITE, MAP_SHARED, descriptor.memfd, 0);
+                    if (MAP_FAILED == memory)
+                    {
+                        res = uv_translate_sys_error(errno);
+                        break;
+                    }
+
+                    // the file is zero filled, only the parked flags need a value: both consumers start parked
+                    Layout* layout = (Layout*)(memory);
+                    layout->magic = MAGIC;
+                    layout->capacity = ring_capacity;
+                    layout->rings[0].consumer_waiting.store(1);
+                    layout->rings[1].consumer_waiting.store(1);
+
+                    munmap(memory, sizeof(Layout));
+
+                    for (int side = 0; side < 2; ++side)
+                    {
+                        descriptor.eventfd[side] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+                        if (descriptor.eventfd[side] < 0)
+                        {
+                            res = uv_translate_sys_error(errno);
+                            break;
+                        }
+                    }
+                } while (false);
+
+                if (res < 0)
+                {
+                    Release(descriptor);
+                }
+
+                return res;
+            }
+
+            static void Release(Descriptor& descriptor)
+            {
+                int* fds[3] = {&descriptor.memfd, &descriptor.eventfd[0], &descriptor.eventfd[1]};
+                for (int* fd : fds)
+                {
+                    if (*fd >= 0)
+                    {
+                        close(*fd);
+                        *fd = -1;
+                    }
+                }
+            }
+
+            // passes the descriptors over a connected unix domain socket (SCM_RIGHTS), blocking
+            static int SendDescriptor(int unix_socket, const Descriptor& descriptor)
+            {
+                int fds[3] = {descriptor.memfd, descriptor.eventfd[0], descriptor.eventfd[1]};
+
+                char byte = 0;
+                struct iovec iov;
+                iov.iov_base = &byte;
+                iov.iov_len = 1;
+
+                union
+                {
+                    char buffer[CMSG_SPACE(sizeof(fds))];
+                    struct cmsghdr align;
+                } control;
+                memset(&control, 0, sizeof(control));
+
+                struct msghdr msg;
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_iov = &iov;
+                msg.msg_iovlen = 1;
+                msg.msg_control = control.buffer;
+                msg.msg_controllen = sizeof(control.buffer);
+
+                struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type = SCM_RIGHTS;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+                memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+                ssize_t res;
+                do
+                {
+                    res = sendmsg(unix_socket, &msg, 0);
+                } while (res < 0 && EINTR == errno);
+
+                return res < 0 ? uv_translate_sys_error(errno) : 0;
+            }
+
+            static int ReceiveDescriptor(int unix_socket, Descriptor& descriptor)
+            {
+                int fds[3] = {-1, -1, -1};
+
+                char byte = 0;
+                struct iovec iov;
+                iov.iov_base = &byte;
+                iov.iov_len = 1;
+
+                union
+                {
+                    char buffer[CMSG_SPACE(sizeof(fds))];
+                    struct cmsghdr align;
+                } control;
+
+                struct msghdr msg;
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_iov = &iov;
+                msg.msg_iovlen = 1;
+                msg.msg_control = control.buffer;
+                msg.msg_controllen = sizeof(control.buffer);
+
+                ssize_t res;
+                do
+                {
+                    res = recvmsg(unix_socket, &msg, MSG_CMSG_CLOEXEC);
+                } while (res < 0 && EINTR == errno);
+
+                if (res < 0)
+                {
+                    return uv_translate_sys_error(errno);
+                }
+
+                struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+                if (nullptr == cmsg || SOL_SOCKET != cmsg->cmsg_level || SCM_RIGHTS != cmsg->cmsg_type || cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+                {
+                    return UV_EPROTO;
+                }
+
+                memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+                descriptor.memfd = fds[0];
+                descriptor.eventfd[0] = fds[1];
+                descriptor.eventfd[1] = fds[2];
+
+                return 0;
+            }
+
+        public:
+            // takes ownership of the descriptors, side is 0 or 1 and must differ between the peers
+            ShmChannel(Loop* loop, const Descriptor& descriptor, int side)
+                : _poll(loop, descriptor.eventfd[side & 1])
+
+                , _side(side & 1)
+                , _descriptor(descriptor)
+
+                , _layout(nullptr)
+                , _layout_size(0)
+
+                , _tx(nullptr)
+                , _rx(nullptr)
+                , _tx_data(nullptr)
+                , _rx_data(nullptr)
+
+                , _capacity(0)
+
+                , _callback_read()
+                , _reading(false)
+
+                , _callback_writable()
+                , _blocked(false)
+
+                , _callback_channel_closed()
+
+                , status(_poll.status)
+            {
+                do
+                {
+                    if (status < 0)
+                    {
+                        break;
+                    }
+
+                    struct stat file_stat;
+                    if (fstat(_descriptor.memfd, &file_stat) < 0)
+                    {
+                        status = uv_translate_sys_error(errno);
+                        break;
+                    }
+
+                    void* memory = mmap(nullptr, (size_t)file_stat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, _descriptor.memfd, 0);
+                    if (MAP_FAILED == memory)
+                    {
+                        status = uv_translate_sys_error(errno);
+                        break;
+                    }
+
+                    Layout* layout = (Layout*)(memory);
+                    if (MAGIC != layout->magic || layoutSize(layout->capacity) != (uint64_t)file_stat.st_size)
+                    {
+                        munmap(memory, (size_t)file_stat.st_size);
+
+                        status = UV_EINVAL;
+                        break;
+                    }
+
+                    _layout = layout;
+                    _layout_size = (size_t)file_stat.st_size;
+                    _capacity = layout->capacity;
+
+                    char* data = (char*)(memory) + ((sizeof(Layout) + 63) & ~size_t(63));
+
+                    _tx = &(layout->rings[_side]);
+                    _rx = &(layout->rings[1 - _side]);
+                    _tx_data = data + _side * _capacity;
+                    _rx_data = data + (1 - _side) * _capacity;
+
+                    status = _poll.Start(UV_READABLE, [this] (int poll_status, int events) { onWakeup(); });
+                } while (false);
+            }
+
+            ~ShmChannel()
+            {
+            }
+
+            // buf points into the shared ring and is only valid during the callback, UV_EPROTO ends reading on a corrupt ring
+            int StartRead(const CallbackRead& callback_read)
+            {
+                if (nullptr == _layout)
+                {
+                    return UV_EINVAL;
+                }
+
+                if (status < 0)
+                {
+                    return status;
+                }
+
+                _callback_read = callback_read;
+                _reading = true;
+
+                // pick up whatever arrived before
+                signal(_descriptor.eventfd[_side]);
+
+                return 0;
+            }
+
+            void StopRead()
+            {
+                _reading = false;
+            }
+
+            /*
+                Copies the message into the ring without blocking.
+                Returns UV_EAGAIN when the ring is full (callback_writable fires once space is available again)
+                or UV_EMSGSIZE for a message larger than half the ring.
+            */
+            int Write(const uv_buf_t* bufs, unsigned int nbufs)
+            {
+                if (nullptr == _layout)
+                {
+                    return UV_EINVAL;
+                }
+
+                size_t len = 0;
+                for (unsigned int i = 0; i < nbufs; ++i)
+                {
+                    len += bufs[i].len;
+                }
+
+                uint64_t record = recordSize(len);
+                if (record > _capacity / 2)
+                {
+                    return UV_EMSGSIZE;
+                }
+
+                uint64_t head = _tx->head.load(std::memory_order_relaxed);
+                uint64_t offset = head & (_capacity - 1);
+                uint64_t contiguous = _capacity - offset;
+                uint64_t needed = record > contiguous ? contiguous + record : record;
+
+                if (writableBytes() < needed)
+                {
+                    _tx->producer_waiting.store(1, std::memory_order_relaxed);
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+                    if (writableBytes() < needed)
+                    {
+                        _blocked = true;
+                        return UV_EAGAIN;
+                    }
+
+                    _tx->producer_waiting.store(0, std::memory_order_relaxed);
+                }
+
+                if (record > contiguous)
+                {
+                    memcpy(_tx_data + offset, &WRAP, sizeof(WRAP));
+
+                    head += contiguous;
+                    offset = 0;
+                }
+
+                char* data = _tx_data + offset + RECORD_HEADER;
+                for (unsigned int i = 0; i < nbufs; ++i)
+                {
+                    memcpy(data, bufs[i].base, bufs[i].len);
+                    data += bufs[i].len;
+                }
+
+                uint32_t len32 = (uint32_t)len;
+                memcpy(_tx_data + offset, &len32, sizeof(len32));
+
+                _tx->head.store(head + record, std::memory_order_release);
+
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (_tx->consumer_waiting.load(std::memory_order_relaxed) && _tx->consumer_waiting.exchange(0))
+                {
+                    signal(peerEventFd());
+                }
+
+                return 0;
+            }
+
+            void StartWritable(const CallbackWritable& callback_writable)
+            {
+                _callback_writable = callback_writable;
+            }
+
+            void StopWritable()
+            {
+                _callback_writable = nullptr;
+            }
+
+            // unmaps the region and closes the descriptors once the poll handle is closed
+            void Close(const CallbackChannelClosed& callback_channel_closed = nullptr)
+            {
+                _callback_channel_closed = callback_channel_closed;
+
+                _reading = false;
+
+                CallbackHandleClosed callback_handle_closed = [this] () {
+                    if (_layout)
+                    {
+                        munmap(_layout, _layout_size);
+                        _layout = nullptr;
+                    }
+
+                    Release(_descriptor);
+
+                    if (_callback_channel_closed)
+                    {
+                        _callback_channel_closed();
+                    }
+                };
+
+                if (0 == _poll.status)
+                {
+                    _poll.Close(callback_handle_closed);
+                }
+                else
+                {
+                    // the poll handle never joined the loop
+                    callback_handle_closed();
+                }
+            }
+
+        private:
+            ShmChannel() = delete;
+
+            ShmChannel(const ShmChannel&) = delete;
+            ShmChannel& operator=(const ShmChannel&) = delete;
+
+            ShmChannel(ShmChannel&&) = delete;
+            ShmChannel& operator=(ShmChannel&&) = delete;
+        };
+    }
+}
+
+#endif
@@ -4,6 +4,28 @@
 #include "libuv_loop.h"
 
 #include "libuv_handle.h"
+#include "libuv_poll_handle.h"
+
+#include "libuv_capture.h"
+
+#include <atomic>
+#include <new>
+#include <vector>
+
+#include <string.h>
+
+#if !defined(_WIN32)
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && !defined(SIOCOUTQNSD)
+#define SIOCOUTQNSD 0x894B
+#endif
 
 namespace io_simplify {
 
@@ -15,15 +37,141 @@ namespace io_simplify {
             using CallbackListen = std::function<void(int)>;
             using CallbackConnect = std::function<void(uv_connect_t*, int)>;
 
+            /*
+                Write request completing through its own callback instead of the handle-level CallbackWritten,
+                which is replaced on every Write and so cannot serve several writers sharing one handle.
+                Embed it as the first member (or base) of a bigger struct to carry per-request state.
+            */
+            struct WriteRequest
+            {
+                uv_write_t req;
+                void (*callback_written)(WriteRequest*, int);
+            };
+
+            /*
+                Socket options applied where the socket comes to exist: after Bind (accepted sockets inherit most of
+                them), to every handle Accept hands out, and around Connect. 0 leaves an option at the system default.
+                Set with SetTuning, which keeps the pointer: share one profile between handles and keep it alive.
+
+                notsent_lowat bounds the bytes the kernel keeps queued but not yet sent, so fresh data is not stuck
+                behind stale data and NotifyWritable fires only once the backlog drained below it. The kernel resets
+                quick acks by itself, so quickack is set again after every read, one more system call each.
+                receive_buffer shapes the window scale only when set before the SYN: on a client, construct the handle
+                with an address family (TcpHandle(loop, AF_INET)) so the socket exists before Connect.
+            */
+            struct Tuning
+            {
+                int send_buffer = 0; // SO_SNDBUF
+                int receive_buffer = 0; // SO_RCVBUF
+                unsigned int notsent_lowat = 0; // TCP_NOTSENT_LOWAT, bytes
+                unsigned int user_timeout = 0; // TCP_USER_TIMEOUT, milliseconds unacknowledged data may wait
+                bool nodelay = false;
+                bool quickack = false; // TCP_QUICKACK
+
+                // interactive streams: small unsent backlog, no delayed acks or Nagle, dead peers noticed in seconds
+                static Tuning LowLatency()
+                {
+                    Tuning tuning;
+                    tuning.notsent_lowat = 16 * 1024;
+                    tuning.user_timeout = 10000;
+                    tuning.nodelay = true;
+                    tuning.quickack = true;
+                    return tuning;
+                }
+
+                // transfers: large buffers for long fat pipes, the kernel paces the rest
+                static Tuning Bulk()
+                {
+                    Tuning tuning;
+                    tuning.send_buffer = 4 * 1024 * 1024;
+                    tuning.receive_buffer = 4 * 1024 * 1024;
+                    tuning.user_timeout = 60000;
+                    return tuning;
+                }
+            };
+
+            // a TCP_INFO subset, see GetInfo()
+            struct Info
+            {
+                uint32_t rtt_us;
+                uint32_t rtt_var_us;
+                uint32_t rto_us;
+                uint32_t send_mss;
+                uint32_t congestion_window; // segments
+                uint32_t slow_start_threshold;
+                uint32_t unacked; // segments in flight
+                uint32_t lost;
+                uint32_t retransmits; // consecutive retransmissions of the current segment
+                uint32_t total_retransmits;
+                uint32_t unsent_bytes; // queued in the kernel, not sent yet (Linux only, 0 elsewhere)
+            };
+
+            using CallbackWritable = std::function<void(int status)>;
+
+            class WriteDispatcher;
+
+        private:
+            // one message queued by WriteThreadSafe, the payload follows the header
+            struct CrossThreadMessage
+            {
+                CrossThreadMessage* next;
+                size_t size;
+            };
+
+            // shared with the dispatcher, outlives the handle while a drain still refers to it
+            struct CrossThreadQueue
+            {
+                std::atomic<CrossThreadMessage*> messages; // pushed by any thread, taken whole by the loop, newest first
+                std::atomic<bool> scheduled;
+                std::atomic<int> references;
+
+                CrossThreadQueue* next_scheduled;
+
+                TcpHandle* handle; // nullptr once the handle is closing
+                WriteDispatcher* dispatcher;
+            };
+
+            struct CrossThreadWrite
+            {
+                uv_write_t req;
+                CrossThreadMessage* messages;
+            };
+
         private:
             uv_stream_t* _stream;
 
+            CrossThreadQueue* _cross_thread_queue;
+
+            uint64_t _copy_failures; // WriteCopy writes completed with an error
+
+            Capture* _capture;
+            uint64_t _capture_connection;
+
+            const Tuning* _tuning;
+
+            // polls a dup of the socket for writability, libuv's own watcher only serves queued writes
+            struct WritablePoll
+            {
+                PollHandle poll;
+                int fd;
+
+                WritablePoll(Loop* loop, int writable_fd)
+                    : poll(loop, writable_fd)
+                    , fd(writable_fd)
+                {
+                }
+            };
+
+            WritablePoll* _writable_poll;
+            CallbackWritable _callback_writable;
+
         private:
             CallbackListen _callback_listen;
             CallbackConnect _callback_connect;
 
         private:
             CallbackAlloc _callback_alloc;
+            ReadBufferSizing _read_sizing;
 
         private:
             CallbackRead _callback_read;
@@ -34,6 +182,9 @@ namespace io_simplify {
             {
                 TcpHandle* server_handle = (TcpHandle*)(stream->data);
 
+                LIBUV_TRACE_CALLBACK(server_handle, TRACE_CALLBACK_LISTEN, status);
+                LIBUV_WATCHDOG_CALLBACK(server_handle, TRACE_CALLBACK_LISTEN);
+
                 server_handle->_callback_listen(status);
             }
 
@@ -41,6 +192,8 @@ namespace io_simplify {
             {
                 TcpHandle* server_handle = (TcpHandle*)(req->handle->data);
 
+                LIBUV_WATCHDOG_CALLBACK(server_handle, TRACE_CALLBACK_CONNECT);
+
                 server_handle->_callback_connect(req, status);
             }
 
@@ -55,25 +208,280 @@ namespace io_simplify {
             {
                 TcpHandle* server_handle = (TcpHandle*)(stream->data);
 
+                LIBUV_TRACE_CALLBACK(server_handle, TRACE_CALLBACK_READ, nread);
+                LIBUV_WATCHDOG_CALLBACK(server_handle, TRACE_CALLBACK_READ);
+
+                if (nullptr != server_handle->_capture)
+                {
+                    server_handle->capture(nread, buf);
+                }
+
+                server_handle->_callback_read(nread, buf);
+
+                if (nread > 0 && nullptr != server_handle->_tuning && server_handle->_tuning->quickack)
+                {
+                    server_handle->quickAck();
+                }
+            }
+
+            static void callback_uv_adaptive_alloc(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf)
+            {
+                TcpHandle* server_handle = (TcpHandle*)(handle->data);
+
+                server_handle->loop->read_buffers.Allocate(server_handle->_read_sizing, buf);
+            }
+
+            static void callback_uv_adaptive_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
+            {
+                TcpHandle* server_handle = (TcpHandle*)(stream->data);
+
+                LIBUV_TRACE_CALLBACK(server_handle, TRACE_CALLBACK_READ, nread);
+                LIBUV_WATCHDOG_CALLBACK(server_handle, TRACE_CALLBACK_READ);
+
+                if (nullptr != server_handle->_capture)
+                {
+                    server_handle->capture(nread, buf);
+                }
+
                 server_handle->_callback_read(nread, buf);
+
+                if (nread > 0 && nullptr != server_handle->_tuning && server_handle->_tuning->quickack)
+                {
+                    server_handle->quickAck();
+                }
+
+                // closing in the callback only schedules the close, the handle is still here
+                server_handle->loop->read_buffers.Release(server_handle->_read_sizing, nread, buf);
             }
 
             static void callback_uv_written(uv_write_t* req, int status)
             {
                 TcpHandle* server_handle = (TcpHandle*)(req->handle->data);
 
+                LIBUV_TRACE_CALLBACK(server_handle, TRACE_CALLBACK_WRITTEN, status);
+                LIBUV_WATCHDOG_CALLBACK(server_handle, TRACE_CALLBACK_WRITTEN);
+
                 server_handle->_callback_written(req, status);
             }
 
+            static void callback_uv_request_written(uv_write_t* req, int status)
+            {
+                LIBUV_TRACE_CALLBACK((TcpHandle*)(req->handle->data), TRACE_CALLBACK_WRITTEN, status);
+                LIBUV_WATCHDOG_CALLBACK((TcpHandle*)(req->handle->data), TRACE_CALLBACK_WRITTEN);
+
+                WriteRequest* write_request = (WriteRequest*)(req);
+
+                write_request->callback_written(write_request, status);
+            }
+
+            static void callback_uv_cross_thread_written(uv_write_t* req, int status)
+            {
+                TcpHandle* server_handle = (TcpHandle*)(req->handle->data);
+
+                LIBUV_TRACE_CALLBACK(server_handle, TRACE_CALLBACK_WRITTEN, status);
+                LIBUV_WATCHDOG_CALLBACK(server_handle, TRACE_CALLBACK_WRITTEN);
+
+                CrossThreadWrite* cross_thread_write = (CrossThreadWrite*)(req);
+
+                freeMessages(cross_thread_write->messages);
+
+                server_handle->loop->arena.Free(cross_thread_write);
+            }
+
+            static void freeMessages(CrossThreadMessage* message)
+            {
+                while (nullptr != message)
+                {
+                    CrossThreadMessage* next = message->next;
+
+                    free(message);
+
+                    message = next;
+                }
+            }
+
+            static void releaseQueue(CrossThreadQueue* queue)
+            {
+                if (1 == queue->references.fetch_sub(1, std::memory_order_acq_rel))
+                {
+                    freeMessages(queue->messages.exchange(nullptr));
+
+                    delete queue;
+                }
+            }
+
+            void capture(ssize_t nread, const uv_buf_t* buf)
+            {
+                if (nread > 0)
+                {
+                    _capture->Record(Capture::RECORD_DATA, _capture_connection, buf->base, (size_t)nread);
+                }
+                else if (nread < 0)
+                {
+                    _capture->Record(Capture::RECORD_CLOSE, _capture_connection, nullptr, 0);
+                    _capture = nullptr;
+                }
+            }
+
+            void detachQueue()
+            {
+                if (nullptr != _cross_thread_queue)
+                {
+                    _cross_thread_queue->handle = nullptr;
+
+                    releaseQueue(_cross_thread_queue);
+
+                    _cross_thread_queue = nullptr;
+                }
+            }
+
+            // loop thread, messages newest first
+            void flushQueue(CrossThreadMessage* messages, std::vector<uv_buf_t>& bufs)
+            {
+                CrossThreadMessage* oldest = nullptr;
+                while (nullptr != messages)
+                {
+                    CrossThreadMessage* next = messages->next;
+
+                    messages->next = oldest;
+                    oldest = messages;
+
+                    messages = next;
+                }
+
+                CrossThreadWrite* cross_thread_write = (CrossThreadWrite*)(Handle<uv_tcp_t>::loop->arena.Allocate(sizeof(CrossThreadWrite)));
+                if (nullptr == cross_thread_write)
+                {
+                    freeMessages(oldest);
+                    return;
+                }
+
+                cross_thread_write->messages = oldest;
+
+                bufs.clear();
+                for (CrossThreadMessage* message = oldest; nullptr != message; message = message->next)
+                {
+                    bufs.push_back(uv_buf_init((char*)(message + 1), (unsigned int)(message->size)));
+                }
+
+                LIBUV_TRACE_BYTES_OUT(this, bufs.data(), bufs.size());
+
+                int res = uv_write(&(cross_thread_write->req), _stream, bufs.data(), (unsigned int)bufs.size(), callback_uv_cross_thread_written);
+                if (res < 0)
+                {
+                    freeMessages(oldest);
+
+                    Handle<uv_tcp_t>::loop->arena.Free(cross_thread_write);
+                }
+            }
+
+            static void callback_uv_copy_written(uv_write_t* req, int status)
+            {
+                TcpHandle* server_handle = (TcpHandle*)(req->handle->data);
+
+                LIBUV_TRACE_CALLBACK(server_handle, TRACE_CALLBACK_WRITTEN, status);
+                LIBUV_WATCHDOG_CALLBACK(server_handle, TRACE_CALLBACK_WRITTEN);
+
+                if (status < 0)
+                {
+                    ++server_handle->_copy_failures;
+                }
+
+                server_handle->loop->arena.Free(req);
+            }
+
+            // -1 before the socket exists, and on Windows
+            int descriptor() const
+            {
+#if !defined(_WIN32)
+                uv_os_fd_t fd;
+                if (0 == uv_fileno((const uv_handle_t*)(Handle<uv_tcp_t>::uv), &fd))
+                {
+                    return (int)fd;
+                }
+#endif
+                return -1;
+            }
+
+            void quickAck()
+            {
+#if defined(TCP_QUICKACK)
+                int fd = descriptor();
+                int on = 1;
+                if (fd >= 0)
+                {
+                    setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+                }
+#endif
+            }
+
+            void applyTuning()
+            {
+                if (nullptr != _tuning)
+                {
+                    Tune(*_tuning);
+                }
+            }
+
+            static void callback_writable_poll(TcpHandle* server_handle, int status)
+            {
+                // libuv is still flushing queued writes, which are older than anything the producer would add
+                if (status >= 0 && uv_stream_get_write_queue_size(server_handle->_stream) > 0)
+                {
+                    return;
+                }
+
+                server_handle->_writable_poll->poll.Stop();
+
+                CallbackWritable callback_writable = std::move(server_handle->_callback_writable);
+                server_handle->_callback_writable = nullptr;
+
+                callback_writable(status);
+            }
+
+            void stopWritablePoll()
+            {
+#if !defined(_WIN32)
+                if (nullptr == _writable_poll)
+                {
+                    return;
+                }
+
+                WritablePoll* writable_poll = _writable_poll;
+
+                _writable_poll = nullptr;
+                _callback_writable = nullptr;
+
+                writable_poll->poll.Close([writable_poll] () {
+                    close(writable_poll->fd);
+
+                    delete writable_poll;
+                });
+#endif
+            }
+
         public:
             explicit TcpHandle(Loop* loop)
                 : Handle<uv_tcp_t>(loop)
                 , _stream((uv_stream_t*)(Handle<uv_tcp_t>::uv))
 
+                , _cross_thread_queue(nullptr)
+
+                , _copy_failures(0)
+
+                , _capture(nullptr)
+                , _capture_connection(0)
+
+                , _tuning(nullptr)
+
+                , _writable_poll(nullptr)
+                , _callback_writable()
+
                 , _callback_listen()
                 , _callback_connect()
 
                 , _callback_alloc()
+                , _read_sizing()
                 , _callback_read()
             {
                 Handle<uv_tcp_t>::status = uv_tcp_init(loop->uv, Handle<uv_tcp_t>::uv);
@@ -83,9 +491,22 @@ namespace io_simplify {
                 : Handle<uv_tcp_t>(loop)
                 , _stream((uv_stream_t*)(Handle<uv_tcp_t>::uv))
 
+                , _cross_thread_queue(nullptr)
+
+                , _copy_failures(0)
+
+                , _capture(nullptr)
+                , _capture_connection(0)
+
+                , _tuning(nullptr)
+
+                , _writable_poll(nullptr)
+                , _callback_writable()
+
                 , _callback_listen()
                 
                 , _callback_alloc()
+                , _read_sizing()
 
                 , _callback_read()
                 , _callback_written()
@@ -95,6 +516,7 @@ namespace io_simplify {
 
             ~TcpHandle()
             {
+                detachQueue();
             }
 
             int NoDelay(int enable)
@@ -107,6 +529,183 @@ namespace io_simplify {
                 return uv_tcp_keepalive(Handle<uv_tcp_t>::uv, enable, seconds);
             }
 
+            // applies tuning now, the first failure is returned but every option is tried
+            int Tune(const Tuning& tuning)
+            {
+                int res = 0;
+                int value;
+
+                if (tuning.send_buffer > 0)
+                {
+                    value = tuning.send_buffer;
+                    int r = uv_send_buffer_size((uv_handle_t*)(Handle<uv_tcp_t>::uv), &value);
+                    res = res < 0 ? res : r;
+                }
+
+                if (tuning.receive_buffer > 0)
+                {
+                    value = tuning.receive_buffer;
+                    int r = uv_recv_buffer_size((uv_handle_t*)(Handle<uv_tcp_t>::uv), &value);
+                    res = res < 0 ? res : r;
+                }
+
+                if (tuning.nodelay)
+                {
+                    int r = uv_tcp_nodelay(Handle<uv_tcp_t>::uv, 1);
+                    res = res < 0 ? res : r;
+                }
+
+#if !defined(_WIN32)
+                int fd = descriptor();
+                if (fd < 0)
+                {
+                    return res < 0 ? res : UV_EBADF;
+                }
+
+                if (tuning.notsent_lowat > 0)
+                {
+#if defined(TCP_NOTSENT_LOWAT)
+                    value = (int)tuning.notsent_lowat;
+                    int r = 0 == setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &value, sizeof(value)) ? 0 : uv_translate_sys_error(errno);
+#else
+                    int r = UV_ENOTSUP;
+#endif
+                    res = res < 0 ? res : r;
+                }
+
+                if (tuning.user_timeout > 0)
+                {
+#if defined(TCP_USER_TIMEOUT)
+                    unsigned int timeout = tuning.user_timeout;
+                    int r = 0 == setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof(timeout)) ? 0 : uv_translate_sys_error(errno);
+#else
+                    int r = UV_ENOTSUP;
+#endif
+                    res = res < 0 ? res : r;
+                }
+
+                if (tuning.quickack)
+                {
+#if defined(TCP_QUICKACK)
+                    value = 1;
+                    int r = 0 == setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &value, sizeof(value)) ? 0 : uv_translate_sys_error(errno);
+#else
+                    int r = UV_ENOTSUP;
+#endif
+                    res = res < 0 ? res : r;
+                }
+#else
+                if (tuning.notsent_lowat > 0 || tuning.user_timeout > 0 || tuning.quickack)
+                {
+                    res = res < 0 ? res : UV_ENOTSUP;
+                }
+#endif
+
+                return res;
+            }
+
+            // kept by pointer, applied by Bind, Accept (to the accepted handle) and Connect from now on
+            void SetTuning(const Tuning* tuning)
+            {
+                _tuning = tuning;
+            }
+
+            /*
+                Calls callback_writable once, when the socket can take more data: with notsent_lowat tuned, once the
+                kernel's unsent backlog drained below it, and never while libuv still holds queued writes. Produce the
+                next chunk from the callback and ask again, instead of piling data into uv_write queues.
+                Calling it again before it fired replaces the callback.
+            */
+            int NotifyWritable(const CallbackWritable& callback_writable)
+            {
+#if !defined(_WIN32)
+                if (nullptr == _writable_poll)
+                {
+                    int fd = descriptor();
+                    if (fd < 0)
+                    {
+                        return UV_EBADF;
+                    }
+
+                    // a second descriptor of the same socket gets its own epoll registration
+                    int writable_fd = dup(fd);
+                    if (writable_fd < 0)
+                    {
+                        return uv_translate_sys_error(errno);
+                    }
+
+                    _writable_poll = new WritablePoll(Handle<uv_tcp_t>::loop, writable_fd);
+                    if (0 != _writable_poll->poll.status)
+                    {
+                        int res = _writable_poll->poll.status;
+
+                        delete _writable_poll;
+                        _writable_poll = nullptr;
+
+                        close(writable_fd);
+
+                        return res;
+                    }
+                }
+
+                _callback_writable = callback_writable;
+
+                return _writable_poll->poll.Start(UV_WRITABLE, [this] (int status, int events) { callback_writable_poll(this, status); });
+#else
+                return UV_ENOTSUP;
+#endif
+            }
+
+            // a pending NotifyWritable is dropped without its callback
+            void CancelWritable()
+            {
+                if (nullptr != _writable_poll)
+                {
+                    _writable_poll->poll.Stop();
+                    _callback_writable = nullptr;
+                }
+            }
+
+            // one getsockopt(TCP_INFO), and one ioctl for unsent_bytes on Linux
+            int GetInfo(Info& info)
+            {
+#if defined(TCP_INFO) && defined(__linux__)
+                int fd = descriptor();
+                if (fd < 0)
+                {
+                    return UV_EBADF;
+                }
+
+                struct tcp_info tcp_info;
+                socklen_t length = sizeof(tcp_info);
+                memset(&tcp_info, 0, sizeof(tcp_info));
+
+                if (0 != getsockopt(fd, IPPROTO_TCP, TCP_INFO, &tcp_info, &length))
+                {
+                    return uv_translate_sys_error(errno);
+                }
+
+                info.rtt_us = tcp_info.tcpi_rtt;
+                info.rtt_var_us = tcp_info.tcpi_rttvar;
+                info.rto_us = tcp_info.tcpi_rto;
+                info.send_mss = tcp_info.tcpi_snd_mss;
+                info.congestion_window = tcp_info.tcpi_snd_cwnd;
+                info.slow_start_threshold = tcp_info.tcpi_snd_ssthresh;
+                info.unacked = tcp_info.tcpi_unacked;
+                info.lost = tcp_info.tcpi_lost;
+                info.retransmits = tcp_info.tcpi_retransmits;
+                info.total_retransmits = tcp_info.tcpi_total_retrans;
+
+                int unsent = 0;
+                info.unsent_bytes = 0 == ioctl(fd, SIOCOUTQNSD, &unsent) ? (uint32_t)unsent : 0;
+
+                return 0;
+#else
+                memset(&info, 0, sizeof(info));
+                return UV_ENOTSUP;
+#endif
+            }
+
             int Bind(const Endpoint& endpoint, unsigned int flags = 0)
             {
                 struct sockaddr_in addr;
@@ -118,7 +717,7 @@ namespace io_simplify {
                         break;
                     }
                     
-                    res = uv_tcp_bind(Handle<uv_tcp_t>::uv, (const struct sockaddr*)&addr, flags);
+                    res = Bind((const struct sockaddr*)&addr, flags);
                 } while (false);
                 
                 return res;
@@ -126,7 +725,13 @@ namespace io_simplify {
 
             int Bind(const struct sockaddr *addr, unsigned int flags = 0)
             {
-                return uv_tcp_bind(Handle<uv_tcp_t>::uv, addr, flags);
+                int res = uv_tcp_bind(Handle<uv_tcp_t>::uv, addr, flags);
+                if (0 == res)
+                {
+                    applyTuning();
+                }
+
+                return res;
             }
 
             int Listen(const CallbackListen& callback_listen, int backlog = 0)
@@ -138,7 +743,18 @@ namespace io_simplify {
 
             int Accept(TcpHandle* client_handle)
             {
-                return uv_accept(_stream, client_handle->_stream);
+                int res = uv_accept(_stream, client_handle->_stream);
+                if (0 == res)
+                {
+                    if (nullptr == client_handle->_tuning)
+                    {
+                        client_handle->_tuning = _tuning;
+                    }
+
+                    client_handle->applyTuning();
+                }
+
+                return res;
             }
 
             int Connect(uv_connect_t *req, const Endpoint& endpoint, const CallbackConnect& callback_connect)
@@ -152,9 +768,7 @@ namespace io_simplify {
                         break;
                     }
                     
-                    _callback_connect = callback_connect;
-
-                    res = uv_tcp_connect(req, Handle<uv_tcp_t>::uv, (const struct sockaddr*)&addr, callback_uv_connect);
+                    res = Connect(req, (const struct sockaddr*)&addr, callback_connect);
                 } while (false);
                 
                 return res;
@@ -163,8 +777,21 @@ namespace io_simplify {
             int Connect(uv_connect_t *req, const struct sockaddr *addr, const CallbackConnect& callback_connect)
             {
                 _callback_connect = callback_connect;
-                    
-                return uv_tcp_connect(req, Handle<uv_tcp_t>::uv, addr, callback_uv_connect);
+
+                // before the SYN when the socket already exists, right after it otherwise
+                bool tuned = nullptr != _tuning && descriptor() >= 0;
+                if (tuned)
+                {
+                    applyTuning();
+                }
+
+                int res = uv_tcp_connect(req, Handle<uv_tcp_t>::uv, addr, callback_uv_connect);
+                if (0 == res && !tuned)
+                {
+                    applyTuning();
+                }
+
+                return res;
             }
 
             int GetEndpoint(Endpoint& endpoint)
@@ -199,6 +826,18 @@ namespace io_simplify {
                 return uv_read_start(_stream, callback_uv_alloc, callback_uv_read);
             }
 
+            /*
+                Reads into buffers of the loop's ReadBufferPool, sized to this connection's recent reads and taken back as
+                soon as callback_read returns: consume or copy the data inside the callback. An idle connection holds no
+                read buffer.
+            */
+            int StartAdaptiveRead(const CallbackRead& callback_read)
+            {
+                _callback_read = callback_read;
+
+                return uv_read_start(_stream, callback_uv_adaptive_alloc, callback_uv_adaptive_read);
+            }
+
             void StopRead()
             {
                 /*
@@ -216,9 +855,289 @@ namespace io_simplify {
             {
                 _callback_written = callback_written;
 
+                LIBUV_TRACE_BYTES_OUT(this, bufs, nbufs);
+
                 return uv_write(req, _stream, bufs, nbufs, callback_uv_written);
             }
 
+            int Write(WriteRequest* write_request,
+                       const uv_buf_t* bufs,
+                       unsigned int nbufs)
+            {
+                LIBUV_TRACE_BYTES_OUT(this, bufs, nbufs);
+
+                return uv_write(&(write_request->req), _stream, bufs, nbufs, callback_uv_request_written);
+            }
+
+            /*
+                Copies bufs next to a write request allocated from the loop arena and writes them; both go back to the arena
+                once the write completed. Meant for small fire-and-forget payloads, the caller's buffers are free on return.
+                Writes failing after the call, including those cancelled by Close, are counted in CopyFailures.
+            */
+            int WriteCopy(const uv_buf_t* bufs, unsigned int nbufs)
+            {
+                size_t size = 0;
+                for (unsigned int i = 0; i < nbufs; ++i)
+                {
+                    size += bufs[i].len;
+                }
+
+                uv_write_t* req = (uv_write_t*)(Handle<uv_tcp_t>::loop->arena.Allocate(sizeof(uv_write_t) + size));
+                if (nullptr == req)
+                {
+                    return UV_ENOMEM;
+                }
+
+                char* data = (char*)(req + 1);
+
+                size_t offset = 0;
+                for (unsigned int i = 0; i < nbufs; ++i)
+                {
+                    memcpy(data + offset, bufs[i].base, bufs[i].len);
+                    offset += bufs[i].len;
+                }
+
+                uv_buf_t buf = uv_buf_init(data, (unsigned int)size);
+
+                LIBUV_TRACE_BYTES_OUT(this, &buf, 1);
+
+                int res = uv_write(req, _stream, &buf, 1, callback_uv_copy_written);
+                if (res < 0)
+                {
+                    Handle<uv_tcp_t>::loop->arena.Free(req);
+                }
+
+                return res;
+            }
+
+            uint64_t CopyFailures() const
+            {
+                return _copy_failures;
+            }
+
+            /*
+                Lets any thread write to this handle through WriteThreadSafe, flushed on the loop thread by dispatcher
+                (one per loop, shared by its handles). Call on the loop thread before the first producer starts;
+                every producer must have returned from its last WriteThreadSafe before the handle is closed.
+            */
+            int EnableThreadSafeWrite(WriteDispatcher* dispatcher)
+            {
+                if (nullptr != _cross_thread_queue)
+                {
+                    return UV_EALREADY;
+                }
+
+                CrossThreadQueue* queue = new (std::nothrow) CrossThreadQueue();
+                if (nullptr == queue)
+                {
+                    return UV_ENOMEM;
+                }
+
+                queue->messages.store(nullptr, std::memory_order_relaxed);
+                queue->scheduled.store(false, std::memory_order_relaxed);
+                queue->references.store(1, std::memory_order_relaxed);
+                queue->next_scheduled = nullptr;
+                queue->handle = this;
+                queue->dispatcher = dispatcher;
+
+                _cross_thread_queue = queue;
+
+                return 0;
+            }
+
+            /*
+                Safe from any thread once EnableThreadSafeWrite was called. bufs are copied into one message and pushed
+                onto the handle's lock-free queue; only the first message after a drain wakes the loop. Everything queued
+                by then leaves in one vectored write, in the order it was queued.
+                Failures of that write only show in the trace counters.
+            */
+            int WriteThreadSafe(const uv_buf_t* bufs, unsigned int nbufs)
+            {
+                CrossThreadQueue* queue = _cross_thread_queue;
+                if (nullptr == queue)
+                {
+                    return UV_EINVAL;
+                }
+
+                size_t size = 0;
+                for (unsigned int i = 0; i < nbufs; ++i)
+                {
+                    size += bufs[i].len;
+                }
+
+                CrossThreadMessage* message = (CrossThreadMessage*)malloc(sizeof(CrossThreadMessage) + size);
+                if (nullptr == message)
+                {
+                    return UV_ENOMEM;
+                }
+
+                message->size = size;
+
+                char* data = (char*)(message + 1);
+                for (unsigned int i = 0; i < nbufs; ++i)
+                {
+                    memcpy(data, bufs[i].base, bufs[i].len);
+                    data += bufs[i].len;
+                }
+
+                message->next = queue->messages.load(std::memory_order_relaxed);
+                while (!queue->messages.compare_exchange_weak(message->next, message))
+                {
+                }
+
+                // pairs with the loop clearing scheduled before it takes the messages
+                if (queue->scheduled.exchange(true))
+                {
+                    return 0;
+                }
+
+                queue->references.fetch_add(1, std::memory_order_relaxed);
+
+                return queue->dispatcher->schedule(queue);
+            }
+
+            /*
+                Appends everything this handle reads to capture, tagged with connection, until the stream ends or
+                StopCapture; the capture must belong to this handle's loop.
+            */
+            void StartCapture(Capture* capture, uint64_t connection)
+            {
+                _capture = capture;
+                _capture_connection = connection;
+
+                _capture->Record(Capture::RECORD_OPEN, connection, nullptr, 0);
+            }
+
+            void StopCapture()
+            {
+                if (nullptr != _capture)
+                {
+                    _capture->Record(Capture::RECORD_CLOSE, _capture_connection, nullptr, 0);
+                    _capture = nullptr;
+                }
+            }
+
+        protected:
+            // Close stops thread-safe writes, messages not flushed yet are dropped
+            void closing() override
+            {
+                detachQueue();
+
+                StopCapture();
+
+                stopWritablePoll();
+            }
+
+        public:
+            /*
+                Per-loop side of WriteThreadSafe: handles with queued messages register here, at most once per drain,
+                and a single async wakeup flushes all of them. Close it after the handles using it.
+            */
+            class WriteDispatcher : public Handle<uv_async_t>
+            {
+                friend class TcpHandle;
+
+            private:
+                std::atomic<CrossThreadQueue*> _scheduled; // newest first
+
+                std::vector<uv_buf_t> _bufs;
+
+            private:
+                static void callback_uv_async(uv_async_t* handle)
+                {
+                    WriteDispatcher* write_dispatcher = (WriteDispatcher*)(handle->data);
+
+                    LIBUV_WATCHDOG_CALLBACK(write_dispatcher, TRACE_CALLBACK_ASYNC);
+
+                    write_dispatcher->drain();
+                }
+
+                int schedule(CrossThreadQueue* queue)
+                {
+                    CrossThreadQueue* head = _scheduled.load(std::memory_order_relaxed);
+                    do
+                    {
+                        queue->next_scheduled = head;
+                    } while (!_scheduled.compare_exchange_weak(head, queue, std::memory_order_release, std::memory_order_relaxed));
+
+                    // whoever found the list empty has woken the loop already
+                    if (nullptr != head)
+                    {
+                        return 0;
+                    }
+
+                    return uv_async_send(Handle<uv_async_t>::uv);
+                }
+
+                void drain()
+                {
+                    CrossThreadQueue* queue = _scheduled.exchange(nullptr, std::memory_order_acquire);
+
+                    // flush handles in the order they were scheduled
+                    CrossThreadQueue* oldest = nullptr;
+                    while (nullptr != queue)
+                    {
+                        CrossThreadQueue* next = queue->next_scheduled;
+
+                        queue->next_scheduled = oldest;
+                        oldest = queue;
+
+                        queue = next;
+                    }
+
+                    while (nullptr != oldest)
+                    {
+                        CrossThreadQueue* next = oldest->next_scheduled;
+
+                        oldest->scheduled.store(false);
+
+                        CrossThreadMessage* messages = oldest->messages.exchange(nullptr);
+                        if (nullptr != oldest->handle && nullptr != messages)
+                        {
+                            oldest->handle->flushQueue(messages, _bufs);
+                        }
+                        else
+                        {
+                            freeMessages(messages);
+                        }
+
+                        releaseQueue(oldest);
+
+                        oldest = next;
+                    }
+                }
+
+            public:
+                explicit WriteDispatcher(Loop* loop)
+                    : Handle<uv_async_t>(loop)
+
+                    , _scheduled(nullptr)
+                    , _bufs()
+                {
+                    Handle<uv_async_t>::status = uv_async_init(loop->uv, Handle<uv_async_t>::uv, callback_uv_async);
+                }
+
+                ~WriteDispatcher()
+                {
+                }
+
+            protected:
+                // Close flushes what is still queued first
+                void closing() override
+                {
+                    drain();
+                }
+
+            private:
+                WriteDispatcher() = delete;
+
+                WriteDispatcher(const WriteDispatcher&) = delete;
+                WriteDispatcher& operator=(const WriteDispatcher&) = delete;
+
+                WriteDispatcher(WriteDispatcher&&) = delete;
+                WriteDispatcher& operator=(WriteDispatcher&&) = delete;
+            };
+
         private:
             TcpHandle() = delete;
 
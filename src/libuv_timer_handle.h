@@ -0,0 +1,94 @@
+#ifndef IO_SIMPLIFY_LIBUV_TIMER_HANDLE_H
+#define IO_SIMPLIFY_LIBUV_TIMER_HANDLE_H
+
+#include "libuv_loop.h"
+
+#include "libuv_handle.h"
+
+namespace io_simplify {
+
+    namespace libuv {
+
+        class TimerHandle : public Handle<uv_timer_t>
+        {
+        public:
+            using CallbackTimer = std::function<void()>;
+
+        private:
+            CallbackTimer _callback_timer;
+
+        private:
+            static void callback_uv_timer(uv_timer_t* handle)
+            {
+                TimerHandle* timer_handle = (TimerHandle*)(handle->data);
+
+                LIBUV_WATCHDOG_CALLBACK(timer_handle, TRACE_CALLBACK_TIMER);
+
+                timer_handle->_callback_timer();
+            }
+
+        public:
+            explicit TimerHandle(Loop* loop)
+                : Handle<uv_timer_t>(loop)
+
+                , _callback_timer()
+            {
+                Handle<uv_timer_t>::status = uv_timer_init(loop->uv, Handle<uv_timer_t>::uv);
+            }
+
+            ~TimerHandle()
+            {
+            }
+
+            /*
+                timeout and repeat are in milliseconds.
+                If timeout is zero, the callback fires on the next event loop iteration. 
+                If repeat is non-zero, the callback fires first after timeout milliseconds and then repeatedly after repeat milliseconds.
+            */
+            int Start(const CallbackTimer& callback_timer, uint64_t timeout, uint64_t repeat = 0)
+            {
+                _callback_timer = callback_timer;
+
+                return uv_timer_start(Handle<uv_timer_t>::uv, callback_uv_timer, timeout, repeat);
+            }
+
+            void Stop()
+            {
+                uv_timer_stop(Handle<uv_timer_t>::uv);
+            }
+
+            // Stop the timer, and if it is repeating restart it using the repeat value as the timeout.
+            int Again()
+            {
+                return uv_timer_again(Handle<uv_timer_t>::uv);
+            }
+
+            void SetRepeat(uint64_t repeat)
+            {
+                uv_timer_set_repeat(Handle<uv_timer_t>::uv, repeat);
+            }
+
+            // milliseconds until the timer fires, 0 when expired or stopped
+            uint64_t DueIn() const
+            {
+                return uv_timer_get_due_in(Handle<uv_timer_t>::uv);
+            }
+
+            bool IsActive() const
+            {
+                return 0 != uv_is_active((const uv_handle_t*)(Handle<uv_timer_t>::uv));
+            }
+
+        private:
+            TimerHandle() = delete;
+
+            TimerHandle(const TimerHandle&) = delete;
+            TimerHandle& operator=(const TimerHandle&) = delete;
+
+            TimerHandle(TimerHandle&&) = delete;
+            TimerHandle& operator=(TimerHandle&&) = delete;
+        };
+    }
+}
+
+#endif
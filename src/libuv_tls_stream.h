@@ -0,0 +1,1367 @@
+#ifndef IO_SIMPLIFY_LIBUV_TLS_STREAM_H
+#define IO_SIMPLIFY_LIBUV_TLS_STREAM_H
+
+#include "libuv_loop.h"
+#include "libuv_mutex.h"
+
+#include "libuv_tcp_handle.h"
+
+#include <atomic>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <openssl/bio.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+// kernel TLS transmit offload, Linux only; define IO_SIMPLIFY_LIBUV_NO_KTLS to leave it out
+#if defined(__linux__) && !defined(OPENSSL_NO_KTLS) && !defined(IO_SIMPLIFY_LIBUV_NO_KTLS)
+#define IO_SIMPLIFY_LIBUV_KTLS
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+#include <linux/tls.h>
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#endif
+
+namespace io_simplify {
+
+    namespace libuv {
+
+        /*
+            Certificates, verification settings and session caches shared by the TlsStreams of one side (server or
+            client), on any number of loops as long as it is configured before the first stream is created. The client
+            session cache is locked and the statistics are atomic, Snapshot them from any thread.
+
+            Servers resume sessions from OpenSSL's cache (TLS 1.2 session ids) and from tickets (TLS 1.3); clients keep
+            the last session received per server name and offer it on the next Handshake to that name.
+
+            Uses OpenSSL. Build with LIBUV_SIMPLIFY_OPENSSL=ON, or link libssl and libcrypto yourself.
+        */
+        class TlsContext
+        {
+            friend class TlsStream;
+
+        public:
+            struct Statistics
+            {
+                uint64_t handshakes = 0;
+                uint64_t resumed = 0; // handshakes that resumed a cached session
+                uint64_t failed = 0;
+                uint64_t kernel_tx = 0; // handshakes that moved record encryption to the kernel
+
+                uint64_t files_sent = 0;
+                uint64_t file_bytes = 0;
+            };
+
+        private:
+            SSL_CTX* _ctx;
+            bool _server;
+
+            // client side: last session per server name, evicted oldest first
+            Mutex _mutex;
+            std::unordered_map<std::string, SSL_SESSION*> _sessions;
+            std::deque<std::string> _session_order;
+            size_t _max_sessions;
+
+            std::atomic<uint64_t> _handshakes;
+            std::atomic<uint64_t> _resumed;
+            std::atomic<uint64_t> _failed;
+            std::atomic<uint64_t> _kernel_tx;
+
+            std::atomic<uint64_t> _files_sent;
+            std::atomic<uint64_t> _file_bytes;
+
+        private:
+            static int callback_new_session(SSL* ssl, SSL_SESSION* session)
+            {
+                TlsContext* context = (TlsContext*)SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+
+                const char* server_name = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+                if (nullptr == server_name || 0 == context->_max_sessions)
+                {
+                    return 0;
+                }
+
+                context->_mutex.Lock();
+
+                auto it = context->_sessions.find(server_name);
+                if (context->_sessions.end() != it)
+                {
+                    SSL_SESSION_free(it->second);
+                    it->second = session;
+                }
+                else
+                {
+                    if (context->_sessions.size() >= context->_max_sessions)
+                    {
+                        auto oldest = context->_sessions.find(context->_session_order.front());
+                        SSL_SESSION_free(oldest->second);
+                        context->_sessions.erase(oldest);
+                        context->_session_order.pop_front();
+                    }
+
+                    context->_sessions.emplace(server_name, session);
+                    context->_session_order.emplace_back(server_name);
+                }
+
+                context->_mutex.Unlock();
+
+                // the cache keeps the reference OpenSSL handed over
+                return 1;
+            }
+
+            // under the lock, a stream on another loop may replace and free the cached session meanwhile
+            void resumeSession(SSL* ssl, const char* server_name)
+            {
+                _mutex.Lock();
+
+                auto it = _sessions.find(server_name);
+                if (_sessions.end() != it)
+                {
+                    SSL_set_session(ssl, it->second);
+                }
+
+                _mutex.Unlock();
+            }
+
+            static void bump(std::atomic<uint64_t>& value, uint64_t delta = 1)
+            {
+                value.fetch_add(delta, std::memory_order_relaxed);
+            }
+
+        public:
+            /*
+                server: accepting side, needs UseCertificate before the first handshake.
+                max_sessions: sessions cached, by OpenSSL on a server, by server name on a client; 0 disables resumption.
+            */
+            explicit TlsContext(bool server, size_t max_sessions = 1024)
+                : _ctx(SSL_CTX_new(server ? TLS_server_method() : TLS_client_method()))
+                , _server(server)
+
+                , _mutex()
+                , _sessions()
+                , _session_order()
+                , _max_sessions(max_sessions)
+
+                , _handshakes(0)
+                , _resumed(0)
+                , _failed(0)
+                , _kernel_tx(0)
+
+                , _files_sent(0)
+                , _file_bytes(0)
+            {
+                if (nullptr == _ctx)
+                {
+                    return;
+                }
+
+                SSL_CTX_set_app_data(_ctx, this);
+                SSL_CTX_set_min_proto_version(_ctx, TLS1_2_VERSION);
+                SSL_CTX_set_mode(_ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+#ifdef IO_SIMPLIFY_LIBUV_KTLS
+                SSL_CTX_set_options(_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+                if (0 == max_sessions)
+                {
+                    SSL_CTX_set_session_cache_mode(_ctx, SSL_SESS_CACHE_OFF);
+                    SSL_CTX_set_options(_ctx, SSL_OP_NO_TICKET);
+                }
+                else if (server)
+                {
+                    static const unsigned char SESSION_ID_CONTEXT[] = "io_simplify";
+
+                    SSL_CTX_set_session_cache_mode(_ctx, SSL_SESS_CACHE_SERVER);
+                    SSL_CTX_sess_set_cache_size(_ctx, (long)max_sessions);
+                    SSL_CTX_set_session_id_context(_ctx, SESSION_ID_CONTEXT, sizeof(SESSION_ID_CONTEXT) - 1);
+                }
+                else
+                {
+                    SSL_CTX_set_session_cache_mode(_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+                    SSL_CTX_sess_set_new_cb(_ctx, callback_new_session);
+                }
+            }
+
+            // after every stream of the context is deleted
+            ~TlsContext()
+            {
+                for (auto& session : _sessions)
+                {
+                    SSL_SESSION_free(session.second);
+                }
+
+                SSL_CTX_free(_ctx);
+            }
+
+            // PEM files, the chain starting with the leaf certificate
+            int UseCertificate(const char* certificate_chain_file, const char* private_key_file)
+            {
+                if (nullptr == _ctx)
+                {
+                    return UV_ENOMEM;
+                }
+
+                if (1 != SSL_CTX_use_certificate_chain_file(_ctx, certificate_chain_file) ||
+                    1 != SSL_CTX_use_PrivateKey_file(_ctx, private_key_file, SSL_FILETYPE_PEM) ||
+                    1 != SSL_CTX_check_private_key(_ctx))
+                {
+                    return UV_EINVAL;
+                }
+
+                return 0;
+            }
+
+            /*
+                Verifies the peer's certificate against ca_file, or the system's default locations when null. Clients also
+                check the certificate matches the server name given to Handshake.
+            */
+            int Verify(const char* ca_file = nullptr)
+            {
+                if (nullptr == _ctx)
+                {
+                    return UV_ENOMEM;
+                }
+
+                int res = nullptr == ca_file ? SSL_CTX_set_default_verify_paths(_ctx) : SSL_CTX_load_verify_locations(_ctx, ca_file, nullptr);
+                if (1 != res)
+                {
+                    return UV_EINVAL;
+                }
+
+                SSL_CTX_set_verify(_ctx, _server ? (SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT) : SSL_VERIFY_PEER, nullptr);
+
+                return 0;
+            }
+
+            // on by default where OpenSSL and the headers support it, the kernel still needs the tls module loaded
+            void EnableKernelTls(bool enable)
+            {
+#ifdef IO_SIMPLIFY_LIBUV_KTLS
+                if (nullptr == _ctx)
+                {
+                    return;
+                }
+
+                if (enable)
+                {
+                    SSL_CTX_set_options(_ctx, SSL_OP_ENABLE_KTLS);
+                }
+                else
+                {
+                    SSL_CTX_clear_options(_ctx, SSL_OP_ENABLE_KTLS);
+                }
+#endif
+            }
+
+            // for settings not wrapped here: ciphers, ALPN, protocol versions
+            SSL_CTX* Native()
+            {
+                return _ctx;
+            }
+
+            // safe from any thread
+            void Snapshot(Statistics& statistics) const
+            {
+                statistics.handshakes = _handshakes.load(std::memory_order_relaxed);
+                statistics.resumed = _resumed.load(std::memory_order_relaxed);
+                statistics.failed = _failed.load(std::memory_order_relaxed);
+                statistics.kernel_tx = _kernel_tx.load(std::memory_order_relaxed);
+
+                statistics.files_sent = _files_sent.load(std::memory_order_relaxed);
+                statistics.file_bytes = _file_bytes.load(std::memory_order_relaxed);
+            }
+
+        private:
+            TlsContext() = delete;
+
+            TlsContext(const TlsContext&) = delete;
+            TlsContext& operator=(const TlsContext&) = delete;
+
+            TlsContext(TlsContext&&) = delete;
+            TlsContext& operator=(TlsContext&&) = delete;
+        };
+
+        /*
+            TLS over a connected TcpHandle, driven from the handle's read and write callbacks through a BIO that reads
+            from the stream's input buffer and appends to its output, which leaves in one write per callback turn.
+
+            Once the handshake settles the application traffic keys, OpenSSL offers them to the BIO, which hands the
+            transmit direction to the kernel (TCP_ULP "tls" + TLS_TX) when the tls module is loaded: Write then puts
+            plaintext on the socket and the kernel builds the records, and SendFile streams a file with sendfile(2)
+            without it ever entering user space. Without kernel support the stream stays in user space, KernelTx()
+            tells which one is in use. Receive keys stay in user space: records already read into the input buffer
+            past the key change could not be handed back to the kernel.
+
+            Plaintext is delivered to CallbackRead from a buffer owned by the stream, valid during the callback only.
+            A peer's close_notify or a TCP EOF reports UV_EOF, a TLS failure UV_EPROTO.
+
+            Close the stream, then the TcpHandle once the stream's close callback ran, and delete the stream after that.
+        */
+        class TlsStream
+        {
+        public:
+            using CallbackHandshake = std::function<void(int status)>;
+            using CallbackFileSent = std::function<void(int status, size_t sent)>;
+            using CallbackStreamClosed = std::function<void()>;
+
+        private:
+            // OpenSSL's internal BIO controls for kernel TLS, see the comment next to BIO_CTRL_GET_KTLS_SEND in bio.h
+            static constexpr int CTRL_SET_KTLS = 72;
+            static constexpr int CTRL_SET_KTLS_SEND_CTRL_MSG = 74;
+            static constexpr int CTRL_CLEAR_KTLS_CTRL_MSG = 75;
+
+            static constexpr size_t INPUT_MIN_READ = 16 * 1024;
+            static constexpr size_t PLAINTEXT_SIZE = 16 * 1024;
+
+            // file bytes sent per writable callback before the rest of the loop gets a turn
+            static constexpr size_t FILE_TURN_SIZE = 4 * 1024 * 1024;
+
+            struct OutputRequest : public TcpHandle::WriteRequest
+            {
+                TlsStream* stream;
+            };
+
+            struct FileTransfer
+            {
+                uv_file file;
+                int64_t offset;
+                size_t length;
+                size_t sent;
+                int result;
+
+                CallbackFileSent callback_file_sent;
+            };
+
+        private:
+            TlsContext* _context;
+            TcpHandle* _tcp;
+
+            SSL* _ssl;
+
+            // unread ciphertext is [_input_begin, _input_end)
+            std::vector<char> _input;
+            size_t _input_begin;
+            size_t _input_end;
+
+            std::vector<char> _plaintext;
+
+            // produced by OpenSSL (or plaintext under kernel TLS) is appended to _output, _writing is in flight
+            std::string _output;
+            std::string _writing;
+            OutputRequest _output_request;
+
+            // plaintext written before the handshake completed, or while a file is being sent
+            std::string _held;
+
+            FileTransfer _file;
+            bool _file_pending;
+            bool _file_active;
+
+            CallbackHandshake _callback_handshake;
+            CallbackRead _callback_read;
+
+            int _fd;
+            int _record_type; // set while OpenSSL writes a control record under kernel TLS
+            int _write_error;
+
+            bool _established;
+            bool _kernel_tx;
+            bool _retry_write;
+            bool _driving;
+            bool _read_done;
+            bool _shutdown_sent;
+            bool _closing;
+            bool _closed;
+            CallbackStreamClosed _callback_stream_closed;
+
+        private:
+            static BIO_METHOD* bioMethod()
+            {
+                static BIO_METHOD* method = [] () {
+                    BIO_METHOD* created = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "io_simplify tls stream");
+                    if (nullptr != created)
+                    {
+                        BIO_meth_set_write(created, callback_bio_write);
+                        BIO_meth_set_read(created, callback_bio_read);
+                        BIO_meth_set_ctrl(created, callback_bio_ctrl);
+                    }
+                    return created;
+                }();
+
+                return method;
+            }
+
+            static int callback_bio_write(BIO* bio, const char* data, int size)
+            {
+                return ((TlsStream*)BIO_get_data(bio))->bioWrite(bio, data, size);
+            }
+
+            static int callback_bio_read(BIO* bio, char* data, int size)
+            {
+                return ((TlsStream*)BIO_get_data(bio))->bioRead(bio, data, size);
+            }
+
+            static long callback_bio_ctrl(BIO* bio, int cmd, long num, void* ptr)
+            {
+                return ((TlsStream*)BIO_get_data(bio))->bioCtrl(cmd, num, ptr);
+            }
+
+            static void callback_output_written(TcpHandle::WriteRequest* write_request, int status)
+            {
+                ((OutputRequest*)(write_request))->stream->written(status);
+            }
+
+            int bioWrite(BIO* bio, const char* data, int size)
+            {
+                BIO_clear_retry_flags(bio);
+
+#ifdef IO_SIMPLIFY_LIBUV_KTLS
+                if (0 != _record_type)
+                {
+                    return writeControlRecord(bio, data, size);
+                }
+#endif
+
+                _output.append(data, (size_t)size);
+
+                return size;
+            }
+
+            int bioRead(BIO* bio, char* data, int size)
+            {
+                BIO_clear_retry_flags(bio);
+
+                size_t available = _input_end - _input_begin;
+                if (0 == available)
+                {
+                    BIO_set_retry_read(bio);
+                    return -1;
+                }
+
+                size_t count = available < (size_t)size ? available : (size_t)size;
+
+                memcpy(data, _input.data() + _input_begin, count);
+                _input_begin += count;
+
+                return (int)count;
+            }
+
+            long bioCtrl(int cmd, long num, void* ptr)
+            {
+                switch (cmd)
+                {
+                case BIO_CTRL_FLUSH:
+                    // output leaves at the end of the current callback, kernel TLS drains it itself
+                    return 1;
+                case BIO_CTRL_PENDING:
+                    return (long)(_input_end - _input_begin);
+                case BIO_CTRL_WPENDING:
+                    return (long)_output.size();
+#ifdef IO_SIMPLIFY_LIBUV_KTLS
+                case CTRL_SET_KTLS:
+                    return enableKernelTx(0 != num, ptr) ? 1 : 0;
+                case BIO_CTRL_GET_KTLS_SEND:
+                    return _kernel_tx ? 1 : 0;
+                case CTRL_SET_KTLS_SEND_CTRL_MSG:
+                    _record_type = (int)num;
+                    return 1;
+                case CTRL_CLEAR_KTLS_CTRL_MSG:
+                    _record_type = 0;
+                    return 1;
+#endif
+                default:
+                    return 0;
+                }
+            }
+
+            // writes what is left of _output without queueing, so that nothing is left for the socket's previous keys
+            bool drainOutput()
+            {
+                if (_file_active || 0 != uv_stream_get_write_queue_size((uv_stream_t*)(_tcp->uv)))
+                {
+                    return false;
+                }
+
+                while (!_output.empty())
+                {
+                    uv_buf_t buf = uv_buf_init(_output.data(), (unsigned int)_output.size());
+
+                    int res = uv_try_write((uv_stream_t*)(_tcp->uv), &buf, 1);
+                    if (res <= 0)
+                    {
+                        return false;
+                    }
+
+                    _output.erase(0, (size_t)res);
+                }
+
+                return true;
+            }
+
+#ifdef IO_SIMPLIFY_LIBUV_KTLS
+            static size_t cryptoInfoSize(uint16_t cipher_type)
+            {
+                switch (cipher_type)
+                {
+                case TLS_CIPHER_AES_GCM_128:
+                    return sizeof(struct tls12_crypto_info_aes_gcm_128);
+#ifdef TLS_CIPHER_AES_GCM_256
+                case TLS_CIPHER_AES_GCM_256:
+                    return sizeof(struct tls12_crypto_info_aes_gcm_256);
+#endif
+#ifdef TLS_CIPHER_AES_CCM_128
+                case TLS_CIPHER_AES_CCM_128:
+                    return sizeof(struct tls12_crypto_info_aes_ccm_128);
+#endif
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+                case TLS_CIPHER_CHACHA20_POLY1305:
+                    return sizeof(struct tls12_crypto_info_chacha20_poly1305);
+#endif
+                default:
+                    return 0;
+                }
+            }
+
+            /*
+                crypto_info starts with the kernel's struct tls_crypto_info; its size follows from the cipher rather than
+                from OpenSSL's wrapper, whose layout is private. Declining leaves the direction in user space.
+            */
+            bool enableKernelTx(bool transmit, void* crypto_info)
+            {
+                if (!transmit || _fd < 0 || !drainOutput())
+                {
+                    return false;
+                }
+
+                size_t size = cryptoInfoSize(((struct tls_crypto_info*)crypto_info)->cipher_type);
+                if (0 == size)
+                {
+                    return false;
+                }
+
+                if (setsockopt(_fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0 && EEXIST != errno)
+                {
+                    return false;
+                }
+
+                if (setsockopt(_fd, SOL_TLS, TLS_TX, crypto_info, (socklen_t)size) < 0)
+                {
+                    return false;
+                }
+
+                _kernel_tx = true;
+
+                return true;
+            }
+
+            // handshake messages and alerts under kernel TLS: the record type travels in a control message
+            int writeControlRecord(BIO* bio, const char* data, int size)
+            {
+                if (!drainOutput())
+                {
+                    BIO_set_retry_write(bio);
+                    return -1;
+                }
+
+                char control[CMSG_SPACE(sizeof(unsigned char))];
+                memset(control, 0, sizeof(control));
+
+                struct iovec iov;
+                iov.iov_base = (void*)data;
+                iov.iov_len = (size_t)size;
+
+                struct msghdr message;
+                memset(&message, 0, sizeof(message));
+                message.msg_iov = &iov;
+                message.msg_iovlen = 1;
+                message.msg_control = control;
+                message.msg_controllen = sizeof(control);
+
+                struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+                header->cmsg_level = SOL_TLS;
+                header->cmsg_type = TLS_SET_RECORD_TYPE;
+                header->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+                *CMSG_DATA(header) = (unsigned char)_record_type;
+
+                ssize_t sent = sendmsg(_fd, &message, MSG_NOSIGNAL);
+                if (sent < 0)
+                {
+                    if (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno)
+                    {
+                        BIO_set_retry_write(bio);
+                    }
+                    return -1;
+                }
+
+                // OpenSSL does not clear the type itself, a partial write keeps it for the rest
+                if (sent == (ssize_t)size)
+                {
+                    _record_type = 0;
+                }
+
+                return (int)sent;
+            }
+
+            // on the loop thread whenever the socket is writable; the socket is non-blocking, so stop once it is full
+            void sendFile()
+            {
+                size_t turn = 0;
+
+                while (_file.sent < _file.length && turn < FILE_TURN_SIZE)
+                {
+                    size_t chunk = _file.length - _file.sent;
+                    if (chunk > FILE_TURN_SIZE - turn)
+                    {
+                        chunk = FILE_TURN_SIZE - turn;
+                    }
+
+                    off_t offset = (off_t)(_file.offset + (int64_t)_file.sent);
+
+                    ssize_t res = ::sendfile(_fd, _file.file, &offset, chunk);
+                    if (res > 0)
+                    {
+                        _file.sent += (size_t)res;
+                        turn += (size_t)res;
+                        continue;
+                    }
+
+                    if (0 == res)
+                    {
+                        // the file is shorter than requested
+                        _file.result = UV_EOF;
+                        fileSent();
+                        return;
+                    }
+
+                    if (EINTR == errno)
+                    {
+                        continue;
+                    }
+
+                    if (EAGAIN != errno && EWOULDBLOCK != errno)
+                    {
+                        _file.result = -errno;
+                        fileSent();
+                        return;
+                    }
+
+                    break;
+                }
+
+                if (_file.sent == _file.length)
+                {
+                    fileSent();
+                    return;
+                }
+
+                int res = waitWritable();
+                if (res < 0)
+                {
+                    _file.result = res;
+                    fileSent();
+                }
+            }
+#else
+            void sendFile()
+            {
+                _file.result = UV_ENOTSUP;
+                fileSent();
+            }
+#endif
+
+            // the file goes out from the TcpHandle's writable poll, on its own descriptor of the socket
+            int waitWritable()
+            {
+                return _tcp->NotifyWritable(
+                    [this] (int status) {
+                        if (status < 0)
+                        {
+                            _file.result = status;
+                            fileSent();
+                            return;
+                        }
+
+                        sendFile();
+                    });
+            }
+
+            void startFile()
+            {
+                if (!_file_pending || !_writing.empty() || !_output.empty() ||
+                    0 != uv_stream_get_write_queue_size((uv_stream_t*)(_tcp->uv)))
+                {
+                    return;
+                }
+
+                _file_pending = false;
+
+                int res = waitWritable();
+                if (res < 0)
+                {
+                    _file.result = res;
+                    finishFile();
+                    return;
+                }
+
+                _file_active = true;
+            }
+
+            void fileSent()
+            {
+                _file_active = false;
+
+                TlsContext::bump(_context->_files_sent);
+                TlsContext::bump(_context->_file_bytes, _file.sent);
+
+                finishFile();
+            }
+
+            void finishFile()
+            {
+                CallbackFileSent callback_file_sent = std::move(_file.callback_file_sent);
+                _file.callback_file_sent = nullptr;
+
+                if (_closing)
+                {
+                    shutdown();
+                }
+                else
+                {
+                    _output.append(_held);
+                    _held.clear();
+
+                    if (_retry_write)
+                    {
+                        _retry_write = false;
+                        drive();
+                    }
+                }
+
+                flush();
+
+                if (callback_file_sent)
+                {
+                    callback_file_sent(_file.result, _file.sent);
+                }
+
+                settle();
+            }
+
+            void flush()
+            {
+                if (_file_active || !_writing.empty() || _output.empty())
+                {
+                    return;
+                }
+
+                _writing.swap(_output);
+
+                uv_buf_t buf = uv_buf_init(_writing.data(), (unsigned int)_writing.size());
+
+                int res = _tcp->Write(&_output_request, &buf, 1);
+                if (res < 0)
+                {
+                    _writing.clear();
+                    _output.clear();
+                    _write_error = res;
+                    fail(res);
+                }
+            }
+
+            void written(int status)
+            {
+                _writing.clear();
+
+                if (status < 0)
+                {
+                    _output.clear();
+                    _write_error = status;
+                    fail(status);
+                    settle();
+                    return;
+                }
+
+                // a control record waited for the socket to drain
+                if (_retry_write && !_closing)
+                {
+                    _retry_write = false;
+                    drive();
+                }
+
+                if (_closing)
+                {
+                    shutdown();
+                }
+
+                flush();
+                startFile();
+                settle();
+            }
+
+            void fail(int status)
+            {
+                if (_read_done)
+                {
+                    return;
+                }
+
+                _read_done = true;
+                _tcp->StopRead();
+
+                if (_closing)
+                {
+                    return;
+                }
+
+                if (!_established)
+                {
+                    TlsContext::bump(_context->_failed);
+
+                    if (_callback_handshake)
+                    {
+                        _callback_handshake(status);
+                    }
+                }
+                else if (_callback_read)
+                {
+                    _callback_read(status, nullptr);
+                }
+            }
+
+            void established()
+            {
+                _established = true;
+
+                TlsContext::bump(_context->_handshakes);
+
+                if (SSL_session_reused(_ssl))
+                {
+                    TlsContext::bump(_context->_resumed);
+                }
+
+                if (_kernel_tx)
+                {
+                    TlsContext::bump(_context->_kernel_tx);
+                }
+
+                if (!_held.empty())
+                {
+                    std::string held;
+                    held.swap(_held);
+
+                    writePlaintext(held.data(), held.size());
+                }
+
+                if (_callback_handshake)
+                {
+                    _callback_handshake(0);
+                }
+            }
+
+            bool writePlaintext(const char* data, size_t size)
+            {
+                if (_kernel_tx)
+                {
+                    _output.append(data, size);
+                    return true;
+                }
+
+                while (size > 0)
+                {
+                    int chunk = size > (size_t)INT_MAX ? INT_MAX : (int)size;
+
+                    ERR_clear_error();
+
+                    int res = SSL_write(_ssl, data, chunk);
+                    if (res <= 0)
+                    {
+                        return false;
+                    }
+
+                    data += res;
+                    size -= (size_t)res;
+                }
+
+                return true;
+            }
+
+            // runs the handshake, then decrypts whatever the input holds
+            void drive()
+            {
+                if (_read_done || _closing)
+                {
+                    return;
+                }
+
+                _driving = true;
+
+                if (!_established)
+                {
+                    ERR_clear_error();
+
+                    int res = SSL_do_handshake(_ssl);
+                    if (1 != res)
+                    {
+                        int error = SSL_get_error(_ssl, res);
+
+                        _retry_write = SSL_ERROR_WANT_WRITE == error;
+
+                        // an alert may be waiting in the output
+                        flush();
+
+                        if (SSL_ERROR_WANT_READ != error && SSL_ERROR_WANT_WRITE != error)
+                        {
+                            fail(UV_EPROTO);
+                        }
+
+                        _driving = false;
+                        return;
+                    }
+
+                    established();
+                }
+
+                while (!_closing && !_read_done && _callback_read)
+                {
+                    ERR_clear_error();
+
+                    int res = SSL_read(_ssl, _plaintext.data(), (int)_plaintext.size());
+                    if (res > 0)
+                    {
+                        uv_buf_t buf = uv_buf_init(_plaintext.data(), (unsigned int)res);
+                        _callback_read(res, &buf);
+                        continue;
+                    }
+
+                    int error = SSL_get_error(_ssl, res);
+                    if (SSL_ERROR_WANT_READ == error || SSL_ERROR_WANT_WRITE == error)
+                    {
+                        _retry_write = SSL_ERROR_WANT_WRITE == error;
+                        break;
+                    }
+
+                    flush();
+                    fail(SSL_ERROR_ZERO_RETURN == error ? UV_EOF : UV_EPROTO);
+
+                    _driving = false;
+                    return;
+                }
+
+                _driving = false;
+
+                flush();
+            }
+
+            void read(ssize_t nread)
+            {
+                if (nread < 0)
+                {
+                    fail((int)nread);
+                    return;
+                }
+
+                _input_end += (size_t)nread;
+
+                drive();
+
+                if (_input_begin == _input_end)
+                {
+                    _input_begin = _input_end = 0;
+                }
+            }
+
+            void alloc(uv_buf_t* buf)
+            {
+                if (_input.size() - _input_end < INPUT_MIN_READ)
+                {
+                    size_t unread = _input_end - _input_begin;
+
+                    memmove(_input.data(), _input.data() + _input_begin, unread);
+                    _input_begin = 0;
+                    _input_end = unread;
+
+                    if (_input.size() - _input_end < INPUT_MIN_READ)
+                    {
+                        _input.resize(_input.size() * 2);
+                    }
+                }
+
+                buf->base = _input.data() + _input_end;
+                buf->len = _input.size() - _input_end;
+            }
+
+            // close_notify, retried once the socket drained if a control record could not go out
+            void shutdown()
+            {
+                if (_file_active)
+                {
+                    return;
+                }
+
+                if (!_established || _shutdown_sent || 0 != _write_error)
+                {
+                    _shutdown_sent = true;
+                    return;
+                }
+
+                ERR_clear_error();
+
+                int res = SSL_shutdown(_ssl);
+                if (res < 0 && SSL_ERROR_WANT_WRITE == SSL_get_error(_ssl, res) && !_writing.empty())
+                {
+                    return;
+                }
+
+                _shutdown_sent = true;
+
+                flush();
+            }
+
+            // the stream is closed once the output and any file left
+            void settle()
+            {
+                if (!_closing || _closed || !_writing.empty() || _file_pending || _file_active)
+                {
+                    return;
+                }
+
+                _closed = true;
+
+                if (_callback_stream_closed)
+                {
+                    _callback_stream_closed();
+                }
+            }
+
+        public:
+            TlsStream(TlsContext* context, TcpHandle* tcp)
+                : _context(context)
+                , _tcp(tcp)
+
+                , _ssl(nullptr)
+
+                , _input(64 * 1024)
+                , _input_begin(0)
+                , _input_end(0)
+
+                , _plaintext(PLAINTEXT_SIZE)
+
+                , _output()
+                , _writing()
+                , _output_request()
+
+                , _held()
+
+                , _file()
+                , _file_pending(false)
+                , _file_active(false)
+
+                , _callback_handshake()
+                , _callback_read()
+
+                , _fd(-1)
+                , _record_type(0)
+                , _write_error(0)
+
+                , _established(false)
+                , _kernel_tx(false)
+                , _retry_write(false)
+                , _driving(false)
+                , _read_done(false)
+                , _shutdown_sent(false)
+                , _closing(false)
+                , _closed(false)
+                , _callback_stream_closed()
+            {
+                _output_request.callback_written = callback_output_written;
+                _output_request.stream = this;
+
+                BIO_METHOD* method = bioMethod();
+                if (nullptr == context->_ctx || nullptr == method)
+                {
+                    return;
+                }
+
+                _ssl = SSL_new(context->_ctx);
+                if (nullptr == _ssl)
+                {
+                    return;
+                }
+
+                BIO* bio = BIO_new(method);
+                if (nullptr == bio)
+                {
+                    SSL_free(_ssl);
+                    _ssl = nullptr;
+                    return;
+                }
+
+                BIO_set_data(bio, this);
+                BIO_set_init(bio, 1);
+
+                // one reference serves both directions
+                SSL_set_bio(_ssl, bio, bio);
+                SSL_set_app_data(_ssl, this);
+
+                if (context->_server)
+                {
+                    SSL_set_accept_state(_ssl);
+                }
+                else
+                {
+                    SSL_set_connect_state(_ssl);
+                }
+            }
+
+            // the TcpHandle must be closed, its write callback refers to the stream
+            ~TlsStream()
+            {
+                SSL_free(_ssl);
+            }
+
+            /*
+                Starts reading the TcpHandle and runs the handshake; callback_handshake gets 0 once it completed, or the
+                failure. Clients pass the server name for SNI, certificate verification and the session cache.
+            */
+            int Handshake(const CallbackHandshake& callback_handshake, const char* server_name = nullptr)
+            {
+                if (nullptr == _ssl)
+                {
+                    return UV_ENOMEM;
+                }
+
+                if (_closing)
+                {
+                    return UV_EPIPE;
+                }
+
+                if (!_context->_server && nullptr != server_name)
+                {
+                    if (1 != SSL_set_tlsext_host_name(_ssl, server_name))
+                    {
+                        return UV_EINVAL;
+                    }
+
+                    if ((SSL_get_verify_mode(_ssl) & SSL_VERIFY_PEER) && 1 != SSL_set1_host(_ssl, server_name))
+                    {
+                        return UV_EINVAL;
+                    }
+
+                    _context->resumeSession(_ssl, server_name);
+                }
+
+                _callback_handshake = callback_handshake;
+
+                // a client's socket only exists once connected
+                uv_os_fd_t fd;
+                if (0 == uv_fileno(_tcp->uv_handle, &fd))
+                {
+                    _fd = (int)fd;
+                }
+
+                int res = _tcp->StartRead(
+                    [this] (ssize_t nread, const uv_buf_t*) {
+                        read(nread);
+                    },
+                    [this] (size_t, uv_buf_t* buf) {
+                        alloc(buf);
+                    });
+                if (res < 0)
+                {
+                    return res;
+                }
+
+                drive();
+
+                return 0;
+            }
+
+            // plaintext received after the handshake; may be set from the handshake callback
+            void StartRead(const CallbackRead& callback_read)
+            {
+                _callback_read = callback_read;
+
+                if (_established && !_driving)
+                {
+                    drive();
+                }
+            }
+
+            /*
+                Copies bufs. Written before the handshake completed, they are sent right after it; while a file is
+                pending or in flight they wait for it.
+            */
+            int Write(const uv_buf_t* bufs, unsigned int nbufs)
+            {
+                if (_closing || 0 != _write_error)
+                {
+                    return _closing ? UV_EPIPE : _write_error;
+                }
+
+                if (nullptr == _ssl)
+                {
+                    return UV_ENOMEM;
+                }
+
+                if (!_established || _file_pending || _file_active)
+                {
+                    for (unsigned int i = 0; i < nbufs; ++i)
+                    {
+                        _held.append(bufs[i].base, bufs[i].len);
+                    }
+
+                    return 0;
+                }
+
+                for (unsigned int i = 0; i < nbufs; ++i)
+                {
+                    if (!writePlaintext(bufs[i].base, bufs[i].len))
+                    {
+                        return UV_EPROTO;
+                    }
+                }
+
+                flush();
+
+                return 0;
+            }
+
+            /*
+                Sends length bytes of file from offset once the output written before has left, with non-blocking
+                sendfile(2) calls each time the socket is writable; only under kernel TLS (UV_ENOTSUP otherwise, fall
+                back to reading the file and Write). The transfer takes over the TcpHandle's NotifyWritable.
+                One file at a time. The file must stay open until callback_file_sent ran.
+            */
+            int SendFile(uv_file file, int64_t offset, size_t length, const CallbackFileSent& callback_file_sent)
+            {
+                if (_closing || 0 != _write_error)
+                {
+                    return _closing ? UV_EPIPE : _write_error;
+                }
+
+                if (!_kernel_tx)
+                {
+                    return UV_ENOTSUP;
+                }
+
+                if (_file_pending || _file_active)
+                {
+                    return UV_EBUSY;
+                }
+
+                _file.file = file;
+                _file.offset = offset;
+                _file.length = length;
+                _file.sent = 0;
+                _file.result = 0;
+                _file.callback_file_sent = callback_file_sent;
+
+                _file_pending = true;
+
+                flush();
+                startFile();
+
+                return 0;
+            }
+
+            bool Established() const
+            {
+                return _established;
+            }
+
+            // records are built by the kernel, SendFile is available
+            bool KernelTx() const
+            {
+                return _kernel_tx;
+            }
+
+            bool Resumed() const
+            {
+                return nullptr != _ssl && SSL_session_reused(_ssl);
+            }
+
+            // bytes written but not handed to the socket yet
+            size_t Pending() const
+            {
+                return _output.size() + _writing.size() + _held.size();
+            }
+
+            SSL* Native()
+            {
+                return _ssl;
+            }
+
+            /*
+                Stops reading, sends close_notify after the output written so far and cancels a file in flight;
+                callback_stream_closed runs once the socket holds everything. The TcpHandle itself stays open.
+            */
+            void Close(const CallbackStreamClosed& callback_stream_closed = nullptr)
+            {
+                if (_closing)
+                {
+                    return;
+                }
+
+                _closing = true;
+                _callback_stream_closed = callback_stream_closed;
+
+                _tcp->StopRead();
+
+                _held.clear();
+
+                // close_notify follows the part of the file already handed to the kernel
+                if (_file_active)
+                {
+                    _tcp->CancelWritable();
+                    _file.result = UV_ECANCELED;
+                    fileSent();
+                    return;
+                }
+
+                shutdown();
+                flush();
+
+                if (_file_pending)
+                {
+                    _file_pending = false;
+                    _file.result = UV_ECANCELED;
+                    finishFile();
+                    return;
+                }
+
+                settle();
+            }
+
+        private:
+            TlsStream() = delete;
+
+            TlsStream(const TlsStream&) = delete;
+            TlsStream& operator=(const TlsStream&) = delete;
+
+            TlsStream(TlsStream&&) = delete;
+            TlsStream& operator=(TlsStream&&) = delete;
+        };
+    }
+}
+
+#endif
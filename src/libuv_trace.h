@@ -0,0 +1,386 @@
+#ifndef IO_SIMPLIFY_LIBUV_TRACE_H
+#define IO_SIMPLIFY_LIBUV_TRACE_H
+
+#include "libuv_base.h"
+
+#include <stdint.h>
+
+/*
+    Tracing hooks for the handle trampolines, selected at compile time with IO_SIMPLIFY_LIBUV_TRACE.
+    Without the define every LIBUV_TRACE_* macro expands to nothing and handles carry no trace state.
+
+    IO_SIMPLIFY_LIBUV_WATCHDOG independently makes every trampoline publish which handle and callback the
+    loop thread is running, for the Watchdog (libuv_watchdog.h) to name the callback a stalled loop is stuck in.
+*/
+namespace io_simplify {
+
+    namespace libuv {
+
+        enum TraceCallback : uint8_t
+        {
+            TRACE_CALLBACK_READ = 0,
+            TRACE_CALLBACK_WRITTEN,
+            TRACE_CALLBACK_LISTEN,
+            TRACE_CALLBACK_RECEIVED,
+            TRACE_CALLBACK_SENT,
+            TRACE_CALLBACK_CONNECT,
+            TRACE_CALLBACK_ASYNC,
+            TRACE_CALLBACK_TIMER,
+            TRACE_CALLBACK_POLL,
+            TRACE_CALLBACK_IDLE,
+            TRACE_CALLBACK_PREPARE,
+            TRACE_CALLBACK_CHECK,
+            TRACE_CALLBACK_CLOSE,
+        };
+
+        inline const char* TraceCallbackName(uint8_t callback)
+        {
+            static const char* const NAMES[] = {
+                "read", "written", "listen", "received", "sent", "connect", "async", "timer", "poll", "idle", "prepare", "check", "close",
+            };
+
+            return callback < sizeof(NAMES) / sizeof(NAMES[0]) ? NAMES[callback] : "unknown";
+        }
+    }
+}
+
+#ifdef IO_SIMPLIFY_LIBUV_WATCHDOG
+
+#include <atomic>
+
+namespace io_simplify {
+
+    namespace libuv {
+
+        // what the owning loop thread runs right now; written by that thread only, read by the watchdog thread
+        struct CallbackSlot
+        {
+            std::atomic<const void*> handle{nullptr};
+            std::atomic<uint64_t> begin{0}; // uv_hrtime() the callback started, 0 between callbacks
+            std::atomic<uint8_t> callback{0};
+        };
+
+        inline CallbackSlot& LocalCallbackSlot()
+        {
+            static thread_local CallbackSlot slot;
+            return slot;
+        }
+
+        // publishes one trampoline invocation, restores the outer one on return
+        class CallbackAttribution
+        {
+            CallbackSlot& _slot;
+
+            const void* _handle;
+            uint64_t _begin;
+            uint8_t _callback;
+
+        public:
+            CallbackAttribution(const void* handle, TraceCallback callback)
+                : _slot(LocalCallbackSlot())
+
+                , _handle(_slot.handle.load(std::memory_order_relaxed))
+                , _begin(_slot.begin.load(std::memory_order_relaxed))
+                , _callback(_slot.callback.load(std::memory_order_relaxed))
+            {
+                _slot.handle.store(handle, std::memory_order_relaxed);
+                _slot.callback.store(callback, std::memory_order_relaxed);
+                _slot.begin.store(uv_hrtime(), std::memory_order_release);
+            }
+
+            ~CallbackAttribution()
+            {
+                _slot.handle.store(_handle, std::memory_order_relaxed);
+                _slot.callback.store(_callback, std::memory_order_relaxed);
+                _slot.begin.store(_begin, std::memory_order_release);
+            }
+
+        private:
+            CallbackAttribution(const CallbackAttribution&) = delete;
+            CallbackAttribution& operator=(const CallbackAttribution&) = delete;
+        };
+    }
+}
+
+#define LIBUV_WATCHDOG_CALLBACK(handle_ptr, callback) \
+    io_simplify::libuv::CallbackAttribution _watchdog_scope((handle_ptr), io_simplify::libuv::callback)
+
+#else
+
+#define LIBUV_WATCHDOG_CALLBACK(handle_ptr, callback) ((void)0)
+
+#endif
+
+#ifdef IO_SIMPLIFY_LIBUV_TRACE
+
+#include "libuv_mutex.h"
+
+#include <atomic>
+#include <vector>
+
+#include <stdio.h>
+#include <stdint.h>
+
+#ifndef IO_SIMPLIFY_LIBUV_TRACE_RING_SIZE
+#define IO_SIMPLIFY_LIBUV_TRACE_RING_SIZE 8192 // events per thread, power of two
+#endif
+
+namespace io_simplify {
+
+    namespace libuv {
+
+        // per handle, only touched on the loop thread
+        struct TraceCounters
+        {
+            uint64_t bytes_in = 0;
+            uint64_t bytes_out = 0;
+            uint64_t calls = 0;
+            uint64_t errors = 0;
+            uint64_t callback_ns = 0; // time spent in user callbacks
+            uint64_t last_callback = 0; // uv_hrtime() of the latest callback
+        };
+
+        struct TraceEvent
+        {
+            uint64_t begin;
+            uint32_t duration;
+            int32_t result;
+            const void* handle;
+            uint8_t callback;
+        };
+
+        /*
+            Single producer ring owned by one thread, overwriting the oldest events.
+            Dump may run on any thread. Every slot is a small seqlock: it carries the index of the event it holds, cleared
+            while the owner rewrites it, so Dump skips slots that were being written or got overwritten while it read them.
+        */
+        class TraceRing
+        {
+            static constexpr uint64_t _mask = IO_SIMPLIFY_LIBUV_TRACE_RING_SIZE - 1;
+
+            static_assert((IO_SIMPLIFY_LIBUV_TRACE_RING_SIZE & _mask) == 0, "IO_SIMPLIFY_LIBUV_TRACE_RING_SIZE must be a power of two");
+
+        private:
+            // fields are relaxed atomics so that reading a slot under rewrite is only stale, never undefined
+            struct Slot
+            {
+                std::atomic<uint64_t> sequence{0}; // event index + 1, 0 while being written
+                std::atomic<uint64_t> begin{0};
+                std::atomic<uint64_t> duration_result{0};
+                std::atomic<const void*> handle{nullptr};
+                std::atomic<uint8_t> callback{0};
+            };
+
+            std::vector<Slot> _events;
+            std::atomic<uint64_t> _head;
+
+            TraceRing* _next;
+
+        private:
+            static Mutex& registryMutex()
+            {
+                static Mutex mutex;
+                return mutex;
+            }
+
+            static TraceRing*& registryHead()
+            {
+                static TraceRing* head = nullptr;
+                return head;
+            }
+
+        public:
+            TraceRing()
+                : _events(IO_SIMPLIFY_LIBUV_TRACE_RING_SIZE)
+                , _head(0)
+                , _next(nullptr)
+            {
+                registryMutex().Lock();
+                _next = registryHead();
+                registryHead() = this;
+                registryMutex().Unlock();
+            }
+
+            ~TraceRing()
+            {
+                registryMutex().Lock();
+                for (TraceRing** ring = &registryHead(); *ring; ring = &((*ring)->_next))
+                {
+                    if (*ring == this)
+                    {
+                        *ring = _next;
+                        break;
+                    }
+                }
+                registryMutex().Unlock();
+            }
+
+            static TraceRing& Local()
+            {
+                static thread_local TraceRing ring;
+                return ring;
+            }
+
+            void Emit(const TraceEvent& event)
+            {
+                uint64_t head = _head.load(std::memory_order_relaxed);
+
+                Slot& slot = _events[head & _mask];
+
+                slot.sequence.store(0, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+
+                slot.begin.store(event.begin, std::memory_order_relaxed);
+                slot.duration_result.store(((uint64_t)event.duration << 32) | (uint32_t)event.result, std::memory_order_relaxed);
+                slot.handle.store(event.handle, std::memory_order_relaxed);
+                slot.callback.store(event.callback, std::memory_order_relaxed);
+
+                slot.sequence.store(head + 1, std::memory_order_release);
+
+                _head.store(head + 1, std::memory_order_release);
+            }
+
+            // one line per event: begin_ns duration_ns handle callback result
+            int Dump(FILE* file) const
+            {
+                uint64_t end = _head.load(std::memory_order_acquire);
+                uint64_t begin = end > _events.size() ? end - _events.size() : 0;
+
+                int count = 0;
+                for (uint64_t index = begin; index < end; ++index)
+                {
+                    const Slot& slot = _events[index & _mask];
+
+                    if (slot.sequence.load(std::memory_order_acquire) != index + 1)
+                    {
+                        continue;
+                    }
+
+                    TraceEvent event;
+                    event.begin = slot.begin.load(std::memory_order_relaxed);
+                    uint64_t duration_result = slot.duration_result.load(std::memory_order_relaxed);
+                    event.duration = (uint32_t)(duration_result >> 32);
+                    event.result = (int32_t)(uint32_t)duration_result;
+                    event.handle = slot.handle.load(std::memory_order_relaxed);
+                    event.callback = slot.callback.load(std::memory_order_relaxed);
+
+                    // the owner started rewriting the slot while it was read
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    if (slot.sequence.load(std::memory_order_relaxed) != index + 1)
+                    {
+                        continue;
+                    }
+
+                    fprintf(file, "%llu %u %p %u %d\n",
+                        (unsigned long long)event.begin, event.duration, event.handle, (unsigned int)event.callback, event.result);
+
+                    ++count;
+                }
+
+                return count;
+            }
+
+            // dumps the rings of every live thread, returns number of events or UV_E* on failure
+            static int DumpAll(const char* path)
+            {
+                FILE* file = fopen(path, "w");
+                if (nullptr == file)
+                {
+                    return UV_EIO;
+                }
+
+                int count = 0;
+
+                registryMutex().Lock();
+                for (TraceRing* ring = registryHead(); ring; ring = ring->_next)
+                {
+                    count += ring->Dump(file);
+                }
+                registryMutex().Unlock();
+
+                fclose(file);
+
+                return count;
+            }
+
+        private:
+            TraceRing(const TraceRing&) = delete;
+            TraceRing& operator=(const TraceRing&) = delete;
+
+            TraceRing(TraceRing&&) = delete;
+            TraceRing& operator=(TraceRing&&) = delete;
+        };
+
+        // wraps one trampoline invocation, accounts the time spent in the user callback
+        class TraceScope
+        {
+            TraceCounters& _counters;
+            TraceEvent _event;
+
+        public:
+            TraceScope(TraceCounters& counters, const void* handle, TraceCallback callback, int64_t result)
+                : _counters(counters)
+                , _event()
+            {
+                _event.begin = uv_hrtime();
+                _event.result = (int32_t)result;
+                _event.handle = handle;
+                _event.callback = callback;
+
+                if (result > 0 && (TRACE_CALLBACK_READ == callback || TRACE_CALLBACK_RECEIVED == callback))
+                {
+                    _counters.bytes_in += result;
+                }
+                else if (result < 0 && UV_EOF != result)
+                {
+                    ++_counters.errors;
+                }
+            }
+
+            ~TraceScope()
+            {
+                uint64_t end = uv_hrtime();
+
+                _event.duration = (uint32_t)(end - _event.begin);
+
+                ++_counters.calls;
+                _counters.callback_ns += end - _event.begin;
+                _counters.last_callback = end;
+
+                TraceRing::Local().Emit(_event);
+            }
+
+        private:
+            TraceScope(const TraceScope&) = delete;
+            TraceScope& operator=(const TraceScope&) = delete;
+        };
+
+        inline size_t TraceBytes(const uv_buf_t* bufs, unsigned int nbufs)
+        {
+            size_t bytes = 0;
+            for (unsigned int i = 0; i < nbufs; ++i)
+            {
+                bytes += bufs[i].len;
+            }
+            return bytes;
+        }
+    }
+}
+
+#define LIBUV_TRACE_COUNTERS io_simplify::libuv::TraceCounters trace;
+
+#define LIBUV_TRACE_CALLBACK(handle_ptr, callback, result) \
+    io_simplify::libuv::TraceScope _trace_scope((handle_ptr)->trace, (handle_ptr), io_simplify::libuv::callback, (int64_t)(result))
+
+#define LIBUV_TRACE_BYTES_OUT(handle_ptr, bufs, nbufs) \
+    ((handle_ptr)->trace.bytes_out += io_simplify::libuv::TraceBytes((bufs), (nbufs)))
+
+#else
+
+#define LIBUV_TRACE_COUNTERS
+#define LIBUV_TRACE_CALLBACK(handle_ptr, callback, result) ((void)0)
+#define LIBUV_TRACE_BYTES_OUT(handle_ptr, bufs, nbufs) ((void)0)
+
+#endif
+
+#endif
@@ -4,6 +4,27 @@
 #include "libuv_loop.h"
 
 #include "libuv_handle.h"
+#include "libuv_poll_handle.h"
+
+#include "libuv_capture.h"
+
+#include <string.h>
+
+#if defined(__linux__)
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#endif
 
 namespace io_simplify {
 
@@ -11,6 +32,25 @@ namespace io_simplify {
 
         class UdpHandle : public Handle<uv_udp_t>
         {
+        public:
+            // what one UDP_SEGMENT send may carry: the kernel's UDP_MAX_SEGMENTS and the largest IPv4 UDP payload
+            static constexpr size_t GSO_MAX_SEGMENTS = 64;
+            static constexpr size_t GSO_MAX_BYTES = 65507;
+
+            /*
+                Same as CallbackReceived plus the size of the datagrams coalesced into buf by GRO:
+                buf holds nread / segment_size datagrams of segment_size bytes, the last one may be shorter.
+                segment_size equals nread for a single datagram.
+            */
+            using CallbackReceivedCoalesced = std::function<void(ssize_t, const uv_buf_t*, const struct sockaddr*, unsigned, size_t)>;
+
+            // send request completing through its own callback, see TcpHandle::WriteRequest
+            struct SendRequest
+            {
+                uv_udp_send_t req;
+                void (*callback_sent)(SendRequest*, int);
+            };
+
         private:
             CallbackAlloc _callback_alloc;
 
@@ -18,6 +58,30 @@ namespace io_simplify {
             CallbackReceived _callback_received;
             CallbackSent _callback_sent;
 
+        private:
+            CallbackReceivedCoalesced _callback_received_coalesced;
+
+            // polls a dup of the socket, libuv's own receive path drops the UDP_GRO cmsg
+            struct GroPoll
+            {
+                PollHandle poll;
+                int fd;
+
+                GroPoll(Loop* loop, int gro_fd)
+                    : poll(loop, gro_fd)
+                    , fd(gro_fd)
+                {
+                }
+            };
+
+            GroPoll* _gro_poll;
+            int _gso_supported; // 0 not probed yet, 1 kernel segmentation, -1 software fallback
+
+            uint64_t _copy_failures; // SendCopy sends completed with an error
+
+            Capture* _capture;
+            uint64_t _capture_id;
+
         private:
             static void callback_uv_alloc(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf)
             {
@@ -30,6 +94,14 @@ namespace io_simplify {
             {
                 UdpHandle* server_handle = (UdpHandle*)(handle->data);
 
+                LIBUV_TRACE_CALLBACK(server_handle, TRACE_CALLBACK_RECEIVED, nread);
+                LIBUV_WATCHDOG_CALLBACK(server_handle, TRACE_CALLBACK_RECEIVED);
+
+                if (nullptr != server_handle->_capture && nread > 0)
+                {
+                    server_handle->capture(buf->base, (size_t)nread, addr, (size_t)nread);
+                }
+
                 server_handle->_callback_received(nread, buf, addr, flags);
             }
 
@@ -37,15 +109,223 @@ namespace io_simplify {
             {
                 UdpHandle* server_handle = (UdpHandle*)(req->handle->data);
 
+                LIBUV_TRACE_CALLBACK(server_handle, TRACE_CALLBACK_SENT, status);
+                LIBUV_WATCHDOG_CALLBACK(server_handle, TRACE_CALLBACK_SENT);
+
                 server_handle->_callback_sent(req, status);
             }
 
+            static void callback_uv_received_coalesced(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf, const struct sockaddr *addr, unsigned flags)
+            {
+                UdpHandle* server_handle = (UdpHandle*)(handle->data);
+
+                LIBUV_TRACE_CALLBACK(server_handle, TRACE_CALLBACK_RECEIVED, nread);
+                LIBUV_WATCHDOG_CALLBACK(server_handle, TRACE_CALLBACK_RECEIVED);
+
+                if (nullptr != server_handle->_capture && nread > 0)
+                {
+                    server_handle->capture(buf->base, (size_t)nread, addr, (size_t)nread);
+                }
+
+                server_handle->_callback_received_coalesced(nread, buf, addr, flags, nread > 0 ? (size_t)nread : 0);
+            }
+
+#if defined(__linux__)
+            static void callback_gro_poll(UdpHandle* server_handle, int status)
+            {
+                LIBUV_WATCHDOG_CALLBACK(server_handle, TRACE_CALLBACK_RECEIVED);
+
+                if (status < 0)
+                {
+                    LIBUV_TRACE_CALLBACK(server_handle, TRACE_CALLBACK_RECEIVED, status);
+
+                    server_handle->_callback_received_coalesced(status, nullptr, nullptr, 0, 0);
+                    return;
+                }
+
+                // bounded like libuv's own receive loop, so one busy socket cannot starve the loop
+                for (int count = 0; count < 32 && server_handle->_gro_poll; ++count)
+                {
+                    uv_buf_t buf = uv_buf_init(nullptr, 0);
+                    server_handle->_callback_alloc(64 * 1024, &buf);
+                    if (nullptr == buf.base || 0 == buf.len)
+                    {
+                        LIBUV_TRACE_CALLBACK(server_handle, TRACE_CALLBACK_RECEIVED, UV_ENOBUFS);
+
+                        server_handle->_callback_received_coalesced(UV_ENOBUFS, &buf, nullptr, 0, 0);
+                        return;
+                    }
+
+                    struct sockaddr_storage peer;
+                    struct iovec iov;
+                    iov.iov_base = buf.base;
+                    iov.iov_len = buf.len;
+
+                    union
+                    {
+                        char buffer[CMSG_SPACE(sizeof(int))];
+                        struct cmsghdr align;
+                    } control;
+
+                    struct msghdr msg;
+                    memset(&msg, 0, sizeof(msg));
+                    msg.msg_name = &peer;
+                    msg.msg_namelen = sizeof(peer);
+                    msg.msg_iov = &iov;
+                    msg.msg_iovlen = 1;
+                    msg.msg_control = control.buffer;
+                    msg.msg_controllen = sizeof(control.buffer);
+
+                    ssize_t nread;
+                    do
+                    {
+                        nread = recvmsg(server_handle->_gro_poll->fd, &msg, MSG_DONTWAIT);
+                    } while (nread < 0 && EINTR == errno);
+
+                    if (nread < 0)
+                    {
+                        int error = EAGAIN == errno || EWOULDBLOCK == errno ? 0 : uv_translate_sys_error(errno);
+
+                        LIBUV_TRACE_CALLBACK(server_handle, TRACE_CALLBACK_RECEIVED, error);
+
+                        // like libuv, hand an unused buffer back with nread 0 so it can be released
+                        server_handle->_callback_received_coalesced(error, &buf, nullptr, 0, 0);
+                        return;
+                    }
+
+                    LIBUV_TRACE_CALLBACK(server_handle, TRACE_CALLBACK_RECEIVED, nread);
+
+                    size_t segment_size = (size_t)nread;
+                    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+                    {
+                        if (IPPROTO_UDP == cmsg->cmsg_level && UDP_GRO == cmsg->cmsg_type)
+                        {
+                            int gso_size = 0;
+                            memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+
+                            segment_size = (size_t)gso_size;
+                        }
+                    }
+
+                    unsigned int flags = (msg.msg_flags & MSG_TRUNC) ? UV_UDP_PARTIAL : 0;
+
+                    if (nullptr != server_handle->_capture && nread > 0)
+                    {
+                        server_handle->capture(buf.base, (size_t)nread, (const struct sockaddr*)&peer, segment_size);
+                    }
+
+                    server_handle->_callback_received_coalesced(nread, &buf, (const struct sockaddr*)&peer, flags, segment_size);
+                }
+            }
+#endif
+
+            // one record per datagram, GRO batches are split back into their segments
+            void capture(const char* data, size_t size, const struct sockaddr* addr, size_t segment_size)
+            {
+                uint64_t connection = Capture::PeerConnection(_capture_id, addr);
+
+                for (size_t offset = 0; offset < size; offset += segment_size)
+                {
+                    size_t length = size - offset < segment_size ? size - offset : segment_size;
+
+                    _capture->Record(Capture::RECORD_DATAGRAM, connection, data + offset, length);
+                }
+            }
+
+            static void callback_uv_copy_sent(uv_udp_send_t* req, int status)
+            {
+                UdpHandle* udp_handle = (UdpHandle*)(req->handle->data);
+
+                LIBUV_TRACE_CALLBACK(udp_handle, TRACE_CALLBACK_SENT, status);
+                LIBUV_WATCHDOG_CALLBACK(udp_handle, TRACE_CALLBACK_SENT);
+
+                if (status < 0)
+                {
+                    ++udp_handle->_copy_failures;
+                }
+
+                udp_handle->loop->arena.Free(req);
+            }
+
+            static void callback_uv_request_sent(uv_udp_send_t* req, int status)
+            {
+                LIBUV_TRACE_CALLBACK((UdpHandle*)(req->handle->data), TRACE_CALLBACK_SENT, status);
+                LIBUV_WATCHDOG_CALLBACK((UdpHandle*)(req->handle->data), TRACE_CALLBACK_SENT);
+
+                SendRequest* send_request = (SendRequest*)(req);
+
+                send_request->callback_sent(send_request, status);
+            }
+
+#if defined(__linux__)
+            // one sendmsg the kernel splits into segments of segment_size bytes, -1 with errno on failure
+            static ssize_t sendSegmented(int fd, char* base, size_t len, uint16_t segment_size, const struct sockaddr* addr)
+            {
+                struct iovec iov;
+                iov.iov_base = base;
+                iov.iov_len = len;
+
+                union
+                {
+                    char buffer[CMSG_SPACE(sizeof(uint16_t))];
+                    struct cmsghdr align;
+                } control;
+                memset(&control, 0, sizeof(control));
+
+                struct msghdr msg;
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_name = (void*)addr;
+                msg.msg_namelen = addr ? (AF_INET6 == addr->sa_family ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in)) : 0;
+                msg.msg_iov = &iov;
+                msg.msg_iovlen = 1;
+                msg.msg_control = control.buffer;
+                msg.msg_controllen = sizeof(control.buffer);
+
+                struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+                cmsg->cmsg_level = IPPROTO_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+
+                ssize_t nsent;
+                do
+                {
+                    nsent = sendmsg(fd, &msg, MSG_DONTWAIT);
+                } while (nsent < 0 && EINTR == errno);
+
+                return nsent;
+            }
+
+            void stopGroPoll()
+            {
+                GroPoll* gro_poll = _gro_poll;
+
+                _gro_poll = nullptr;
+
+                gro_poll->poll.Close([gro_poll] () {
+                    close(gro_poll->fd);
+
+                    delete gro_poll;
+                });
+            }
+#endif
+
         public:
             explicit UdpHandle(Loop* loop)
                 : Handle<uv_udp_t>(loop)
 
                 , _callback_alloc()
                 , _callback_received()
+
+                , _callback_received_coalesced()
+
+                , _gro_poll(nullptr)
+                , _gso_supported(0)
+
+                , _copy_failures(0)
+
+                , _capture(nullptr)
+                , _capture_id(0)
             {
                 Handle<uv_udp_t>::status = uv_udp_init(loop->uv, Handle<uv_udp_t>::uv);
             }
@@ -57,6 +337,16 @@ namespace io_simplify {
 
                 , _callback_received()
                 , _callback_sent()
+
+                , _callback_received_coalesced()
+
+                , _gro_poll(nullptr)
+                , _gso_supported(0)
+
+                , _copy_failures(0)
+
+                , _capture(nullptr)
+                , _capture_id(0)
             {
                 Handle<uv_udp_t>::status = uv_udp_init_ex(loop->uv, Handle<uv_udp_t>::uv, flags);
             }
@@ -192,11 +482,109 @@ namespace io_simplify {
                 return uv_udp_recv_start(Handle<uv_udp_t>::uv, callback_uv_alloc, callback_uv_received);
             }
 
+            /*
+                Receives with UDP_GRO enabled where the kernel supports it (Linux 5.0+): back to back datagrams from one peer
+                arrive coalesced in one buffer of up to 64 KiB, together with their segment size.
+                Elsewhere it falls back to the plain receive path, delivering one datagram per call.
+            */
+            int StartReceiveCoalesced(
+                const CallbackReceivedCoalesced& callback_received_coalesced, 
+                const CallbackAlloc& callback_alloc = [] (size_t suggested_size, uv_buf_t *buf) {
+                    buf->base = (char*)malloc(suggested_size);
+                    buf->len = suggested_size;
+                })
+            {
+                _callback_alloc = callback_alloc;
+                _callback_received_coalesced = callback_received_coalesced;
+
+#if defined(__linux__)
+                if (_gro_poll)
+                {
+                    return 0;
+                }
+
+                uv_os_fd_t fd;
+                int on = 1;
+                if (0 == uv_fileno((const uv_handle_t*)(Handle<uv_udp_t>::uv), &fd) && 0 == setsockopt(fd, IPPROTO_UDP, UDP_GRO, &on, sizeof(on)))
+                {
+                    // a second descriptor of the same socket gets its own epoll registration
+                    int gro_fd = dup(fd);
+                    if (gro_fd >= 0)
+                    {
+                        GroPoll* gro_poll = new GroPoll(Handle<uv_udp_t>::loop, gro_fd);
+
+                        if (0 == gro_poll->poll.status)
+                        {
+                            _gro_poll = gro_poll;
+
+                            if (0 == gro_poll->poll.Start(UV_READABLE, [this] (int status, int events) { callback_gro_poll(this, status); }))
+                            {
+                                return 0;
+                            }
+
+                            stopGroPoll();
+                        }
+                        else
+                        {
+                            delete gro_poll;
+                            close(gro_fd);
+                        }
+                    }
+
+                    // coalesced datagrams must not reach the plain path
+                    int off = 0;
+                    setsockopt(fd, IPPROTO_UDP, UDP_GRO, &off, sizeof(off));
+                }
+#endif
+
+                return uv_udp_recv_start(Handle<uv_udp_t>::uv, callback_uv_alloc, callback_uv_received_coalesced);
+            }
+
+            // also stops StartReceiveCoalesced
             void StopReceive()
             {
+#if defined(__linux__)
+                if (_gro_poll)
+                {
+                    uv_os_fd_t fd;
+                    if (0 == uv_fileno((const uv_handle_t*)(Handle<uv_udp_t>::uv), &fd))
+                    {
+                        int off = 0;
+                        setsockopt(fd, IPPROTO_UDP, UDP_GRO, &off, sizeof(off));
+                    }
+
+                    stopGroPoll();
+                }
+#endif
+
                 uv_udp_recv_stop(Handle<uv_udp_t>::uv);
             }
 
+            /*
+                Appends every datagram this handle receives to capture, keyed by id and the peer address;
+                the capture must belong to this handle's loop. id keeps the low 16 bits.
+            */
+            void StartCapture(Capture* capture, uint64_t id)
+            {
+                _capture = capture;
+                _capture_id = id & 0xffff;
+            }
+
+            void StopCapture()
+            {
+                _capture = nullptr;
+            }
+
+        protected:
+            // Close stops receiving, which also closes the GRO poll and its descriptor
+            void closing() override
+            {
+                StopReceive();
+
+                StopCapture();
+            }
+
+        public:
             int Send(uv_udp_send_t* req,
                        const uv_buf_t* bufs,
                        unsigned int nbufs,
@@ -204,6 +592,8 @@ namespace io_simplify {
             {
                 _callback_sent = callback_sent;
 
+                LIBUV_TRACE_BYTES_OUT(this, bufs, nbufs);
+
                 return uv_udp_send(req, Handle<uv_udp_t>::uv, bufs, nbufs, nullptr, callback_uv_sent);
             }
 
@@ -215,9 +605,162 @@ namespace io_simplify {
             {
                 _callback_sent = callback_sent;
 
+                LIBUV_TRACE_BYTES_OUT(this, bufs, nbufs);
+
                 return uv_udp_send(req, Handle<uv_udp_t>::uv, bufs, nbufs, addr, callback_uv_sent);
             }
 
+            // addr may be nullptr on a connected handle
+            int Send(SendRequest* send_request,
+                       const uv_buf_t* bufs,
+                       unsigned int nbufs,
+                       const struct sockaddr* addr = nullptr)
+            {
+                LIBUV_TRACE_BYTES_OUT(this, bufs, nbufs);
+
+                return uv_udp_send(&(send_request->req), Handle<uv_udp_t>::uv, bufs, nbufs, addr, callback_uv_request_sent);
+            }
+
+            // see TcpHandle::WriteCopy, addr may be nullptr on a connected handle
+            int SendCopy(const uv_buf_t* bufs, unsigned int nbufs, const struct sockaddr* addr = nullptr)
+            {
+                size_t size = 0;
+                for (unsigned int i = 0; i < nbufs; ++i)
+                {
+                    size += bufs[i].len;
+                }
+
+                uv_udp_send_t* req = (uv_udp_send_t*)(Handle<uv_udp_t>::loop->arena.Allocate(sizeof(uv_udp_send_t) + size));
+                if (nullptr == req)
+                {
+                    return UV_ENOMEM;
+                }
+
+                char* data = (char*)(req + 1);
+
+                size_t offset = 0;
+                for (unsigned int i = 0; i < nbufs; ++i)
+                {
+                    memcpy(data + offset, bufs[i].base, bufs[i].len);
+                    offset += bufs[i].len;
+                }
+
+                uv_buf_t buf = uv_buf_init(data, (unsigned int)size);
+
+                LIBUV_TRACE_BYTES_OUT(this, &buf, 1);
+
+                int res = uv_udp_send(req, Handle<uv_udp_t>::uv, &buf, 1, addr, callback_uv_copy_sent);
+                if (res < 0)
+                {
+                    Handle<uv_udp_t>::loop->arena.Free(req);
+                }
+
+                return res;
+            }
+
+            // see TcpHandle::CopyFailures
+            uint64_t CopyFailures() const
+            {
+                return _copy_failures;
+            }
+
+            /*
+                Sends buf as consecutive datagrams of segment_size bytes (the last one may be shorter) without queueing, 
+                like uv_udp_try_send. With UDP_SEGMENT (Linux 4.18+) the kernel splits each send; a buffer beyond what one
+                send may carry (GSO_MAX_SEGMENTS segments, GSO_MAX_BYTES bytes) goes out in several sends of whole segments.
+                Elsewhere, or when the kernel refuses to segment, every segment is sent on its own.
+                Returns bytes sent, which may stop short, or UV_EAGAIN while earlier sends are still queued.
+                addr may be nullptr on a connected handle.
+            */
+            int TrySendSegmented(const uv_buf_t& buf, size_t segment_size, const struct sockaddr* addr = nullptr)
+            {
+                if (0 == segment_size)
+                {
+                    return UV_EINVAL;
+                }
+
+                if (uv_udp_get_send_queue_count(Handle<uv_udp_t>::uv) > 0)
+                {
+                    return UV_EAGAIN;
+                }
+
+                size_t sent = 0;
+
+#if defined(__linux__)
+                // whole segments per send, under 2 is not worth the kernel's segmentation
+                size_t segments_per_send = segment_size <= GSO_MAX_BYTES ? GSO_MAX_BYTES / segment_size : 0;
+                if (segments_per_send > GSO_MAX_SEGMENTS)
+                {
+                    segments_per_send = GSO_MAX_SEGMENTS;
+                }
+
+                uv_os_fd_t fd;
+                if (segments_per_send > 1 && buf.len > segment_size && 0 == uv_fileno((const uv_handle_t*)(Handle<uv_udp_t>::uv), &fd))
+                {
+                    if (0 == _gso_supported)
+                    {
+                        int value = 0;
+                        socklen_t value_len = sizeof(value);
+
+                        _gso_supported = 0 == getsockopt(fd, IPPROTO_UDP, UDP_SEGMENT, &value, &value_len) ? 1 : -1;
+                    }
+
+                    while (_gso_supported > 0 && buf.len - sent > segment_size)
+                    {
+                        size_t len = buf.len - sent < segments_per_send * segment_size ? buf.len - sent : segments_per_send * segment_size;
+
+                        uv_buf_t segments = uv_buf_init(buf.base + sent, (unsigned int)len);
+
+                        ssize_t nsent = sendSegmented(fd, segments.base, segments.len, (uint16_t)segment_size, addr);
+                        if (nsent < 0)
+                        {
+                            if (EAGAIN == errno || EWOULDBLOCK == errno || ENOBUFS == errno)
+                            {
+                                return sent > 0 ? (int)sent : UV_EAGAIN;
+                            }
+
+                            if (EIO == errno)
+                            {
+                                // the device cannot checksum segments, stop asking the kernel
+                                _gso_supported = -1;
+                            }
+                            else if (EINVAL != errno && EMSGSIZE != errno)
+                            {
+                                return sent > 0 ? (int)sent : uv_translate_sys_error(errno);
+                            }
+
+                            // EINVAL, EMSGSIZE: segments this size cannot be offloaded (e.g. above the path MTU)
+                            break;
+                        }
+
+                        segments.len = (unsigned int)nsent;
+                        LIBUV_TRACE_BYTES_OUT(this, &segments, 1);
+
+                        sent += (size_t)nsent;
+                    }
+                }
+#endif
+
+                while (sent < buf.len)
+                {
+                    size_t segment_len = buf.len - sent < segment_size ? buf.len - sent : segment_size;
+
+                    uv_buf_t segment = uv_buf_init(buf.base + sent, (unsigned int)segment_len);
+
+                    int res = uv_udp_try_send(Handle<uv_udp_t>::uv, &segment, 1, addr);
+                    if (res < 0)
+                    {
+                        return sent > 0 ? (int)sent : res;
+                    }
+
+                    LIBUV_TRACE_BYTES_OUT(this, &segment, 1);
+
+                    sent += segment_len;
+                }
+
+                return (int)sent;
+            }
+
         private:
             UdpHandle() = delete;
 
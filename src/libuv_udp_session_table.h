@@ -0,0 +1,491 @@
+#ifndef IO_SIMPLIFY_LIBUV_UDP_SESSION_TABLE_H
+#define IO_SIMPLIFY_LIBUV_UDP_SESSION_TABLE_H
+
+#include "libuv_loop.h"
+
+#include "libuv_timer_handle.h"
+#include "libuv_udp_handle.h"
+
+#include <vector>
+
+#include <stdint.h>
+#include <string.h>
+
+namespace io_simplify {
+
+    namespace libuv {
+
+        /*
+            Per-peer session demux for a UdpHandle.
+
+            Sessions live in a pool sized once at construction and are found through an open-addressing table
+            (linear probing, backward-shift deletion, no tombstones) keyed on the binary address and port, so a
+            datagram costs one hash and usually one cache line of probing, with no formatting and no allocation.
+            Sessions also sit on a list ordered by last activity; the expiry timer only walks the ones past
+            idle_timeout, however many peers are active.
+
+            Loop thread only.
+        */
+        class UdpSessionTable
+        {
+        public:
+            class Session
+            {
+                friend class UdpSessionTable;
+
+            public:
+                union
+                {
+                    struct sockaddr sa;
+                    struct sockaddr_in v4;
+                    struct sockaddr_in6 v6;
+                } address;
+
+                uint64_t last_active; // uv_now() of the last datagram, milliseconds
+                void* data;
+
+            private:
+                uint32_t _hash;
+
+                // activity list while in use, free list otherwise
+                uint32_t _prev;
+                uint32_t _next;
+
+            public:
+                const struct sockaddr* Address() const
+                {
+                    return &(address.sa);
+                }
+            };
+
+            // session is nullptr for errors, the nread 0 that hands a buffer back, and peers refused because the table is full
+            using CallbackSessionReceived = std::function<void(Session*, ssize_t, const uv_buf_t*, unsigned)>;
+            using CallbackSession = std::function<void(Session*)>;
+            using CallbackTableClosed = std::function<void()>;
+
+            struct Statistics
+            {
+                uint64_t created = 0;
+                uint64_t expired = 0;
+                uint64_t removed = 0; // by Remove or Close
+                uint64_t rejected = 0; // table full
+                uint64_t lookups = 0;
+                uint64_t probes = 0; // slots visited by lookups, probes / lookups is the average probe length
+            };
+
+        private:
+            static constexpr uint32_t NONE = UINT32_MAX;
+
+            struct Slot
+            {
+                uint32_t hash;
+                uint32_t session; // index + 1, 0 for an empty slot
+            };
+
+        private:
+            Loop* _loop;
+            TimerHandle _timer;
+
+            uint64_t _idle_timeout;
+
+            std::vector<Session> _sessions;
+            std::vector<Slot> _slots;
+            uint32_t _mask;
+
+            uint32_t _free;
+            uint32_t _oldest;
+            uint32_t _newest;
+            size_t _size;
+
+            Statistics _statistics;
+
+            CallbackSessionReceived _callback_session_received;
+            CallbackSession _callback_session_opened;
+            CallbackSession _callback_session_closed;
+
+            CallbackTableClosed _callback_table_closed;
+
+        private:
+            static uint32_t hashOf(const struct sockaddr* addr)
+            {
+                uint64_t key = 0;
+
+                if (AF_INET == addr->sa_family)
+                {
+                    const struct sockaddr_in* addr_in = (const struct sockaddr_in*)addr;
+
+                    key = ((uint64_t)(addr_in->sin_addr.s_addr) << 16) | addr_in->sin_port;
+                }
+                else
+                {
+                    const struct sockaddr_in6* addr_in6 = (const struct sockaddr_in6*)addr;
+
+                    uint64_t words[2];
+                    memcpy(words, &(addr_in6->sin6_addr), sizeof(words));
+
+                    key = (words[0] * 0x9e3779b97f4a7c15ull) ^ words[1] ^ ((uint64_t)(addr_in6->sin6_port) << 48);
+                }
+
+                // murmur3 finalizer, spreads the port and the low address bits over the whole word
+                key ^= key >> 33;
+                key *= 0xff51afd7ed558ccdull;
+                key ^= key >> 33;
+                key *= 0xc4ceb3fe1a85ec53ull;
+                key ^= key >> 33;
+
+                return (uint32_t)key;
+            }
+
+            static bool equals(const Session& session, const struct sockaddr* addr)
+            {
+                if (session.address.sa.sa_family != addr->sa_family)
+                {
+                    return false;
+                }
+
+                if (AF_INET == addr->sa_family)
+                {
+                    const struct sockaddr_in* addr_in = (const struct sockaddr_in*)addr;
+
+                    return session.address.v4.sin_port == addr_in->sin_port && session.address.v4.sin_addr.s_addr == addr_in->sin_addr.s_addr;
+                }
+
+                const struct sockaddr_in6* addr_in6 = (const struct sockaddr_in6*)addr;
+
+                return session.address.v6.sin6_port == addr_in6->sin6_port
+                    && 0 == memcmp(&(session.address.v6.sin6_addr), &(addr_in6->sin6_addr), sizeof(addr_in6->sin6_addr));
+            }
+
+            // slot holding addr, or the empty slot ending its probe sequence
+            uint32_t probe(const struct sockaddr* addr, uint32_t hash)
+            {
+                ++_statistics.lookups;
+
+                uint32_t i = hash & _mask;
+                while (true)
+                {
+                    ++_statistics.probes;
+
+                    const Slot& slot = _slots[i];
+                    if (0 == slot.session || (slot.hash == hash && equals(_sessions[slot.session - 1], addr)))
+                    {
+                        return i;
+                    }
+
+                    i = (i + 1) & _mask;
+                }
+            }
+
+            void unlink(uint32_t index)
+            {
+                Session& session = _sessions[index];
+
+                if (NONE != session._prev)
+                {
+                    _sessions[session._prev]._next = session._next;
+                }
+                else
+                {
+                    _oldest = session._next;
+                }
+
+                if (NONE != session._next)
+                {
+                    _sessions[session._next]._prev = session._prev;
+                }
+                else
+                {
+                    _newest = session._prev;
+                }
+            }
+
+            void append(uint32_t index)
+            {
+                Session& session = _sessions[index];
+
+                session._prev = _newest;
+                session._next = NONE;
+
+                if (NONE != _newest)
+                {
+                    _sessions[_newest]._next = index;
+                }
+                else
+                {
+                    _oldest = index;
+                }
+
+                _newest = index;
+            }
+
+            void release(uint32_t index)
+            {
+                Session& session = _sessions[index];
+
+                // backward-shift deletion: pull later entries of the probe run into the hole
+                uint32_t hole = session._hash & _mask;
+                while (_slots[hole].session != index + 1)
+                {
+                    hole = (hole + 1) & _mask;
+                }
+
+                uint32_t i = hole;
+                while (true)
+                {
+                    i = (i + 1) & _mask;
+
+                    const Slot& slot = _slots[i];
+                    if (0 == slot.session)
+                    {
+                        break;
+                    }
+
+                    uint32_t home = slot.hash & _mask;
+
+                    // the entry may move back unless its home lies cyclically in (hole, i]
+                    bool movable = hole <= i ? (home <= hole || home > i) : (home <= hole && home > i);
+                    if (movable)
+                    {
+                        _slots[hole] = slot;
+                        hole = i;
+                    }
+                }
+
+                _slots[hole].session = 0;
+
+                unlink(index);
+
+                if (_callback_session_closed)
+                {
+                    _callback_session_closed(&session);
+                }
+
+                session.data = nullptr;
+                session._next = _free;
+                _free = index;
+
+                --_size;
+            }
+
+            void expire()
+            {
+                uint64_t now = uv_now(_loop->uv);
+
+                while (NONE != _oldest && _sessions[_oldest].last_active + _idle_timeout <= now)
+                {
+                    ++_statistics.expired;
+
+                    release(_oldest);
+                }
+            }
+
+        public:
+            /*
+                max_sessions: pool size, peers beyond it are refused until a session expires or is removed.
+                idle_timeout: milliseconds without a datagram before a session expires, 0 keeps sessions until removed.
+            */
+            UdpSessionTable(Loop* loop, size_t max_sessions = 64 * 1024, uint64_t idle_timeout = 30000)
+                : _loop(loop)
+                , _timer(loop)
+
+                , _idle_timeout(idle_timeout)
+
+                , _sessions(max_sessions)
+                , _slots()
+                , _mask(0)
+
+                , _free(NONE)
+                , _oldest(NONE)
+                , _newest(NONE)
+                , _size(0)
+
+                , _statistics()
+
+                , _callback_session_received()
+                , _callback_session_opened()
+                , _callback_session_closed()
+
+                , _callback_table_closed()
+            {
+                // at most half full, probe runs stay short
+                size_t slots = 16;
+                while (slots < max_sessions * 2)
+                {
+                    slots <<= 1;
+                }
+
+                _slots.resize(slots, Slot{0, 0});
+                _mask = (uint32_t)(slots - 1);
+
+                for (size_t i = max_sessions; i > 0; --i)
+                {
+                    _sessions[i - 1].data = nullptr;
+                    _sessions[i - 1]._next = _free;
+                    _free = (uint32_t)(i - 1);
+                }
+            }
+
+            ~UdpSessionTable()
+            {
+            }
+
+            // opened: a new peer got a session; closed: a session expires or is removed, release its data here
+            void SetSessionCallbacks(const CallbackSession& callback_session_opened, const CallbackSession& callback_session_closed)
+            {
+                _callback_session_opened = callback_session_opened;
+                _callback_session_closed = callback_session_closed;
+            }
+
+            // receives on udp_handle and hands every datagram over with its session
+            int Start(
+                UdpHandle* udp_handle,
+                const CallbackSessionReceived& callback_session_received,
+                const CallbackAlloc& callback_alloc = [] (size_t suggested_size, uv_buf_t *buf) {
+                    buf->base = (char*)malloc(suggested_size);
+                    buf->len = suggested_size;
+                })
+            {
+                _callback_session_received = callback_session_received;
+
+                if (_idle_timeout > 0)
+                {
+                    uint64_t interval = _idle_timeout / 4 > 0 ? _idle_timeout / 4 : 1;
+
+                    int res = _timer.Start([this] () { expire(); }, interval, interval);
+                    if (res < 0)
+                    {
+                        return res;
+                    }
+                }
+
+                return udp_handle->StartReceive(
+                    [this] (ssize_t nread, const uv_buf_t* buf, const struct sockaddr* addr, unsigned flags) {
+                        Session* session = nullptr;
+                        if (nread >= 0 && nullptr != addr)
+                        {
+                            session = Open(addr);
+                        }
+
+                        _callback_session_received(session, nread, buf, flags);
+                    },
+                    callback_alloc);
+            }
+
+            Session* Find(const struct sockaddr* addr)
+            {
+                if (AF_INET != addr->sa_family && AF_INET6 != addr->sa_family)
+                {
+                    return nullptr;
+                }
+
+                const Slot& slot = _slots[probe(addr, hashOf(addr))];
+
+                return 0 != slot.session ? &(_sessions[slot.session - 1]) : nullptr;
+            }
+
+            // the session of addr, created if new, marked active now; nullptr when the table is full
+            Session* Open(const struct sockaddr* addr)
+            {
+                if (AF_INET != addr->sa_family && AF_INET6 != addr->sa_family)
+                {
+                    return nullptr;
+                }
+
+                uint32_t hash = hashOf(addr);
+                Slot& slot = _slots[probe(addr, hash)];
+
+                if (0 != slot.session)
+                {
+                    uint32_t index = slot.session - 1;
+
+                    if (index != _newest)
+                    {
+                        unlink(index);
+                        append(index);
+                    }
+
+                    Session* session = &(_sessions[index]);
+                    session->last_active = uv_now(_loop->uv);
+
+                    return session;
+                }
+
+                if (NONE == _free)
+                {
+                    ++_statistics.rejected;
+                    return nullptr;
+                }
+
+                uint32_t index = _free;
+                _free = _sessions[index]._next;
+
+                Session* session = &(_sessions[index]);
+                memset(&(session->address), 0, sizeof(session->address));
+                memcpy(&(session->address), addr, AF_INET == addr->sa_family ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6));
+                session->last_active = uv_now(_loop->uv);
+                session->_hash = hash;
+
+                slot.hash = hash;
+                slot.session = index + 1;
+
+                append(index);
+
+                ++_size;
+                ++_statistics.created;
+
+                if (_callback_session_opened)
+                {
+                    _callback_session_opened(session);
+                }
+
+                return session;
+            }
+
+            void Remove(Session* session)
+            {
+                ++_statistics.removed;
+
+                release((uint32_t)(session - _sessions.data()));
+            }
+
+            size_t Size() const
+            {
+                return _size;
+            }
+
+            const Statistics& GetStatistics() const
+            {
+                return _statistics;
+            }
+
+            // removes every session; stop receiving on the handle first
+            void Close(const CallbackTableClosed& callback_table_closed = nullptr)
+            {
+                _callback_table_closed = callback_table_closed;
+
+                while (NONE != _oldest)
+                {
+                    Remove(&(_sessions[_oldest]));
+                }
+
+                _timer.Close([this] () {
+                    if (_callback_table_closed)
+                    {
+                        _callback_table_closed();
+                    }
+                });
+            }
+
+        private:
+            UdpSessionTable() = delete;
+
+            UdpSessionTable(const UdpSessionTable&) = delete;
+            UdpSessionTable& operator=(const UdpSessionTable&) = delete;
+
+            UdpSessionTable(UdpSessionTable&&) = delete;
+            UdpSessionTable& operator=(UdpSessionTable&&) = delete;
+        };
+    }
+}
+
+#endif
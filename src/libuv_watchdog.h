@@ -0,0 +1,672 @@
+#ifndef IO_SIMPLIFY_LIBUV_WATCHDOG_H
+#define IO_SIMPLIFY_LIBUV_WATCHDOG_H
+
+#include "libuv_loop.h"
+
+#include "libuv_async_handle.h"
+#include "libuv_check_handle.h"
+#include "libuv_metrics.h"
+#include "libuv_mutex.h"
+#include "libuv_prepare_handle.h"
+#include "libuv_trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// stack samples of a stalled loop thread, where glibc or macOS provide backtrace(3)
+#if defined(__GLIBC__) || defined(__APPLE__)
+#define IO_SIMPLIFY_LIBUV_WATCHDOG_SAMPLING
+
+#include <errno.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <signal.h>
+#endif
+
+#ifndef IO_SIMPLIFY_LIBUV_WATCHDOG_FRAMES
+#define IO_SIMPLIFY_LIBUV_WATCHDOG_FRAMES 32 // frames kept per stack sample
+#endif
+
+namespace io_simplify {
+
+    namespace libuv {
+
+        class LoopWatch;
+
+        /*
+            One thread watching the heartbeat of any number of loops (see LoopWatch). A loop beats before and after
+            every poll for i/o, and is woken up by the watchdog when it has been quiet for a quarter of the threshold,
+            so an idle loop keeps beating; a loop whose heartbeat is older than the threshold is stalled, stuck in a
+            callback or in a long run of them.
+
+            On a stall the watchdog reads which handle and callback the loop thread is running (built with
+            IO_SIMPLIFY_LIBUV_WATCHDOG, otherwise the handle is null) and samples its stack: it sends sample_signal
+            to the loop thread, whose handler records a backtrace(3). The handler is installed by Start; pass 0 to
+            skip sampling. SIGURG is ignored by default, so a signal arriving after Stop does no harm. Like any signal it
+            cuts short a sleep or a blocking call the stalled thread is in (EINTR), so code that blocks on purpose
+            should retry.
+
+            CallbackStall runs on the watchdog thread when a stall is detected and again when it ended.
+        */
+        class Watchdog
+        {
+            friend class LoopWatch;
+
+        public:
+            struct Stall
+            {
+                const char* loop_name;
+                bool finished; // false when detected, true once the loop beat again
+
+                uint64_t begin; // uv_hrtime() of the last heartbeat before the stall
+                uint64_t duration_ns; // so far, when not finished
+
+                // the callback running when the stall was detected; null handle without IO_SIMPLIFY_LIBUV_WATCHDOG
+                const void* handle;
+                uint8_t callback; // TraceCallback
+                uint64_t callback_ns; // how long it had been running at detection
+
+                int frames; // 0 when not sampled
+                void* stack[IO_SIMPLIFY_LIBUV_WATCHDOG_FRAMES];
+            };
+
+            using CallbackStall = std::function<void(const Stall& stall)>;
+
+        private:
+#ifdef IO_SIMPLIFY_LIBUV_WATCHDOG_SAMPLING
+            struct Sample
+            {
+                pthread_t thread;
+                std::atomic<bool> done;
+                int frames;
+                void* stack[IO_SIMPLIFY_LIBUV_WATCHDOG_FRAMES];
+            };
+
+            static std::atomic<Sample*>& pendingSample()
+            {
+                static std::atomic<Sample*> sample(nullptr);
+                return sample;
+            }
+
+            // one sample at a time in the process, whichever watchdog takes it
+            static Mutex& samplingMutex()
+            {
+                static Mutex mutex;
+                return mutex;
+            }
+
+            static void callback_signal(int)
+            {
+                int saved_errno = errno;
+
+                Sample* sample = pendingSample().load(std::memory_order_acquire);
+                if (nullptr != sample && pthread_equal(sample->thread, pthread_self()) && !sample->done.load(std::memory_order_relaxed))
+                {
+                    // the handler and the signal trampoline are not worth reporting
+                    void* stack[IO_SIMPLIFY_LIBUV_WATCHDOG_FRAMES + 2];
+                    int frames = backtrace(stack, IO_SIMPLIFY_LIBUV_WATCHDOG_FRAMES + 2);
+
+                    int skipped = frames > 2 ? 2 : 0;
+                    for (int i = skipped; i < frames; ++i)
+                    {
+                        sample->stack[i - skipped] = stack[i];
+                    }
+                    sample->frames = frames - skipped;
+
+                    sample->done.store(true, std::memory_order_release);
+                }
+
+                errno = saved_errno;
+            }
+#endif
+
+        private:
+            uint64_t _threshold; // nanoseconds
+            uint64_t _interval;
+            int _sample_signal;
+
+            CallbackStall _callback_stall;
+
+            Mutex _mutex;
+            std::vector<LoopWatch*> _watches; // guarded by _mutex
+
+            // odd while a pass inspects its copy of _watches, which runs without the mutex
+            std::atomic<uint64_t> _generation;
+            std::vector<LoopWatch*> _inspected; // changed under _mutex, read by the watchdog thread without it
+
+            std::thread _thread;
+            std::atomic<bool> _stopping;
+            bool _running;
+
+#ifdef IO_SIMPLIFY_LIBUV_WATCHDOG_SAMPLING
+            struct sigaction _previous_action;
+            Sample _sample;
+#endif
+
+        private:
+            void run();
+
+            void add(LoopWatch* watch)
+            {
+                _mutex.Lock();
+                _watches.push_back(watch);
+                _mutex.Unlock();
+            }
+
+            // once it returns the watchdog thread no longer touches watch
+            void remove(LoopWatch* watch)
+            {
+                _mutex.Lock();
+
+                _watches.erase(std::remove(_watches.begin(), _watches.end(), watch), _watches.end());
+
+                uint64_t generation = _generation.load(std::memory_order_acquire);
+                bool inspected = 1 == (generation & 1) && _inspected.end() != std::find(_inspected.begin(), _inspected.end(), watch);
+
+                // from CallbackStall: the pass skips the watch instead, waiting for it would never end
+                if (inspected && std::this_thread::get_id() == _thread.get_id())
+                {
+                    std::replace(_inspected.begin(), _inspected.end(), watch, (LoopWatch*)nullptr);
+                    inspected = false;
+                }
+
+                _mutex.Unlock();
+
+                // the pass in progress copied the list while the watch was in it
+                while (inspected && generation == _generation.load(std::memory_order_acquire))
+                {
+                    std::this_thread::sleep_for(std::chrono::microseconds(100));
+                }
+            }
+
+            // waits up to 100 ms for the loop thread to take its own backtrace
+            int sample(Stall& stall, void* thread)
+            {
+#ifdef IO_SIMPLIFY_LIBUV_WATCHDOG_SAMPLING
+                if (0 == _sample_signal)
+                {
+                    return 0;
+                }
+
+                samplingMutex().Lock();
+
+                _sample.thread = *(pthread_t*)thread;
+                _sample.frames = 0;
+                _sample.done.store(false, std::memory_order_relaxed);
+
+                pendingSample().store(&_sample, std::memory_order_release);
+
+                if (0 == pthread_kill(_sample.thread, _sample_signal))
+                {
+                    for (int i = 0; i < 1000 && !_sample.done.load(std::memory_order_acquire); ++i)
+                    {
+                        std::this_thread::sleep_for(std::chrono::microseconds(100));
+                    }
+                }
+
+                pendingSample().store(nullptr, std::memory_order_release);
+
+                if (_sample.done.load(std::memory_order_acquire))
+                {
+                    stall.frames = _sample.frames;
+                    for (int i = 0; i < stall.frames; ++i)
+                    {
+                        stall.stack[i] = _sample.stack[i];
+                    }
+                }
+
+                samplingMutex().Unlock();
+
+                return stall.frames;
+#else
+                return 0;
+#endif
+            }
+
+        public:
+            /*
+                threshold: milliseconds without a heartbeat that make a stall.
+                sample_signal: signal used to sample a stalled loop's stack, 0 for none.
+            */
+            explicit Watchdog(uint64_t threshold = 100, const CallbackStall& callback_stall = nullptr,
+#ifdef SIGURG
+                int sample_signal = SIGURG)
+#else
+                int sample_signal = 0)
+#endif
+                : _threshold((threshold > 0 ? threshold : 1) * 1000000)
+                , _interval(_threshold / 4)
+                , _sample_signal(sample_signal)
+
+                , _callback_stall(callback_stall)
+
+                , _mutex()
+                , _watches()
+
+                , _generation(0)
+                , _inspected()
+
+                , _thread()
+                , _stopping(false)
+                , _running(false)
+            {
+            }
+
+            ~Watchdog()
+            {
+                Stop();
+            }
+
+            int Start()
+            {
+                if (_running)
+                {
+                    return UV_EALREADY;
+                }
+
+#ifdef IO_SIMPLIFY_LIBUV_WATCHDOG_SAMPLING
+                if (0 != _sample_signal)
+                {
+                    // backtrace loads its unwinder on first use, which is not safe inside a signal handler
+                    void* warm_up[1];
+                    backtrace(warm_up, 1);
+
+                    struct sigaction action;
+                    memset(&action, 0, sizeof(action));
+                    action.sa_handler = callback_signal;
+                    action.sa_flags = SA_RESTART;
+                    sigemptyset(&action.sa_mask);
+
+                    if (0 != sigaction(_sample_signal, &action, &_previous_action))
+                    {
+                        return UV_EINVAL;
+                    }
+                }
+#endif
+
+                _stopping.store(false, std::memory_order_relaxed);
+                _thread = std::thread(&Watchdog::run, this);
+                _running = true;
+
+                return 0;
+            }
+
+            void Stop()
+            {
+                if (!_running)
+                {
+                    return;
+                }
+
+                _stopping.store(true, std::memory_order_release);
+                _thread.join();
+                _running = false;
+
+#ifdef IO_SIMPLIFY_LIBUV_WATCHDOG_SAMPLING
+                if (0 != _sample_signal)
+                {
+                    sigaction(_sample_signal, &_previous_action, nullptr);
+                }
+#endif
+            }
+
+            uint64_t Threshold() const
+            {
+                return _threshold / 1000000;
+            }
+
+            // one line of summary, then one per frame (symbolized with backtrace_symbols where available)
+            static void Format(const Stall& stall, std::string& out)
+            {
+                char line[256];
+
+                int length = snprintf(line, sizeof(line), "loop %s %s for %llu ms", stall.loop_name,
+                    stall.finished ? "stalled" : "is stalling", (unsigned long long)(stall.duration_ns / 1000000));
+                out.append(line, length);
+
+                if (nullptr != stall.handle)
+                {
+                    length = snprintf(line, sizeof(line), " in %s callback of handle %p, running for %llu ms",
+                        TraceCallbackName(stall.callback), stall.handle, (unsigned long long)(stall.callback_ns / 1000000));
+                    out.append(line, length);
+                }
+                out.push_back('\n');
+
+#ifdef IO_SIMPLIFY_LIBUV_WATCHDOG_SAMPLING
+                char** symbols = stall.frames > 0 ? backtrace_symbols((void* const*)stall.stack, stall.frames) : nullptr;
+
+                for (int i = 0; i < stall.frames; ++i)
+                {
+                    if (nullptr != symbols)
+                    {
+                        snprintf(line, sizeof(line), "    #%d %s\n", i, symbols[i]);
+                    }
+                    else
+                    {
+                        snprintf(line, sizeof(line), "    #%d %p\n", i, stall.stack[i]);
+                    }
+                    out.append(line);
+                }
+
+                free(symbols);
+#endif
+            }
+
+        private:
+            Watchdog(const Watchdog&) = delete;
+            Watchdog& operator=(const Watchdog&) = delete;
+
+            Watchdog(Watchdog&&) = delete;
+            Watchdog& operator=(Watchdog&&) = delete;
+        };
+
+        /*
+            Puts one loop under a Watchdog: a prepare and a check handle beat around every poll for i/o, and an async
+            handle lets the watchdog wake the loop when it has been quiet. Start on the loop thread, and Close before
+            the loop stops running, or the watchdog takes the stopped loop for a stalled one.
+
+            Stalls are counted in the statistics and, with a registry, in uv_loop_stalls_total and a histogram of
+            their durations, uv_loop_stall_milliseconds.
+        */
+        class LoopWatch
+        {
+            friend class Watchdog;
+
+        public:
+            using CallbackLoopWatchClosed = std::function<void()>;
+
+            struct Statistics
+            {
+                uint64_t stalls = 0;
+                uint64_t stall_ns = 0; // stalls that ended
+                uint64_t max_stall_ns = 0;
+                uint64_t current_stall_ns = 0; // 0 unless stalled right now
+                uint64_t samples = 0; // stalls with a stack sample
+            };
+
+        private:
+            Watchdog* _watchdog;
+            std::string _name;
+
+            PrepareHandle _prepare;
+            CheckHandle _check;
+            AsyncHandle _async;
+
+            std::atomic<uint64_t> _heartbeat;
+
+#ifdef IO_SIMPLIFY_LIBUV_WATCHDOG
+            CallbackSlot* _slot;
+#endif
+#ifdef IO_SIMPLIFY_LIBUV_WATCHDOG_SAMPLING
+            pthread_t _thread;
+#endif
+
+            // watchdog thread only
+            bool _stalled;
+            uint64_t _last_wake_up;
+            Watchdog::Stall _stall;
+
+            std::atomic<uint64_t> _stalls;
+            std::atomic<uint64_t> _stall_ns;
+            std::atomic<uint64_t> _max_stall_ns;
+            std::atomic<uint64_t> _current_stall_ns;
+            std::atomic<uint64_t> _samples;
+
+            MetricsRegistry::Counter _stalls_counter;
+            MetricsRegistry::Histogram _stall_histogram;
+
+            int _closing;
+            CallbackLoopWatchClosed _callback_loop_watch_closed;
+
+        private:
+            void beat()
+            {
+                _heartbeat.store(uv_hrtime(), std::memory_order_release);
+            }
+
+            void closed()
+            {
+                if (0 == --_closing && _callback_loop_watch_closed)
+                {
+                    _callback_loop_watch_closed();
+                }
+            }
+
+            // on the watchdog thread, Close waits for a pass that may be inspecting the watch
+            void inspect(Watchdog* watchdog, uint64_t now)
+            {
+                uint64_t heartbeat = _heartbeat.load(std::memory_order_acquire);
+                uint64_t age = now > heartbeat ? now - heartbeat : 0;
+
+                if (_stalled)
+                {
+                    if (heartbeat == _stall.begin)
+                    {
+                        _current_stall_ns.store(age, std::memory_order_relaxed);
+                        return;
+                    }
+
+                    // the first beat after the stall tells when the loop got back
+                    uint64_t duration = heartbeat - _stall.begin;
+
+                    _stalled = false;
+                    _current_stall_ns.store(0, std::memory_order_relaxed);
+                    _stall_ns.fetch_add(duration, std::memory_order_relaxed);
+                    if (duration > _max_stall_ns.load(std::memory_order_relaxed))
+                    {
+                        _max_stall_ns.store(duration, std::memory_order_relaxed);
+                    }
+
+                    _stall_histogram.Observe(duration / 1000000);
+
+                    if (watchdog->_callback_stall)
+                    {
+                        _stall.finished = true;
+                        _stall.duration_ns = duration;
+
+                        watchdog->_callback_stall(_stall);
+                    }
+                    return;
+                }
+
+                if (age < watchdog->_threshold)
+                {
+                    // keeps an idle loop beating, at most once per interval
+                    if (age >= watchdog->_interval && now - _last_wake_up >= watchdog->_interval)
+                    {
+                        _last_wake_up = now;
+                        _async.Async([this] () {
+                            beat();
+                        });
+                    }
+                    return;
+                }
+
+                _stalled = true;
+
+                _stall.loop_name = _name.c_str();
+                _stall.finished = false;
+                _stall.begin = heartbeat;
+                _stall.duration_ns = age;
+                _stall.handle = nullptr;
+                _stall.callback = 0;
+                _stall.callback_ns = 0;
+                _stall.frames = 0;
+
+#ifdef IO_SIMPLIFY_LIBUV_WATCHDOG
+                uint64_t begin = _slot->begin.load(std::memory_order_acquire);
+                if (0 != begin)
+                {
+                    _stall.handle = _slot->handle.load(std::memory_order_relaxed);
+                    _stall.callback = _slot->callback.load(std::memory_order_relaxed);
+                    _stall.callback_ns = now > begin ? now - begin : 0;
+                }
+#endif
+
+#ifdef IO_SIMPLIFY_LIBUV_WATCHDOG_SAMPLING
+                if (watchdog->sample(_stall, &_thread) > 0)
+                {
+                    _samples.fetch_add(1, std::memory_order_relaxed);
+                }
+#endif
+
+                _stalls.fetch_add(1, std::memory_order_relaxed);
+                _current_stall_ns.store(age, std::memory_order_relaxed);
+                _stalls_counter.Add();
+
+                if (watchdog->_callback_stall)
+                {
+                    watchdog->_callback_stall(_stall);
+                }
+            }
+
+        public:
+            LoopWatch(Watchdog* watchdog, Loop* loop, const char* name = "default", MetricsRegistry* registry = nullptr, const char* labels = nullptr)
+                : _watchdog(watchdog)
+                , _name(name)
+
+                , _prepare(loop)
+                , _check(loop)
+                , _async(loop)
+
+                , _heartbeat(0)
+
+#ifdef IO_SIMPLIFY_LIBUV_WATCHDOG
+                , _slot(nullptr)
+#endif
+
+                , _stalled(false)
+                , _last_wake_up(0)
+                , _stall()
+
+                , _stalls(0)
+                , _stall_ns(0)
+                , _max_stall_ns(0)
+                , _current_stall_ns(0)
+                , _samples(0)
+
+                , _stalls_counter()
+                , _stall_histogram()
+
+                , _closing(0)
+                , _callback_loop_watch_closed()
+            {
+                if (nullptr != registry)
+                {
+                    static const uint64_t STALL_BOUNDS[] = {50, 100, 250, 500, 1000, 2500, 5000, 10000};
+
+                    _stalls_counter = registry->AddCounter("uv_loop_stalls_total", "Times the loop went without a heartbeat past the watchdog threshold.", labels);
+                    _stall_histogram = registry->AddHistogram("uv_loop_stall_milliseconds", "Duration of loop stalls.", labels,
+                        STALL_BOUNDS, sizeof(STALL_BOUNDS) / sizeof(STALL_BOUNDS[0]));
+                }
+            }
+
+            ~LoopWatch()
+            {
+            }
+
+            // on the loop thread
+            int Start()
+            {
+#ifdef IO_SIMPLIFY_LIBUV_WATCHDOG
+                _slot = &LocalCallbackSlot();
+#endif
+#ifdef IO_SIMPLIFY_LIBUV_WATCHDOG_SAMPLING
+                _thread = pthread_self();
+#endif
+
+                beat();
+
+                int res = _prepare.Start([this] () { beat(); });
+                if (res < 0)
+                {
+                    return res;
+                }
+
+                res = _check.Start([this] () { beat(); });
+                if (res < 0)
+                {
+                    return res;
+                }
+
+                _watchdog->add(this);
+
+                return 0;
+            }
+
+            // safe from any thread
+            void Snapshot(Statistics& statistics) const
+            {
+                statistics.stalls = _stalls.load(std::memory_order_relaxed);
+                statistics.stall_ns = _stall_ns.load(std::memory_order_relaxed);
+                statistics.max_stall_ns = _max_stall_ns.load(std::memory_order_relaxed);
+                statistics.current_stall_ns = _current_stall_ns.load(std::memory_order_relaxed);
+                statistics.samples = _samples.load(std::memory_order_relaxed);
+            }
+
+            void Close(const CallbackLoopWatchClosed& callback_loop_watch_closed = nullptr)
+            {
+                if (0 != _closing)
+                {
+                    return;
+                }
+
+                _watchdog->remove(this);
+
+                _closing = 3;
+                _callback_loop_watch_closed = callback_loop_watch_closed;
+
+                _prepare.Close([this] () { closed(); });
+                _check.Close([this] () { closed(); });
+                _async.Close([this] () { closed(); });
+            }
+
+        private:
+            LoopWatch() = delete;
+
+            LoopWatch(const LoopWatch&) = delete;
+            LoopWatch& operator=(const LoopWatch&) = delete;
+
+            LoopWatch(LoopWatch&&) = delete;
+            LoopWatch& operator=(LoopWatch&&) = delete;
+        };
+
+        inline void Watchdog::run()
+        {
+            while (!_stopping.load(std::memory_order_acquire))
+            {
+                uint64_t now = uv_hrtime();
+
+                // sampling and CallbackStall run without the mutex, Start and Close on the loop threads do not wait for them
+                _mutex.Lock();
+                _inspected = _watches;
+                _generation.fetch_add(1, std::memory_order_release);
+                _mutex.Unlock();
+
+                for (size_t i = 0; i < _inspected.size(); ++i)
+                {
+                    if (nullptr != _inspected[i])
+                    {
+                        _inspected[i]->inspect(this, now);
+                    }
+                }
+
+                _generation.fetch_add(1, std::memory_order_release);
+
+                std::this_thread::sleep_for(std::chrono::nanoseconds(_interval));
+            }
+        }
+    }
+}
+
+#endif
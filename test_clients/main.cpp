@@ -1,155 +1,851 @@
 
 #include "libuv_tcp_handle.h"
 #include "libuv_udp_handle.h"
+#include "libuv_timer_handle.h"
+#include "libuv_idle_handle.h"
 
-#include "libuv_async_handle.h"
+#include "libuv_histogram.h"
 
 #include <thread>
+#include <vector>
+#include <deque>
 
 #include <string>
+#include <cstring>
 #include <iostream>
+#include <iomanip>
 
-class UserThread
+/*
+    Open-loop load generator.
+
+    Every connection owns a fixed schedule of intended send times (rate / connections apart) and latency is measured
+    from the intended send time, not from the moment the request actually left. A slow server therefore shows up as
+    latency instead of silently lowering the offered load (coordinated omission). Requests held back by the pipelining
+    depth keep their intended time; requests still held back when the run ends are reported as missed.
+
+    Due requests go out on a 1 ms timer tick, so sender-side scheduling adds up to 1 ms to every latency; with --spin 1
+    the loops poll without blocking and check the schedule every iteration instead, at the cost of one busy core per loop.
+
+    TCP expects a fixed number of response bytes per request (an echo server by default), UDP expects one datagram
+    per request echoing its first 8 bytes, the request sequence number.
+*/
+
+struct Options
+{
+    io_simplify::Endpoint endpoint;
+
+    bool udp = false;
+
+    unsigned int threads = 1;
+    unsigned int connections = 1;
+
+    double rate = 1000.0; // requests per second, all connections together
+    double duration = 10.0; // seconds
+    double warmup = 0.0; // seconds not recorded
+
+    size_t size = 64; // request payload bytes
+    size_t response = 0; // response bytes per tcp request, 0 means size
+    unsigned int pipeline = 1; // outstanding requests per connection
+
+    uint64_t timeout = 1000; // ms, udp requests unanswered that long are lost; also how long the end of the run waits
+
+    bool spin = false;
+};
+
+// every count covers the measured requests only, those intended to be sent after the warmup
+struct Results
+{
+    io_simplify::libuv::Histogram latency; // nanoseconds, from intended send time
+
+    uint64_t sent = 0;
+    uint64_t completed = 0;
+    uint64_t lost = 0;
+    uint64_t missed = 0;
+    uint64_t errors = 0;
+    uint64_t connect_failed = 0;
+
+    uint64_t bytes_out = 0;
+    uint64_t bytes_in = 0;
+};
+
+class LoadThread;
+
+class LoadConnection
+{
+private:
+    struct TcpWrite : public io_simplify::libuv::TcpHandle::WriteRequest
+    {
+        LoadConnection* connection;
+    };
+
+    struct UdpSend : public io_simplify::libuv::UdpHandle::SendRequest
+    {
+        LoadConnection* connection;
+        char payload[1];
+    };
+
+    struct Outstanding
+    {
+        uint64_t sequence;
+        uint64_t intended;
+    };
+
+private:
+    LoadThread* _thread;
+    const Options& _options;
+
+    io_simplify::libuv::TcpHandle* _tcp;
+    io_simplify::libuv::UdpHandle* _udp;
+    uv_connect_t _connect_req;
+
+    // intended time of the next request not sent yet, advances by _period whether or not it could be sent
+    uint64_t _period;
+    uint64_t _next_due;
+    uint64_t _sequence;
+
+    std::deque<Outstanding> _outstanding;
+    size_t _response_bytes;
+
+    std::vector<TcpWrite*> _tcp_writes;
+    std::vector<UdpSend*> _udp_sends;
+    std::vector<uv_buf_t> _batch;
+
+    bool _closing;
+
+private:
+    static void callback_tcp_written(io_simplify::libuv::TcpHandle::WriteRequest* write_request, int status)
+    {
+        TcpWrite* tcp_write = (TcpWrite*)(write_request);
+
+        tcp_write->connection->_tcp_writes.push_back(tcp_write);
+        tcp_write->connection->written(status);
+    }
+
+    static void callback_udp_sent(io_simplify::libuv::UdpHandle::SendRequest* send_request, int status)
+    {
+        UdpSend* udp_send = (UdpSend*)(send_request);
+
+        udp_send->connection->_udp_sends.push_back(udp_send);
+        udp_send->connection->written(status);
+    }
+
+    void written(int status);
+
+    void complete(const Outstanding& outstanding, uint64_t now, size_t bytes);
+
+    bool measured(const Outstanding& outstanding) const;
+
+    void receivedTcp(ssize_t nread);
+
+    void receivedUdp(const char* data, ssize_t nread);
+
+    int send(size_t count);
+
+public:
+    LoadConnection(LoadThread* thread, const Options& options);
+
+    ~LoadConnection();
+
+    void Connect();
+
+    void Schedule(uint64_t period, uint64_t first_due)
+    {
+        _period = period;
+        _next_due = first_due;
+    }
+
+    // sends every request due by now that fits the pipelining window, expires lost udp requests, ends the run
+    void Pump(uint64_t now);
+
+    void Close();
+};
+
+class LoadThread
 {
+    friend class LoadConnection;
+
 private:
-    io_simplify::libuv::Loop* _loop;
-    io_simplify::libuv::AsyncHandle* _async;
-    io_simplify::Endpoint _endpoint;
+    const Options& _options;
+    unsigned int _first_connection;
+    unsigned int _connection_count;
+
+    io_simplify::libuv::Loop _loop;
+    io_simplify::libuv::TimerHandle _timer;
+    io_simplify::libuv::IdleHandle _idle;
+
+    std::vector<LoadConnection*> _connections;
+    unsigned int _connecting;
+    unsigned int _open;
+
+    std::string _payload;
+    std::vector<char> _receive_buffer;
+
+    uint64_t _record_from;
+    uint64_t _end;
+
+    Results _results;
 
     std::thread _thread;
 
-    void process_user_input()
+private:
+    void connected()
     {
-        std::string user_cmd;
+        if (0 != --_connecting)
+        {
+            return;
+        }
 
-        io_simplify::libuv::TcpHandle tcp_handle(_loop);
-        io_simplify::libuv::UdpHandle udp_handle(_loop);
+        // the schedule starts once every connection of this loop is up
+        uint64_t start = uv_hrtime();
 
-        uv_udp_send_t udp_send_req;
-        uv_write_t tcp_write_req;
-        uv_connect_t tcp_conn_req;
-            
-        do
+        _record_from = start + (uint64_t)(_options.warmup * 1e9);
+        _end = start + (uint64_t)(_options.duration * 1e9);
+
+        uint64_t period = (uint64_t)(1e9 * _options.connections / _options.rate);
+
+        for (unsigned int i = 0; i < _connection_count; ++i)
         {
-            std::cout << "please input command:" << std::endl;
+            // spread the connections evenly over one period
+            _connections[i]->Schedule(period, start + period * (_first_connection + i) / _options.connections);
+        }
 
-            std::cin >> user_cmd;
+        if (_options.spin)
+        {
+            _idle.Start([this] () { tick(); });
+        }
+        else
+        {
+            _timer.Start([this] () { tick(); }, 1, 1);
+        }
+    }
 
-            if (user_cmd == "quit")
-            {
-                _async->Async([this, &udp_handle, &tcp_handle]() {
-                    udp_handle.AsyncClose();
-                    tcp_handle.AsyncClose();
-                    _async->AsyncClose();
-                    _loop->Stop();
-
-                    });
-                
-                break;
-            }
+    void tick()
+    {
+        uint64_t now = uv_hrtime();
+
+        for (LoadConnection* connection : _connections)
+        {
+            connection->Pump(now);
+        }
+    }
+
+    void connectionClosed()
+    {
+        if (0 == --_open)
+        {
+            _timer.Close();
+            _idle.Close();
+        }
+    }
+
+    void run()
+    {
+        for (unsigned int i = 0; i < _connection_count; ++i)
+        {
+            _connections.push_back(new LoadConnection(this, _options));
+        }
+
+        _connecting = _connection_count;
+        _open = _connection_count;
+
+        for (LoadConnection* connection : _connections)
+        {
+            connection->Connect();
+        }
+
+        _loop.Run();
+
+        for (LoadConnection* connection : _connections)
+        {
+            delete connection;
+        }
+        _connections.clear();
+    }
+
+public:
+    LoadThread(const Options& options, unsigned int first_connection, unsigned int connection_count)
+        : _options(options)
+        , _first_connection(first_connection)
+        , _connection_count(connection_count)
+
+        , _loop()
+        , _timer(&_loop)
+        , _idle(&_loop)
+
+        , _connections()
+        , _connecting(0)
+        , _open(0)
+
+        , _payload(options.size, 'x')
+        , _receive_buffer(64 * 1024)
+
+        , _record_from(0)
+        , _end(0)
+
+        , _results()
+
+        , _thread()
+    {
+    }
+
+    ~LoadThread()
+    {
+    }
+
+    void Start()
+    {
+        _thread = std::thread(&LoadThread::run, this);
+    }
+
+    const Results& Join()
+    {
+        _thread.join();
+
+        return _results;
+    }
+};
+
+LoadConnection::LoadConnection(LoadThread* thread, const Options& options)
+    : _thread(thread)
+    , _options(options)
+
+    , _tcp(nullptr)
+    , _udp(nullptr)
+    , _connect_req()
+
+    , _period(0)
+    , _next_due(UINT64_MAX)
+    , _sequence(0)
+
+    , _outstanding()
+    , _response_bytes(0)
+
+    , _tcp_writes()
+    , _udp_sends()
+    , _batch()
+
+    , _closing(false)
+{
+}
+
+LoadConnection::~LoadConnection()
+{
+    // the handles own the close callback that reports them closed, they go once the loop has finished
+    delete _tcp;
+    delete _udp;
+
+    for (TcpWrite* tcp_write : _tcp_writes)
+    {
+        delete tcp_write;
+    }
+
+    for (UdpSend* udp_send : _udp_sends)
+    {
+        free(udp_send);
+    }
+}
+
+void LoadConnection::Connect()
+{
+    if (_options.udp)
+    {
+        _udp = new io_simplify::libuv::UdpHandle(&(_thread->_loop));
+
+        int res = _udp->Connect(_options.endpoint);
+        if (res >= 0)
+        {
+            res = _udp->StartReceive(
+                [this] (ssize_t nread, const uv_buf_t* buf, const struct sockaddr*, unsigned int) {
+                    receivedUdp(buf->base, nread);
+                },
+                [this] (size_t, uv_buf_t* buf) {
+                    buf->base = _thread->_receive_buffer.data();
+                    buf->len = _thread->_receive_buffer.size();
+                });
+        }
 
-            if (user_cmd.size() > 6)
+        if (res < 0)
+        {
+            std::cout << "udp connect failed: " << uv_strerror(res) << "(" << res << ")" << std::endl;
+
+            ++_thread->_results.connect_failed;
+            Close();
+        }
+
+        _thread->connected();
+        return;
+    }
+
+    _tcp = new io_simplify::libuv::TcpHandle(&(_thread->_loop));
+
+    int res = _tcp->Connect(&_connect_req, _options.endpoint, [this] (uv_connect_t*, int status) {
+        if (status >= 0)
+        {
+            _tcp->NoDelay(1);
+
+            status = _tcp->StartRead(
+                [this] (ssize_t nread, const uv_buf_t*) {
+                    receivedTcp(nread);
+                },
+                [this] (size_t, uv_buf_t* buf) {
+                    buf->base = _thread->_receive_buffer.data();
+                    buf->len = _thread->_receive_buffer.size();
+                });
+        }
+
+        if (status < 0)
+        {
+            std::cout << "tcp connect failed: " << uv_strerror(status) << "(" << status << ")" << std::endl;
+
+            ++_thread->_results.connect_failed;
+            Close();
+        }
+
+        _thread->connected();
+    });
+
+    if (res < 0)
+    {
+        std::cout << "tcp connect failed: " << uv_strerror(res) << "(" << res << ")" << std::endl;
+
+        ++_thread->_results.connect_failed;
+        Close();
+
+        _thread->connected();
+    }
+}
+
+void LoadConnection::Pump(uint64_t now)
+{
+    if (_closing || 0 == _period)
+    {
+        return;
+    }
+
+    Results& results = _thread->_results;
+
+    // udp requests past the timeout are lost, their window slot is free again
+    if (_udp)
+    {
+        uint64_t timeout = _options.timeout * 1000000;
+
+        while (!_outstanding.empty() && _outstanding.front().intended + timeout < now)
+        {
+            if (measured(_outstanding.front()))
             {
-                if(user_cmd.substr(0, 5) == "usend")
-                {
-                    //uv_udp_send_t* udp_send_req = (uv_udp_send_t*)malloc(sizeof(uv_udp_send_t));
-                    _async->Async([&udp_handle, &udp_send_req, &user_cmd]() {
-                        uv_buf_t buf = uv_buf_init(user_cmd.data() + 6, user_cmd.size() - 6);
-                        int res = udp_handle.Send(&udp_send_req, &buf, 1, [] (uv_udp_send_t* req, int status) {
-                            std::cout << "udp send status: " << uv_strerror(status) << "(" << status << ")" << std::endl;
-                            //free(req);
-                        });
-
-                        if (res < 0)
-                        {
-                            std::cout << "udp send failed: " << uv_strerror(res) << "(" << res << ")" << std::endl;
-                        }
-                    });
-                    continue;
-                }
-
-                if(user_cmd.substr(0, 5) == "tsend")
-                {
-                    _async->Async([&tcp_handle, &tcp_write_req, &user_cmd]() {
-                        uv_buf_t buf = uv_buf_init(user_cmd.data() + 6, user_cmd.size() - 6);
-                        tcp_handle.Write(&tcp_write_req, &buf, 1, [] (uv_write_t* req, int status) {
-                            std::cout << "tcp write status: " << uv_strerror(status) << "(" << status << ")" << std::endl;
-                        });
-                    });
-                    continue;
-                }
+                ++results.lost;
             }
 
-            if (user_cmd == "connect.udp.server")
+            _outstanding.pop_front();
+        }
+    }
+
+    size_t count = 0;
+    size_t measured_count = 0;
+    while (_next_due <= now && _next_due < _thread->_end && _outstanding.size() < _options.pipeline)
+    {
+        _outstanding.push_back(Outstanding{_sequence++, _next_due});
+        _next_due += _period;
+
+        ++count;
+
+        if (measured(_outstanding.back()))
+        {
+            ++measured_count;
+        }
+    }
+
+    if (count > 0)
+    {
+        int res = send(count);
+        if (res < 0)
+        {
+            std::cout << "send failed: " << uv_strerror(res) << "(" << res << ")" << std::endl;
+
+            ++results.errors;
+            Close();
+            return;
+        }
+
+        results.sent += measured_count;
+        results.bytes_out += measured_count * _thread->_payload.size();
+    }
+
+    if (now < _thread->_end)
+    {
+        return;
+    }
+
+    if (_outstanding.empty() || now > _thread->_end + _options.timeout * 1000000)
+    {
+        // due but never sent: the window stayed full until the end
+        while (_next_due < _thread->_end)
+        {
+            if (_next_due >= _thread->_record_from)
             {
-                int res = udp_handle.Connect(_endpoint);
-                if (res < 0)
-                {
-                    std::cout << "udp_handle connect failed: " << uv_strerror(res) << "(" << res << ")" << std::endl;
-                }
-                
-                continue;
+                ++results.missed;
             }
 
-            if (user_cmd == "connect.tcp.server")
+            _next_due += _period;
+        }
+
+        for (const Outstanding& outstanding : _outstanding)
+        {
+            if (measured(outstanding))
             {
-                int res = tcp_handle.Connect(&tcp_conn_req, _endpoint, [] (uv_connect_t* req, int status) {
-                    if (status < 0)
-                    {
-                        std::cout << "callback, tcp_handle connect failed: " << uv_strerror(status) << "(" << status << ")" << std::endl;
-                    }
-                });
-                if (res < 0)
-                {
-                    std::cout << "tcp_handle connect failed: " << uv_strerror(res) << "(" << res << ")" << std::endl;
-                }
-                
-                continue;
+                ++results.lost;
             }
+        }
+        _outstanding.clear();
 
-            std::cout << "unrecognized command: " << user_cmd << std::endl;
-        } while (true);
+        Close();
     }
+}
 
-public:
-    UserThread(io_simplify::libuv::Loop* loop, io_simplify::libuv::AsyncHandle* async, const io_simplify::Endpoint& endpoint)
-        : _loop(loop)
-        , _async(async)
-        , _endpoint(endpoint)
-        , _thread(std::thread(&UserThread::process_user_input, this))
+int LoadConnection::send(size_t count)
+{
+    const std::string& payload = _thread->_payload;
+
+    if (_tcp)
     {
+        // the whole batch leaves in one write, every buffer refers to the same payload
+        _batch.assign(count, uv_buf_init((char*)payload.data(), (unsigned int)payload.size()));
+
+        TcpWrite* tcp_write = nullptr;
+        if (_tcp_writes.empty())
+        {
+            tcp_write = new TcpWrite();
+            tcp_write->callback_written = callback_tcp_written;
+            tcp_write->connection = this;
+        }
+        else
+        {
+            tcp_write = _tcp_writes.back();
+            _tcp_writes.pop_back();
+        }
+
+        int res = _tcp->Write(tcp_write, _batch.data(), (unsigned int)count);
+        if (res < 0)
+        {
+            _tcp_writes.push_back(tcp_write);
+        }
+
+        return res;
     }
 
-    ~UserThread()
+    for (size_t i = _outstanding.size() - count; i < _outstanding.size(); ++i)
     {
-        _thread.join();
+        UdpSend* udp_send = nullptr;
+        if (_udp_sends.empty())
+        {
+            udp_send = (UdpSend*)malloc(sizeof(UdpSend) + payload.size());
+            udp_send->callback_sent = callback_udp_sent;
+            udp_send->connection = this;
+
+            memcpy(udp_send->payload, payload.data(), payload.size());
+        }
+        else
+        {
+            udp_send = _udp_sends.back();
+            _udp_sends.pop_back();
+        }
+
+        memcpy(udp_send->payload, &(_outstanding[i].sequence), sizeof(uint64_t));
+
+        uv_buf_t buf = uv_buf_init(udp_send->payload, (unsigned int)payload.size());
+
+        int res = _udp->Send(udp_send, &buf, 1);
+        if (res < 0)
+        {
+            _udp_sends.push_back(udp_send);
+
+            return res;
+        }
     }
-};
 
-int main(int argc, char** argv) 
+    return 0;
+}
+
+void LoadConnection::written(int status)
+{
+    if (status < 0 && !_closing)
+    {
+        std::cout << "send failed: " << uv_strerror(status) << "(" << status << ")" << std::endl;
+
+        ++_thread->_results.errors;
+        Close();
+    }
+}
+
+bool LoadConnection::measured(const Outstanding& outstanding) const
+{
+    return outstanding.intended >= _thread->_record_from;
+}
+
+void LoadConnection::complete(const Outstanding& outstanding, uint64_t now, size_t bytes)
+{
+    Results& results = _thread->_results;
+
+    if (measured(outstanding))
+    {
+        results.latency.Record(now - outstanding.intended);
+        ++results.completed;
+
+        results.bytes_in += bytes;
+    }
+}
+
+void LoadConnection::receivedTcp(ssize_t nread)
+{
+    if (nread < 0)
+    {
+        if (!_closing)
+        {
+            std::cout << "read failed: " << uv_strerror(nread) << "(" << nread << ")" << std::endl;
+
+            ++_thread->_results.errors;
+            Close();
+        }
+        return;
+    }
+
+    uint64_t now = uv_hrtime();
+    size_t response = _options.response > 0 ? _options.response : _options.size;
+
+    _response_bytes += nread;
+
+    while (_response_bytes >= response && !_outstanding.empty())
+    {
+        _response_bytes -= response;
+
+        complete(_outstanding.front(), now, response);
+        _outstanding.pop_front();
+    }
+
+    // the freed window slots may already be due
+    Pump(now);
+}
+
+void LoadConnection::receivedUdp(const char* data, ssize_t nread)
+{
+    if (nread < (ssize_t)sizeof(uint64_t))
+    {
+        return;
+    }
+
+    uint64_t now = uv_hrtime();
+
+    uint64_t sequence = 0;
+    memcpy(&sequence, data, sizeof(sequence));
+
+    // earlier requests still waiting were dropped on the way; a reply older than the window is a late one
+    while (!_outstanding.empty() && _outstanding.front().sequence < sequence)
+    {
+        if (measured(_outstanding.front()))
+        {
+            ++_thread->_results.lost;
+        }
+
+        _outstanding.pop_front();
+    }
+
+    if (!_outstanding.empty() && _outstanding.front().sequence == sequence)
+    {
+        complete(_outstanding.front(), now, (size_t)nread);
+        _outstanding.pop_front();
+    }
+
+    Pump(now);
+}
+
+void LoadConnection::Close()
 {
-    io_simplify::libuv::Loop loop;
+    if (_closing)
+    {
+        return;
+    }
 
-    io_simplify::libuv::AsyncHandle async_handle(&loop);
+    _closing = true;
 
-    int res = 0;
-    do
+    if (_tcp)
+    {
+        _tcp->StopRead();
+        _tcp->Close([this] () {
+            _thread->connectionClosed();
+        });
+    }
+    else if (_udp)
     {
-        if (argc < 3)
+        _udp->StopReceive();
+        _udp->Close([this] () {
+            _thread->connectionClosed();
+        });
+    }
+}
+
+static bool parse_options(int argc, char** argv, Options& options)
+{
+    if (argc < 3)
+    {
+        return false;
+    }
+
+    options.endpoint = io_simplify::Endpoint {argv[1], (uint16_t)atoi(argv[2])};
+
+    for (int i = 3; i + 1 < argc; i += 2)
+    {
+        std::string name = argv[i];
+        const char* value = argv[i + 1];
+
+        if (name == "--protocol")
+        {
+            options.udp = (std::string(value) == "udp");
+        }
+        else if (name == "--threads")
+        {
+            options.threads = (unsigned int)atoi(value);
+        }
+        else if (name == "--connections")
+        {
+            options.connections = (unsigned int)atoi(value);
+        }
+        else if (name == "--rate")
+        {
+            options.rate = atof(value);
+        }
+        else if (name == "--duration")
+        {
+            options.duration = atof(value);
+        }
+        else if (name == "--warmup")
+        {
+            options.warmup = atof(value);
+        }
+        else if (name == "--size")
+        {
+            options.size = (size_t)atol(value);
+        }
+        else if (name == "--response")
+        {
+            options.response = (size_t)atol(value);
+        }
+        else if (name == "--pipeline")
+        {
+            options.pipeline = (unsigned int)atoi(value);
+        }
+        else if (name == "--timeout")
+        {
+            options.timeout = (uint64_t)atol(value);
+        }
+        else if (name == "--spin")
         {
-            std::cout << "usage: \n     " << argv[0] << " ip port" << std::endl;
-            break;
+            options.spin = (0 != atoi(value));
         }
+        else
+        {
+            std::cout << "unrecognized option: " << name << std::endl;
+            return false;
+        }
+    }
+
+    if (0 == options.threads || 0 == options.connections || 0 == options.pipeline || options.rate <= 0.0 || options.duration <= options.warmup)
+    {
+        std::cout << "threads, connections, pipeline and rate must be positive, duration longer than warmup" << std::endl;
+        return false;
+    }
 
-        io_simplify::Endpoint endpoint {argv[1], (uint16_t)atoi(argv[2])};
+    if (options.udp && options.size < sizeof(uint64_t))
+    {
+        std::cout << "udp payloads carry an 8 byte sequence number, size must be at least 8" << std::endl;
+        return false;
+    }
+
+    if (options.threads > options.connections)
+    {
+        options.threads = options.connections;
+    }
 
-        UserThread user_thread(&loop, &async_handle, endpoint);
+    return true;
+}
+
+static void report(const Options& options, const Results& results)
+{
+    double seconds = options.duration - options.warmup;
+
+    std::cout << std::fixed << std::setprecision(1);
+
+    std::cout << (options.udp ? "udp" : "tcp") << ", " << options.threads << " loops, " << options.connections << " connections, "
+        << "target " << options.rate << " req/s for " << options.duration << " s (" << options.warmup << " s warmup), "
+        << "payload " << options.size << " B, pipeline " << options.pipeline << std::endl;
+
+    std::cout << "requests: sent " << results.sent << ", completed " << results.completed << ", lost " << results.lost
+        << ", missed " << results.missed << ", errors " << results.errors << ", connect failed " << results.connect_failed << std::endl;
+
+    std::cout << "throughput: " << results.completed / seconds << " req/s, "
+        << results.bytes_out / seconds / 1e6 << " MB/s out, " << results.bytes_in / seconds / 1e6 << " MB/s in" << std::endl;
+
+    const io_simplify::libuv::Histogram& latency = results.latency;
+
+    std::cout << std::setprecision(2) << "latency (us, from intended send time):" << std::endl;
+    std::cout << "    min " << latency.Min() / 1e3 << ", mean " << latency.Mean() / 1e3 << ", max " << latency.Max() / 1e3 << std::endl;
+
+    const double percentiles[] = {50.0, 90.0, 99.0, 99.9, 99.99, 99.999};
+    for (double percentile : percentiles)
+    {
+        std::cout << "    p" << std::setprecision(6) << std::defaultfloat << percentile << std::fixed << std::setprecision(2)
+            << "  " << latency.Percentile(percentile) / 1e3 << std::endl;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+
+    if (!parse_options(argc, argv, options))
+    {
+        std::cout << "usage: \n     " << argv[0] << " ip port [--protocol tcp|udp] [--threads N] [--connections M] [--rate R]"
+            << " [--duration S] [--warmup S] [--size B] [--response B] [--pipeline D] [--timeout MS] [--spin 0|1]" << std::endl;
+        return 1;
+    }
+
+    std::vector<LoadThread*> threads;
+
+    unsigned int first_connection = 0;
+    for (unsigned int i = 0; i < options.threads; ++i)
+    {
+        unsigned int connection_count = options.connections / options.threads + (i < options.connections % options.threads ? 1 : 0);
+
+        threads.push_back(new LoadThread(options, first_connection, connection_count));
+
+        first_connection += connection_count;
+    }
+
+    for (LoadThread* thread : threads)
+    {
+        thread->Start();
+    }
+
+    Results total;
+    for (LoadThread* thread : threads)
+    {
+        const Results& results = thread->Join();
+
+        total.latency.Merge(results.latency);
+
+        total.sent += results.sent;
+        total.completed += results.completed;
+        total.lost += results.lost;
+        total.missed += results.missed;
+        total.errors += results.errors;
+        total.connect_failed += results.connect_failed;
+
+        total.bytes_out += results.bytes_out;
+        total.bytes_in += results.bytes_in;
+
+        delete thread;
+    }
 
-        res = loop.Run();
-        
-    } while (false);
-    
-    std::cout << "main exit: " << uv_strerror(res) << "(" << res << ")" << std::endl;
+    report(options, total);
 
-    return res;
+    return 0;
 }
@@ -0,0 +1,854 @@
+#include "libuv_tcp_handle.h"
+#include "libuv_udp_handle.h"
+#include "libuv_timer_handle.h"
+#include "libuv_idle_handle.h"
+
+#include "libuv_capture.h"
+#include "libuv_histogram.h"
+
+#include <unordered_map>
+#include <vector>
+#include <deque>
+
+#include <string>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+    Replays a capture written by io_simplify::libuv::Capture against a server.
+
+    The capture is mapped and walked in place; payloads go out straight from the mapping. Every captured tcp connection
+    gets its own connection, every captured udp peer its own connected socket. Records are released on their captured
+    timeline divided by --speed (1 is real time, 10 ten times faster), or as fast as the server takes them with
+    --speed 0, where a connection with more than --window bytes in flight holds the whole replay back.
+
+    Latency runs from the intended send time of a payload to the first read after it: a udp datagram answers one
+    payload, a tcp read every payload sent before it. That is exact for request/response protocols and optimistic for
+    pipelined ones whose responses trickle in. Throughput is taken up to the last payload sent or response read, so
+    waiting out --timeout for missing responses at the end does not count.
+*/
+
+struct Options
+{
+    std::string path;
+    io_simplify::Endpoint endpoint;
+
+    double speed = 1.0; // 0 means as fast as possible
+
+    size_t window = 4 * 1024 * 1024; // bytes in flight per connection, --speed 0 only
+    uint64_t timeout = 1000; // ms, how long the end of the replay waits for responses
+
+    bool spin = false;
+};
+
+struct Results
+{
+    io_simplify::libuv::Histogram latency; // nanoseconds, from intended send time to the first response read
+    io_simplify::libuv::Histogram lag; // nanoseconds, from intended to actual send time, paced replay only
+
+    uint64_t records = 0;
+    uint64_t connections = 0;
+    uint64_t connect_failed = 0;
+
+    uint64_t sent = 0;
+    uint64_t answered = 0;
+    uint64_t unanswered = 0;
+    uint64_t errors = 0;
+
+    uint64_t bytes_out = 0;
+    uint64_t bytes_in = 0;
+
+    uint64_t elapsed = 0; // nanoseconds, first record to the last payload sent or response read
+};
+
+class Replayer;
+
+class ReplayConnection
+{
+private:
+    struct TcpWrite : public io_simplify::libuv::TcpHandle::WriteRequest
+    {
+        ReplayConnection* connection;
+        size_t size;
+    };
+
+    struct UdpSend : public io_simplify::libuv::UdpHandle::SendRequest
+    {
+        ReplayConnection* connection;
+        size_t size;
+    };
+
+private:
+    Replayer* _replayer;
+
+    io_simplify::libuv::TcpHandle* _tcp;
+    io_simplify::libuv::UdpHandle* _udp;
+    uv_connect_t _connect_req;
+    uv_shutdown_t _shutdown_req;
+
+    std::deque<uint64_t> _pending; // intended send times waiting for a response
+    size_t _in_flight; // bytes handed to libuv and not written yet
+
+    bool _finished;
+    bool _shutdown;
+    bool _closing;
+
+private:
+    static void callback_tcp_written(io_simplify::libuv::TcpHandle::WriteRequest* write_request, int status)
+    {
+        TcpWrite* tcp_write = (TcpWrite*)(write_request);
+
+        ReplayConnection* connection = tcp_write->connection;
+        size_t size = tcp_write->size;
+
+        connection->loop().arena.Delete(tcp_write);
+        connection->written(size, status);
+    }
+
+    static void callback_udp_sent(io_simplify::libuv::UdpHandle::SendRequest* send_request, int status)
+    {
+        UdpSend* udp_send = (UdpSend*)(send_request);
+
+        ReplayConnection* connection = udp_send->connection;
+        size_t size = udp_send->size;
+
+        connection->loop().arena.Delete(udp_send);
+        connection->written(size, status);
+    }
+
+    io_simplify::libuv::Loop& loop();
+
+    void written(size_t size, int status);
+
+    void received(ssize_t nread);
+
+    void failed(const char* what, int res);
+
+    void drained();
+
+public:
+    explicit ReplayConnection(Replayer* replayer);
+
+    ~ReplayConnection();
+
+    void Open(bool udp);
+
+    void Send(const char* data, size_t size, uint64_t intended);
+
+    // the captured connection ended, close once everything sent has been answered
+    void Finish();
+
+    size_t InFlight() const
+    {
+        return _in_flight;
+    }
+
+    void Close();
+};
+
+class Replayer
+{
+    friend class ReplayConnection;
+
+private:
+    const Options& _options;
+
+    io_simplify::libuv::Loop _loop;
+    io_simplify::libuv::TimerHandle _timer;
+    io_simplify::libuv::IdleHandle _idle;
+
+    const char* _data;
+    size_t _mapped;
+    size_t _size; // up to the last complete record
+    size_t _cursor;
+
+    uint64_t _first_time; // capture time of the first record
+    uint64_t _start;
+    uint64_t _deadline; // once every record went out, the longest the replay waits for responses
+    uint64_t _last_activity;
+
+    std::unordered_map<uint64_t, ReplayConnection*> _active; // by captured connection
+    std::vector<ReplayConnection*> _connections;
+    unsigned int _open;
+
+    std::vector<char> _receive_buffer;
+
+    Results _results;
+
+private:
+    const io_simplify::libuv::Capture::RecordHeader* record() const
+    {
+        return (const io_simplify::libuv::Capture::RecordHeader*)(_data + _cursor);
+    }
+
+    ReplayConnection* connection(uint64_t id, bool udp)
+    {
+        auto found = _active.find(id);
+        if (found != _active.end())
+        {
+            return found->second;
+        }
+
+        // the capture may start in the middle of a connection, its first data opens it
+        ReplayConnection* connection = new ReplayConnection(this);
+
+        _active.emplace(id, connection);
+        _connections.push_back(connection);
+
+        ++_open;
+        ++_results.connections;
+
+        connection->Open(udp);
+
+        return connection;
+    }
+
+    void finish()
+    {
+        for (auto& active : _active)
+        {
+            active.second->Finish();
+        }
+
+        _active.clear();
+    }
+
+    // the replay ends once every record went out and every connection closed
+    void stopIfDone()
+    {
+        if (0 == _open && _cursor == _size)
+        {
+            _results.elapsed = _last_activity > _start ? _last_activity - _start : 0;
+
+            _timer.Close();
+            _idle.Close();
+        }
+    }
+
+    void connectionClosed()
+    {
+        --_open;
+
+        stopIfDone();
+    }
+
+public:
+    explicit Replayer(const Options& options)
+        : _options(options)
+
+        , _loop()
+        , _timer(&_loop)
+        , _idle(&_loop)
+
+        , _data(nullptr)
+        , _mapped(0)
+        , _size(0)
+        , _cursor(0)
+
+        , _first_time(0)
+        , _start(0)
+        , _deadline(0)
+        , _last_activity(0)
+
+        , _active()
+        , _connections()
+        , _open(0)
+
+        , _receive_buffer(64 * 1024)
+
+        , _results()
+    {
+    }
+
+    ~Replayer()
+    {
+        for (ReplayConnection* connection : _connections)
+        {
+            delete connection;
+        }
+
+        if (nullptr != _data)
+        {
+            munmap((void*)_data, _mapped);
+        }
+    }
+
+    int Map(const std::string& path)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return uv_translate_sys_error(errno);
+        }
+
+        struct stat file_stat;
+        if (0 != fstat(fd, &file_stat) || (size_t)file_stat.st_size < sizeof(io_simplify::libuv::Capture::FileHeader))
+        {
+            close(fd);
+            return UV_EINVAL;
+        }
+
+        void* data = mmap(nullptr, (size_t)file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if (MAP_FAILED == data)
+        {
+            return uv_translate_sys_error(errno);
+        }
+
+        madvise(data, (size_t)file_stat.st_size, MADV_SEQUENTIAL);
+
+        _data = (const char*)data;
+        _mapped = (size_t)file_stat.st_size;
+        _size = _mapped;
+
+        if (0 != memcmp(_data, io_simplify::libuv::Capture::MAGIC, sizeof(io_simplify::libuv::Capture::MAGIC)))
+        {
+            return UV_EINVAL;
+        }
+
+        _cursor = sizeof(io_simplify::libuv::Capture::FileHeader);
+
+        // a capture cut short (the process died while writing) ends at its last complete record
+        size_t end = _cursor;
+        while (end + sizeof(io_simplify::libuv::Capture::RecordHeader) <= _size)
+        {
+            size_t record_size = io_simplify::libuv::Capture::RecordSize(((const io_simplify::libuv::Capture::RecordHeader*)(_data + end))->length);
+            if (end + record_size > _size)
+            {
+                break;
+            }
+
+            end += record_size;
+        }
+        _size = end;
+
+        if (_cursor < _size)
+        {
+            _first_time = record()->time_ns;
+        }
+
+        return 0;
+    }
+
+    // releases every record due by now
+    void Pump()
+    {
+        uint64_t now = uv_hrtime();
+
+        while (_cursor < _size)
+        {
+            const io_simplify::libuv::Capture::RecordHeader* header = record();
+
+            uint64_t intended = now;
+            if (_options.speed > 0.0)
+            {
+                intended = _start + (uint64_t)((header->time_ns - _first_time) / _options.speed);
+                if (intended > now)
+                {
+                    break;
+                }
+            }
+
+            const char* payload = (const char*)(header + 1);
+
+            switch (header->type)
+            {
+            case io_simplify::libuv::Capture::RECORD_OPEN:
+                connection(header->connection, false);
+                break;
+            case io_simplify::libuv::Capture::RECORD_DATA:
+            case io_simplify::libuv::Capture::RECORD_DATAGRAM:
+                {
+                    ReplayConnection* replay_connection = connection(header->connection, io_simplify::libuv::Capture::RECORD_DATAGRAM == header->type);
+
+                    // unpaced, a connection that falls behind holds everything back until its writes complete
+                    if (_options.speed <= 0.0 && replay_connection->InFlight() > _options.window)
+                    {
+                        return;
+                    }
+
+                    if (_options.speed > 0.0)
+                    {
+                        _results.lag.Record(now - intended);
+                    }
+
+                    replay_connection->Send(payload, header->length, intended);
+                }
+                break;
+            case io_simplify::libuv::Capture::RECORD_CLOSE:
+                {
+                    auto found = _active.find(header->connection);
+                    if (found != _active.end())
+                    {
+                        found->second->Finish();
+
+                        _active.erase(found);
+                    }
+                }
+                break;
+            default:
+                break;
+            }
+
+            ++_results.records;
+
+            _cursor += io_simplify::libuv::Capture::RecordSize(header->length);
+
+            if (_cursor == _size)
+            {
+                _deadline = now + _options.timeout * 1000000;
+
+                // udp peers and tcp connections still open at the end of the capture
+                finish();
+
+                stopIfDone();
+                return;
+            }
+        }
+    }
+
+    void Tick()
+    {
+        if (_cursor < _size)
+        {
+            Pump();
+        }
+        else if (uv_hrtime() > _deadline)
+        {
+            // responses that never came
+            for (ReplayConnection* connection : _connections)
+            {
+                connection->Close();
+            }
+        }
+    }
+
+    const Results& Run()
+    {
+        _start = uv_hrtime();
+
+        if (_options.spin || _options.speed <= 0.0)
+        {
+            _idle.Start([this] () { Tick(); });
+        }
+        else
+        {
+            _timer.Start([this] () { Tick(); }, 1, 1);
+        }
+
+        if (_cursor < _size)
+        {
+            Pump();
+        }
+        else
+        {
+            stopIfDone();
+        }
+
+        _loop.Run();
+
+        return _results;
+    }
+};
+
+ReplayConnection::ReplayConnection(Replayer* replayer)
+    : _replayer(replayer)
+
+    , _tcp(nullptr)
+    , _udp(nullptr)
+    , _connect_req()
+    , _shutdown_req()
+
+    , _pending()
+    , _in_flight(0)
+
+    , _finished(false)
+    , _shutdown(false)
+    , _closing(false)
+{
+}
+
+ReplayConnection::~ReplayConnection()
+{
+    // the handles own the close callback that reports them closed, they go once the loop has finished
+    delete _tcp;
+    delete _udp;
+}
+
+io_simplify::libuv::Loop& ReplayConnection::loop()
+{
+    return _replayer->_loop;
+}
+
+void ReplayConnection::failed(const char* what, int res)
+{
+    std::cout << what << " failed: " << uv_strerror(res) << "(" << res << ")" << std::endl;
+
+    ++_replayer->_results.errors;
+    Close();
+}
+
+void ReplayConnection::Open(bool udp)
+{
+    const Options& options = _replayer->_options;
+
+    if (udp)
+    {
+        _udp = new io_simplify::libuv::UdpHandle(&loop());
+
+        int res = _udp->Connect(options.endpoint);
+        if (res >= 0)
+        {
+            res = _udp->StartReceive(
+                [this] (ssize_t nread, const uv_buf_t*, const struct sockaddr* addr, unsigned int) {
+                    // nread 0 without a peer only hands the buffer back
+                    if (nread != 0 || nullptr != addr)
+                    {
+                        received(nread);
+                    }
+                },
+                [this] (size_t, uv_buf_t* buf) {
+                    buf->base = _replayer->_receive_buffer.data();
+                    buf->len = _replayer->_receive_buffer.size();
+                });
+        }
+
+        if (res < 0)
+        {
+            ++_replayer->_results.connect_failed;
+            failed("udp connect", res);
+        }
+        return;
+    }
+
+    _tcp = new io_simplify::libuv::TcpHandle(&loop());
+
+    // writes issued before the connection is up are queued by libuv
+    int res = _tcp->Connect(&_connect_req, options.endpoint, [this] (uv_connect_t*, int status) {
+        if (status >= 0)
+        {
+            _tcp->NoDelay(1);
+
+            status = _tcp->StartRead(
+                [this] (ssize_t nread, const uv_buf_t*) {
+                    if (0 != nread)
+                    {
+                        received(nread);
+                    }
+                },
+                [this] (size_t, uv_buf_t* buf) {
+                    buf->base = _replayer->_receive_buffer.data();
+                    buf->len = _replayer->_receive_buffer.size();
+                });
+        }
+
+        if (status < 0 && !_closing)
+        {
+            ++_replayer->_results.connect_failed;
+            failed("tcp connect", status);
+        }
+    });
+
+    if (res < 0)
+    {
+        ++_replayer->_results.connect_failed;
+        failed("tcp connect", res);
+    }
+}
+
+void ReplayConnection::Send(const char* data, size_t size, uint64_t intended)
+{
+    if (_closing || 0 == size)
+    {
+        return;
+    }
+
+    Results& results = _replayer->_results;
+
+    // the payload stays in the mapped capture, only the request comes from the arena
+    uv_buf_t buf = uv_buf_init((char*)data, (unsigned int)size);
+
+    int res = 0;
+    if (_tcp)
+    {
+        TcpWrite* tcp_write = loop().arena.New<TcpWrite>();
+        tcp_write->callback_written = callback_tcp_written;
+        tcp_write->connection = this;
+        tcp_write->size = size;
+
+        res = _tcp->Write(tcp_write, &buf, 1);
+        if (res < 0)
+        {
+            loop().arena.Delete(tcp_write);
+        }
+    }
+    else
+    {
+        UdpSend* udp_send = loop().arena.New<UdpSend>();
+        udp_send->callback_sent = callback_udp_sent;
+        udp_send->connection = this;
+        udp_send->size = size;
+
+        res = _udp->Send(udp_send, &buf, 1);
+        if (res < 0)
+        {
+            loop().arena.Delete(udp_send);
+        }
+    }
+
+    if (res < 0)
+    {
+        failed("send", res);
+        return;
+    }
+
+    _in_flight += size;
+    _pending.push_back(intended);
+
+    _replayer->_last_activity = uv_hrtime();
+
+    ++results.sent;
+    results.bytes_out += size;
+}
+
+void ReplayConnection::written(size_t size, int status)
+{
+    _in_flight -= size;
+
+    if (status < 0 && !_closing)
+    {
+        failed("send", status);
+        return;
+    }
+
+    drained();
+
+    // a connection over the window may have been holding the replay back
+    if (_replayer->_options.speed <= 0.0 && _in_flight <= _replayer->_options.window)
+    {
+        _replayer->Pump();
+    }
+}
+
+void ReplayConnection::received(ssize_t nread)
+{
+    if (nread < 0)
+    {
+        if (!_closing && UV_EOF != nread)
+        {
+            failed("read", (int)nread);
+        }
+        Close();
+        return;
+    }
+
+    Results& results = _replayer->_results;
+
+    results.bytes_in += nread;
+
+    uint64_t now = uv_hrtime();
+
+    _replayer->_last_activity = now;
+
+    // a datagram answers one payload, a tcp read everything sent so far (responses coalesce in the stream)
+    do
+    {
+        if (_pending.empty())
+        {
+            break;
+        }
+
+        results.latency.Record(now - _pending.front());
+        _pending.pop_front();
+
+        ++results.answered;
+    } while (_tcp);
+
+    drained();
+}
+
+// a finished tcp connection shuts its side down and closes on the server's eof, so late response bytes still arrive
+void ReplayConnection::drained()
+{
+    if (!_finished || _closing || !_pending.empty() || 0 != _in_flight)
+    {
+        return;
+    }
+
+    if (_udp)
+    {
+        Close();
+        return;
+    }
+
+    if (!_shutdown)
+    {
+        _shutdown = true;
+
+        if (uv_shutdown(&_shutdown_req, (uv_stream_t*)(_tcp->uv), nullptr) < 0)
+        {
+            Close();
+        }
+    }
+}
+
+void ReplayConnection::Finish()
+{
+    _finished = true;
+
+    drained();
+}
+
+void ReplayConnection::Close()
+{
+    if (_closing)
+    {
+        return;
+    }
+
+    _closing = true;
+
+    _replayer->_results.unanswered += _pending.size();
+    _pending.clear();
+
+    if (_tcp)
+    {
+        _tcp->StopRead();
+        _tcp->Close([this] () {
+            _replayer->connectionClosed();
+        });
+    }
+    else if (_udp)
+    {
+        _udp->StopReceive();
+        _udp->Close([this] () {
+            _replayer->connectionClosed();
+        });
+    }
+}
+
+static bool parse_options(int argc, char** argv, Options& options)
+{
+    if (argc < 4)
+    {
+        return false;
+    }
+
+    options.path = argv[1];
+    options.endpoint = io_simplify::Endpoint {argv[2], (uint16_t)atoi(argv[3])};
+
+    for (int i = 4; i + 1 < argc; i += 2)
+    {
+        std::string name = argv[i];
+        const char* value = argv[i + 1];
+
+        if (name == "--speed")
+        {
+            options.speed = std::string(value) == "max" ? 0.0 : atof(value);
+        }
+        else if (name == "--window")
+        {
+            options.window = (size_t)atol(value);
+        }
+        else if (name == "--timeout")
+        {
+            options.timeout = (uint64_t)atol(value);
+        }
+        else if (name == "--spin")
+        {
+            options.spin = (0 != atoi(value));
+        }
+        else
+        {
+            std::cout << "unrecognized option: " << name << std::endl;
+            return false;
+        }
+    }
+
+    if (options.speed < 0.0)
+    {
+        std::cout << "speed must not be negative" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+static void print_histogram(const char* title, const io_simplify::libuv::Histogram& histogram)
+{
+    std::cout << std::fixed << std::setprecision(2) << title << std::endl;
+    std::cout << "    min " << histogram.Min() / 1e3 << ", mean " << histogram.Mean() / 1e3 << ", max " << histogram.Max() / 1e3 << std::endl;
+
+    const double percentiles[] = {50.0, 90.0, 99.0, 99.9, 99.99, 99.999};
+    for (double percentile : percentiles)
+    {
+        std::cout << "    p" << std::setprecision(6) << std::defaultfloat << percentile << std::fixed << std::setprecision(2)
+            << "  " << histogram.Percentile(percentile) / 1e3 << std::endl;
+    }
+}
+
+static void report(const Options& options, const Results& results)
+{
+    double seconds = results.elapsed / 1e9;
+    if (seconds <= 0.0)
+    {
+        seconds = 1e-9;
+    }
+
+    std::cout << std::fixed << std::setprecision(1);
+
+    std::cout << options.path << " at ";
+    if (options.speed > 0.0)
+    {
+        std::cout << options.speed << "x";
+    }
+    else
+    {
+        std::cout << "maximum speed";
+    }
+    std::cout << ": " << results.records << " records, " << results.connections << " connections in " << seconds << " s" << std::endl;
+
+    std::cout << "payloads: sent " << results.sent << ", answered " << results.answered << ", unanswered " << results.unanswered
+        << ", errors " << results.errors << ", connect failed " << results.connect_failed << std::endl;
+
+    std::cout << "throughput: " << results.sent / seconds << " payloads/s, "
+        << results.bytes_out / seconds / 1e6 << " MB/s out, " << results.bytes_in / seconds / 1e6 << " MB/s in" << std::endl;
+
+    print_histogram("latency (us, from intended send time to the first response):", results.latency);
+
+    if (options.speed > 0.0)
+    {
+        print_histogram("send lag (us, behind the captured timeline):", results.lag);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+
+    if (!parse_options(argc, argv, options))
+    {
+        std::cout << "usage: \n     " << argv[0] << " capture ip port [--speed N|max] [--window B] [--timeout MS] [--spin 0|1]" << std::endl;
+        return 1;
+    }
+
+    Replayer replayer(options);
+
+    int res = replayer.Map(options.path);
+    if (res < 0)
+    {
+        std::cout << "cannot read capture " << options.path << ": " << uv_strerror(res) << "(" << res << ")" << std::endl;
+        return 1;
+    }
+
+    report(options, replayer.Run());
+
+    return 0;
+}
@@ -38,11 +38,10 @@ private:
 
                         std::cout << "connection accept: " << endpoint.address << ":" << endpoint.port << std::endl;
 
-                        uv_buf_t read_buf = uv_buf_init((char*)malloc(128), 128);
                         uv_write_t* req = (uv_write_t*)malloc(sizeof(uv_write_t));
 
-                        client_handle->StartRead(
-                            [client_handle, endpoint, read_buf, req] (ssize_t nread, const uv_buf_t *buf) {
+                        client_handle->StartAdaptiveRead(
+                            [client_handle, endpoint, req] (ssize_t nread, const uv_buf_t *buf) {
                                 if (nread > 0)
                                 {
                                     std::cout << "data received: [" << std::string(buf->base, buf->base + nread) << "] from: " << endpoint.address << ":" << endpoint.port << std::endl;
@@ -57,17 +56,12 @@ private:
                                     std::cout << "data read failed: " << uv_strerror(nread) << "(" << nread << ")" << std::endl;
 
                                     client_handle->StopRead();
-                                    client_handle->Close([client_handle, read_buf, req] () {
+                                    client_handle->Close([client_handle, req] () {
                                         free(req);
-                                        free(read_buf.base);
 
                                         delete client_handle;
                                     });
                                 }
-                            },
-                            [read_buf] (size_t suggested_size, uv_buf_t* buff) {
-                                buff->base = read_buf.base;
-                                buff->len = read_buf.len;
                             });
                     }
                     else